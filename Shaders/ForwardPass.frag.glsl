@@ -1,10 +1,20 @@
 #version 330
 
+// The maximum number of lights other than the main light.
+// Must match SceneUniformBuffer.
+#define MAX_ADDITIONAL_LIGHTS 3
+
 layout(std140) uniform scene_data
 {
     uniform vec3 _AmbientColor;
     uniform vec3 _LightColor;
     uniform vec3 _LightDirection;
+    
+    // Directional, spot and point lights other than the main light
+    uniform vec4 _AdditionalLightColors[MAX_ADDITIONAL_LIGHTS];
+    uniform vec4 _AdditionalLightDirections[MAX_ADDITIONAL_LIGHTS]; // w = cos of spot half angle
+    uniform vec4 _AdditionalLightPositions[MAX_ADDITIONAL_LIGHTS]; // w = range, 0 if directional
+    uniform uint _AdditionalLightCount;
 };
 
 // Camera uniform buffer
@@ -46,6 +56,9 @@ uniform sampler2D _ShadowMask;
 // Main / normal map texture coordinate
 in vec2 texcoord;
 
+// World space position. Used for local lights.
+in vec3 worldPos;
+
 // Final colour
 out vec4 fragColor;
 
@@ -99,16 +112,60 @@ vec3 UnpackNormalMap(vec4 packedNormal)
 #endif // NORMAL_MAP_ON
 
 /*
- * Gets the shadow mask value for the given coordinate.
+ * Gets the shadow mask values for the given coordinate.
+ * The main light is in r, and additional lights in g, b and a.
  */
-float SampleShadow()
+vec4 SampleShadow()
 {
     // Derive the shadow coord from the screen position.
     vec2 shadowCoord = gl_FragCoord.xy / _ScreenResolution;
     
     // Shadow map already filtered and stored in
     // the shadow mask. Just use the value directly.
-    return texture(_ShadowMask, shadowCoord).r;
+    return texture(_ShadowMask, shadowCoord);
+}
+
+/*
+ * Computes the Lambert lighting from the additional lights.
+ * Each light is attenuated by its shadow mask channel.
+ * Spot and point lights also fade out towards their range,
+ * and spot lights are limited to their cone.
+ */
+vec3 AdditionalLights(vec4 surface, vec3 worldNormal, vec4 shadow)
+{
+    vec3 light = vec3(0.0);
+    for(uint i = 0u; i < _AdditionalLightCount; ++i)
+    {
+        vec3 toLight = _AdditionalLightDirections[i].xyz;
+        float attenuation = 1.0;
+        
+        float range = _AdditionalLightPositions[i].w;
+        if(range > 0.0)
+        {
+            // Local light. Use the direction to the light position.
+            vec3 offset = _AdditionalLightPositions[i].xyz - worldPos;
+            float distance = length(offset);
+            toLight = offset / max(distance, 0.000001);
+            
+            // Quadratic falloff to zero at the range
+            float falloff = clamp(1.0 - distance / range, 0.0, 1.0);
+            attenuation = falloff * falloff;
+            
+            // Spot lights soften the cone edge over the outer tenth of the cone.
+            // Point lights have a cone of -1.
+            float cosCone = _AdditionalLightDirections[i].w;
+            if(cosCone > -1.0)
+            {
+                float cosAngle = dot(toLight, _AdditionalLightDirections[i].xyz);
+                attenuation *= smoothstep(cosCone, mix(cosCone, 1.0, 0.1), cosAngle);
+            }
+        }
+        
+        float ndotl = max(0.0, dot(worldNormal, toLight));
+        light += ndotl * attenuation * _AdditionalLightColors[i].rgb * surface.rgb * shadow[i + 1u];
+    }
+    
+    return light;
 }
 
 void main()
@@ -141,10 +198,11 @@ void main()
 #endif 
     
     // Sample the shadow map from the screen space shadow mask
-    float shadow = SampleShadow();
+    vec4 shadow = SampleShadow();
     
     // Modify the direct light based on shadow sampling.
-    directLight *= shadow;
+    directLight *= shadow.r;
+    directLight += AdditionalLights(col, worldNormal, shadow);
     
     // Use direct + ambient light for final colour
     vec3 ambientLight = col.rgb * _AmbientColor;
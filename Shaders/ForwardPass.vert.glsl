@@ -1,11 +1,21 @@
 #version 330
 
+// The maximum number of lights other than the main light.
+// Must match SceneUniformBuffer.
+#define MAX_ADDITIONAL_LIGHTS 3
+
 // Scene uniform buffer
 layout(std140) uniform scene_data
 {
     uniform vec3 _AmbientColor;
     uniform vec3 _LightColor;
     uniform vec3 _LightDirection;
+    
+    // Directional, spot and point lights other than the main light
+    uniform vec4 _AdditionalLightColors[MAX_ADDITIONAL_LIGHTS];
+    uniform vec4 _AdditionalLightDirections[MAX_ADDITIONAL_LIGHTS]; // w = cos of spot half angle
+    uniform vec4 _AdditionalLightPositions[MAX_ADDITIONAL_LIGHTS]; // w = range, 0 if directional
+    uniform uint _AdditionalLightCount;
 };
 
 // Camera uniform buffer
@@ -55,14 +65,18 @@ layout(location = 3) in vec2 _texcoord;
 
 out vec2 texcoord;
 
+// World space position. Used for local lights.
+out vec3 worldPos;
+
 void main()
 {
     mat4x4 _ModelToWorld = _ModelToWorldPerInstance[gl_InstanceID];
-    gl_Position = _ViewProjectionMatrix * (_ModelToWorld * _position);
+    vec4 worldPosition = _ModelToWorld * _position;
+    gl_Position = _ViewProjectionMatrix * worldPosition;
+    worldPos = worldPosition.xyz;
     
 #if defined(SPECULAR_ON) || defined(FOG_ON)
     // Compute the vector to the camera
-    vec4 worldPosition = _ModelToWorld * _position;
     vec3 toCamera = _CameraPosition - worldPosition.xyz;
     float toCameraDist = length(toCamera);
     
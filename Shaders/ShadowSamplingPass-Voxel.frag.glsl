@@ -4,6 +4,25 @@
 // 17x17 PCF can touch up to 3x3=9 leaf nodes
 #define PCF_MAX_LOOKUPS 9
 
+// The largest PCF offset, in voxels. Cascades are only used for
+// coords at least this far inside their bounds.
+#define PCF_MAX_OFFSET 32.0
+
+// The maximum number of cascades, keyframes and lights.
+// Must match VoxelsUniformBuffer.
+#define MAX_VOXEL_CASCADES 32
+#define MAX_VOXEL_KEYFRAMES 16
+#define MAX_VOXEL_LIGHTS 4
+
+// The fraction of a cascade's distance range that is blended
+// with the next cascade.
+#define CASCADE_BLEND_FRACTION 0.1
+
+// Light types. Must match LightType.
+#define VOXEL_LIGHT_DIRECTIONAL 0u
+#define VOXEL_LIGHT_SPOT 1u
+#define VOXEL_LIGHT_POINT 2u
+
 // Camera uniform buffer
 layout(std140) uniform camera_data
 {
@@ -16,12 +35,53 @@ layout(std140) uniform camera_data
     uniform vec2 _CameraClipPlanes; // x = near, y = far
 };
 
+// A region of the tree covered by equally sized tiles
+struct VoxelCascade
+{
+    mat4x4 worldToVoxel;
+    uint treeHeight;
+    uint tileSubdivisions;
+    
+    // The index of the cascade's first root node pointer
+    uint firstTile;
+    
+    // The camera distance up to which the cascade is used
+    float maxDistance;
+};
+
+// A light rotation that the tree was built for,
+// or a perspective view of a local light.
+struct VoxelKeyframe
+{
+    uint firstCascade;
+    uint cascadeCount;
+};
+
+// A shadow casting light and its keyframes
+struct VoxelLight
+{
+    uint firstKeyframe;
+    uint keyframeCount;
+    
+    // The keyframes either side of the light's current rotation
+    uint currentKeyframe;
+    uint nextKeyframe;
+    float keyframeBlend;
+    
+    // Local lights select a keyframe by position instead
+    uint type;
+    vec4 position; // w = range
+};
+
 // voxel_data uniform buffer
 layout(std140) uniform voxel_data
 {
-    uniform mat4x4 _WorldToVoxel;
-    uniform uint _VoxelTreeHeight;
-    uniform uint _TileSubdivisions;
+    // The cascades grouped by keyframe, highest resolution first.
+    // The last cascade of a keyframe covers the entire scene.
+    uniform VoxelCascade _VoxelCascades[MAX_VOXEL_CASCADES];
+    uniform VoxelKeyframe _VoxelKeyframes[MAX_VOXEL_KEYFRAMES];
+    uniform VoxelLight _VoxelLights[MAX_VOXEL_LIGHTS];
+    uniform uint _VoxelLightCount;
     
     // The total number of voxels in the PCF kernel
     uniform uint _PCFSampleCount;
@@ -29,6 +89,14 @@ layout(std140) uniform voxel_data
     // The number of leaf nodes visited in a PCF kernel
     uniform uint _PCFLookups;
     
+    // The root pointer of tiles that are not built yet
+    uniform uint _VoxelEmptyRoot;
+    
+    // The single cascade trees of rigid dynamic objects, shadowing
+    // the main light. Trees with a negative maxDistance are disabled.
+    uniform uint _VoxelFirstObjectCascade;
+    uniform uint _VoxelObjectCascadeCount;
+    
     // The bitmask and offset for PCF kernel lookups.
     // Stores (xOffset, yOffset, bitmask0, bitmask1)
     // PCF_MAX_LOOKUPS values per original leaf mask index
@@ -45,7 +113,7 @@ in vec3 viewDir;
 in vec2 texcoord;
 
 // Output color
-// Contains (shadow, 0, 0, 0)
+// Contains the shadow of up to 4 lights
 out vec4 fragColor;
 
 // The result of querying the voxel tree several times
@@ -63,24 +131,76 @@ struct LeafNodeQuery
     uvec2 bits; // 64 bits, 2 words, high bits in x
 };
 
+/*
+ * Checks if a world-space position is far enough inside a cascade
+ * for all PCF lookups to stay within the cascade's tiles.
+ */
+bool isInsideCascade(uint cascade, vec4 worldSpacePosition)
+{
+    vec4 voxelPosition = _VoxelCascades[cascade].worldToVoxel * worldSpacePosition;
+    vec2 coord = voxelPosition.xy / voxelPosition.w;
+    float resolution = float(_VoxelCascades[cascade].tileSubdivisions << _VoxelCascades[cascade].treeHeight);
+    
+    return all(greaterThanEqual(coord, vec2(PCF_MAX_OFFSET)))
+        && all(lessThan(coord, vec2(resolution - PCF_MAX_OFFSET)));
+}
+
+/*
+ * Checks if the tile containing a world-space position has been built.
+ */
+bool isTileBuilt(uint cascade, vec4 worldSpacePosition)
+{
+    vec4 voxelPosition = _VoxelCascades[cascade].worldToVoxel * worldSpacePosition;
+    uvec2 tile = uvec2(voxelPosition.xy / voxelPosition.w) >> _VoxelCascades[cascade].treeHeight;
+    uint tileIndex = (tile.x * _VoxelCascades[cascade].tileSubdivisions) + tile.y;
+    
+    int entry = int(tileIndex + _VoxelCascades[cascade].firstTile) * 2;
+    return texelFetch(_VoxelData, entry).r != _VoxelEmptyRoot;
+}
+
+/*
+ * Finds the first cascade of a keyframe, starting at firstCascade,
+ * that covers the position at the given camera distance.
+ * Cascades are skipped where their tile is not built yet.
+ * The last cascade covers the entire scene and is always used
+ * if no other cascade matches.
+ */
+uint selectCascade(uint keyframe, vec4 worldSpacePosition, float distance, uint firstCascade)
+{
+    uint lastCascade = _VoxelKeyframes[keyframe].firstCascade + _VoxelKeyframes[keyframe].cascadeCount - 1u;
+    
+    for(uint i = firstCascade; i < lastCascade; ++i)
+    {
+        if(distance < _VoxelCascades[i].maxDistance && isInsideCascade(i, worldSpacePosition) && isTileBuilt(i, worldSpacePosition))
+        {
+            return i;
+        }
+    }
+    
+    return lastCascade;
+}
+
 /*
  * Get the voxel-space coordinate corresponding to a world-space position.
  * The computed coordinate can be used to look up a voxel in the tree.
+ * Perspective cascades of local lights have linear depths, so only
+ * x and y are divided by w. w is 1 for directional lights.
  */
-uvec3 getVoxelCoord(vec4 worldSpacePosition)
+uvec3 getVoxelCoord(uint cascade, vec4 worldSpacePosition)
 {
     // worldSpacePosition.w must be 1
-    return uvec3((_WorldToVoxel * worldSpacePosition).xyz);
+    vec4 voxelPosition = _VoxelCascades[cascade].worldToVoxel * worldSpacePosition;
+    return uvec3(voxelPosition.xy / voxelPosition.w, voxelPosition.z);
 }
 
 /*
  * Computes the child index at a given depth for the specified coord.
  * Must be consistent with the cpp builder code.
  */
-uint getChildIndex(uint depth, uvec3 coord)
+uint getChildIndex(uint treeHeight, uint depth, uvec3 coord)
 {
     // The last inner node before the leaf nodes is treated differently.
-    if(depth == _VoxelTreeHeight - 3u)
+    if(depth == treeHeight - 3u)
     {
         // Nodes are in a vertical stack.
         // Recover directly from the last z coord bits.
@@ -88,7 +208,7 @@ uint getChildIndex(uint depth, uvec3 coord)
     }
     
     // Use the least significant bit for each axis.
-    uvec3 childIndex = (coord >> (_VoxelTreeHeight - 1u - depth)) & 1u;
+    uvec3 childIndex = (coord >> (treeHeight - 1u - depth)) & 1u;
 
     // Combine them
     return (childIndex.x << 2) | (childIndex.y << 1) | childIndex.z;
@@ -123,20 +243,53 @@ uint getVoxelLeafIndex(uvec3 coord)
     return (coord.x << 3) | coord.y;
 }
 
-LeafNodeQuery getLeafNode(uvec3 coord)
+/*
+ * The root node and resolution of the tile containing a voxel.
+ * Tiles with few shadow casters have shorter trees than the cascade.
+ * coord is the voxel coordinate scaled to the tile's resolution.
+ */
+struct TileLookup
+{
+    int rootAddress;
+    uint treeHeight;
+    uint shift;
+    uvec3 coord;
+};
+
+/*
+ * Finds the tile containing the coord and reads its root table entry.
+ */
+TileLookup getTile(uint cascade, uvec3 coord)
 {
     // Compute which tile the coord is in
-    uvec2 tile = coord.xy >> _VoxelTreeHeight;
-    uint tileIndex = (tile.x * _TileSubdivisions) + tile.y;
+    uvec2 tile = coord.xy >> _VoxelCascades[cascade].treeHeight;
+    uint tileIndex = (tile.x * _VoxelCascades[cascade].tileSubdivisions) + tile.y;
+    
+    // The cascade's root entries follow those of the earlier cascades.
+    // Each entry is a root pointer followed by the tile's tree height.
+    int entry = int(tileIndex + _VoxelCascades[cascade].firstTile) * 2;
+    
+    TileLookup t;
+    t.rootAddress = int(texelFetch(_VoxelData, entry).r);
+    t.treeHeight = texelFetch(_VoxelData, entry + 1).r;
+    t.shift = _VoxelCascades[cascade].treeHeight - t.treeHeight;
+    t.coord = coord >> t.shift;
+    return t;
+}
+
+LeafNodeQuery getLeafNode(TileLookup tile)
+{
+    uint treeHeight = tile.treeHeight;
+    uvec3 coord = tile.coord;
     
     // Get the memory address of the first node to visit
-    int memAddress = int(texelFetch(_VoxelData, int(tileIndex)).r);
+    int memAddress = tile.rootAddress;
 
     // Traverse inner nodes
-    for(uint depth = 0u; depth <= _VoxelTreeHeight - 3u; ++depth)
+    for(uint depth = 0u; depth <= treeHeight - 3u; ++depth)
     {
         // Fetch the node's child mask
-        uint childIndex = getChildIndex(depth, coord);
+        uint childIndex = getChildIndex(treeHeight, depth, coord);
         uint childMask = texelFetch(_VoxelData, memAddress).r >> 16;
         uint childState = (childMask >> (childIndex * 2u)) & 3u;
         
@@ -158,25 +311,167 @@ LeafNodeQuery getLeafNode(uvec3 coord)
     
     // We have reached a leaf node.
     LeafNodeQuery q;
-    q.treeDepthReached = _VoxelTreeHeight;
+    q.treeDepthReached = treeHeight;
     q.bits = uvec2(texelFetch(_VoxelData, memAddress).r,
                  texelFetch(_VoxelData, memAddress + 1).r);
     return q;
 }
 
+/*
+ * Resamples the bits of a leaf onto a finer voxel grid.
+ * origin is the corner of the fine leaf in fine voxels. Each voxel
+ * of the leaf covers 2^levels fine voxels in x and y.
+ */
+uvec2 upsampleLeaf(uvec2 bits, uvec2 origin, uint levels)
+{
+    uvec2 fineBits = uvec2(0u);
+    for(uint x = 0u; x < 8u; ++x)
+    {
+        for(uint y = 0u; y < 8u; ++y)
+        {
+            // Find the leaf voxel covering the fine voxel
+            uvec2 leafCoord = ((origin + uvec2(x, y)) >> levels) & 7u;
+            uint index = (leafCoord.x << 3) | leafCoord.y;
+            uint shadowing = (bits[index >> 5] >> (index & 31u)) & 1u;
+            
+            // Copy its state to the fine voxel
+            uint fineIndex = (x << 3) | y;
+            fineBits[fineIndex >> 5] |= shadowing << (fineIndex & 31u);
+        }
+    }
+    
+    return fineBits;
+}
+
+/*
+ * Computes the size of a pixel's footprint as a power of 2 voxels
+ * at the cascade's full resolution.
+ */
+int getFootprintLevel(uint cascade, vec4 worldPos, float linearDepth)
+{
+    // World space height of a pixel on the far plane, scaled to the pixel depth.
+    // Frustum corners 0 and 1 are the top and bottom right corners.
+    float farPixelSize = length(_FrustumCorners[0].xyz - _FrustumCorners[1].xyz) / _ScreenResolution.y;
+    float pixelSize = farPixelSize * linearDepth;
+    
+    // The number of voxels per world unit along the voxel x axis.
+    // Perspective voxels grow with their distance from the light.
+    mat4x4 worldToVoxel = _VoxelCascades[cascade].worldToVoxel;
+    float voxelsPerUnit = length(vec3(worldToVoxel[0].x, worldToVoxel[1].x, worldToVoxel[2].x));
+    voxelsPerUnit /= (worldToVoxel * worldPos).w;
+    
+    // The size of the pixel footprint as a power of 2 voxels
+    float footprint = pixelSize * voxelsPerUnit;
+    return int(floor(log2(max(footprint, 1.0))));
+}
+
+/*
+ * Computes the tree depth where traversal can stop for a pixel.
+ * The children of a node at depth d cover 2^(height-1-d) voxels
+ * in x and y. Traversal stops at the first depth whose children
+ * are no larger than the pixel's footprint in voxels.
+ */
+uint getLODDepth(TileLookup tile, int footprintLevel)
+{
+    // Voxels in lower resolution tiles are larger
+    int tileLevel = footprintLevel - int(tile.shift);
+    return uint(max(int(tile.treeHeight) - 1 - tileLevel, 0));
+}
+
+/*
+ * Traverses the tree down to the specified depth and finds the
+ * prefiltered shadowing of the node there.
+ * Nodes whose shadowing changes along z can't be prefiltered, as
+ * their fraction includes depths in front of and behind the receiver.
+ * Returns false if there is no usable node above the leaves.
+ */
+bool getFilteredNode(TileLookup tile, uint lodDepth, out VoxelQuery q)
+{
+    uint treeHeight = tile.treeHeight;
+    uvec3 coord = tile.coord;
+    
+    // Get the memory address of the first node to visit
+    int memAddress = tile.rootAddress;
+    
+    // Traverse inner nodes above the leaf parents
+    for(uint depth = 0u; depth < treeHeight - 3u; ++depth)
+    {
+        // Fetch the node's child mask
+        uint childIndex = getChildIndex(treeHeight, depth, coord);
+        uint childMask = texelFetch(_VoxelData, memAddress).r >> 16;
+        uint childState = (childMask >> (childIndex * 2u)) & 3u;
+        
+        // If uniform shadow, exit early
+        if(childState < 2u)
+        {
+            q.treeDepthReached = depth;
+            q.shadowAttenuation = float(childState);
+            return true;
+        }
+        
+        // Mixed shadow
+        // Retrieve the child node memory location
+        int childPtrOffset = getChildPointerOffset(childMask, childIndex);
+        int childPtr = memAddress + childPtrOffset;
+        memAddress = int(texelFetch(_VoxelData, childPtr).r);
+        
+        // Use the prefiltered value once the inner child covers the pixel.
+        // The shadowed fraction is stored in the low 15 bits and the
+        // z variation flag in the bit above it.
+        if(depth >= lodDepth)
+        {
+            uint shadowedFraction = texelFetch(_VoxelData, memAddress).r & 65535u;
+            if(shadowedFraction < 32768u)
+            {
+                q.treeDepthReached = depth + 1u;
+                q.shadowAttenuation = 1.0 - float(shadowedFraction) / 32767.0;
+                return true;
+            }
+        }
+    }
+    
+    // Every node on the path changes along z.
+    // The caller falls back to the leaf lookup.
+    return false;
+}
+
 /*
  * Get the shadow attenuation for the voxel with the given coordinate.
  * Also performs PCF filtering, if enabled.
+ * Traversal stops early if the pixel footprint covers a leaf or more.
  */
-VoxelQuery sampleShadowTree(uvec3 coord)
+VoxelQuery sampleShadowTree(uint cascade, uvec3 coord, int footprintLevel)
 {
+    // Find the tile and the coord at the tile's resolution
+    TileLookup tile = getTile(cascade, coord);
+    
     // Get the location of the coord within its leaf
-    uint leafIndex = getVoxelLeafIndex(coord);
+    uint leafIndex = getVoxelLeafIndex(tile.coord);
+    
+    // Use a prefiltered node when the pixel covers more than a leaf.
+    uint lodDepth = getLODDepth(tile, footprintLevel);
+    uint filterLevels = 0u;
+    
+#if defined(SHADOW_PCF_FILTER)
+    
+    // Keep PCF filtering until the pixel also covers the kernel.
+    // A prefiltered node at least as wide as the kernel replaces it.
+    uint kernelLeaves = uint(sqrt(float(_PCFLookups)) + 0.5);
+    filterLevels = uint(findMSB(kernelLeaves - 1u) + 1);
+    
+#endif
+    
+    if(lodDepth + filterLevels < tile.treeHeight - 3u)
+    {
+        VoxelQuery filtered;
+        if(getFilteredNode(tile, lodDepth, filtered))
+            return filtered;
+    }
     
 #if !defined(SHADOW_PCF_FILTER)
     
     // Get the leaf node
-    LeafNodeQuery leaf = getLeafNode(coord);
+    LeafNodeQuery leaf = getLeafNode(tile);
     
     // Get the shadowing state of the voxel
     uint shadowing = leafIndex > 31u
@@ -198,19 +493,41 @@ VoxelQuery sampleShadowTree(uvec3 coord)
     // Calculate the sum of the tree depths for debugging overlays
     uint treeDepthSum = 0u;
     
+    // Tiles of different resolutions put the bitmasks on different
+    // voxel grids. Filter on the finest grid the kernel touches so
+    // the kernel doesn't jump at the borders between them.
+    uint kernelShift = tile.shift;
+    for(uint i = 0; i < _PCFLookups; i++)
+    {
+        uvec2 offset = _PCFOffsets[leafIndex * PCF_MAX_LOOKUPS + i].xy;
+        uvec3 pcfCoord = uvec3((tile.coord.xy + offset) << tile.shift, coord.z);
+        kernelShift = min(kernelShift, getTile(cascade, pcfCoord).shift);
+    }
+    
+    uvec3 kernelCoord = coord >> kernelShift;
+    uint kernelIndex = getVoxelLeafIndex(kernelCoord);
+    
     // Process each PCF lookup
     for(uint i = 0; i < _PCFLookups; i++)
     {
         // Get the lookup data
-        uvec4 lookup = _PCFOffsets[leafIndex * PCF_MAX_LOOKUPS + i];
+        uvec4 lookup = _PCFOffsets[kernelIndex * PCF_MAX_LOOKUPS + i];
         uvec2 offset = lookup.xy;
         uvec2 bitmask = lookup.zw;
         
-        // Get the leaf coord
-        uvec3 pcfCoord = uvec3(coord.xy + offset, coord.z);
+        // Get the leaf coord. The offsets are applied at the kernel's
+        // resolution, so the kernel widens in lower resolution tiles.
+        uvec3 pcfCoord = uvec3((kernelCoord.xy + offset) << kernelShift, coord.z);
         
-        // Query the shadow tree
-        LeafNodeQuery leaf = getLeafNode(pcfCoord);
+        // Query the shadow tree.
+        // Leaves of coarser tiles are resampled onto the kernel's grid.
+        TileLookup pcfTile = getTile(cascade, pcfCoord);
+        LeafNodeQuery leaf = getLeafNode(pcfTile);
+        if(pcfTile.shift > kernelShift)
+        {
+            uvec2 origin = (pcfCoord.xy >> kernelShift) & ~7u;
+            leaf.bits = upsampleLeaf(leaf.bits, origin, pcfTile.shift - kernelShift);
+        }
         unshadowed += bitCount(leaf.bits & bitmask);
         treeDepthSum += leaf.treeDepthReached;
     }
@@ -224,6 +541,175 @@ VoxelQuery sampleShadowTree(uvec3 coord)
 #endif
 }
 
+/*
+ * Samples the shadow tree of a cascade at a world-space position.
+ */
+VoxelQuery sampleCascade(uint cascade, vec4 worldPos, float linearDepth)
+{
+    // Get the coordinate for the voxel tree
+    uvec3 voxelCoord = getVoxelCoord(cascade, worldPos);
+    
+#if defined(SHADOW_VOXEL_LOD)
+    // Stop traversal at the depth matching the pixel footprint
+    int footprintLevel = getFootprintLevel(cascade, worldPos, linearDepth);
+#else
+    // Always traverse to the leaf nodes
+    int footprintLevel = 0;
+#endif
+    
+    // Sample the shadow tree
+    return sampleShadowTree(cascade, voxelCoord, footprintLevel);
+}
+
+/*
+ * Samples the shadow trees of a keyframe at a world-space position.
+ * Uses the highest resolution cascade covering the position.
+ * Also outputs the cascade that was used.
+ */
+VoxelQuery sampleKeyframe(uint keyframe, vec4 worldPos, float linearDepth, out uint cascade)
+{
+    // Select the highest resolution cascade covering the pixel
+    float distance = length(worldPos.xyz - _CameraPosition);
+    uint firstCascade = _VoxelKeyframes[keyframe].firstCascade;
+    uint lastCascade = firstCascade + _VoxelKeyframes[keyframe].cascadeCount - 1u;
+    cascade = selectCascade(keyframe, worldPos, distance, firstCascade);
+    
+    // Sample the shadow tree
+    VoxelQuery result = sampleCascade(cascade, worldPos, linearDepth);
+    
+    // Blend with the next cascade towards the end of the cascade's range
+    // to hide the change in resolution.
+    float blendStart = _VoxelCascades[cascade].maxDistance * (1.0 - CASCADE_BLEND_FRACTION);
+    if(cascade < lastCascade && distance > blendStart)
+    {
+        uint nextCascade = selectCascade(keyframe, worldPos, distance, cascade + 1u);
+        VoxelQuery next = sampleCascade(nextCascade, worldPos, linearDepth);
+        
+        float blend = (distance - blendStart) / (_VoxelCascades[cascade].maxDistance - blendStart);
+        result.shadowAttenuation = mix(result.shadowAttenuation, next.shadowAttenuation, blend);
+    }
+    
+    return result;
+}
+
+/*
+ * Finds the cube face of a point light containing a light to
+ * position offset. Faces are ordered +x, -x, +y, -y, +z, -z.
+ */
+uint getCubeFace(vec3 offset)
+{
+    vec3 size = abs(offset);
+    if(size.x >= size.y && size.x >= size.z)
+    {
+        return offset.x > 0.0 ? 0u : 1u;
+    }
+    else if(size.y >= size.z)
+    {
+        return offset.y > 0.0 ? 2u : 3u;
+    }
+    
+    return offset.z > 0.0 ? 4u : 5u;
+}
+
+/*
+ * Samples the perspective view of a spot or point light that
+ * contains a world-space position.
+ * Positions outside the light's views are unshadowed, as the
+ * forward pass does not light them.
+ */
+VoxelQuery sampleLocalLight(uint light, vec4 worldPos, float linearDepth, out uint cascade)
+{
+    // Point lights have a view for each cube face
+    uint keyframe = _VoxelLights[light].firstKeyframe;
+    if(_VoxelLights[light].type == VOXEL_LIGHT_POINT)
+    {
+        keyframe += getCubeFace(worldPos.xyz - _VoxelLights[light].position.xyz);
+    }
+    
+    // Each view is a single cascade
+    cascade = _VoxelKeyframes[keyframe].firstCascade;
+    
+    // Check the position is in front of the light, within its range
+    // and far enough inside the view for the PCF lookups.
+    vec4 voxelPosition = _VoxelCascades[cascade].worldToVoxel * worldPos;
+    float tileResolution = float(1u << _VoxelCascades[cascade].treeHeight);
+    if(voxelPosition.w <= 0.0 || voxelPosition.z >= tileResolution || !isInsideCascade(cascade, worldPos))
+    {
+        VoxelQuery q;
+        q.treeDepthReached = 0u;
+        q.shadowAttenuation = 1.0;
+        return q;
+    }
+    
+    return sampleCascade(cascade, worldPos, linearDepth);
+}
+
+/*
+ * Samples the shadow trees of a light at a world-space position.
+ * Blends between the keyframes either side of the light's rotation.
+ * Also outputs the cascade that was used.
+ */
+VoxelQuery sampleLight(uint light, vec4 worldPos, float linearDepth, out uint cascade)
+{
+    // Local lights are static and have no keyframe blending
+    if(_VoxelLights[light].type != VOXEL_LIGHT_DIRECTIONAL)
+    {
+        return sampleLocalLight(light, worldPos, linearDepth, cascade);
+    }
+    
+    // Sample the keyframe for the light's current rotation
+    VoxelQuery result = sampleKeyframe(_VoxelLights[light].currentKeyframe, worldPos, linearDepth, cascade);
+    
+    // Blend towards the next keyframe as the light rotates
+    float keyframeBlend = _VoxelLights[light].keyframeBlend;
+    if(keyframeBlend > 0.0)
+    {
+        uint nextCascade;
+        VoxelQuery next = sampleKeyframe(_VoxelLights[light].nextKeyframe, worldPos, linearDepth, nextCascade);
+        result.shadowAttenuation = mix(result.shadowAttenuation, next.shadowAttenuation, keyframeBlend);
+    }
+    
+    return result;
+}
+
+/*
+ * Samples the trees of rigid dynamic objects at a world-space position.
+ * Each tree's matrix moves receivers into the object's space when the
+ * tree was built. Receivers beside or in front of an object are not
+ * shadowed by it, and receivers behind it use the furthest voxel.
+ */
+float sampleObjectTrees(vec4 worldPos, float linearDepth)
+{
+    float shadow = 1.0;
+    for(uint i = 0u; i < _VoxelObjectCascadeCount; ++i)
+    {
+        uint cascade = _VoxelFirstObjectCascade + i;
+        if(_VoxelCascades[cascade].maxDistance < 0.0 || !isInsideCascade(cascade, worldPos))
+        {
+            continue;
+        }
+        
+        vec4 voxelPosition = _VoxelCascades[cascade].worldToVoxel * worldPos;
+        float tileResolution = float(1u << _VoxelCascades[cascade].treeHeight);
+        if(voxelPosition.z < 0.0)
+        {
+            continue;
+        }
+        
+        uvec3 voxelCoord = uvec3(voxelPosition.xy, min(voxelPosition.z, tileResolution - 1.0));
+        
+#if defined(SHADOW_VOXEL_LOD)
+        int footprintLevel = getFootprintLevel(cascade, worldPos, linearDepth);
+#else
+        int footprintLevel = 0;
+#endif
+        
+        shadow *= sampleShadowTree(cascade, voxelCoord, footprintLevel).shadowAttenuation;
+    }
+    
+    return shadow;
+}
+
 void main()
 {
     // Retrieve screen coordinate and linear depth.
@@ -239,11 +725,17 @@ void main()
     // view dir from vertex shader and linear depth using 1 madd
     vec4 worldPos = vec4(viewDir * linearDepth + _CameraPosition, 1.0);
     
-    // Get the coordinate for the voxel tree
-    uvec3 voxelCoord = getVoxelCoord(worldPos);
+    // Sample each light's trees. Unused channels are unshadowed.
+    vec4 shadows = vec4(1.0);
+    uint cascade;
+    VoxelQuery result = sampleLight(0u, worldPos, linearDepth, cascade);
+    shadows[0] = result.shadowAttenuation * sampleObjectTrees(worldPos, linearDepth);
     
-    // Sample the shadow tree
-    VoxelQuery result = sampleShadowTree(voxelCoord);
+    for(uint i = 1u; i < _VoxelLightCount; ++i)
+    {
+        uint lightCascade;
+        shadows[i] = sampleLight(i, worldPos, linearDepth, lightCascade).shadowAttenuation;
+    }
     
 #ifdef DEBUG_SHOW_VOXEL_TREE_DEPTH
     
@@ -251,7 +743,7 @@ void main()
     if(texcoord.x < 0.5) discard;
     
     // Determine the % of the tree traversed
-    float traversalDepth = float(result.treeDepthReached) / (float(_VoxelTreeHeight));
+    float traversalDepth = float(result.treeDepthReached) / (float(_VoxelCascades[cascade].treeHeight));
     
     // Determine the resulting colour
     vec4 rootColour = vec4(0.0, 0.0, 1.0, 0.5); // blue
@@ -261,7 +753,7 @@ void main()
 #else
     
     // Output shadow
-    fragColor = vec4(result.shadowAttenuation, 0, 0, 1);
+    fragColor = shadows;
     
 #endif
 }
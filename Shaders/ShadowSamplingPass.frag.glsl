@@ -34,7 +34,7 @@ in vec3 viewDir;
 in vec2 texcoord;
 
 // Output color
-// Contains (shadow, 0, 0, 0)
+// Contains (shadow, 1, 1, 1)
 out vec4 fragColor;
 
 void main()
@@ -95,8 +95,10 @@ void main()
     // Sample the shadow map.
     float shadow = textureProj(_ShadowMapTexture, shadowCoord);
 
-    // Return the shadow attenuation
-    fragColor = vec4(shadow, 0.0, 0.0, 0.0);
+    // Return the shadow attenuation.
+    // Only the main light uses the shadow map. The other lights
+    // are unchanged when MIN blended with the voxel tree pass.
+    fragColor = vec4(shadow, 1.0, 1.0, 1.0);
     
 #endif
 }
@@ -1,8 +1,8 @@
 #include "Mesh.hpp"
 
-Mesh::Mesh(std::vector<Vector3> &positions, int elementsCount, const void* elementsOffset, int baseVertex)
+Mesh::Mesh(std::vector<Vector3> &positions, std::vector<MeshElementIndex> &elements, const void* elementsOffset, int baseVertex)
     : positions_(positions),
-    elementsCount_(elementsCount),
+    elements_(elements),
     elementsOffset_(elementsOffset),
     baseVertex_((int)baseVertex)
 {
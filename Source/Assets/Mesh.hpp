@@ -9,20 +9,22 @@ typedef unsigned short MeshElementIndex;
 class Mesh
 {
 public:
-    Mesh(std::vector<Vector3> &positions, int elementsCount, const void* elementsOffset, int baseVertex);
+    Mesh(std::vector<Vector3> &positions, std::vector<MeshElementIndex> &elements, const void* elementsOffset, int baseVertex);
     
     // Object space vertex positions
     const Vector3* vertices() const { return &positions_[0]; }
     int verticesCount() const { return (int)positions_.size(); }
     
-    // Elements info
-    int elementsCount() const { return elementsCount_; }
+    // Elements info.
+    // The elements are triangle vertex indices relative to the mesh.
+    const MeshElementIndex* elements() const { return &elements_[0]; }
+    int elementsCount() const { return (int)elements_.size(); }
     const void* elementsOffset() const { return elementsOffset_; }
     int baseVertex() const { return baseVertex_; }
     
 private:
     std::vector<Vector3> positions_;
-    int elementsCount_;
+    std::vector<MeshElementIndex> elements_;
     const void* elementsOffset_;
     int baseVertex_;
 };
@@ -159,10 +159,9 @@ Mesh* MeshCollection::addMesh(std::vector<Vector3> newPositions,
     elements_.insert(elements_.end(), newElements.begin(), newElements.end());
     
     // Finally, return a mesh that references the correct location
-    const int elementsCount = (int)newElements.size();
     const void* elementsOffset = (void*)((elements_.size() - newElements.size()) * sizeof(MeshElementIndex));
     const int baseVertex = (int)(positions_.size() - newPositions.size());
-    return new Mesh(newPositions, elementsCount, elementsOffset, baseVertex);
+    return new Mesh(newPositions, newElements, elementsOffset, baseVertex);
 }
 
 void MeshCollection::addFullScreenQuad()
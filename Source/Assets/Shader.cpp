@@ -224,6 +224,7 @@ string Shader::createFeatureDefines() const
     
     // Shadow filtering defines
     if(hasFeature(SF_Shadow_PCF_Filter)) defines += "\n #define SHADOW_PCF_FILTER";
+    if(hasFeature(SF_Shadow_Voxel_LOD)) defines += "\n #define SHADOW_VOXEL_LOD";
     
     return defines;
 }
@@ -40,6 +40,9 @@ enum ShaderFeature
     
     // Enables voxel PCF filtering
     SF_Shadow_PCF_Filter = 1024,
+    
+    // Enables prefiltered voxel tree sampling for distant pixels
+    SF_Shadow_Voxel_LOD = 2048,
 };
 
 
@@ -135,3 +135,13 @@ Texture* Texture::singleChannel(int width, int height)
     
     return new Texture(texture, width, height, GL_RED, GL_RED, GL_UNSIGNED_BYTE);
 }
+
+Texture* Texture::fourChannel(int width, int height)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    
+    return new Texture(texture, width, height, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE);
+}
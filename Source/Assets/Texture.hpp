@@ -45,6 +45,9 @@ public:
     // Creates a texture with a single colour channel.
     static Texture* singleChannel(int width, int height);
     
+    // Creates a texture with 4 colour channels.
+    static Texture* fourChannel(int width, int height);
+    
 private:
     GLuint id_;
     int width_;
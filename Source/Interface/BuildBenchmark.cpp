@@ -0,0 +1,191 @@
+#include "BuildBenchmark.hpp"
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include <QElapsedTimer>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+
+#include "Scene.hpp"
+#include "UniformManager.hpp"
+#include "VoxelBufferPool.hpp"
+#include "VoxelTree.hpp"
+
+// The resolutions of the cascade covering the entire scene
+const static int BenchmarkResolutions[] = { 2048, 4096, 8192, 16384, 32768, 65536, 131072 };
+
+// Resets the peak resident memory so each run reports its own peak.
+// Only supported on Linux. Elsewhere the peak covers the whole process.
+static void resetPeakMemory()
+{
+#if defined(__linux__)
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if(file != NULL)
+    {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+// Gets the peak resident memory in MB
+static double peakMemoryMB()
+{
+#if defined(__linux__)
+    // VmHWM is reset by resetPeakMemory, unlike ru_maxrss
+    FILE* file = fopen("/proc/self/status", "r");
+    if(file != NULL)
+    {
+        char line[256];
+        long peakKB = -1;
+        while(fgets(line, sizeof(line), file) != NULL)
+        {
+            if(sscanf(line, "VmHWM: %ld kB", &peakKB) == 1)
+            {
+                break;
+            }
+        }
+        
+        fclose(file);
+        if(peakKB >= 0)
+        {
+            return peakKB / 1024.0;
+        }
+    }
+    
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // KB
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / (1024.0 * 1024.0); // Bytes
+#endif
+}
+
+// Gets the numbers of concurrent builds to measure.
+// Powers of two up to the core count, and the core count itself.
+static std::vector<int> benchmarkWorkerCounts()
+{
+    int cores = std::max((int)std::thread::hardware_concurrency(), 1);
+    
+    std::vector<int> workers;
+    for(int count = 1; count < cores; count *= 2)
+    {
+        workers.push_back(count);
+    }
+    
+    workers.push_back(cores);
+    return workers;
+}
+
+int runBuildBenchmark(const char* resultsFileName, int repeats, bool deterministic)
+{
+    // Render the dual shadow maps with an offscreen context
+    QSurfaceFormat format;
+    format.setVersion(4, 0);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+    
+    QOpenGLContext context;
+    context.setFormat(format);
+    if(context.create() == false)
+    {
+        printf("Failed to create an OpenGL context for the build benchmark \n");
+        return 1;
+    }
+    
+    QOffscreenSurface surface;
+    surface.setFormat(context.format());
+    surface.create();
+    if(context.makeCurrent(&surface) == false)
+    {
+        printf("Failed to make the build benchmark context current \n");
+        return 1;
+    }
+    
+    std::ofstream file(resultsFileName);
+    if(!file)
+    {
+        printf("Failed to write build benchmark results %s \n", resultsFileName);
+        return 1;
+    }
+    
+    // Every tree is built for the same scene
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    Scene* scene = new Scene();
+    scene->loadFromFile("scene.scene");
+    UniformManager* uniformManager = new UniformManager();
+    
+    file << "Resolution,Workers,Run,Wall Time (ms),Tiles,Tiles/s,Peak RSS (MB),Tree Size (MB),Original Size (MB),Compression Ratio,Fingerprint,Checksum" << std::endl;
+    
+    std::vector<int> workerCounts = benchmarkWorkerCounts();
+    QElapsedTimer timer;
+    for(unsigned int r = 0; r < sizeof(BenchmarkResolutions) / sizeof(BenchmarkResolutions[0]); ++r)
+    {
+        int resolution = BenchmarkResolutions[r];
+        for(auto workers = workerCounts.begin(); workers != workerCounts.end(); ++workers)
+        {
+            for(int run = 0; run < repeats; ++run)
+            {
+                // Buffers kept from the previous run would count towards
+                // this run's peak
+                VoxelBufferPool::trim();
+                resetPeakMemory();
+                timer.start();
+                
+                // Build the entire tree
+                VoxelTree* tree = new VoxelTree(uniformManager, scene, resolution);
+                tree->setConcurrentBuilds(*workers);
+                tree->setDeterministicBuild(deterministic);
+                
+                // There is no frame to keep responsive, so
+                // do as much main thread work as possible
+                tree->setBuildFrameBudget(0.0);
+                while(tree->completedTiles() < tree->totalTiles())
+                {
+                    tree->updateBuild();
+                }
+                
+                double seconds = timer.nsecsElapsed() * 1e-9;
+                double peakMB = peakMemoryMB();
+                int tiles = tree->requestedTiles();
+                double treeSizeMB = tree->sizeBytes() / (1024.0 * 1024.0);
+                double originalSizeMB = tree->originalSizeBytes() / (1024.0 * 1024.0);
+                
+                char fingerprint[17];
+                char checksum[17];
+                sprintf(fingerprint, "%016llx", (unsigned long long)tree->fingerprint());
+                sprintf(checksum, "%016llx", (unsigned long long)tree->checksum());
+                
+                file << resolution << ","
+                    << *workers << ","
+                    << run << ","
+                    << seconds * 1000.0 << ","
+                    << tiles << ","
+                    << tiles / seconds << ","
+                    << peakMB << ","
+                    << treeSizeMB << ","
+                    << originalSizeMB << ","
+                    << originalSizeMB / treeSizeMB << ","
+                    << fingerprint << ","
+                    << checksum << std::endl;
+                
+                printf("%dK, %d workers, run %d: %.0f ms, %.1f tiles/s, %.0f MB peak, %.1f MB tree \n",
+                       resolution / 1024, *workers, run, seconds * 1000.0, tiles / seconds, peakMB, treeSizeMB);
+                
+                delete tree;
+            }
+        }
+    }
+    
+    delete uniformManager;
+    delete scene;
+    
+    printf("Build benchmark results written to %s \n", resultsFileName);
+    return 0;
+}
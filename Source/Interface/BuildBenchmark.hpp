@@ -0,0 +1,11 @@
+#pragma once
+
+// Builds the voxel tree for the test scene at each resolution from 2K to
+// 128K with a range of concurrent builder counts, without opening a window.
+// Each build is repeated to show the variance between runs. Writes the
+// wall time, tiles per second, peak resident memory, tree size,
+// compression ratio and tree fingerprint and checksum of every run to
+// a CSV file. Deterministic builds should have the same checksum for
+// every builder count.
+// Requires a QGuiApplication. Returns the process exit code.
+int runBuildBenchmark(const char* resultsFileName, int repeats, bool deterministic);
@@ -41,6 +41,11 @@ float InputManager::getMovementSpeed() const
     return isKeyDown(InputKey::Key_Shift) ? 20.0 : 5.0;
 }
 
+float InputManager::getLightRotation() const
+{
+    return getAxisMovement(InputKey::Key_R, InputKey::Key_F);
+}
+
 float InputManager::getAxisMovement(InputKey positiveDir, InputKey negativeDir) const
 {
     float val = 0.0;
@@ -26,6 +26,9 @@ public:
     float getVerticalMovement() const;
     float getMovementSpeed() const;
     
+    // Main light rotation axis
+    float getLightRotation() const;
+    
     // Updates key press state
     void keyPressed(InputKey key);
     void keyReleased(InputKey key);
@@ -10,6 +10,7 @@ MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolu
     
     // Create groups
     statsGroupBox_ = new QGroupBox("Stats");
+    treeStatsGroupBox_ = new QGroupBox("Tree Stats");
     featureToggles_ = new QGroupBox("Shader Features");
     shadowMethodRadios_ = new QGroupBox("Shadow Methods");
     overlayRadios_ = new QGroupBox("Debug Overlay");
@@ -19,6 +20,7 @@ MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolu
     
     // Use a vertical layout for all groups
     statsGroupBox_->setLayout(new QBoxLayout(QBoxLayout::TopToBottom));
+    treeStatsGroupBox_->setLayout(new QBoxLayout(QBoxLayout::TopToBottom));
     featureToggles_->setLayout(new QBoxLayout(QBoxLayout::TopToBottom));
     shadowMethodRadios_->setLayout(new QBoxLayout(QBoxLayout::TopToBottom));
     overlayRadios_->setLayout(new QBoxLayout(QBoxLayout::TopToBottom));
@@ -38,6 +40,16 @@ MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolu
     treeTilesLabel_ = createStatsLabel();
     originalSizeLabel_ = createStatsLabel();
     treeSizeLabel_ = createStatsLabel();
+    treeBuildTimeLabel_ = createStatsLabel();
+    treeBuildMemoryLabel_ = createStatsLabel();
+    
+    // Create tree stats widgets.
+    // The report is computed on request as it walks the whole tree.
+    treeStatsButton_ = new QPushButton("Compute Tree Stats");
+    treeStatsLabel_ = new QLabel();
+    treeStatsLabel_->setWordWrap(true);
+    treeStatsGroupBox_->layout()->addWidget(treeStatsButton_);
+    treeStatsGroupBox_->layout()->addWidget(treeStatsLabel_);
     
     // Create shading feature toggles
     createFeatureToggle(SF_Texture, "Diffuse Textures");
@@ -45,6 +57,7 @@ MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolu
     createFeatureToggle(SF_NormalMap, "Normal Mapping");
     createFeatureToggle(SF_Cutout, "Cutout Transparency");
     createFeatureToggle(SF_Fog, "Fog");
+    createFeatureToggle(SF_Shadow_Voxel_LOD, "Voxel Tree LOD");
     
     // Create shadow method toggles
     createShadowMethodRadio(SMM_ShadowMap, "Shadow Mapping");    createShadowMethodRadio(SMM_VoxelTree, "Voxel Tree");
@@ -80,6 +93,7 @@ MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolu
     // Add widgets to side panel
     QBoxLayout* sidePanelLayout = new QBoxLayout(QBoxLayout::TopToBottom);
     sidePanelLayout->addWidget(statsGroupBox_);
+    sidePanelLayout->addWidget(treeStatsGroupBox_);
     sidePanelLayout->addWidget(featureToggles_);
     sidePanelLayout->addWidget(shadowMethodRadios_);
     sidePanelLayout->addWidget(overlayRadios_);
@@ -6,6 +6,7 @@
 #include <QtWidgets/QGroupBox>
 #include <QtWidgets/QRadioButton>
 #include <QtWidgets/QLabel>
+#include <QtWidgets/QPushButton>
 
 #include "RendererWidget.hpp"
 
@@ -26,6 +27,12 @@ public:
     QLabel* treeTilesLabel() const { return treeTilesLabel_; }
     QLabel* originalSizeLabel() const { return originalSizeLabel_; }
     QLabel* treeSizeLabel() const { return treeSizeLabel_; }
+    QLabel* treeBuildTimeLabel() const { return treeBuildTimeLabel_; }
+    QLabel* treeBuildMemoryLabel() const { return treeBuildMemoryLabel_; }
+    
+    // Tree stats widgets
+    QPushButton* treeStatsButton() const { return treeStatsButton_; }
+    QLabel* treeStatsLabel() const { return treeStatsLabel_; }
     
     // Render setting widget lists
     QObjectList shaderFeatureToggles() { return featureToggles_->children(); }
@@ -52,6 +59,13 @@ private:
     QLabel* treeTilesLabel_;
     QLabel* originalSizeLabel_;
     QLabel* treeSizeLabel_;
+    QLabel* treeBuildTimeLabel_;
+    QLabel* treeBuildMemoryLabel_;
+    
+    // Tree stats report
+    QGroupBox* treeStatsGroupBox_;
+    QPushButton* treeStatsButton_;
+    QLabel* treeStatsLabel_;
     
     // Render setting widget groups
     QGroupBox* featureToggles_;
@@ -43,6 +43,9 @@ MainWindowController::MainWindowController(MainWindow* window)
         connect(window_->voxelPCFFilterSizeRadios()[i], SIGNAL(toggled(bool)), SLOT(voxelPCFFilterSizeToggled()));
     }
     
+    // Tree stats button signal
+    connect(window_->treeStatsButton(), SIGNAL(clicked()), SLOT(treeStatsRequested()));
+    
     // Start the performance test
     performanceTest_.startTest();
 }
@@ -148,6 +151,39 @@ void MainWindowController::voxelPCFFilterSizeToggled()
     window_->rendererWidget()->setVoxelPCFFilterSize(kernelSize);
 }
 
+void MainWindowController::treeStatsRequested()
+{
+    VoxelTreeStats* stats = window_->rendererWidget()->computeTreeStats();
+    
+    // Summarise the report
+    QString text = QString("Nodes: %1 unique / %2 referenced\n").arg(stats->uniqueNodes()).arg(stats->references());
+    text += QString("Dedup Hit Rate: %1%\n").arg(stats->dedupHitRate() * 100.0, 0, 'f', 1);
+    text += QString("Compression: %1 : 1\n").arg(stats->compressionRatio(), 0, 'f', 1);
+    text += QString("Built Tiles: %1\n").arg(stats->builtTiles());
+    text += QString("Reduced Resolution Tiles: %1\n").arg(stats->reducedResolutionTiles());
+    text += QString("Keyframe Rebuilds: %1 (%2 tiles)\n").arg(stats->keyframeRebuilds()).arg(stats->keyframeRebuildTiles());
+    text += QString("Leaf Masks: %1 distinct").arg(stats->distinctLeafMasks());
+    
+    // Add the size of each level, from the leaves up
+    for(int level = 1; level < VoxelTreeStats::LevelCount; ++level)
+    {
+        const VoxelLevelStats &levelStats = stats->level(level);
+        if(levelStats.references > 0)
+        {
+            text += QString("\nLevel %1: %2 nodes, %3 KB")
+                .arg(level)
+                .arg(levelStats.uniqueNodes)
+                .arg(levelStats.bytes / 1024);
+        }
+    }
+    
+    window_->treeStatsLabel()->setText(text);
+    
+    // Write the full report
+    stats->writeJSON("voxel-tree-stats.json");
+    delete stats;
+}
+
 void MainWindowController::update(float deltaTime)
 {
     // Update performance tests
@@ -157,6 +193,7 @@ void MainWindowController::update(float deltaTime)
     if(performanceTest_.isRunning() == false)
     {
         applyCameraMovement(deltaTime);
+        applyLightRotation(deltaTime);
     }
     
     // Update the statistics ui
@@ -179,6 +216,22 @@ void MainWindowController::applyCameraMovement(float deltaTime)
     camera->translate(movement * deltaTime);
 }
 
+void MainWindowController::applyLightRotation(float deltaTime)
+{
+    // Keyframed lights follow their own cycle
+    Light* light = window_->rendererWidget()->scene()->light(0);
+    float rotation = inputManager_.getLightRotation();
+    if(rotation == 0.0 || light->keyframes().size() > 1)
+    {
+        return;
+    }
+    
+    // Slowly turn the light around the world up axis.
+    // The voxel tree is rebuilt in the background as it moves.
+    const float degreesPerSecond = 5.0;
+    light->rotate(rotation * degreesPerSecond * deltaTime, Vector3(0.0, 1.0, 0.0));
+}
+
 void MainWindowController::updateStatsUI()
 {
     // Get the render resolution
@@ -197,6 +250,10 @@ void MainWindowController::updateStatsUI()
     int completedTiles = tree->completedTiles();
     size_t originalSizeMB = tree->originalSizeMB();
     size_t treeSizeMB = tree->sizeMB();
+    float buildFrameTime = tree->buildFrameTime();
+    float buildFrameBudget = tree->buildFrameBudget();
+    size_t buildMemoryMB = tree->buildMemoryBytes() / (1024 * 1024);
+    int buildMemoryBudgetMB = tree->buildMemoryBudgetMB();
     
     // Create the text for each label
     QString resolutionText = QString("%1 x %2").arg(resX).arg(resY);
@@ -205,6 +262,10 @@ void MainWindowController::updateStatsUI()
     QString tilesText = QString("Tiles: %1 / %2").arg(completedTiles).arg(totalTiles);
     QString originalSizeText = QString("Original Size: %1 MB").arg(originalSizeMB);
     QString treeSizeText = QString("Tree Size: %1 MB").arg(treeSizeMB);
+    QString buildTimeText = QString("Build: %1 ms / frame (%2 ms budget)")
+        .arg(buildFrameTime, 0, 'f', 1)
+        .arg(buildFrameBudget, 0, 'f', 1);
+    QString buildMemoryText = QString("Build Memory: %1 MB (%2 MB budget)").arg(buildMemoryMB).arg(buildMemoryBudgetMB);
     
     // Update the stats labels
     window_->resolutionLabel()->setText(resolutionText);
@@ -213,6 +274,8 @@ void MainWindowController::updateStatsUI()
     window_->treeTilesLabel()->setText(tilesText);
     window_->originalSizeLabel()->setText(originalSizeText);
     window_->treeSizeLabel()->setText(treeSizeText);
+    window_->treeBuildTimeLabel()->setText(buildTimeText);
+    window_->treeBuildMemoryLabel()->setText(buildMemoryText);
     
     // Update the pass rendering time labels
     for(int pass = 0; pass < stats->passCount(); ++pass)
@@ -30,6 +30,10 @@ public slots:
     void shadowCascadesToggled();
     void voxelPCFFilterSizeToggled();
 
+    // Computes the tree stats report, shows it
+    // and writes it to voxel-tree-stats.json
+    void treeStatsRequested();
+    
 private:
     MainWindow* window_;
     InputManager inputManager_;
@@ -41,6 +45,7 @@ private:
     // Called each frame
     void update(float deltaTime);
     void applyCameraMovement(float deltaTime);
+    void applyLightRotation(float deltaTime);
     void updateStatsUI();
     
     // Qt event handling
@@ -35,6 +35,12 @@ void Bounds::expandToCover(const Vector3 &point)
     max_.z = std::max(max_.z, point.z);
 }
 
+bool Bounds::contains(const Bounds &other) const
+{
+    return other.min_.x >= min_.x && other.min_.y >= min_.y && other.min_.z >= min_.z
+        && other.max_.x <= max_.x && other.max_.y <= max_.y && other.max_.z <= max_.z;
+}
+
 Bounds Bounds::cover(const Vector4* points, int count)
 {
     assert(count > 0);
@@ -19,6 +19,9 @@ public:
     // Expands the bounds to contain the given point
     void expandToCover(const Vector3 &point);
     
+    // Returns true if the other bounds are entirely inside these bounds
+    bool contains(const Bounds &other) const;
+    
     // Creates a Bounds instance covering the given points
     static Bounds cover(const Vector4* points, int count);
     
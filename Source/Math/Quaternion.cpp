@@ -1,6 +1,7 @@
 #include "Quaternion.hpp"
 
 #include <math.h>
+#include <algorithm>
 
 Quaternion::Quaternion()
     : v(Vector3(0.0, 0.0, 0.0)), w(1.0)
@@ -69,6 +70,23 @@ Quaternion Quaternion::euler(Vector3 &euler)
     return Quaternion::euler(euler.x, euler.y, euler.z);
 }
 
+Quaternion Quaternion::nlerp(const Quaternion &a, const Quaternion &b, float t)
+{
+    // Negate b if needed to take the shortest path
+    float dot = Vector3::dot(a.v, b.v) + (a.w * b.w);
+    Quaternion target = (dot < 0.0) ? -1.0 * b : b;
+    
+    Quaternion result = ((1.0 - t) * a) + (t * target);
+    return (1.0 / result.norm()) * result;
+}
+
+float Quaternion::angle(const Quaternion &a, const Quaternion &b)
+{
+    // q and -q are the same rotation, so use the absolute dot product
+    float dot = fabs(Vector3::dot(a.v, b.v) + (a.w * b.w));
+    return 2.0 * acos(std::min(dot, 1.0f)) * (180.0 / M_PI);
+}
+
 Quaternion operator * (const Quaternion &q, float scalar)
 {
     return Quaternion(scalar * q.v, scalar * q.w);
@@ -29,6 +29,13 @@ struct Quaternion
     // around the y axis, and then x degrees around the x axis.
     static Quaternion euler(float x, float y, float z);
     static Quaternion euler(Vector3 &euler);
+    
+    // Interpolates between 2 rotations along the shortest path.
+    // Uses normalized linear interpolation.
+    static Quaternion nlerp(const Quaternion &a, const Quaternion &b, float t);
+    
+    // The angle (degrees) of the rotation between 2 unit quaternions
+    static float angle(const Quaternion &a, const Quaternion &b);
 };
 
 Quaternion operator * (const Quaternion &q, float scalar);
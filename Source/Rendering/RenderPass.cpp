@@ -42,7 +42,7 @@ void RenderPass::setSupportedFeatures(ShaderFeatureList supportedFeatures)
     shaderCollection_->setSupportedFeatures(supportedFeatures);
 }
 
-void RenderPass::submit(Camera* camera, const vector<MeshInstance> &instances, bool drawStatic, bool drawDynamic)
+void RenderPass::submit(Camera* camera, const vector<MeshInstance> &instances, bool drawStatic, bool drawDynamic, bool drawVoxelShadowed)
 {
     // Setup the camera uniform buffer
     CameraUniformBuffer cub;
@@ -93,7 +93,8 @@ void RenderPass::submit(Camera* camera, const vector<MeshInstance> &instances, b
     {
         // Check if the instance should be skipped due to its static flag
         if((instance->isStatic() && !drawStatic)
-           || (!instance->isStatic() && !drawDynamic))
+           || (!instance->isStatic() && !drawDynamic)
+           || (instance->hasVoxelShadows() && !drawVoxelShadowed))
         {
             continue;
         }
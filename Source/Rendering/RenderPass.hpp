@@ -35,8 +35,9 @@ public:
     void setSupportedFeatures(ShaderFeatureList supportedFeatures);
     
     // Sends draw commands to the graphics API.
-    // The meshes can be filtered based on their static flag state.
-    void submit(Camera* camera, const vector<MeshInstance> &instances, bool drawStatic = true, bool drawDynamic = true);
+    // The meshes can be filtered based on their static flag state,
+    // and dynamic meshes shadowed by the voxel tree can be skipped.
+    void submit(Camera* camera, const vector<MeshInstance> &instances, bool drawStatic = true, bool drawDynamic = true, bool drawVoxelShadowed = true);
     
     // Draws a full screen quad using all enabled shader features.
     void renderFullScreen();
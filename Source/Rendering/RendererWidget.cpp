@@ -1,6 +1,7 @@
 #include "RendererWidget.hpp"
 
 #include <assert.h>
+#include <math.h>
 #include <cstdio>
 
 #include <iostream>
@@ -83,10 +84,44 @@ void RendererWidget::precomputeTree()
     }
 }
 
+bool RendererWidget::saveTree(const char* fileName)
+{
+    VoxelTreeSampler* sampler = voxelTree_->createSampler();
+    bool saved = sampler->save(fileName);
+    delete sampler;
+    
+    return saved;
+}
+
+VoxelTreeStats* RendererWidget::computeTreeStats()
+{
+    return voxelTree_->computeStats();
+}
+
+void RendererWidget::recordTileDepths(const char* fileName)
+{
+    voxelTree_->recordTileDepths(fileName);
+}
+
+void RendererWidget::setDeterministicBuild(bool deterministic)
+{
+    voxelTree_->setDeterministicBuild(deterministic);
+}
+
+void RendererWidget::setBuildFrameBudget(float milliseconds)
+{
+    voxelTree_->setBuildFrameBudget(milliseconds);
+}
+
+void RendererWidget::setBuildMemoryBudget(int megabytes)
+{
+    voxelTree_->setBuildMemoryBudgetMB(megabytes);
+}
+
 void RendererWidget::initializeGL()
 {
     printf("Initializing OpenGL %s \n", glGetString(GL_VERSION));
-
+    
     // Configure OpenGL state
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
@@ -155,11 +190,47 @@ void RendererWidget::paintGL()
     data.ambientLightColor = Vector4(scene_->mainLight()->ambient(), 1.0);
     data.lightColor = Vector4(scene_->mainLight()->color(), 1.0);
     data.lightDirection = -1.0 * scene_->mainLight()->forward();
+    
+    // Add the other lights. Their shadows come from the voxel tree.
+    const vector<Light> &lights = scene_->lights();
+    data.additionalLightCount = std::min((int)lights.size() - 1, SceneUniformBuffer::MaxAdditionalLights);
+    for(unsigned int i = 0; i < data.additionalLightCount; ++i)
+    {
+        const Light &light = lights[i+1];
+        data.additionalLightColors[i] = Vector4(light.color(), 1.0);
+        data.additionalLightDirections[i] = -1.0 * light.forward();
+        data.additionalLightPositions[i] = Vector4(light.position(), 0.0);
+        
+        // Point lights have no cone, so use the full sphere
+        data.additionalLightDirections[i].w = -1.0;
+        if(light.type() == LightType::Spot)
+        {
+            float halfAngle = (light.spotAngle() / 2.0) * (M_PI / 180.0);
+            data.additionalLightDirections[i].w = cos(halfAngle);
+        }
+        
+        // Local lights are attenuated up to their range
+        if(light.type() != LightType::Directional)
+        {
+            data.additionalLightPositions[i].w = light.range();
+        }
+    }
     uniformManager_->updateSceneBuffer(data);
     
-    // Update construction of the voxel tree
+    // Rebuild voxel tree tiles affected by static geometry changes
+    // or light rotation and update construction of the voxel tree
+    voxelTree_->updateStaticGeometry();
+    voxelTree_->updateLightRotations();
     voxelTree_->updateBuild();
     
+    // Move the trees of rigid dynamic objects. Objects shadowed by
+    // their tree are left out of the shadow map in combined mode.
+    voxelTree_->updateObjectTrees();
+    for(unsigned int i = 0; i < scene_->meshInstances().size(); ++i)
+    {
+        scene_->meshInstance(i)->setHasVoxelShadows(voxelTree_->hasVoxelShadows(i));
+    }
+    
     // Render shadow depth to the shadow map framebuffer.
     stats_->passStarted(0);
     renderShadowMap();
@@ -273,10 +344,12 @@ void RendererWidget::renderShadowMap()
     // Update the shadow uniform buffer
     shadowMap_->updateUniformBuffer();
     
-    // Render all cascades
+    // Render all cascades.
+    // Dynamic objects shadowed by their voxel tree are skipped in combined mode.
     bool renderStaticObjects = (shadowMask_->method() == SMM_ShadowMap);
     bool renderDynamicObjects = true;
-    shadowMap_->renderCascades(renderStaticObjects, renderDynamicObjects);
+    bool renderVoxelShadowedObjects = renderStaticObjects;
+    shadowMap_->renderCascades(renderStaticObjects, renderDynamicObjects, true, renderVoxelShadowedObjects);
 }
 
 void RendererWidget::renderSceneDepth()
@@ -327,7 +400,7 @@ void RendererWidget::renderForward()
     
     // Use the main camera
     scene_->mainCamera()->bind();
-        
+    
     // Render the final image
     forwardPass_->submit(scene_->mainCamera(), scene_->meshInstances());
 }
@@ -20,7 +20,7 @@ public:
     
     Scene* scene() { return scene_; }
     UniformManager* uniformManager() { return uniformManager_; }
-
+    
     // Current rendering info
     int resolutionX() const { return shadowMask_->texture()->width(); }
     int resolutionY() const { return shadowMask_->texture()->height(); }
@@ -53,6 +53,29 @@ public:
     // starting to render the scene. Used for profiling.
     void precomputeTree();
     
+    // Saves the voxel tree for the main light to a file,
+    // eg to be served by a shadow query server.
+    bool saveTree(const char* fileName);
+    
+    // Computes a report on the voxel tree's nodes.
+    // The caller owns the stats.
+    VoxelTreeStats* computeTreeStats();
+    
+    // Records the depths of the next few tiles that are built
+    void recordTileDepths(const char* fileName);
+    
+    // Builds the voxel tree with a layout that does not
+    // depend on the order builders finish in
+    void setDeterministicBuild(bool deterministic);
+    
+    // Sets the time (ms) spent building the voxel tree on
+    // the main thread each frame. Zero means no limit.
+    void setBuildFrameBudget(float milliseconds);
+    
+    // Sets the memory (MB) that tiles being built can use.
+    // Zero means no limit.
+    void setBuildMemoryBudget(int megabytes);
+
 private:
     Scene* scene_;
     UniformManager* uniformManager_;
@@ -73,7 +96,7 @@ private:
     int currentOverlay_;
     
     int voxelResolution_;
-
+    
     // QGLWidget override methods
     void initializeGL();
     void resizeGL(int w, int h);
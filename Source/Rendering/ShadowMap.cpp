@@ -91,6 +91,16 @@ void ShadowMap::setCascades(int cascadesCount, int resolution)
     }
 }
 
+void ShadowMap::setViewportResolution(int resolution)
+{
+    // Only used for shadow maps with a single cascade
+    assert(cascadesCount_ == 1);
+    assert(resolution > 0 && resolution <= resolution_);
+    
+    cascades_[0].camera.setPixelWidth(resolution);
+    cascades_[0].camera.setPixelHeight(resolution);
+}
+
 void ShadowMap::updatePosition(Camera* viewCamera)
 {
     // Ensure each cascade is drawn from the correct direction
@@ -147,12 +157,20 @@ void ShadowMap::updatePosition(Camera* viewCamera)
 }
 
 void ShadowMap::setLightSpaceBounds(Bounds lightSpaceBounds)
+{
+    setLightSpaceBounds(lightSpaceBounds, scene_->mainLight()->rotation());
+}
+
+void ShadowMap::setLightSpaceBounds(Bounds lightSpaceBounds, const Quaternion &lightRotation)
 {
     // Only used for shadow maps with a single cascade
     assert(cascadesCount_ == 1);
     
+    // The camera may have been used for a perspective view
+    cascades_[0].camera.setType(CameraType::Orthographic);
+    
     // Rotate the camera correctly.
-    cascades_[0].camera.setRotation(scene_->mainLight()->rotation());
+    cascades_[0].camera.setRotation(lightRotation);
     
     // Get the light to world transformation matrix (without translation)
     Matrix4x4 lightToWorld = cascades_[0].camera.localToWorld();
@@ -177,6 +195,20 @@ void ShadowMap::setLightSpaceBounds(Bounds lightSpaceBounds)
     cascades_[0].camera.setFarPlane(size.z / 2.0);
 }
 
+void ShadowMap::setPerspective(const Vector3 &position, const Quaternion &rotation, float fov, float nearPlane, float farPlane)
+{
+    // Only used for shadow maps with a single cascade
+    assert(cascadesCount_ == 1);
+    
+    // Look from the light along its forward direction
+    cascades_[0].camera.setType(CameraType::Perspective);
+    cascades_[0].camera.setPosition(position);
+    cascades_[0].camera.setRotation(rotation);
+    cascades_[0].camera.setFov(fov);
+    cascades_[0].camera.setNearPlane(nearPlane);
+    cascades_[0].camera.setFarPlane(farPlane);
+}
+
 void ShadowMap::updateUniformBuffer() const
 {
     ShadowUniformBuffer shadowData;
@@ -196,7 +228,22 @@ void ShadowMap::updateUniformBuffer() const
     uniformManager_->updateShadowBuffer(shadowData);
 }
 
-void ShadowMap::renderCascades(bool drawStatic, bool drawDynamic, bool depthBias)
+void ShadowMap::renderCascades(bool drawStatic, bool drawDynamic, bool depthBias, bool drawVoxelShadowed)
+{
+    renderInstances(scene_->meshInstances(), drawStatic, drawDynamic, depthBias, drawVoxelShadowed, true);
+}
+
+void ShadowMap::renderCascades(const vector<MeshInstance> &instances, bool depthBias)
+{
+    renderInstances(instances, true, true, depthBias, true, true);
+}
+
+void ShadowMap::renderCascadesPart(const vector<MeshInstance> &instances, bool drawStatic, bool drawDynamic, bool depthBias, bool clear)
+{
+    renderInstances(instances, drawStatic, drawDynamic, depthBias, true, clear);
+}
+
+void ShadowMap::renderInstances(const vector<MeshInstance> &instances, bool drawStatic, bool drawDynamic, bool depthBias, bool drawVoxelShadowed, bool clear)
 {
     // Enable depth biasing to prevent shadow acne
     if(depthBias)
@@ -218,10 +265,10 @@ void ShadowMap::renderCascades(bool drawStatic, bool drawDynamic, bool depthBias
         cascades_[c].camera.bind();
         
         // Only clear the shadow map if this is the first cascade being rendered
-        shadowCasterPass_->setClearFlags(c == 0 ? GL_DEPTH_BUFFER_BIT : GL_NONE);
+        shadowCasterPass_->setClearFlags((c == 0 && clear) ? GL_DEPTH_BUFFER_BIT : GL_NONE);
         
         // Render the scene using the camera.
-        shadowCasterPass_->submit(&cascades_[c].camera, scene_->meshInstances(), drawStatic, drawDynamic);
+        shadowCasterPass_->submit(&cascades_[c].camera, instances, drawStatic, drawDynamic, drawVoxelShadowed);
     }
     
     // Disable depth biasing
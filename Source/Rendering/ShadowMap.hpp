@@ -45,17 +45,35 @@ public:
     // Sets the resolution of each cascade
     void setCascades(int cascadesCount, int resolution);
     
+    // Renders a single cascade into the corner of the texture at a lower
+    // resolution. The texture keeps its size and is not reallocated.
+    void setViewportResolution(int resolution);
+    
     // Moves the shadow map to fit the current view
     void updatePosition(Camera* viewCamera);
     
     // Directly sets the shadow map bounds in light space.
+    // The light rotation defaults to the main light's rotation.
     void setLightSpaceBounds(Bounds lightSpaceBounds);
+    void setLightSpaceBounds(Bounds lightSpaceBounds, const Quaternion &lightRotation);
+    
+    // Renders a perspective view from a local light instead.
+    // Only used for shadow maps with a single, square cascade.
+    void setPerspective(const Vector3 &position, const Quaternion &rotation, float fov, float nearPlane, float farPlane);
     
     // Updates the shadows uniform buffer
     void updateUniformBuffer() const;
     
-    // Rerenders all shadow map cascades
-    void renderCascades(bool drawStatic = true, bool drawDynamic = true, bool depthBias = true);
+    // Rerenders all shadow map cascades.
+    // Dynamic instances shadowed by their own voxel tree can be skipped.
+    void renderCascades(bool drawStatic = true, bool drawDynamic = true, bool depthBias = true, bool drawVoxelShadowed = true);
+    
+    // Rerenders all shadow map cascades with only the given instances
+    void renderCascades(const vector<MeshInstance> &instances, bool depthBias = true);
+    
+    // Renders the given instances over the cascades without clearing them
+    // unless requested, so a shadow map can be rendered in several parts
+    void renderCascadesPart(const vector<MeshInstance> &instances, bool drawStatic, bool drawDynamic, bool depthBias, bool clear);
     
 private:
     const Scene* scene_;
@@ -70,6 +88,9 @@ private:
     int resolution_;
     int cascadesCount_;
     
+    // Renders each cascade with the instances that pass the filters
+    void renderInstances(const vector<MeshInstance> &instances, bool drawStatic, bool drawDynamic, bool depthBias, bool drawVoxelShadowed, bool clear);
+    
     // Computes the start distance of a shadow cascade
     float getCascadeMin(int cascade, float farPlane) const;
     
@@ -7,8 +7,9 @@ ShadowMask::ShadowMask(UniformManager* uniformManager, ShadowMaskMethod method)
     texture_(NULL),
     voxelTree_(NULL)
 {
-    // Create a single channel texture for the shadow mask
-    texture_ = Texture::singleChannel(1, 1);
+    // Create a texture for the shadow mask.
+    // Each channel stores the shadowing of one light.
+    texture_ = Texture::fourChannel(1, 1);
     texture_->setWrapMode(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
     texture_->setMinFilter(GL_NEAREST);
     texture_->setMagFilter(GL_NEAREST);
@@ -25,7 +26,7 @@ ShadowMask::ShadowMask(UniformManager* uniformManager, ShadowMaskMethod method)
     
     // RenderPass for the VoxelTree method
     voxelTreePass_ = new RenderPass("ShadowSamplingPass-Voxel", uniformManager);
-    voxelTreePass_->setSupportedFeatures(SF_Shadow_PCF_Filter);
+    voxelTreePass_->setSupportedFeatures(SF_Shadow_PCF_Filter | SF_Shadow_Voxel_LOD);
 }
 
 ShadowMask::~ShadowMask()
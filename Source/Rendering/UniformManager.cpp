@@ -1,5 +1,8 @@
 #include "UniformManager.hpp"
 
+// The light count is clamped to this with std::min, which needs a definition
+const int SceneUniformBuffer::MaxAdditionalLights;
+
 UniformManager::UniformManager()
 {
     createBuffers();
@@ -22,9 +22,19 @@ struct SceneUniformBuffer
 {
     static const int BlockID = 1;
     
+    // Must match MAX_ADDITIONAL_LIGHTS in the forward pass shaders
+    static const int MaxAdditionalLights = 3;
+    
     Vector4 ambientLightColor;
     Vector4 lightColor;
     Vector4 lightDirection; // To light. Normalized
+    
+    // Directional, spot and point lights other than the main light.
+    // Their shadows are stored in the shadow mask g, b and a channels.
+    Vector4 additionalLightColors[MaxAdditionalLights];
+    Vector4 additionalLightDirections[MaxAdditionalLights]; // w = cos of spot half angle
+    Vector4 additionalLightPositions[MaxAdditionalLights]; // w = range, 0 for directional lights
+    uint32_t additionalLightCount;
 };
 
 
@@ -62,10 +72,65 @@ struct VoxelsUniformBuffer
 {
     static const int BlockID = 3;
     
-    Matrix4x4 worldToVoxels;
+    // Must match MAX_VOXEL_CASCADES, MAX_VOXEL_KEYFRAMES and
+    // MAX_VOXEL_LIGHTS in the voxel sampling shader.
+    // There is one shadow mask channel per light.
+    static const int MaxCascades = 32;
+    static const int MaxKeyframes = 16;
+    static const int MaxLights = 4;
+    
+    struct Cascade
+    {
+        Matrix4x4 worldToVoxels;
+        
+        uint32_t treeHeight;
+        uint32_t tileSubdivisions;
+        
+        // The index of the cascade's first root node pointer
+        uint32_t firstTile;
+        
+        // The camera distance up to which the cascade is used
+        float maxDistance;
+    };
+    
+    // A light rotation and its cascades
+    struct Keyframe
+    {
+        uint32_t firstCascade;
+        uint32_t cascadeCount;
+        
+        // Padding for std140 alignment
+        uint32_t paddingBits[2];
+    };
+    
+    // A shadow casting light and its keyframes
+    struct Light
+    {
+        uint32_t firstKeyframe;
+        uint32_t keyframeCount;
+        
+        // The keyframes either side of the light's current rotation
+        // and the blend between them.
+        uint32_t currentKeyframe;
+        uint32_t nextKeyframe;
+        float keyframeBlend;
+        
+        // The LightType. Local lights select a keyframe by position.
+        uint32_t type;
+        
+        // Padding for std140 alignment
+        uint32_t paddingBits[2];
+        
+        // Local lights only. The world space position and range.
+        Vector4 position;
+    };
     
-    uint32_t voxelTreeHeight;
-    uint32_t tileSubdivisions;
+    // The cascades grouped by keyframe, highest resolution first.
+    // The last cascade of a keyframe covers the entire scene.
+    Cascade cascades[MaxCascades];
+    Keyframe keyframes[MaxKeyframes];
+    Light lights[MaxLights];
+    uint32_t lightCount;
     
     // The total number of voxels used in the PCF kernel
     uint32_t pcfSampleCount;
@@ -73,6 +138,17 @@ struct VoxelsUniformBuffer
     // The number of leaf nodes visited for each PCF kernel.
     uint32_t pcfLookups;
     
+    // The root pointer of tiles that are not built yet
+    uint32_t emptyRoot;
+    
+    // The single cascade trees of rigid dynamic objects.
+    // Trees that are out of date have a negative maxDistance.
+    uint32_t firstObjectCascade;
+    uint32_t objectCascadeCount;
+    
+    // Padding for std140 alignment
+    uint32_t objectPaddingBits[2];
+    
     struct PCFOffset
     {
         uint32_t xOffset;
@@ -1,8 +1,17 @@
 #include "Light.hpp"
 
+#include <math.h>
+#include <algorithm>
+
 Light::Light(Vector3 color, Vector3 ambient)
     : color_(color),
-    ambient_(ambient)
+    ambient_(ambient),
+    type_(LightType::Directional),
+    range_(0.0),
+    spotAngle_(0.0),
+    voxelResolution_(0),
+    keyframes_(),
+    cycleTime_(0.0)
 {
     
 }
@@ -16,3 +25,78 @@ void Light::setAmbient(Vector3 ambient)
 {
     ambient_ = ambient;
 }
+
+void Light::setSpot(float spotAngle, float range, int voxelResolution)
+{
+    type_ = LightType::Spot;
+    spotAngle_ = spotAngle;
+    range_ = range;
+    voxelResolution_ = voxelResolution;
+}
+
+void Light::setPoint(float range, int voxelResolution)
+{
+    type_ = LightType::Point;
+    spotAngle_ = 0.0;
+    range_ = range;
+    voxelResolution_ = voxelResolution;
+}
+
+void Light::addKeyframe(float time, const Quaternion &rotation)
+{
+    LightKeyframe keyframe;
+    keyframe.time = time;
+    keyframe.rotation = rotation;
+    
+    // Keep the keyframes sorted by time
+    auto position = keyframes_.begin();
+    while(position != keyframes_.end() && position->time <= time)
+    {
+        position ++;
+    }
+    
+    keyframes_.insert(position, keyframe);
+}
+
+void Light::currentKeyframes(int* current, int* next, float* blend) const
+{
+    *current = 0;
+    *next = 0;
+    *blend = 0.0;
+    
+    // Find the last keyframe at or before the current time
+    for(unsigned int i = 0; i + 1 < keyframes_.size(); ++i)
+    {
+        if(cycleTime_ >= keyframes_[i].time && cycleTime_ < keyframes_[i+1].time)
+        {
+            float duration = keyframes_[i+1].time - keyframes_[i].time;
+            
+            *current = i;
+            *next = i + 1;
+            *blend = (cycleTime_ - keyframes_[i].time) / duration;
+            return;
+        }
+    }
+}
+
+void Light::update(float deltaTime)
+{
+    // Lights need at least 2 keyframes at different times to move
+    if(keyframes_.size() < 2 || keyframes_.back().time <= keyframes_.front().time)
+    {
+        return;
+    }
+    
+    // Advance the cycle, restarting at the first keyframe
+    // once the last keyframe is reached.
+    float cycleStart = keyframes_.front().time;
+    float cycleLength = keyframes_.back().time - cycleStart;
+    float elapsed = std::max(cycleTime_ - cycleStart, 0.0f) + deltaTime;
+    cycleTime_ = cycleStart + fmod(elapsed, cycleLength);
+    
+    // Rotate to match the keyframes
+    int current, next;
+    float blend;
+    currentKeyframes(&current, &next, &blend);
+    setRotation(Quaternion::nlerp(keyframes_[current].rotation, keyframes_[next].rotation, blend));
+}
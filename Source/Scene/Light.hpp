@@ -1,8 +1,29 @@
 #pragma once
 
+#include <vector>
+
+using namespace std;
+
 #include "Vector3.hpp"
+#include "Quaternion.hpp"
 #include "Object.hpp"
 
+// The light rotation at a point in a repeating cycle, eg a time of day.
+struct LightKeyframe
+{
+    // The time in seconds from the start of the cycle
+    float time;
+    
+    Quaternion rotation;
+};
+
+enum class LightType
+{
+    Directional,
+    Spot,
+    Point
+};
+
 class Light : public Object
 {
 public:
@@ -14,7 +35,44 @@ public:
     void setColor(Vector3 color);
     void setAmbient(Vector3 ambient);
     
+    // Light type. Spot and point lights are static local lights
+    // that light the scene up to their range.
+    LightType type() const { return type_; }
+    float range() const { return range_; }
+    
+    // The full cone angle of a spot light, in degrees
+    float spotAngle() const { return spotAngle_; }
+    
+    // The resolution of the voxel tree for each view of a local light
+    int voxelResolution() const { return voxelResolution_; }
+    
+    // Makes the light a spot or point light
+    void setSpot(float spotAngle, float range, int voxelResolution);
+    void setPoint(float range, int voxelResolution);
+    
+    // The keyframed rotations, in time order.
+    // The cycle restarts once the last keyframe is reached.
+    const vector<LightKeyframe>& keyframes() const { return keyframes_; }
+    void addKeyframe(float time, const Quaternion &rotation);
+    
+    // Finds the keyframes either side of the current time in the cycle
+    // and the blend between them. Both are 0 without keyframes.
+    void currentKeyframes(int* current, int* next, float* blend) const;
+    
+    // Advances the cycle and rotates the light to match
+    void update(float deltaTime);
+    
 private:
     Vector3 color_;
     Vector3 ambient_;
+    
+    // Local light settings
+    LightType type_;
+    float range_;
+    float spotAngle_;
+    int voxelResolution_;
+    
+    // Keyframed rotation
+    vector<LightKeyframe> keyframes_;
+    float cycleTime_;
 };
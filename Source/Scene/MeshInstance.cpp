@@ -2,6 +2,7 @@
 
 MeshInstance::MeshInstance(Mesh* mesh, ShaderFeatureList shaderFeatures, Texture* texture, Texture* normalMap)
     : static_(true),
+    voxelShadows_(false),
     mesh_(mesh),
     shaderFeatures_(shaderFeatures),
     texture_(texture),
@@ -18,4 +19,5 @@ bool MeshInstance::isStatic() const
 void MeshInstance::makeNonStatic()
 {
     static_ = false;
+    markChanged();
 }
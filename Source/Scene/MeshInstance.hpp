@@ -29,12 +29,20 @@ public:
     // This should be done for animated meshes
     void makeNonStatic();
     
+    // True if the mesh is dynamic but its shadow currently comes from
+    // its own voxel tree, so it can be skipped in the shadow map.
+    bool hasVoxelShadows() const { return voxelShadows_; }
+    void setHasVoxelShadows(bool voxelShadows) { voxelShadows_ = voxelShadows; }
+    
 private:
     
     // True if static.
     // Static objects are not animated and are rendered into voxel trees
     bool static_;
     
+    // True while the mesh's voxel tree is up to date
+    bool voxelShadows_;
+    
     // Rendering assets / settings
     Mesh* mesh_;
     ShaderFeatureList shaderFeatures_;
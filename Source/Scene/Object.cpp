@@ -5,7 +5,8 @@ Object::Object()
     rotation_(Quaternion::identity()),
     scale_(Vector3::one()),
     worldToLocal_(Matrix4x4::identity()),
-    localToWorld_(Matrix4x4::identity())
+    localToWorld_(Matrix4x4::identity()),
+    changeCount_(0)
 {
     
 }
@@ -70,4 +71,5 @@ void Object::recreateTransformation()
 {
     localToWorld_ = Matrix4x4::trs(position_, rotation_, scale_);
     worldToLocal_ = Matrix4x4::trsInverse(position_, rotation_, scale_);
+    markChanged();
 }
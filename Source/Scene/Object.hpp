@@ -37,6 +37,14 @@ public:
     // Rotates the object around the given world space vector.
     // The angle is measured in degrees.
     void rotate(float angle, const Vector3 &axis);
+    
+    // Incremented whenever the object changes, so users of
+    // the object can check for changes without comparing it
+    unsigned int changeCount() const { return changeCount_; }
+
+protected:
+    
+    void markChanged() { ++changeCount_; }
 
 private:
     
@@ -49,5 +57,7 @@ private:
     Matrix4x4 worldToLocal_;
     Matrix4x4 localToWorld_;
     
+    unsigned int changeCount_;
+    
     void recreateTransformation();
 };
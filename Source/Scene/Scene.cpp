@@ -9,6 +9,8 @@ Scene::Scene()
     : cameras_(),
     lights_(),
     meshInstances_(),
+    voxelCascades_(),
+    voxelImportance_(),
     meshes_(),
     textures_(),
     meshCollection_()
@@ -27,6 +29,12 @@ void Scene::update(float deltaTime)
     {
         animations_[i].update(deltaTime);
     }
+    
+    // Update keyframed lights
+    for(unsigned int i = 0; i < lights_.size(); ++i)
+    {
+        lights_[i].update(deltaTime);
+    }
 }
 
 bool Scene::loadFromFile(const string &fileName)
@@ -49,9 +57,24 @@ bool Scene::loadFromFile(const string &fileName)
         return false;
     }
     
+    // The main light must be directional
+    if(lights_.empty() || lights_[0].type() != LightType::Directional)
+    {
+        printf("The first light in scene %s must be a directional light \n", fileName.c_str());
+        return false;
+    }
+    
     // After all meshes are loaded, send the collection to the gpu
     meshCollection_.upload();
     
+    // Load the importance map with the same name, if there is one
+    string importanceFileName = fileName.substr(0, fileName.find_last_of('.')) + ".importance";
+    if(!loadVoxelImportanceMap(importanceFileName))
+    {
+        printf("Failed to read voxel importance map %s \n", importanceFileName.c_str());
+        return false;
+    }
+    
     printf("Loaded scene %s successfully \n", fileName.c_str());
     return true;
 }
@@ -69,6 +92,14 @@ bool Scene::loadObject(ifstream &file)
     {
         return loadLight(file);
     }
+    else if(objectType == "spotlight")
+    {
+        return loadSpotLight(file);
+    }
+    else if(objectType == "pointlight")
+    {
+        return loadPointLight(file);
+    }
     else if(objectType == "mesh")
     {
         return loadMeshInstance(file);
@@ -77,6 +108,14 @@ bool Scene::loadObject(ifstream &file)
     {
         return loadAnimation(file);
     }
+    else if(objectType == "voxelcascade")
+    {
+        return loadVoxelCascade(file);
+    }
+    else if(objectType == "lightkeyframe")
+    {
+        return loadLightKeyframe(file);
+    }
     
     printf("Object type %s not known. \n", objectType.c_str());
     return false;
@@ -133,6 +172,58 @@ bool Scene::loadLight(ifstream &file)
     return true;
 }
 
+bool Scene::loadSpotLight(ifstream &file)
+{
+    // Color, cone angle, range and voxel resolution are stored sequentially
+    Vector3 color;
+    float spotAngle, range;
+    int resolution;
+    file >> color >> spotAngle >> range >> resolution;
+    
+    if(!isValidLocalLightResolution(resolution) || spotAngle <= 0.0 || spotAngle >= 180.0)
+    {
+        printf("Invalid spot light angle %f or resolution %d \n", spotAngle, resolution);
+        return false;
+    }
+    
+    // Local lights do not add ambient light
+    Light light(color, Vector3::zero());
+    light.setSpot(spotAngle, range, resolution);
+    loadObjectTransform(file, &light);
+    
+    lights_.push_back(light);
+    return true;
+}
+
+bool Scene::loadPointLight(ifstream &file)
+{
+    // Color, range and voxel resolution are stored sequentially
+    Vector3 color;
+    float range;
+    int resolution;
+    file >> color >> range >> resolution;
+    
+    if(!isValidLocalLightResolution(resolution))
+    {
+        printf("Invalid point light resolution %d \n", resolution);
+        return false;
+    }
+    
+    // Local lights do not add ambient light
+    Light light(color, Vector3::zero());
+    light.setPoint(range, resolution);
+    loadObjectTransform(file, &light);
+    
+    lights_.push_back(light);
+    return true;
+}
+
+bool Scene::isValidLocalLightResolution(int resolution) const
+{
+    // Each view of a local light is a single power of 2 tile
+    return resolution >= 128 && resolution <= 4096 && (resolution & (resolution - 1)) == 0;
+}
+
 bool Scene::loadMeshInstance(ifstream &file)
 {
     // Mesh name, shader features and textures are stored sequentially.
@@ -178,6 +269,111 @@ bool Scene::loadAnimation(ifstream &file)
     return true;
 }
 
+bool Scene::loadVoxelCascade(ifstream &file)
+{
+    // Centre, size, resolution and max distance are stored sequentially
+    VoxelCascadeRegion cascade;
+    file >> cascade.centre >> cascade.size >> cascade.resolution >> cascade.maxDistance;
+    
+    // The resolution must be a power of 2 so it can be split into tiles
+    if(cascade.resolution < 8 || (cascade.resolution & (cascade.resolution - 1)) != 0)
+    {
+        printf("Invalid voxel cascade resolution %d \n", cascade.resolution);
+        return false;
+    }
+    
+    voxelCascades_.push_back(cascade);
+    return true;
+}
+
+bool Scene::loadLightKeyframe(ifstream &file)
+{
+    // Time and rotation are stored sequentially
+    float time;
+    Vector3 eulerAngles;
+    file >> time >> eulerAngles;
+    
+    // Keyframes belong to the most recently loaded light
+    if(lights_.empty())
+    {
+        printf("Light keyframe must follow a light \n");
+        return false;
+    }
+    
+    // Local lights are static
+    if(lights_.back().type() != LightType::Directional)
+    {
+        printf("Light keyframes are only supported for directional lights \n");
+        return false;
+    }
+    
+    lights_.back().addKeyframe(time, Quaternion::euler(eulerAngles));
+    return true;
+}
+
+bool Scene::loadVoxelImportanceMap(const string &fileName)
+{
+    string fullPath = SCENES_DIRECTORY + fileName;
+    
+    // The map is optional
+    ifstream file(fullPath.c_str());
+    if(!file.is_open())
+    {
+        return true;
+    }
+    
+    // The region and dimensions are stored first
+    VoxelImportanceMap map;
+    file >> map.min >> map.max >> map.width >> map.height;
+    
+    if(file.fail() || map.width <= 0 || map.height <= 0)
+    {
+        return false;
+    }
+    
+    // Followed by the values, row by row
+    map.values.resize(map.width * map.height);
+    for(int i = 0; i < map.width * map.height; ++i)
+    {
+        file >> map.values[i];
+    }
+    
+    if(file.fail())
+    {
+        return false;
+    }
+    
+    voxelImportance_ = map;
+    printf("Loaded voxel importance map %s \n", fileName.c_str());
+    return true;
+}
+
+float Scene::voxelImportance(const Vector3 &worldPos) const
+{
+    const VoxelImportanceMap &map = voxelImportance_;
+    
+    // Everything is important if there is no map
+    if(!hasVoxelImportanceMap())
+    {
+        return 1.0;
+    }
+    
+    // Get the position within the map region in [0-1] range
+    float u = (worldPos.x - map.min.x) / (map.max.x - map.min.x);
+    float v = (worldPos.z - map.min.y) / (map.max.y - map.min.y);
+    
+    // Positions outside the map use full resolution
+    if(u < 0.0 || u >= 1.0 || v < 0.0 || v >= 1.0)
+    {
+        return 1.0;
+    }
+    
+    // Use the nearest value
+    int x = (int)(u * map.width);
+    int y = (int)(v * map.height);
+    return map.values[y * map.width + x];
+}
+
 Mesh* Scene::getMesh(const string &name)
 {
     // Use a cached mesh if possible.
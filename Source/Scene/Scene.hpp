@@ -14,6 +14,37 @@ using namespace std;
 #include "Object.hpp"
 #include "Texture.hpp"
 #include "Animation.hpp"
+#include "Vector2.hpp"
+
+// A region of the scene that is covered by its own voxel tree cascade.
+struct VoxelCascadeRegion
+{
+    // The world space centre of the region
+    Vector3 centre;
+    
+    // The width of the region in light space x and y
+    float size;
+    
+    // The voxel resolution of the cascade
+    int resolution;
+    
+    // The camera distance up to which the cascade is used
+    float maxDistance;
+};
+
+// An artist specified map of voxel tree detail over the world x-z plane.
+// Values are in [0-1], where 1 is full resolution.
+struct VoxelImportanceMap
+{
+    // The world space x-z region covered by the map
+    Vector2 min;
+    Vector2 max;
+    
+    // The map dimensions and values, row by row
+    int width;
+    int height;
+    vector<float> values;
+};
 
 class Scene
 {
@@ -24,12 +55,35 @@ public:
     const Camera* mainCamera() const { return &cameras_[0]; }
     Camera* mainCamera() { return &cameras_[0]; }
     
-    // The shadow casting light
+    // The shadow casting light. Always a directional light.
     const Light* mainLight() const { return &lights_[0]; }
     
+    // All lights, starting with the main light
+    const vector<Light>& lights() const { return lights_; }
+    
+    // Gives access to a light for editing.
+    // Rotating a directional light without keyframes rebuilds its voxel tree.
+    Light* light(int index) { return &lights_[index]; }
+    
     // The mesh instances to be rendered
     const vector<MeshInstance>& meshInstances() const { return meshInstances_; }
     
+    // Gives access to a mesh instance for editing.
+    // Changes to static instances are picked up by the voxel tree.
+    MeshInstance* meshInstance(int index) { return &meshInstances_[index]; }
+    
+    // High resolution voxel tree regions, highest priority first.
+    // The rest of the scene is covered by a lower resolution tree.
+    const vector<VoxelCascadeRegion>& voxelCascades() const { return voxelCascades_; }
+    
+    // Artist specified voxel tree detail.
+    // Loaded from a .importance file next to the .scene file, if present.
+    bool hasVoxelImportanceMap() const { return !voxelImportance_.values.empty(); }
+    
+    // Samples the voxel importance map at a world space position.
+    // Returns 1 outside the map.
+    float voxelImportance(const Vector3 &worldPos) const;
+    
     void update(float deltaTime);
     
     // Loads scene objects from the given .scene file
@@ -42,6 +96,8 @@ private:
     vector<Light> lights_;
     vector<MeshInstance> meshInstances_;
     vector<Animation> animations_;
+    vector<VoxelCascadeRegion> voxelCascades_;
+    VoxelImportanceMap voxelImportance_;
     
     // Assets
     map<string, Mesh*> meshes_;
@@ -52,8 +108,16 @@ private:
     void loadObjectTransform(ifstream &file, Object* object);
     bool loadCamera(ifstream &file);
     bool loadLight(ifstream &file);
+    bool loadSpotLight(ifstream &file);
+    bool loadPointLight(ifstream &file);
+    bool isValidLocalLightResolution(int resolution) const;
     bool loadMeshInstance(ifstream &file);
     bool loadAnimation(ifstream &file);
+    bool loadVoxelCascade(ifstream &file);
+    bool loadLightKeyframe(ifstream &file);
+    
+    // Loads the optional voxel importance map
+    bool loadVoxelImportanceMap(const string &fileName);
     
     // Used to store meshes before they are sent to the gpu
     MeshCollection meshCollection_;
@@ -0,0 +1,120 @@
+#include "ShadowQueryBenchmark.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <thread>
+
+#include <QElapsedTimer>
+
+#include "ShadowQueryClient.hpp"
+#include "ShadowQueryServer.hpp"
+
+// The queries made for each batch size
+const static int BenchmarkQueries = 1 << 20;
+
+// Batches are repeated at most this many times, so that
+// small batches do not make the benchmark too slow
+const static int MaxBenchmarkBatches = 20000;
+
+// Gets the queries per second for a number of batches and a time
+static double queriesPerSecond(int batchSize, int batches, qint64 nanoseconds)
+{
+    return (double)batchSize * batches / (nanoseconds * 1e-9);
+}
+
+int runShadowQueryBenchmark(const char* treeFileName)
+{
+    VoxelTreeSampler* sampler = VoxelTreeSampler::load(treeFileName);
+    if(sampler == NULL)
+    {
+        return 1;
+    }
+    
+    // Serve the tree to a client in the same process
+    char socketPath[64];
+    sprintf(socketPath, "/tmp/shadowquery-benchmark-%d.sock", (int)getpid());
+    
+    ShadowQueryServer* server = new ShadowQueryServer(sampler);
+    if(server->listen(socketPath) == false)
+    {
+        delete server;
+        delete sampler;
+        return 1;
+    }
+    
+    thread serverThread(&ShadowQueryServer::run, server);
+    
+    ShadowQueryClient* client = new ShadowQueryClient();
+    if(client->connect(socketPath))
+    {
+        // Query random positions within the tree
+        Bounds bounds = sampler->bounds();
+        vector<Vector3> positions(BenchmarkQueries);
+        srand(0);
+        for(int i = 0; i < BenchmarkQueries; ++i)
+        {
+            Vector3 t(rand() / (float)RAND_MAX, rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+            positions[i] = Vector3(bounds.min().x + bounds.size().x * t.x,
+                                   bounds.min().y + bounds.size().y * t.y,
+                                   bounds.min().z + bounds.size().z * t.z);
+        }
+        
+        printf("Tree %s, %.1f MB \n", treeFileName, sampler->sizeBytes() / (1024.0 * 1024.0));
+        printf("Batch size, In process (queries/s), Socket (queries/s), Shared memory (queries/s) \n");
+        
+        vector<float> results;
+        QElapsedTimer timer;
+        for(int batchSize = 1; batchSize <= BenchmarkQueries; batchSize *= 16)
+        {
+            int batches = min(BenchmarkQueries / batchSize, MaxBenchmarkBatches);
+            vector<vector<Vector3> > batchPositions(batches);
+            for(int i = 0; i < batches; ++i)
+            {
+                batchPositions[i].assign(positions.begin() + i * batchSize, positions.begin() + (i + 1) * batchSize);
+            }
+            
+            timer.start();
+            for(int i = 0; i < batches; ++i)
+            {
+                sampler->sampleBatch(batchPositions[i], results);
+            }
+            
+            qint64 inProcessTime = timer.nsecsElapsed();
+            
+            // Every batch goes through the socket
+            client->setSharedMemoryThreshold(BenchmarkQueries + 1);
+            timer.start();
+            for(int i = 0; i < batches; ++i)
+            {
+                client->samplePoints(batchPositions[i], results);
+            }
+            
+            qint64 socketTime = timer.nsecsElapsed();
+            
+            // Every batch goes through shared memory
+            client->setSharedMemoryThreshold(1);
+            timer.start();
+            for(int i = 0; i < batches; ++i)
+            {
+                client->samplePoints(batchPositions[i], results);
+            }
+            
+            qint64 sharedMemoryTime = timer.nsecsElapsed();
+            
+            printf("%d, %.0f, %.0f, %.0f \n", batchSize,
+                   queriesPerSecond(batchSize, batches, inProcessTime),
+                   queriesPerSecond(batchSize, batches, socketTime),
+                   queriesPerSecond(batchSize, batches, sharedMemoryTime));
+        }
+    }
+    
+    // Disconnect before the server waits for its clients
+    delete client;
+    server->stop();
+    serverThread.join();
+    delete server;
+    delete sampler;
+    
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Measures the throughput of point queries against a saved tree, made in
+// process and through a local ShadowQueryServer over the socket and over
+// shared memory, for a range of batch sizes. Prints a table of the
+// queries per second. Returns the process exit code.
+int runShadowQueryBenchmark(const char* treeFileName);
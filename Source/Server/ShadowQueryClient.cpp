@@ -0,0 +1,282 @@
+#include "ShadowQueryClient.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+ShadowQueryClient::ShadowQueryClient()
+    : socket_(-1),
+    sharedMemoryThreshold_(4096),
+    sharedMemoryFile_(-1),
+    sharedMemory_(NULL),
+    sharedMemorySize_(0)
+{
+    
+}
+
+ShadowQueryClient::~ShadowQueryClient()
+{
+    if(socket_ >= 0)
+    {
+        close(socket_);
+    }
+    
+    if(sharedMemory_ != NULL)
+    {
+        munmap(sharedMemory_, sharedMemorySize_);
+        close(sharedMemoryFile_);
+    }
+}
+
+bool ShadowQueryClient::connect(const char* socketPath)
+{
+    // A server that exits should not kill the client
+    signal(SIGPIPE, SIG_IGN);
+    
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    
+    strcpy(address.sun_path, socketPath);
+    
+    socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(socket_ < 0 || ::connect(socket_, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        printf("Failed to connect to shadow query server %s \n", socketPath);
+        return false;
+    }
+    
+    return true;
+}
+
+bool ShadowQueryClient::bounds(Bounds* bounds)
+{
+    float results[6];
+    vector<uint8_t> resultBytes;
+    if(request(SQT_Bounds, vector<float>(), 0, NULL, &resultBytes) == false || resultBytes.size() != sizeof(results))
+    {
+        return false;
+    }
+    
+    memcpy(results, resultBytes.data(), sizeof(results));
+    *bounds = Bounds(Vector3(results[0], results[1], results[2]), Vector3(results[3], results[4], results[5]));
+    return true;
+}
+
+bool ShadowQueryClient::samplePoints(const vector<Vector3> &positions, vector<float> &results)
+{
+    vector<float> queries;
+    queries.reserve(positions.size() * 3);
+    for(auto p = positions.begin(); p != positions.end(); ++p)
+    {
+        queries.push_back(p->x);
+        queries.push_back(p->y);
+        queries.push_back(p->z);
+    }
+    
+    results.resize(positions.size());
+    return request(SQT_Points, queries, positions.size(), results.data(), NULL);
+}
+
+bool ShadowQueryClient::shadowedFractions(const vector<Bounds> &boxes, vector<float> &results)
+{
+    vector<float> queries;
+    queries.reserve(boxes.size() * 6);
+    for(auto b = boxes.begin(); b != boxes.end(); ++b)
+    {
+        queries.push_back(b->min().x);
+        queries.push_back(b->min().y);
+        queries.push_back(b->min().z);
+        queries.push_back(b->max().x);
+        queries.push_back(b->max().y);
+        queries.push_back(b->max().z);
+    }
+    
+    results.resize(boxes.size());
+    return request(SQT_Boxes, queries, boxes.size(), results.data(), NULL);
+}
+
+bool ShadowQueryClient::shadowedRectangleFractions(const vector<Vector3> &rectangles, vector<float> &results)
+{
+    vector<float> queries;
+    queries.reserve(rectangles.size() * 3);
+    for(auto v = rectangles.begin(); v != rectangles.end(); ++v)
+    {
+        queries.push_back(v->x);
+        queries.push_back(v->y);
+        queries.push_back(v->z);
+    }
+    
+    results.resize(rectangles.size() / 3);
+    return request(SQT_Rectangles, queries, rectangles.size() / 3, results.data(), NULL);
+}
+
+bool ShadowQueryClient::shadowIntervals(const vector<Vector3> &segments, vector<vector<VoxelShadowInterval> > &intervals)
+{
+    vector<float> queries;
+    queries.reserve(segments.size() * 3);
+    for(auto v = segments.begin(); v != segments.end(); ++v)
+    {
+        queries.push_back(v->x);
+        queries.push_back(v->y);
+        queries.push_back(v->z);
+    }
+    
+    uint32_t segmentCount = segments.size() / 2;
+    vector<uint8_t> resultBytes;
+    if(request(SQT_Segments, queries, segmentCount, NULL, &resultBytes) == false)
+    {
+        return false;
+    }
+    
+    // Read the interval count of each segment, then its intervals
+    intervals.assign(segmentCount, vector<VoxelShadowInterval>());
+    size_t offset = 0;
+    for(uint32_t i = 0; i < segmentCount; ++i)
+    {
+        uint32_t intervalCount;
+        if(offset + sizeof(uint32_t) > resultBytes.size())
+        {
+            return false;
+        }
+        
+        memcpy(&intervalCount, &resultBytes[offset], sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        if(offset + intervalCount * sizeof(ShadowQueryInterval) > resultBytes.size())
+        {
+            return false;
+        }
+        
+        for(uint32_t j = 0; j < intervalCount; ++j)
+        {
+            ShadowQueryInterval input;
+            memcpy(&input, &resultBytes[offset], sizeof(input));
+            offset += sizeof(input);
+            
+            VoxelShadowInterval interval = { input.start, input.end, input.shadowed != 0 };
+            intervals[i].push_back(interval);
+        }
+    }
+    
+    return true;
+}
+
+bool ShadowQueryClient::reserveSharedMemory(size_t size)
+{
+    if(size <= sharedMemorySize_)
+    {
+        return true;
+    }
+    
+    if(sharedMemory_ != NULL)
+    {
+        munmap(sharedMemory_, sharedMemorySize_);
+        close(sharedMemoryFile_);
+        sharedMemoryFile_ = -1;
+        sharedMemory_ = NULL;
+        sharedMemorySize_ = 0;
+    }
+    
+    // Grow in powers of two to avoid remapping for every batch
+    size_t newSize = 1 << 16;
+    while(newSize < size)
+    {
+        newSize *= 2;
+    }
+    
+    // The server only maps files that cannot shrink, so a larger
+    // batch needs a new file rather than growing this one
+    int file = memfd_create("shadowquery", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(file < 0 || ftruncate(file, newSize) != 0 || fcntl(file, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+    {
+        printf("Failed to create shared memory \n");
+        if(file >= 0)
+        {
+            close(file);
+        }
+        
+        return false;
+    }
+    
+    void* memory = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if(memory == MAP_FAILED)
+    {
+        printf("Failed to map shared memory \n");
+        close(file);
+        return false;
+    }
+    
+    sharedMemoryFile_ = file;
+    sharedMemory_ = memory;
+    sharedMemorySize_ = newSize;
+    return true;
+}
+
+bool ShadowQueryClient::request(uint32_t type, const vector<float> &queries, uint32_t queryCount, float* results, vector<uint8_t>* resultBytes)
+{
+    if(socket_ < 0)
+    {
+        return false;
+    }
+    
+    ShadowQueryRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = type;
+    request.queryCount = queryCount;
+    
+    // Large batches of queries are passed through shared memory,
+    // with space for fixed size results after them
+    size_t queryBytes = queries.size() * sizeof(float);
+    size_t fixedResultBytes = (size_t)queryCount * shadowQueryResultBytes(type);
+    bool useSharedMemory = (queryCount > 0 && queryCount >= sharedMemoryThreshold_);
+    if(useSharedMemory)
+    {
+        if(reserveSharedMemory(queryBytes + fixedResultBytes) == false)
+        {
+            return false;
+        }
+        
+        memcpy(sharedMemory_, queries.data(), queryBytes);
+        request.sharedMemorySize = sharedMemorySize_;
+        if(writeSocketWithFile(socket_, &request, sizeof(request), sharedMemoryFile_) == false)
+        {
+            return false;
+        }
+    }
+    else if(writeSocket(socket_, &request, sizeof(request)) == false
+            || writeSocket(socket_, queries.data(), queryBytes) == false)
+    {
+        return false;
+    }
+    
+    ShadowQueryResponse response;
+    if(readSocket(socket_, &response, sizeof(response)) == false || response.status != SQS_Succeeded)
+    {
+        return false;
+    }
+    
+    // Fixed size results in shared memory follow the queries
+    bool fixedSize = (shadowQueryResultBytes(type) > 0);
+    if(fixedSize && useSharedMemory)
+    {
+        memcpy(results, (const char*)sharedMemory_ + queryBytes, fixedResultBytes);
+        return true;
+    }
+    
+    if(fixedSize)
+    {
+        return response.resultBytes == fixedResultBytes && readSocket(socket_, results, fixedResultBytes);
+    }
+    
+    resultBytes->resize(response.resultBytes);
+    return readSocket(socket_, resultBytes->data(), response.resultBytes);
+}
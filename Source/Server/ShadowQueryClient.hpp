@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "ShadowQueryProtocol.hpp"
+#include "VoxelTreeSampler.hpp"
+
+// Sends shadow queries to a ShadowQueryServer.
+// Batches of at least sharedMemoryThreshold queries are passed through
+// a memory file owned by the client rather than the socket. The file is
+// sent to the server with each request.
+class ShadowQueryClient
+{
+public:
+    ShadowQueryClient();
+    ~ShadowQueryClient();
+    
+    // Connects to a server. Returns false if there is no server at the path.
+    bool connect(const char* socketPath);
+    
+    uint32_t sharedMemoryThreshold() const { return sharedMemoryThreshold_; }
+    void setSharedMemoryThreshold(uint32_t queryCount) { sharedMemoryThreshold_ = queryCount; }
+    
+    // Gets the world space bounds covered by the server's tree
+    bool bounds(Bounds* bounds);
+    
+    // Gets the shadowing at each position. 0 when shadowed and 1 when lit.
+    bool samplePoints(const vector<Vector3> &positions, vector<float> &results);
+    
+    // Gets the shadowed fraction of each box
+    bool shadowedFractions(const vector<Bounds> &boxes, vector<float> &results);
+    
+    // Gets the shadowed fraction of each parallelogram.
+    // Each is given by 3 vectors: a corner and two edges.
+    bool shadowedRectangleFractions(const vector<Vector3> &rectangles, vector<float> &results);
+    
+    // Gets the shadowed and lit intervals along each segment.
+    // Each is given by 2 vectors: the start and the end.
+    bool shadowIntervals(const vector<Vector3> &segments, vector<vector<VoxelShadowInterval> > &intervals);
+    
+private:
+    int socket_;
+    uint32_t sharedMemoryThreshold_;
+    
+    // The shared memory file and its mapping, replaced when it grows
+    int sharedMemoryFile_;
+    void* sharedMemory_;
+    size_t sharedMemorySize_;
+    
+    // Makes sure the shared memory file has at least the given size
+    bool reserveSharedMemory(size_t size);
+    
+    // Sends a request and reads its results. Fixed size results are
+    // written to results, and others are output to resultBytes.
+    bool request(uint32_t type, const vector<float> &queries, uint32_t queryCount, float* results, vector<uint8_t>* resultBytes);
+};
@@ -0,0 +1,170 @@
+#include "ShadowQueryProtocol.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+int shadowQueryFloats(uint32_t type)
+{
+    switch(type)
+    {
+        case SQT_Points:
+            return 3;
+        case SQT_Boxes:
+            return 6;
+        case SQT_Rectangles:
+            return 9;
+        case SQT_Segments:
+            return 6;
+        default:
+            return 0;
+    }
+}
+
+int shadowQueryResultBytes(uint32_t type)
+{
+    switch(type)
+    {
+        case SQT_Points:
+        case SQT_Boxes:
+        case SQT_Rectangles:
+            return sizeof(float);
+        default:
+            return 0;
+    }
+}
+
+bool writeSocket(int socket, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    while(size > 0)
+    {
+        ssize_t written = send(socket, bytes, size, 0);
+        if(written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        
+        if(written <= 0)
+        {
+            return false;
+        }
+        
+        bytes += written;
+        size -= written;
+    }
+    
+    return true;
+}
+
+bool readSocket(int socket, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+    while(size > 0)
+    {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if(received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        
+        if(received <= 0)
+        {
+            return false;
+        }
+        
+        bytes += received;
+        size -= received;
+    }
+    
+    return true;
+}
+
+bool writeSocketWithFile(int socket, const void* data, size_t size, int file)
+{
+    iovec bytes;
+    bytes.iov_base = (void*)data;
+    bytes.iov_len = size;
+    
+    // The file is passed as ancillary data with the first bytes
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &bytes;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &file, sizeof(int));
+    
+    ssize_t written = sendmsg(socket, &message, 0);
+    while(written < 0 && errno == EINTR)
+    {
+        written = sendmsg(socket, &message, 0);
+    }
+    
+    if(written <= 0)
+    {
+        return false;
+    }
+    
+    // Send the rest of the bytes normally
+    return writeSocket(socket, (const char*)data + written, size - written);
+}
+
+bool readSocketWithFile(int socket, void* data, size_t size, int* file)
+{
+    *file = -1;
+    
+    iovec bytes;
+    bytes.iov_base = data;
+    bytes.iov_len = size;
+    
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &bytes;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    ssize_t received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    while(received < 0 && errno == EINTR)
+    {
+        received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    }
+    
+    if(received <= 0)
+    {
+        return false;
+    }
+    
+    // Files that do not fit in the control buffer are closed by the kernel
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if(header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS
+       && header->cmsg_len == CMSG_LEN(sizeof(int)))
+    {
+        memcpy(file, CMSG_DATA(header), sizeof(int));
+    }
+    
+    // Read the rest of the bytes normally
+    if(readSocket(socket, (char*)data + received, size - received) == false)
+    {
+        if(*file >= 0)
+        {
+            close(*file);
+            *file = -1;
+        }
+        
+        return false;
+    }
+    
+    return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// The requests understood by the shadow query server.
+// Queries are sent as floats in world space.
+enum ShadowQueryType
+{
+    SQT_Points,       // position. A float result each.
+    SQT_Boxes,        // AABB min, max. A float result each.
+    SQT_Rectangles,   // corner, edgeA, edgeB. A float result each.
+    SQT_Segments,     // start, end. A list of intervals each.
+    SQT_Bounds,       // No queries. Returns the tree's bounds as min, max.
+};
+
+// Sent before the queries of each request
+struct ShadowQueryRequest
+{
+    uint32_t type;
+    uint32_t queryCount;
+    
+    // When sharedMemorySize is set, the queries are in a memory file sent
+    // with the request rather than on the socket, and fixed size results
+    // are written to it straight after them. The file must be sealed
+    // against shrinking. Segment results are always sent on the socket as
+    // their size is not known in advance.
+    uint64_t sharedMemorySize;
+};
+
+// The outcome of a request
+enum ShadowQueryStatus
+{
+    SQS_Succeeded,
+    SQS_UnknownType,
+    SQS_TooManyQueries,
+    SQS_SharedMemoryFailed,
+};
+
+// Sent before the results of each request
+struct ShadowQueryResponse
+{
+    uint32_t status;
+    
+    // The bytes of results that follow on the socket.
+    // Segment results can exceed 4 GB for large batches.
+    uint64_t resultBytes;
+};
+
+// A segment result is an interval count followed by the intervals
+struct ShadowQueryInterval
+{
+    float start;
+    float end;
+    uint32_t shadowed;
+};
+
+// Gets the number of floats in each query of a type
+int shadowQueryFloats(uint32_t type);
+
+// Gets the number of bytes in each result of a type,
+// or 0 if the results vary in size.
+int shadowQueryResultBytes(uint32_t type);
+
+// Sends or receives an exact number of bytes. Returns false if the
+// socket is closed or fails. SIGPIPE must be ignored by the caller.
+bool writeSocket(int socket, const void* data, size_t size);
+bool readSocket(int socket, void* data, size_t size);
+
+// Sends or receives an exact number of bytes along with a file descriptor.
+// The received file is -1 if none was sent, and is closed by the caller.
+bool writeSocketWithFile(int socket, const void* data, size_t size, int file);
+bool readSocketWithFile(int socket, void* data, size_t size, int* file);
@@ -0,0 +1,339 @@
+#include "ShadowQueryServer.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+ShadowQueryServer::ShadowQueryServer(const VoxelTreeSampler* sampler)
+    : sampler_(sampler),
+    listenSocket_(-1),
+    socketPath_(),
+    stopped_(false),
+    connections_(),
+    connectionsMutex_()
+{
+    
+}
+
+ShadowQueryServer::~ShadowQueryServer()
+{
+    stop();
+    
+    // Client threads use the sampler, so wait for them to finish.
+    // No connections are added once the server is stopped.
+    connectionsMutex_.lock();
+    vector<ShadowQueryConnection*> connections;
+    connections.swap(connections_);
+    connectionsMutex_.unlock();
+    
+    for(auto connection = connections.begin(); connection != connections.end(); ++connection)
+    {
+        (*connection)->worker.join();
+        delete *connection;
+    }
+    
+    if(listenSocket_ >= 0)
+    {
+        close(listenSocket_);
+        unlink(socketPath_.c_str());
+    }
+}
+
+bool ShadowQueryServer::listen(const char* socketPath)
+{
+    // Clients that disconnect early should not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        printf("Socket path %s is too long \n", socketPath);
+        return false;
+    }
+    
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    
+    listenSocket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenSocket_ < 0
+       || bind(listenSocket_, (sockaddr*)&address, sizeof(address)) != 0
+       || ::listen(listenSocket_, SOMAXCONN) != 0)
+    {
+        printf("Failed to listen on socket %s \n", socketPath);
+        return false;
+    }
+    
+    socketPath_ = socketPath;
+    return true;
+}
+
+void ShadowQueryServer::run()
+{
+    while(stopped_ == false)
+    {
+        int clientSocket = accept(listenSocket_, NULL, NULL);
+        if(clientSocket < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            
+            break;
+        }
+        
+        connectionsMutex_.lock();
+        
+        // Clients accepted while stopping are not served
+        if(stopped_)
+        {
+            close(clientSocket);
+            connectionsMutex_.unlock();
+            break;
+        }
+        
+        // Remove clients that have disconnected
+        for(auto connection = connections_.begin(); connection != connections_.end();)
+        {
+            if((*connection)->finished)
+            {
+                (*connection)->worker.join();
+                delete *connection;
+                connection = connections_.erase(connection);
+            }
+            else
+            {
+                ++connection;
+            }
+        }
+        
+        ShadowQueryConnection* connection = new ShadowQueryConnection();
+        connection->socket = clientSocket;
+        connection->finished = false;
+        connection->worker = thread(&ShadowQueryServer::serveClient, this, connection);
+        connections_.push_back(connection);
+        connectionsMutex_.unlock();
+    }
+}
+
+void ShadowQueryServer::stop()
+{
+    // Wake the thread blocked in accept
+    stopped_ = true;
+    if(listenSocket_ >= 0)
+    {
+        shutdown(listenSocket_, SHUT_RDWR);
+    }
+    
+    // Wake the client threads blocked reading requests.
+    // Closed sockets are skipped, as their numbers may be reused.
+    connectionsMutex_.lock();
+    for(auto connection = connections_.begin(); connection != connections_.end(); ++connection)
+    {
+        if((*connection)->finished == false)
+        {
+            shutdown((*connection)->socket, SHUT_RDWR);
+        }
+    }
+    
+    connectionsMutex_.unlock();
+}
+
+void ShadowQueryServer::serveClient(ShadowQueryConnection* connection)
+{
+    int clientSocket = connection->socket;
+    ShadowQueryRequest request;
+    int sharedMemoryFile;
+    while(stopped_ == false && readSocketWithFile(clientSocket, &request, sizeof(request), &sharedMemoryFile))
+    {
+        bool handled = handleRequest(clientSocket, request, sharedMemoryFile);
+        if(sharedMemoryFile >= 0)
+        {
+            close(sharedMemoryFile);
+        }
+        
+        if(handled == false)
+        {
+            break;
+        }
+    }
+    
+    connectionsMutex_.lock();
+    close(clientSocket);
+    connection->finished = true;
+    connectionsMutex_.unlock();
+}
+
+bool ShadowQueryServer::handleRequest(int clientSocket, const ShadowQueryRequest &request, int sharedMemoryFile)
+{
+    ShadowQueryResponse response;
+    response.status = SQS_Succeeded;
+    response.resultBytes = 0;
+    
+    if(request.type == SQT_Bounds)
+    {
+        Bounds bounds = sampler_->bounds();
+        float results[6] = { bounds.min().x, bounds.min().y, bounds.min().z, bounds.max().x, bounds.max().y, bounds.max().z };
+        response.resultBytes = sizeof(results);
+        return writeSocket(clientSocket, &response, sizeof(response)) && writeSocket(clientSocket, results, sizeof(results));
+    }
+    
+    // Unknown requests cannot be skipped, as their size is unknown
+    int queryFloats = shadowQueryFloats(request.type);
+    if(queryFloats == 0)
+    {
+        response.status = SQS_UnknownType;
+        writeSocket(clientSocket, &response, sizeof(response));
+        return false;
+    }
+    
+    size_t queryBytes = (size_t)request.queryCount * queryFloats * sizeof(float);
+    size_t resultBytes = (size_t)request.queryCount * shadowQueryResultBytes(request.type);
+    
+    // Find the queries and where to write the results
+    vector<float> socketQueries;
+    vector<float> socketResults;
+    const float* queries = NULL;
+    float* results = NULL;
+    void* sharedMemory = NULL;
+    if(request.sharedMemorySize > 0)
+    {
+        // Check the file is as large as the client says, and sealed so
+        // that it cannot shrink while it is mapped. Accessing pages past
+        // its end would kill the server.
+        struct stat fileStatus;
+        int seals = (sharedMemoryFile >= 0) ? fcntl(sharedMemoryFile, F_GET_SEALS) : -1;
+        if(seals >= 0 && (seals & F_SEAL_SHRINK) != 0
+           && fstat(sharedMemoryFile, &fileStatus) == 0
+           && (uint64_t)fileStatus.st_size >= request.sharedMemorySize
+           && request.sharedMemorySize >= queryBytes + resultBytes)
+        {
+            sharedMemory = mmap(NULL, request.sharedMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, sharedMemoryFile, 0);
+        }
+        
+        if(sharedMemory == NULL || sharedMemory == MAP_FAILED)
+        {
+            response.status = SQS_SharedMemoryFailed;
+            return writeSocket(clientSocket, &response, sizeof(response));
+        }
+        
+        queries = (const float*)sharedMemory;
+        results = (float*)((char*)sharedMemory + queryBytes);
+    }
+    else
+    {
+        if(request.queryCount > MaxSocketQueries)
+        {
+            response.status = SQS_TooManyQueries;
+            writeSocket(clientSocket, &response, sizeof(response));
+            return false;
+        }
+        
+        socketQueries.resize(request.queryCount * queryFloats);
+        if(readSocket(clientSocket, socketQueries.data(), queryBytes) == false)
+        {
+            return false;
+        }
+        
+        socketResults.resize(request.queryCount);
+        queries = socketQueries.data();
+        results = socketResults.data();
+    }
+    
+    // Segments have a varying number of intervals,
+    // so their results are always sent on the socket.
+    vector<uint8_t> segmentResults;
+    if(request.type == SQT_Segments)
+    {
+        answerSegments(queries, request.queryCount, segmentResults);
+        response.resultBytes = segmentResults.size();
+    }
+    else
+    {
+        answerQueries(request.type, queries, request.queryCount, results);
+        response.resultBytes = (sharedMemory == NULL) ? resultBytes : 0;
+    }
+    
+    if(sharedMemory != NULL)
+    {
+        munmap(sharedMemory, request.sharedMemorySize);
+    }
+    
+    if(writeSocket(clientSocket, &response, sizeof(response)) == false)
+    {
+        return false;
+    }
+    
+    if(request.type == SQT_Segments)
+    {
+        return writeSocket(clientSocket, segmentResults.data(), segmentResults.size());
+    }
+    
+    return writeSocket(clientSocket, results, response.resultBytes);
+}
+
+void ShadowQueryServer::answerQueries(uint32_t type, const float* queries, uint32_t queryCount, float* results) const
+{
+    if(type == SQT_Points)
+    {
+        // Points are sorted and traversed together
+        vector<Vector3> positions(queryCount);
+        for(uint32_t i = 0; i < queryCount; ++i)
+        {
+            positions[i] = Vector3(queries[i * 3], queries[i * 3 + 1], queries[i * 3 + 2]);
+        }
+        
+        vector<float> shadowing;
+        sampler_->sampleBatch(positions, shadowing);
+        memcpy(results, shadowing.data(), queryCount * sizeof(float));
+    }
+    else if(type == SQT_Boxes)
+    {
+        for(uint32_t i = 0; i < queryCount; ++i)
+        {
+            const float* q = queries + i * 6;
+            results[i] = sampler_->shadowedFraction(Bounds(Vector3(q[0], q[1], q[2]), Vector3(q[3], q[4], q[5])));
+        }
+    }
+    else if(type == SQT_Rectangles)
+    {
+        for(uint32_t i = 0; i < queryCount; ++i)
+        {
+            const float* q = queries + i * 9;
+            results[i] = sampler_->shadowedFraction(Vector3(q[0], q[1], q[2]), Vector3(q[3], q[4], q[5]), Vector3(q[6], q[7], q[8]));
+        }
+    }
+}
+
+void ShadowQueryServer::answerSegments(const float* queries, uint32_t queryCount, vector<uint8_t> &results) const
+{
+    vector<VoxelShadowInterval> intervals;
+    for(uint32_t i = 0; i < queryCount; ++i)
+    {
+        const float* q = queries + i * 6;
+        sampler_->shadowIntervals(Vector3(q[0], q[1], q[2]), Vector3(q[3], q[4], q[5]), intervals);
+        
+        // Add the interval count, then the intervals
+        size_t offset = results.size();
+        uint32_t intervalCount = intervals.size();
+        results.resize(offset + sizeof(uint32_t) + intervalCount * sizeof(ShadowQueryInterval));
+        memcpy(&results[offset], &intervalCount, sizeof(uint32_t));
+        
+        ShadowQueryInterval* output = (ShadowQueryInterval*)&results[offset + sizeof(uint32_t)];
+        for(uint32_t j = 0; j < intervalCount; ++j)
+        {
+            output[j].start = intervals[j].start;
+            output[j].end = intervals[j].end;
+            output[j].shadowed = intervals[j].shadowed ? 1 : 0;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#include "ShadowQueryProtocol.hpp"
+#include "VoxelTreeSampler.hpp"
+
+// A connected client and the thread serving it
+struct ShadowQueryConnection
+{
+    int socket;
+    thread worker;
+    
+    // Set once the socket is closed, while the clients mutex is locked
+    bool finished;
+};
+
+// Serves batches of shadow queries against a single tree to other
+// processes over a Unix domain socket. Each client is served on its
+// own thread. Large batches can be passed through shared memory.
+class ShadowQueryServer
+{
+    // The most queries sent on the socket in one request.
+    // Larger batches must use shared memory.
+    const static uint32_t MaxSocketQueries = 1 << 22;
+    
+public:
+    // The sampler is not owned by the server
+    ShadowQueryServer(const VoxelTreeSampler* sampler);
+    ~ShadowQueryServer();
+    
+    // Creates the socket, replacing any left by an earlier server.
+    // Returns false if the socket cannot be created.
+    bool listen(const char* socketPath);
+    
+    // Accepts clients until stop is called
+    void run();
+    
+    // Stops accepting clients and disconnects the connected clients
+    void stop();
+    
+private:
+    const VoxelTreeSampler* sampler_;
+    int listenSocket_;
+    string socketPath_;
+    atomic<bool> stopped_;
+    
+    // The connected clients. Finished connections are
+    // removed when the next client connects.
+    vector<ShadowQueryConnection*> connections_;
+    mutex connectionsMutex_;
+    
+    // Answers a client's requests until it disconnects or the server stops
+    void serveClient(ShadowQueryConnection* connection);
+    
+    // Reads a request's queries and sends its results. The shared
+    // memory file is the one sent with the request, or -1.
+    // Returns false if the connection should be closed.
+    bool handleRequest(int clientSocket, const ShadowQueryRequest &request, int sharedMemoryFile);
+    
+    // Answers queries of a type with fixed size results
+    void answerQueries(uint32_t type, const float* queries, uint32_t queryCount, float* results) const;
+    
+    // Answers segment queries, adding the intervals to the results
+    void answerSegments(const float* queries, uint32_t queryCount, vector<uint8_t> &results) const;
+};
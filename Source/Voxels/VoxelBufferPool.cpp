@@ -0,0 +1,181 @@
+#include "VoxelBufferPool.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+mutex VoxelBufferPool::mutex_;
+map<size_t, vector<void*>> VoxelBufferPool::idleBuffers_;
+size_t VoxelBufferPool::idleBytes_ = 0;
+size_t VoxelBufferPool::maxIdleBytes_ = (size_t)DefaultMaxIdleMB * 1024 * 1024;
+bool VoxelBufferPool::hugePages_ = false;
+int VoxelBufferPool::acquiredBuffers_ = 0;
+int VoxelBufferPool::reusedBuffers_ = 0;
+
+void* VoxelBufferPool::acquire(size_t bytes, bool prefault)
+{
+    // Small buffers are cheap to allocate
+    if(bytes < MinPooledBytes)
+    {
+        return malloc(bytes);
+    }
+    
+    // Reuse an unused buffer of the same size if there is one
+    mutex_.lock();
+    acquiredBuffers_ ++;
+    auto idle = idleBuffers_.find(bytes);
+    if(idle != idleBuffers_.end() && idle->second.empty() == false)
+    {
+        void* buffer = idle->second.back();
+        idle->second.pop_back();
+        idleBytes_ -= bytes;
+        reusedBuffers_ ++;
+        mutex_.unlock();
+        return buffer;
+    }
+    
+    bool hugePages = hugePages_;
+    mutex_.unlock();
+    
+    // Otherwise map a new one outside the lock
+    return mapBuffer(bytes, prefault, hugePages);
+}
+
+void VoxelBufferPool::release(void* buffer, size_t bytes)
+{
+    if(buffer == NULL)
+    {
+        return;
+    }
+    
+    if(bytes < MinPooledBytes)
+    {
+        free(buffer);
+        return;
+    }
+    
+    // Keep the buffer for the next tile, unless the pool is full
+    mutex_.lock();
+    if(idleBytes_ + bytes <= maxIdleBytes_)
+    {
+        idleBuffers_[bytes].push_back(buffer);
+        idleBytes_ += bytes;
+        mutex_.unlock();
+        return;
+    }
+    
+    mutex_.unlock();
+    unmapBuffer(buffer, bytes);
+}
+
+void VoxelBufferPool::trim(size_t maxIdleBytes)
+{
+    // Take the unused buffers to free, then free them outside the lock
+    mutex_.lock();
+    map<size_t, vector<void*>> buffers;
+    for(auto size = idleBuffers_.rbegin(); size != idleBuffers_.rend() && idleBytes_ > maxIdleBytes; ++size)
+    {
+        while(size->second.empty() == false && idleBytes_ > maxIdleBytes)
+        {
+            buffers[size->first].push_back(size->second.back());
+            size->second.pop_back();
+            idleBytes_ -= size->first;
+        }
+    }
+    
+    mutex_.unlock();
+    
+    for(auto size = buffers.begin(); size != buffers.end(); ++size)
+    {
+        for(auto buffer = size->second.begin(); buffer != size->second.end(); ++buffer)
+        {
+            unmapBuffer(*buffer, size->first);
+        }
+    }
+}
+
+size_t VoxelBufferPool::idleBytes()
+{
+    mutex_.lock();
+    size_t bytes = idleBytes_;
+    mutex_.unlock();
+    return bytes;
+}
+
+int VoxelBufferPool::maxIdleMB()
+{
+    mutex_.lock();
+    int value = maxIdleBytes_ / (1024 * 1024);
+    mutex_.unlock();
+    return value;
+}
+
+void VoxelBufferPool::setMaxIdleMB(int megabytes)
+{
+    mutex_.lock();
+    maxIdleBytes_ = (size_t)std::max(megabytes, 0) * 1024 * 1024;
+    mutex_.unlock();
+}
+
+void VoxelBufferPool::setHugePages(bool enabled)
+{
+    mutex_.lock();
+    hugePages_ = enabled;
+    mutex_.unlock();
+}
+
+int VoxelBufferPool::acquiredBuffers()
+{
+    mutex_.lock();
+    int value = acquiredBuffers_;
+    mutex_.unlock();
+    return value;
+}
+
+int VoxelBufferPool::reusedBuffers()
+{
+    mutex_.lock();
+    int value = reusedBuffers_;
+    mutex_.unlock();
+    return value;
+}
+
+void* VoxelBufferPool::mapBuffer(size_t bytes, bool prefault, bool hugePages)
+{
+    // Large buffers are mapped directly, so they can be given huge pages
+    // and are returned to the system as soon as they are freed
+    void* buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if(buffer == MAP_FAILED)
+    {
+        printf("Failed to allocate a %zu KB build buffer \n", bytes / 1024);
+        abort();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if(hugePages)
+    {
+        madvise(buffer, bytes, MADV_HUGEPAGE);
+    }
+#else
+    (void)hugePages;
+#endif
+
+    // Fault in every page now, rather than while the tile is built
+    if(prefault)
+    {
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        for(size_t offset = 0; offset < bytes; offset += pageSize)
+        {
+            ((volatile char*)buffer)[offset] = 0;
+        }
+    }
+    
+    return buffer;
+}
+
+void VoxelBufferPool::unmapBuffer(void* buffer, size_t bytes)
+{
+    munmap(buffer, bytes);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Recycles the large buffers used by tile builds, such as the tile
+// depths, their mip levels, the leaf caches and the builders' node
+// buffers. Tiles of the same resolution need buffers of the same
+// sizes, so most buffers are reused from an earlier tile instead of
+// being allocated and faulted in again. Buffers smaller than
+// MinPooledBytes are allocated normally. Thread safe.
+class VoxelBufferPool
+{
+public:
+    // The smallest buffer (bytes) that is pooled
+    const static size_t MinPooledBytes = 64 * 1024;
+    
+    // The default memory (MB) kept in unused buffers
+    const static int DefaultMaxIdleMB = 1024;
+    
+    // Gets a buffer of the given size. The contents are undefined.
+    // New buffers are faulted in before they are returned, unless only
+    // part of the buffer is likely to be used.
+    static void* acquire(size_t bytes, bool prefault = true);
+    
+    // Returns a buffer, with the size it was acquired with.
+    // It is freed if the pool already holds too much memory.
+    static void release(void* buffer, size_t bytes);
+    
+    // Typed wrappers
+    static float* acquireFloats(size_t count) { return (float*)acquire(count * sizeof(float)); }
+    static void releaseFloats(float* buffer, size_t count) { release(buffer, count * sizeof(float)); }
+    
+    // Frees unused buffers, largest first, until at most the given
+    // memory is kept. Frees every unused buffer by default, eg once
+    // the tree is built.
+    static void trim(size_t maxIdleBytes = 0);
+    
+    // The memory held in unused buffers
+    static size_t idleBytes();
+    
+    // The most memory (MB) kept in unused buffers
+    static int maxIdleMB();
+    static void setMaxIdleMB(int megabytes);
+    
+    // Backs new buffers with huge pages where supported (Linux).
+    // Off by default.
+    static void setHugePages(bool enabled);
+    
+    // The number of buffers acquired, and how many were reused
+    static int acquiredBuffers();
+    static int reusedBuffers();
+    
+private:
+    static mutex mutex_;
+    
+    // The unused buffers of each size
+    static map<size_t, vector<void*>> idleBuffers_;
+    static size_t idleBytes_;
+    static size_t maxIdleBytes_;
+    
+    static bool hugePages_;
+    static int acquiredBuffers_;
+    static int reusedBuffers_;
+    
+    // Maps a new buffer and faults in its pages, or unmaps a buffer
+    static void* mapBuffer(size_t bytes, bool prefault, bool hugePages);
+    static void unmapBuffer(void* buffer, size_t bytes);
+};
@@ -0,0 +1,77 @@
+#include "VoxelBuildQueue.hpp"
+
+#include <algorithm>
+
+VoxelBuildQueue::VoxelBuildQueue()
+    : mutex_(),
+    notFull_(),
+    notEmpty_(),
+    builders_(),
+    capacity_(1),
+    closed_(false)
+{
+}
+
+void VoxelBuildQueue::setCapacity(int capacity)
+{
+    unique_lock<mutex> lock(mutex_);
+    capacity_ = std::max(capacity, 1);
+    notFull_.notify_all();
+}
+
+int VoxelBuildQueue::size()
+{
+    unique_lock<mutex> lock(mutex_);
+    return builders_.size();
+}
+
+bool VoxelBuildQueue::full()
+{
+    unique_lock<mutex> lock(mutex_);
+    return (int)builders_.size() >= capacity_;
+}
+
+bool VoxelBuildQueue::closed()
+{
+    unique_lock<mutex> lock(mutex_);
+    return closed_;
+}
+
+void VoxelBuildQueue::push(VoxelBuilder* builder)
+{
+    unique_lock<mutex> lock(mutex_);
+    while((int)builders_.size() >= capacity_ && closed_ == false)
+    {
+        notFull_.wait(lock);
+    }
+    
+    builders_.push_back(builder);
+    notEmpty_.notify_one();
+}
+
+VoxelBuilder* VoxelBuildQueue::pop()
+{
+    unique_lock<mutex> lock(mutex_);
+    while(builders_.empty() && closed_ == false)
+    {
+        notEmpty_.wait(lock);
+    }
+    
+    if(closed_)
+    {
+        return NULL;
+    }
+    
+    VoxelBuilder* builder = builders_.front();
+    builders_.pop_front();
+    notFull_.notify_one();
+    return builder;
+}
+
+void VoxelBuildQueue::close()
+{
+    unique_lock<mutex> lock(mutex_);
+    closed_ = true;
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+}
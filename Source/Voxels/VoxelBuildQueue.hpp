@@ -0,0 +1,46 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "VoxelBuilder.hpp"
+
+using namespace std;
+
+// A bounded queue of builders passed between two stages of the tile
+// build pipeline. Producers wait while the queue is full, so a slow
+// stage holds up the stages before it instead of using more memory.
+class VoxelBuildQueue
+{
+public:
+    VoxelBuildQueue();
+    
+    // The most builders the queue holds
+    int capacity() const { return capacity_; }
+    void setCapacity(int capacity);
+    
+    int size();
+    bool full();
+    bool closed();
+    
+    // Adds a builder, waiting while the queue is full.
+    // Closed queues do not wait.
+    void push(VoxelBuilder* builder);
+    
+    // Removes the oldest builder, waiting while the queue is empty.
+    // Returns NULL once the queue is closed.
+    VoxelBuilder* pop();
+    
+    // Wakes every waiting thread and stops the queue handing
+    // out builders. The builders are still owned by the tree.
+    void close();
+    
+private:
+    mutex mutex_;
+    condition_variable notFull_;
+    condition_variable notEmpty_;
+    deque<VoxelBuilder*> builders_;
+    int capacity_;
+    bool closed_;
+};
@@ -0,0 +1,201 @@
+#include "VoxelBuildTrace.hpp"
+
+#include <stdio.h>
+
+atomic<bool> VoxelBuildTrace::enabled_(false);
+QElapsedTimer VoxelBuildTrace::timer_;
+mutex VoxelBuildTrace::eventsMutex_;
+vector<VoxelTraceEvent> VoxelBuildTrace::events_;
+vector<const char*> VoxelBuildTrace::threadNames_;
+
+// The ids of finished threads, which are given to
+// new threads with the same name
+static vector<int> freeThreadIds;
+static mutex freeThreadIdsMutex;
+
+// The trace state of a thread.
+// The thread's id is freed when the thread exits.
+struct VoxelTraceThread
+{
+    VoxelTraceThread()
+        : id(-1),
+        tile(-1)
+    {
+    }
+    
+    ~VoxelTraceThread()
+    {
+        if(id >= 0)
+        {
+            freeThreadIdsMutex.lock();
+            freeThreadIds.push_back(id);
+            freeThreadIdsMutex.unlock();
+        }
+    }
+    
+    int id;
+    int tile;
+};
+
+static thread_local VoxelTraceThread traceThread;
+
+void VoxelBuildTrace::start()
+{
+    eventsMutex_.lock();
+    events_.clear();
+    eventsMutex_.unlock();
+    
+    timer_.start();
+    enabled_ = true;
+}
+
+void VoxelBuildTrace::stop()
+{
+    enabled_ = false;
+}
+
+void VoxelBuildTrace::nameThread(const char* name)
+{
+    if(enabled_)
+    {
+        int thread = threadId(name);
+        
+        eventsMutex_.lock();
+        threadNames_[thread] = name;
+        eventsMutex_.unlock();
+    }
+}
+
+void VoxelBuildTrace::addEvent(const char* name, int tile, qint64 start, qint64 end)
+{
+    VoxelTraceEvent event;
+    event.name = name;
+    event.tile = tile;
+    event.thread = threadId();
+    event.start = start;
+    event.end = end;
+    
+    eventsMutex_.lock();
+    events_.push_back(event);
+    eventsMutex_.unlock();
+}
+
+int VoxelBuildTrace::currentTile()
+{
+    return traceThread.tile;
+}
+
+void VoxelBuildTrace::setCurrentTile(int tile)
+{
+    traceThread.tile = tile;
+}
+
+bool VoxelBuildTrace::write(const char* fileName)
+{
+    FILE* file = fopen(fileName, "w");
+    if(file == NULL)
+    {
+        printf("Failed to write build trace %s \n", fileName);
+        return false;
+    }
+    
+    eventsMutex_.lock();
+    
+    // Name each thread that recorded events
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Voxel Tree Build\"}}");
+    for(unsigned int i = 0; i < threadNames_.size(); ++i)
+    {
+        const char* name = (threadNames_[i] != NULL) ? threadNames_[i] : "Thread";
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", i, name);
+        fprintf(file, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}", i, i);
+    }
+    
+    // Complete events, with times in microseconds
+    for(auto event = events_.begin(); event != events_.end(); ++event)
+    {
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"build\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                event->name, event->thread, event->start / 1000.0, (event->end - event->start) / 1000.0);
+        
+        if(event->tile >= 0)
+        {
+            fprintf(file, ",\"args\":{\"tile\":%d}", event->tile);
+        }
+        
+        fprintf(file, "}");
+    }
+    
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    size_t eventCount = events_.size();
+    eventsMutex_.unlock();
+    
+    fclose(file);
+    printf("Wrote %zu build trace events to %s \n", eventCount, fileName);
+    return true;
+}
+
+int VoxelBuildTrace::threadId(const char* name)
+{
+    if(traceThread.id < 0)
+    {
+        // Reuse the id of a finished thread with the same name
+        freeThreadIdsMutex.lock();
+        eventsMutex_.lock();
+        for(auto id = freeThreadIds.begin(); id != freeThreadIds.end(); ++id)
+        {
+            if(threadNames_[*id] == name)
+            {
+                traceThread.id = *id;
+                freeThreadIds.erase(id);
+                break;
+            }
+        }
+        
+        if(traceThread.id < 0)
+        {
+            traceThread.id = threadNames_.size();
+            threadNames_.push_back(name);
+        }
+        
+        eventsMutex_.unlock();
+        freeThreadIdsMutex.unlock();
+    }
+    
+    return traceThread.id;
+}
+
+VoxelTraceScope::VoxelTraceScope(const char* name, int tile)
+    : name_(name),
+    tile_(tile),
+    previousTile_(-1),
+    start_(0),
+    enabled_(VoxelBuildTrace::isEnabled())
+{
+    if(enabled_)
+    {
+        // Nested scopes inherit the tile
+        previousTile_ = VoxelBuildTrace::currentTile();
+        if(tile_ < 0)
+        {
+            tile_ = previousTile_;
+        }
+        
+        VoxelBuildTrace::setCurrentTile(tile_);
+        start_ = VoxelBuildTrace::now();
+    }
+}
+
+VoxelTraceScope::~VoxelTraceScope()
+{
+    end();
+}
+
+void VoxelTraceScope::end()
+{
+    if(enabled_)
+    {
+        VoxelBuildTrace::addEvent(name_, tile_, start_, VoxelBuildTrace::now());
+        VoxelBuildTrace::setCurrentTile(previousTile_);
+        enabled_ = false;
+    }
+}
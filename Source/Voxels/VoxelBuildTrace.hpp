@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <QElapsedTimer>
+
+using namespace std;
+
+// A timed phase of the tile build pipeline
+struct VoxelTraceEvent
+{
+    // Must be a string literal
+    const char* name;
+    
+    // The tile being processed, or -1
+    int tile;
+    
+    // The trace thread id, see VoxelBuildTrace::nameThread
+    int thread;
+    
+    // Nanoseconds since tracing started
+    qint64 start;
+    qint64 end;
+};
+
+// Records the phases of tile builds on every thread, for viewing
+// as a Chrome trace (chrome://tracing or Perfetto). Tracing is off
+// until started, and costs a single atomic load per scope when off.
+// Events are coarse (a handful per tile), so they are kept in one
+// list behind a mutex.
+class VoxelBuildTrace
+{
+public:
+    // Starts recording, discarding any earlier events
+    static void start();
+    
+    // Stops recording. Recorded events are kept until the next start.
+    static void stop();
+    
+    static bool isEnabled() { return enabled_; }
+    
+    // Names the calling thread in the trace. Must be called before
+    // the thread records any events. Threads that finish give their
+    // id to the next thread with the same name, so short lived
+    // builder threads share a few rows.
+    static void nameThread(const char* name);
+    
+    // Records a finished event on the calling thread
+    static void addEvent(const char* name, int tile, qint64 start, qint64 end);
+    
+    // Nanoseconds since tracing started
+    static qint64 now() { return timer_.nsecsElapsed(); }
+    
+    // The tile of the innermost scope on the calling thread, or -1
+    static int currentTile();
+    static void setCurrentTile(int tile);
+    
+    // Writes the recorded events as Chrome trace JSON
+    static bool write(const char* fileName);
+    
+private:
+    static atomic<bool> enabled_;
+    static QElapsedTimer timer_;
+    
+    // The recorded events and the name given to each thread id
+    static mutex eventsMutex_;
+    static vector<VoxelTraceEvent> events_;
+    static vector<const char*> threadNames_;
+    
+    // Gets the calling thread's trace id
+    static int threadId(const char* name = NULL);
+};
+
+// Records an event covering the lifetime of the scope.
+// Scopes without a tile take the tile of the enclosing scope,
+// so nested phases of a tile build are tagged with its index.
+class VoxelTraceScope
+{
+public:
+    VoxelTraceScope(const char* name, int tile = -1);
+    ~VoxelTraceScope();
+    
+    // Ends the event before the end of the scope
+    void end();
+    
+private:
+    const char* name_;
+    int tile_;
+    int previousTile_;
+    qint64 start_;
+    bool enabled_;
+};
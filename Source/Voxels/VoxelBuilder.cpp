@@ -4,24 +4,30 @@
 #include <cstdio>
 #include <cstring>
 
+#include "VoxelBuildTrace.hpp"
+
 VoxelBuilder::VoxelBuilder(int tileIndex, int resolution, float* entryDepths, float* exitDepths)
     : tileIndex_(tileIndex),
     resolution_(resolution),
     entryDepths_(entryDepths),
     exitDepths_(exitDepths),
-    buildState_(VoxelBuilderState::Building),
+    buildState_(VoxelBuilderState::DepthsRead),
+    cancelled_(false),
     depthMap_(NULL),
     writer_(NULL),
-    leafCache_(NULL)
+    leafCache_(NULL),
+    rootAddress_(0)
 {
-    // Start the build thread
-    buildThread_ = std::thread(&VoxelBuilder::build, this);
 }
 
 VoxelBuilder::~VoxelBuilder()
 {
-    // Ensure the build thread has finished
-    buildThread_.join();
+    // Release the depths if the depth map was never created
+    if(entryDepths_ != NULL)
+    {
+        VoxelBufferPool::releaseFloats(entryDepths_, (size_t)resolution_ * resolution_);
+        VoxelBufferPool::releaseFloats(exitDepths_, (size_t)resolution_ * resolution_);
+    }
     
     // Delete the depth map
     if(depthMap_ != NULL)
@@ -35,19 +41,42 @@ VoxelBuilder::~VoxelBuilder()
         delete writer_;
     }
     
-    // Delete the leaf cache
+    // Release the leaf cache
     if(leafCache_ != NULL)
     {
-        delete[] leafCache_;
+        VoxelBufferPool::release(leafCache_, leafCacheBytes());
     }
 }
 
-void VoxelBuilder::build()
+void VoxelBuilder::buildDepthMap()
+{
+    assert(buildState_ == VoxelBuilderState::DepthsRead);
+    
+    // Cancelled builders skip straight through the pipeline
+    if(cancelled_ == false)
+    {
+        VoxelTraceScope scope("Prepare Tile", tileIndex_);
+        
+        // Create the building objects
+        createDepthMap();
+        createWriter();
+        createLeafCache();
+    }
+    
+    buildState_ = VoxelBuilderState::MipsBuilt;
+}
+
+void VoxelBuilder::buildTree()
 {
-    // Create the building objects
-    createDepthMap();
-    createWriter();
-    createLeafCache();
+    assert(buildState_ == VoxelBuilderState::MipsBuilt);
+    
+    if(cancelled_ || depthMap_ == NULL)
+    {
+        buildState_ = VoxelBuilderState::Done;
+        return;
+    }
+    
+    VoxelTraceScope buildScope("Build Tile", tileIndex_);
     
     // The root tile covers the entire region.
     VoxelTile root;
@@ -60,14 +89,18 @@ void VoxelBuilder::build()
     // Process the root tile
     // This recursively processes all tiles
     uint64_t hash;
-    rootAddress_ = processTile(root, &hash);
+    uint16_t shadowedFraction;
+    {
+        VoxelTraceScope scope("Build Nodes");
+        rootAddress_ = processTile(root, &hash, &shadowedFraction);
+    }
     
     // The depth map is no longer needed
     delete depthMap_;
     depthMap_ = NULL;
     
     // The leaf cache is no longer needed
-    delete[] leafCache_;
+    VoxelBufferPool::release(leafCache_, leafCacheBytes());
     leafCache_ = NULL;
     
     // The writer *is* still needed, as it contains the built tree.
@@ -76,11 +109,20 @@ void VoxelBuilder::build()
     buildState_ = VoxelBuilderState::Done;
 }
 
+void VoxelBuilder::build()
+{
+    buildDepthMap();
+    buildTree();
+}
+
 void VoxelBuilder::createDepthMap()
 {
     // The constructor builds the depth hierarchy.
-    // This is slow so should be run from the builder thread.
+    // This is slow so should be run from a pipeline thread.
+    // The depth map now owns the depths.
     depthMap_ = new VoxelDepthMap(resolution_, entryDepths_, exitDepths_);
+    entryDepths_ = NULL;
+    exitDepths_ = NULL;
 }
 
 void VoxelBuilder::createWriter()
@@ -91,35 +133,49 @@ void VoxelBuilder::createWriter()
 
 void VoxelBuilder::createLeafCache()
 {
-    // Create the leaf cache.
-    // There is one cache per 8x8 tile in the depth map.
-    int leafTileCount = (resolution_ / 8) * (resolution_ / 8);
-    leafCache_ = new VoxelLeafCache[leafTileCount];
+    // Create the leaf cache. It is recycled from an earlier tile.
+    leafCache_ = (VoxelLeafCache*)VoxelBufferPool::acquire(leafCacheBytes());
     
     // Set each tile's change distance to 0 so they will be computed on first use
-    std::memset(leafCache_, 0, leafTileCount * sizeof(VoxelLeafCache));
+    std::memset(leafCache_, 0, leafCacheBytes());
+}
+
+size_t VoxelBuilder::leafCacheBytes() const
+{
+    // There is one cache per 8x8 tile in the depth map
+    size_t leafTileCount = (size_t)(resolution_ / 8) * (resolution_ / 8);
+    return leafTileCount * sizeof(VoxelLeafCache);
 }
 
-VoxelPointer VoxelBuilder::processTile(const VoxelTile &tile, VoxelNodeHash* hash)
+VoxelPointer VoxelBuilder::processTile(const VoxelTile &tile, VoxelNodeHash* hash, uint16_t* shadowedFraction)
 {
     if(tile.depth == 1)
     {
         // Treat as a leaf tile if it is an 8x8x1 block
-        return processLeafTile(tile, hash);
+        return processLeafTile(tile, hash, shadowedFraction);
     }
     else
     {
         // Otherwise treat as a normal inner tile
-        return processInnerTile(tile, hash);
+        return processInnerTile(tile, hash, shadowedFraction);
     }
 }
 
-VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash* hash)
+VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash* hash, uint16_t* shadowedFraction)
 {
     // The tile should be a cube of at least size 8
     assert(tile.width >= 8);
     assert(tile.width == tile.depth);
     
+    // Skip the remaining tiles once cancelled.
+    // The partial tree is discarded.
+    if(cancelled_)
+    {
+        *hash = 0;
+        *shadowedFraction = 0;
+        return 0;
+    }
+    
     // Get the child locations
     VoxelTile children[8];
     getChildLocations(tile, children);
@@ -130,8 +186,9 @@ VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash
     // Get the child mask
     node.childMask = depthMap_->sampleChildMask(children);
     
-    // Store the hash for each child node
+    // Store the hash and shadowed fraction for each child node
     VoxelNodeHash childHashes[8];
+    uint16_t childFractions[8];
     
     // Track the number of expanded children
     int visitedChildren = 0;
@@ -146,7 +203,7 @@ VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash
             VoxelTile child = children[i];
             
             // Process the child
-            node.childPositions[visitedChildren] = processTile(child, &childHashes[i]);
+            node.childPositions[visitedChildren] = processTile(child, &childHashes[i], &childFractions[i]);
             
             // Keep track of how many expanded children have been visited.
             visitedChildren ++;
@@ -156,17 +213,32 @@ VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash
             // The child is not expanded.
             // For hashing, use the child mask instead.
             childHashes[i] = node.childMask;
+            
+            // Uniform children are either fully shadowed or unshadowed
+            VoxelShadowing shadowing = (VoxelShadowing)((node.childMask >> (i * 2)) & 3);
+            childFractions[i] = (shadowing == VS_Shadowed) ? VoxelFullyShadowed : 0;
         }
     }
     
     // Compute the node hash
     *hash = computeInnerNodeHash(childHashes);
     
+    // Prefilter the children for LOD sampling.
+    // The fraction is derived from the children, so nodes
+    // with the same hash always have the same fraction.
+    node.shadowedFraction = computeInnerShadowedFraction(childFractions);
+    
+    // Flag nodes that can't be prefiltered for receivers inside them
+    if(computeInnerVariesInZ(node.childMask, childHashes, childFractions, tile.width == 8))
+        node.shadowedFraction |= VoxelVariesInZ;
+    
+    *shadowedFraction = node.shadowedFraction;
+    
     // Save the node and return its memory address.
     return writer_->writeNode(node, visitedChildren, *hash);
 }
 
-VoxelPointer VoxelBuilder::processLeafTile(const VoxelTile &tile, VoxelNodeHash* hash)
+VoxelPointer VoxelBuilder::processLeafTile(const VoxelTile &tile, VoxelNodeHash* hash, uint16_t* shadowedFraction)
 {
     // The tile should be of width 8 and depth 1
     assert(tile.width == 8);
@@ -181,6 +253,7 @@ VoxelPointer VoxelBuilder::processLeafTile(const VoxelTile &tile, VoxelNodeHash*
     {
         // Reuse the cached tile
         *hash = cachedLeaf->hash;
+        *shadowedFraction = computeLeafShadowedFraction(cachedLeaf->hash);
         return cachedLeaf->location;
     }
     
@@ -192,6 +265,7 @@ VoxelPointer VoxelBuilder::processLeafTile(const VoxelTile &tile, VoxelNodeHash*
     
     // The leafmask is the hash
     *hash = leafNode.leafMask;
+    *shadowedFraction = computeLeafShadowedFraction(leafNode.leafMask);
     
     // Save the leaf node and return its memory address.
     VoxelPointer ptr = writer_->writeLeaf(leafNode);
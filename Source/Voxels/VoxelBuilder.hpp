@@ -1,8 +1,9 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
-#include <thread>
 
+#include "VoxelBufferPool.hpp"
 #include "VoxelDepthMap.hpp"
 #include "VoxelWriter.hpp"
 #include "VoxelNode.hpp"
@@ -22,26 +23,49 @@ struct VoxelLeafCache
 // State of the builder
 enum class VoxelBuilderState
 {
-    // Building is underway on a background thread
-    Building,
+    // The tile's depths have been read back
+    DepthsRead,
+    
+    // The depth mip hierarchy is built
+    MipsBuilt,
     
     // Building is finished
     Done
 };
 
 // Builds a voxel tree structure.
+// The build is in two stages, which are run by the tile build
+// pipeline on different threads. The builder takes ownership of
+// the depth arrays, which must be acquired from VoxelBufferPool.
 class VoxelBuilder
 {
 public:
     VoxelBuilder(int tileIndex, int resolution, float* entryDepths, float* exitDepths);
     ~VoxelBuilder();
     
+    // Builds the depth mip hierarchy
+    void buildDepthMap();
+    
+    // Builds the tree from the depth mips
+    void buildTree();
+    
+    // Runs both stages on the calling thread
+    void build();
+    
     // The index of the tile being built
     int tileIndex() const { return tileIndex_; }
     
+    // The resolution of the tile being built
+    int resolution() const { return resolution_; }
+    
     // The current build state
     VoxelBuilderState buildState() const { return buildState_; }
     
+    // Stops the build early. Cancelled builders finish as soon as
+    // possible and their tree must be discarded.
+    void cancel() { cancelled_ = true; }
+    bool isCancelled() const { return cancelled_; }
+    
     // Tree data
     const void* tree() const { return writer_->data(); }
     size_t treeSizeWords() const { return writer_->dataSizeWords(); }
@@ -55,14 +79,15 @@ private:
     // The index of the tile being built
     int tileIndex_;
     
-    // The input depth values
+    // The input depth values.
+    // Owned by the depth map once it is created.
     int resolution_;
     float* entryDepths_;
     float* exitDepths_;
 
-    // The thread used for building and current state
-    std::thread buildThread_;
-    VoxelBuilderState buildState_;
+    // The current state
+    std::atomic<VoxelBuilderState> buildState_;
+    std::atomic<bool> cancelled_;
     
     // Objects used during building
     VoxelDepthMap* depthMap_;
@@ -71,19 +96,20 @@ private:
     
     // The address of the root node.
     VoxelPointer rootAddress_;
-
-    // Builds the tree. Called from the background thread.
-    void build();
     
     // Creates objects used for tree construction
     void createDepthMap();
     void createWriter();
     void createLeafCache();
     
-    // Tile processing. Returns the hash of the tile node
-    VoxelPointer processTile(const VoxelTile &tile, VoxelNodeHash* hash);
-    VoxelPointer processInnerTile(const VoxelTile &tile, VoxelNodeHash* hash);
-    VoxelPointer processLeafTile(const VoxelTile &tile, VoxelNodeHash* hash);
+    // The size of the leaf cache
+    size_t leafCacheBytes() const;
+    
+    // Tile processing. Outputs the hash and quantized shadowed
+    // fraction of the tile node.
+    VoxelPointer processTile(const VoxelTile &tile, VoxelNodeHash* hash, uint16_t* shadowedFraction);
+    VoxelPointer processInnerTile(const VoxelTile &tile, VoxelNodeHash* hash, uint16_t* shadowedFraction);
+    VoxelPointer processLeafTile(const VoxelTile &tile, VoxelNodeHash* hash, uint16_t* shadowedFraction);
     
     // Computes the location and size of the 8 children of a tile
     void getChildLocations(const VoxelTile &parent, VoxelTile* children) const;
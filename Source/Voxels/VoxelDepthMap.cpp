@@ -1,10 +1,16 @@
 #include "VoxelDepthMap.hpp"
 
 #include <math.h>
+#include <stdio.h>
+
+#include "VoxelBufferPool.hpp"
+#include "VoxelBuildTrace.hpp"
 
 VoxelDepthMap::VoxelDepthMap(int resolution, float* entryDepths, float* exitDepths)
     : resolution_(resolution)
 {
+    VoxelTraceScope scope("Build Depth Mips");
+    
     // Must be a +vs resolution
     assert(resolution_ > 0);
     
@@ -28,9 +34,9 @@ VoxelDepthMap::VoxelDepthMap(int resolution, float* entryDepths, float* exitDept
         resolution /= 2;
         int mipResolution = resolution;
         
-        // Make the arrays
-        entryDepths_[mip] = new float[mipResolution * mipResolution];
-        exitDepths_[mip] = new float[mipResolution * mipResolution];
+        // Make the arrays, reusing those of an earlier tile
+        entryDepths_[mip] = VoxelBufferPool::acquireFloats(mipResolution * mipResolution);
+        exitDepths_[mip] = VoxelBufferPool::acquireFloats(mipResolution * mipResolution);
         
         // Consider row in the parent mip
         for(int parentRow = 0; parentRow < parentResolution; ++parentRow)
@@ -70,11 +76,12 @@ VoxelDepthMap::VoxelDepthMap(int resolution, float* entryDepths, float* exitDept
 
 VoxelDepthMap::~VoxelDepthMap()
 {
-    // Delete the mip levels
+    // Return the mip levels to the pool
     for(int i = 0; i < mipHierarchyHeight_; ++i)
     {
-        delete[] entryDepths_[i];
-        delete[] exitDepths_[i];
+        int mipResolution = resolution_ >> i;
+        VoxelBufferPool::releaseFloats(entryDepths_[i], (size_t)mipResolution * mipResolution);
+        VoxelBufferPool::releaseFloats(exitDepths_[i], (size_t)mipResolution * mipResolution);
     }
     
     // Delete the main arrays
@@ -177,3 +184,70 @@ uint16_t VoxelDepthMap::sampleChildMask(const VoxelTile* children) const
     
     return childMask;
 }
+
+bool recordTileDepths(const char* fileName, int tile, int resolution, const float* entryDepths, const float* exitDepths)
+{
+    FILE* file = fopen(fileName, "ab");
+    if(file == NULL)
+    {
+        printf("Failed to record tile depths to %s \n", fileName);
+        return false;
+    }
+    
+    int32_t header[2] = { tile, resolution };
+    size_t texels = (size_t)resolution * resolution;
+    bool written = fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(entryDepths, sizeof(float), texels, file) == texels
+        && fwrite(exitDepths, sizeof(float), texels, file) == texels;
+    
+    fclose(file);
+    return written;
+}
+
+bool loadRecordedDepths(const char* fileName, std::vector<VoxelRecordedDepths> &tiles)
+{
+    FILE* file = fopen(fileName, "rb");
+    if(file == NULL)
+    {
+        printf("Failed to open recorded depths %s \n", fileName);
+        return false;
+    }
+    
+    // Read tiles until the end of the file
+    int32_t header[2];
+    bool valid = true;
+    while(fread(header, sizeof(header), 1, file) == 1)
+    {
+        // Resolutions are powers of two up to 16K
+        int resolution = header[1];
+        if(resolution < 8 || resolution > 16384 || (resolution & (resolution - 1)) != 0)
+        {
+            valid = false;
+            break;
+        }
+        
+        VoxelRecordedDepths depths;
+        depths.tile = header[0];
+        depths.resolution = resolution;
+        depths.entryDepths.resize((size_t)resolution * resolution);
+        depths.exitDepths.resize((size_t)resolution * resolution);
+        
+        if(fread(depths.entryDepths.data(), sizeof(float), depths.entryDepths.size(), file) != depths.entryDepths.size()
+           || fread(depths.exitDepths.data(), sizeof(float), depths.exitDepths.size(), file) != depths.exitDepths.size())
+        {
+            valid = false;
+            break;
+        }
+        
+        tiles.push_back(depths);
+    }
+    
+    fclose(file);
+    
+    if(valid == false)
+    {
+        printf("Recorded depths %s are truncated or invalid \n", fileName);
+    }
+    
+    return valid;
+}
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <assert.h>
 #include <math.h>
+#include <vector>
 
 #include "Scene.hpp"
 #include "VoxelNode.hpp"
@@ -11,6 +12,7 @@
 class VoxelDepthMap
 {
 public:
+    // Takes ownership of the depths, which must be acquired from VoxelBufferPool
     VoxelDepthMap(int resolution, float* entryDepths, float* exitDepths);
     ~VoxelDepthMap();
 
@@ -33,3 +35,20 @@ private:
     float** entryDepths_;
     float** exitDepths_;
 };
+
+// A tile's dual shadow map, recorded from a real build
+// so the builder can be benchmarked on it.
+struct VoxelRecordedDepths
+{
+    int tile;
+    int resolution;
+    std::vector<float> entryDepths;
+    std::vector<float> exitDepths;
+};
+
+// Appends a tile's entry and exit depths to a recording file.
+// Each tile is stored as its index and resolution, followed by the depths.
+bool recordTileDepths(const char* fileName, int tile, int resolution, const float* entryDepths, const float* exitDepths);
+
+// Loads every tile from a recording file
+bool loadRecordedDepths(const char* fileName, std::vector<VoxelRecordedDepths> &tiles);
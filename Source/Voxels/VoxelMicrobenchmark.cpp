@@ -0,0 +1,474 @@
+#include "VoxelMicrobenchmark.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <QElapsedTimer>
+
+#include "VoxelBufferPool.hpp"
+#include "VoxelBuilder.hpp"
+#include "VoxelDepthMap.hpp"
+#include "VoxelNode.hpp"
+#include "VoxelWriter.hpp"
+
+using namespace std;
+
+// Each benchmark is run this many times and the fastest run is reported
+const static int BenchmarkRuns = 5;
+
+// The resolution of the synthetic depth maps
+const static int SyntheticResolution = 1024;
+
+// The number of distinct inputs made for the sampling and hashing
+// benchmarks, and the number of passes made over them per run
+const static int SampleCount = 1 << 16;
+const static int SamplePasses = 16;
+
+// The number of nodes written per run of the node writing benchmarks
+const static int WrittenNodeCount = 1 << 18;
+
+// The deduplication hit rates of the node writing benchmarks
+const static double WriterHitRates[] = { 0.0, 0.5, 0.9, 0.99 };
+
+// Stops results of the measured calls being optimized away
+static volatile uint64_t benchmarkSink;
+
+// A pair of depth maps the depth kernels are measured on
+struct MicrobenchmarkInput
+{
+    string name;
+    int resolution;
+    vector<float> entryDepths;
+    vector<float> exitDepths;
+};
+
+// Gets a random 64 bit value
+static uint64_t random64()
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+// Gets a random value in [0, 1]
+static float random01()
+{
+    return rand() / (float)RAND_MAX;
+}
+
+static void printResult(const char* benchmark, const string &input, double nsPerOp, double bytesPerOp)
+{
+    printf("%s, %s, %.2f, %.2f \n", benchmark, input.c_str(), nsPerOp, bytesPerOp);
+}
+
+// Makes the synthetic inputs
+static vector<MicrobenchmarkInput> syntheticInputs()
+{
+    int res = SyntheticResolution;
+    vector<MicrobenchmarkInput> inputs(3);
+    
+    inputs[0].name = "Synthetic Noise";
+    inputs[1].name = "Synthetic Slope";
+    inputs[2].name = "Synthetic Empty";
+    for(auto input = inputs.begin(); input != inputs.end(); ++input)
+    {
+        input->resolution = res;
+        input->entryDepths.resize(res * res);
+        input->exitDepths.resize(res * res);
+    }
+    
+    srand(0);
+    for(int y = 0; y < res; ++y)
+    {
+        for(int x = 0; x < res; ++x)
+        {
+            int i = y * res + x;
+            
+            // Independent thin casters at every texel. No leaf masks are
+            // reused along z and few nodes are duplicates.
+            inputs[0].entryDepths[i] = random01() * 0.9;
+            inputs[0].exitDepths[i] = inputs[0].entryDepths[i] + random01() * 0.1;
+            
+            // A steep plane, like a sloped roof
+            inputs[1].entryDepths[i] = 0.05 + 0.9 * (x * 0.6 + y * 0.4) / res;
+            inputs[1].exitDepths[i] = inputs[1].entryDepths[i] + 0.05;
+            
+            // Nothing casts a shadow
+            inputs[2].entryDepths[i] = 1.0;
+            inputs[2].exitDepths[i] = 1.0;
+        }
+    }
+    
+    return inputs;
+}
+
+// Copies depths into a buffer from the pool, as
+// depth maps and builders take ownership of them.
+static float* copyDepths(const vector<float> &depths)
+{
+    float* copied = VoxelBufferPool::acquireFloats(depths.size());
+    copy(depths.begin(), depths.end(), copied);
+    return copied;
+}
+
+// Creates a depth map from copies of the input's depths
+static VoxelDepthMap* createDepthMap(const MicrobenchmarkInput &input)
+{
+    return new VoxelDepthMap(input.resolution, copyDepths(input.entryDepths), copyDepths(input.exitDepths));
+}
+
+static void benchmarkDepthMap(const MicrobenchmarkInput &input)
+{
+    // The mip levels allocated by the depth map
+    double mipBytes = 0.0;
+    for(int mipResolution = input.resolution / 2; mipResolution > 1; mipResolution /= 2)
+    {
+        mipBytes += 2.0 * mipResolution * mipResolution * sizeof(float);
+    }
+    
+    qint64 bestTime = -1;
+    QElapsedTimer timer;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        float* entryDepths = copyDepths(input.entryDepths);
+        float* exitDepths = copyDepths(input.exitDepths);
+        
+        timer.start();
+        VoxelDepthMap* depthMap = new VoxelDepthMap(input.resolution, entryDepths, exitDepths);
+        qint64 time = timer.nsecsElapsed();
+        
+        delete depthMap;
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+    }
+    
+    printResult("VoxelDepthMap construction", input.name, bestTime, mipBytes);
+}
+
+static void benchmarkLeafMasks(const MicrobenchmarkInput &input, const VoxelDepthMap* depthMap)
+{
+    // Random leaves anywhere in the tile
+    vector<VoxelTile> leaves(SampleCount);
+    for(int i = 0; i < SampleCount; ++i)
+    {
+        leaves[i].x = (rand() % (input.resolution / 8)) * 8;
+        leaves[i].y = (rand() % (input.resolution / 8)) * 8;
+        leaves[i].z = rand() % input.resolution;
+    }
+    
+    qint64 bestTime = -1;
+    QElapsedTimer timer;
+    uint64_t sink = 0;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        timer.start();
+        for(int pass = 0; pass < SamplePasses; ++pass)
+        {
+            for(auto leaf = leaves.begin(); leaf != leaves.end(); ++leaf)
+            {
+                int nextChangeZ;
+                sink += depthMap->sampleLeafMask(leaf->x, leaf->y, leaf->z, &nextChangeZ) + nextChangeZ;
+            }
+        }
+        
+        qint64 time = timer.nsecsElapsed();
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+    }
+    
+    benchmarkSink = sink;
+    printResult("sampleLeafMask", input.name, (double)bestTime / (SampleCount * SamplePasses), 0.0);
+}
+
+static void benchmarkChildMasks(const MicrobenchmarkInput &input, const VoxelDepthMap* depthMap)
+{
+    // The children of random parents at every level, laid
+    // out in the same way as VoxelBuilder::getChildLocations
+    int levels = log2(input.resolution) - 2;
+    vector<VoxelTile> children(SampleCount * 8);
+    for(int i = 0; i < SampleCount; ++i)
+    {
+        int width = 8 << (rand() % levels);
+        int cells = input.resolution / width;
+        int x = (rand() % cells) * width;
+        int y = (rand() % cells) * width;
+        int z = (rand() % cells) * width;
+        
+        for(int c = 0; c < 8; ++c)
+        {
+            VoxelTile &child = children[i * 8 + c];
+            if(width == 8)
+            {
+                // A stack of leaves
+                child.x = x;
+                child.y = y;
+                child.z = z + c;
+                child.width = 8;
+                child.depth = 1;
+            }
+            else
+            {
+                child.x = x + (width / 2) * (c >> 2);
+                child.y = y + (width / 2) * ((c >> 1) & 1);
+                child.z = z + (width / 2) * (c & 1);
+                child.width = width / 2;
+                child.depth = width / 2;
+            }
+        }
+    }
+    
+    qint64 bestTime = -1;
+    QElapsedTimer timer;
+    uint64_t sink = 0;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        timer.start();
+        for(int pass = 0; pass < SamplePasses; ++pass)
+        {
+            for(int i = 0; i < SampleCount; ++i)
+            {
+                sink += depthMap->sampleChildMask(&children[i * 8]);
+            }
+        }
+        
+        qint64 time = timer.nsecsElapsed();
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+    }
+    
+    benchmarkSink = sink;
+    printResult("sampleChildMask", input.name, (double)bestTime / (SampleCount * SamplePasses), 0.0);
+}
+
+static void benchmarkNodeHash()
+{
+    vector<VoxelNodeHash> childHashes(SampleCount * 8);
+    for(auto hash = childHashes.begin(); hash != childHashes.end(); ++hash)
+    {
+        *hash = random64();
+    }
+    
+    qint64 bestTime = -1;
+    QElapsedTimer timer;
+    uint64_t sink = 0;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        timer.start();
+        for(int pass = 0; pass < SamplePasses; ++pass)
+        {
+            for(int i = 0; i < SampleCount; ++i)
+            {
+                sink += computeInnerNodeHash(&childHashes[i * 8]);
+            }
+        }
+        
+        qint64 time = timer.nsecsElapsed();
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+    }
+    
+    benchmarkSink = sink;
+    printResult("computeInnerNodeHash", "Random", (double)bestTime / (SampleCount * SamplePasses), 0.0);
+}
+
+// Picks which of the written nodes repeat an earlier node.
+// Returns the index of the node each write repeats, or -1 for new nodes.
+static vector<int> repeatedNodes(double hitRate)
+{
+    vector<int> repeats(WrittenNodeCount, -1);
+    for(int i = 1; i < WrittenNodeCount; ++i)
+    {
+        if(random01() < hitRate)
+        {
+            // Repeat an earlier new node
+            int earlier = rand() % i;
+            repeats[i] = (repeats[earlier] >= 0) ? repeats[earlier] : earlier;
+        }
+    }
+    
+    return repeats;
+}
+
+static void benchmarkWriteLeaf(double hitRate)
+{
+    vector<int> repeats = repeatedNodes(hitRate);
+    vector<VoxelLeafNode> leaves(WrittenNodeCount);
+    for(int i = 0; i < WrittenNodeCount; ++i)
+    {
+        leaves[i].leafMask = (repeats[i] >= 0) ? leaves[repeats[i]].leafMask : random64();
+    }
+    
+    qint64 bestTime = -1;
+    size_t writtenBytes = 0;
+    QElapsedTimer timer;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        VoxelWriter* writer = new VoxelWriter();
+        size_t startBytes = writer->dataSizeBytes();
+        
+        timer.start();
+        for(auto leaf = leaves.begin(); leaf != leaves.end(); ++leaf)
+        {
+            writer->writeLeaf(*leaf);
+        }
+        
+        qint64 time = timer.nsecsElapsed();
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+        writtenBytes = writer->dataSizeBytes() - startBytes;
+        delete writer;
+    }
+    
+    char input[32];
+    sprintf(input, "%.0f%% Hit Rate", hitRate * 100.0);
+    printResult("VoxelWriter::writeLeaf", input, (double)bestTime / WrittenNodeCount, (double)writtenBytes / WrittenNodeCount);
+}
+
+static void benchmarkWriteNode(double hitRate)
+{
+    // Nodes with random child states and hashes
+    vector<int> repeats = repeatedNodes(hitRate);
+    vector<VoxelInnerNode> nodes(WrittenNodeCount);
+    vector<int> expandedCounts(WrittenNodeCount);
+    vector<VoxelNodeHash> hashes(WrittenNodeCount);
+    for(int i = 0; i < WrittenNodeCount; ++i)
+    {
+        if(repeats[i] >= 0)
+        {
+            nodes[i] = nodes[repeats[i]];
+            expandedCounts[i] = expandedCounts[repeats[i]];
+            hashes[i] = hashes[repeats[i]];
+            continue;
+        }
+        
+        VoxelInnerNode &node = nodes[i];
+        node.shadowedFraction = rand() & 0xFFFF;
+        node.childMask = 0;
+        expandedCounts[i] = 0;
+        for(int c = 0; c < 8; ++c)
+        {
+            int state = rand() % 3;
+            node.childMask |= state << (c * 2);
+            if(state == VS_Mixed)
+            {
+                node.childPositions[expandedCounts[i]++] = rand();
+            }
+        }
+        
+        hashes[i] = random64();
+    }
+    
+    qint64 bestTime = -1;
+    size_t writtenBytes = 0;
+    QElapsedTimer timer;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        VoxelWriter* writer = new VoxelWriter();
+        size_t startBytes = writer->dataSizeBytes();
+        
+        timer.start();
+        for(int i = 0; i < WrittenNodeCount; ++i)
+        {
+            writer->writeNode(nodes[i], expandedCounts[i], hashes[i]);
+        }
+        
+        qint64 time = timer.nsecsElapsed();
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+        writtenBytes = writer->dataSizeBytes() - startBytes;
+        delete writer;
+    }
+    
+    char input[32];
+    sprintf(input, "%.0f%% Hit Rate", hitRate * 100.0);
+    printResult("VoxelWriter::writeNode", input, (double)bestTime / WrittenNodeCount, (double)writtenBytes / WrittenNodeCount);
+}
+
+static void benchmarkWriteTree(const MicrobenchmarkInput &input)
+{
+    // Build the tile's tree
+    float* entryDepths = copyDepths(input.entryDepths);
+    float* exitDepths = copyDepths(input.exitDepths);
+    VoxelBuilder* builder = new VoxelBuilder(0, input.resolution, entryDepths, exitDepths);
+    builder->build();
+    
+    const uint32_t* tree = (const uint32_t*)builder->tree();
+    
+    // Write the tree into an empty buffer, and into one that already
+    // holds it, where every node is a duplicate
+    qint64 bestTime = -1;
+    qint64 bestDuplicateTime = -1;
+    size_t writtenBytes = 0;
+    size_t duplicateBytes = 0;
+    QElapsedTimer timer;
+    for(int run = 0; run < BenchmarkRuns; ++run)
+    {
+        VoxelWriter* writer = new VoxelWriter();
+        size_t startBytes = writer->dataSizeBytes();
+        
+        timer.start();
+        writer->writeTree(tree, builder->rootAddress(), input.resolution);
+        qint64 time = timer.nsecsElapsed();
+        size_t middleBytes = writer->dataSizeBytes();
+        
+        timer.start();
+        writer->writeTree(tree, builder->rootAddress(), input.resolution);
+        qint64 duplicateTime = timer.nsecsElapsed();
+        
+        bestTime = (bestTime < 0) ? time : min(bestTime, time);
+        bestDuplicateTime = (bestDuplicateTime < 0) ? duplicateTime : min(bestDuplicateTime, duplicateTime);
+        writtenBytes = middleBytes - startBytes;
+        duplicateBytes = writer->dataSizeBytes() - middleBytes;
+        delete writer;
+    }
+    
+    printResult("VoxelWriter::writeTree", input.name, bestTime, writtenBytes);
+    printResult("VoxelWriter::writeTree (duplicate)", input.name, bestDuplicateTime, duplicateBytes);
+    delete builder;
+}
+
+int runVoxelMicrobenchmarks(const char* recordedDepthsFileName)
+{
+    vector<MicrobenchmarkInput> inputs = syntheticInputs();
+    
+    // Add the recorded tiles
+    if(recordedDepthsFileName != NULL)
+    {
+        vector<VoxelRecordedDepths> recorded;
+        if(loadRecordedDepths(recordedDepthsFileName, recorded) == false)
+        {
+            return 1;
+        }
+        
+        for(auto tile = recorded.begin(); tile != recorded.end(); ++tile)
+        {
+            MicrobenchmarkInput input;
+            input.name = "Tile " + to_string(tile->tile) + " (" + to_string(tile->resolution) + ")";
+            input.resolution = tile->resolution;
+            input.entryDepths.swap(tile->entryDepths);
+            input.exitDepths.swap(tile->exitDepths);
+            inputs.push_back(input);
+        }
+    }
+    
+    printf("Benchmark, Input, ns/op, bytes/op \n");
+    
+    // The depth kernels run on every input
+    for(auto input = inputs.begin(); input != inputs.end(); ++input)
+    {
+        srand(1);
+        benchmarkDepthMap(*input);
+        
+        VoxelDepthMap* depthMap = createDepthMap(*input);
+        benchmarkLeafMasks(*input, depthMap);
+        benchmarkChildMasks(*input, depthMap);
+        delete depthMap;
+        
+        benchmarkWriteTree(*input);
+    }
+    
+    // The hashing and node writing benchmarks use random nodes
+    srand(2);
+    benchmarkNodeHash();
+    for(unsigned int i = 0; i < sizeof(WriterHitRates) / sizeof(WriterHitRates[0]); ++i)
+    {
+        benchmarkWriteLeaf(WriterHitRates[i]);
+        benchmarkWriteNode(WriterHitRates[i]);
+    }
+    
+    return 0;
+}
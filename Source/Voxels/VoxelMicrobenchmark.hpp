@@ -0,0 +1,10 @@
+#pragma once
+
+// Measures the inner kernels of the tree builder in isolation: depth map
+// construction, leaf and child mask sampling, inner node hashing, writing
+// leaves and inner nodes at a range of deduplication hit rates, and
+// writing whole tile trees. The depth kernels run on synthetic depths,
+// including a worst case of noise, and on the tiles in a recording made
+// with -recorddepths, if one is given. Prints the fastest of several runs
+// of each as ns/op and bytes/op. Returns the process exit code.
+int runVoxelMicrobenchmarks(const char* recordedDepthsFileName);
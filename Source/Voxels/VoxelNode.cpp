@@ -31,3 +31,69 @@ VoxelNodeHash computeInnerNodeHash(VoxelNodeHash* childHashes)
     
     return hash;
 }
+
+uint16_t computeLeafShadowedFraction(uint64_t leafMask)
+{
+    // Set bits in the leaf mask are unshadowed voxels
+    int shadowedCount = 64 - __builtin_popcountll(leafMask);
+    
+    // Scale to the 15 bit fraction range
+    return (uint16_t)((shadowedCount * VoxelFullyShadowed) / 64);
+}
+
+uint16_t computeInnerShadowedFraction(const uint16_t* childFractions)
+{
+    // Each child covers 1/8 of the node's region
+    // Ignore the z variation flags of the children.
+    uint32_t sum = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        sum += childFractions[i] & VoxelFullyShadowed;
+    }
+    
+    // Average, rounding to the nearest value
+    return (uint16_t)((sum + 4) / 8);
+}
+
+// Returns true if two children of an inner node have the same contents.
+static bool childrenMatch(uint16_t childMask, const VoxelNodeHash* childHashes, int a, int b)
+{
+    int stateA = (childMask >> (a * 2)) & 3;
+    int stateB = (childMask >> (b * 2)) & 3;
+    
+    // Uniform children only need the same state.
+    // Mixed children are deduplicated by hash.
+    if(stateA != stateB)
+        return false;
+    
+    return stateA != VS_Mixed || childHashes[a] == childHashes[b];
+}
+
+bool computeInnerVariesInZ(uint16_t childMask, const VoxelNodeHash* childHashes, const uint16_t* childFractions, bool leafChildren)
+{
+    if(leafChildren)
+    {
+        // Each leaf is a single z slice.
+        // The node varies unless all slices are the same.
+        for(int i = 1; i < 8; ++i)
+        {
+            if(!childrenMatch(childMask, childHashes, 0, i))
+                return true;
+        }
+        
+        return false;
+    }
+    
+    for(int i = 0; i < 8; ++i)
+    {
+        // Variation inside any child is variation inside the node
+        if(((childMask >> (i * 2)) & 3) == VS_Mixed && (childFractions[i] & VoxelVariesInZ) != 0)
+            return true;
+        
+        // Compare the front and back child of each x-y column
+        if((i & 1) == 0 && !childrenMatch(childMask, childHashes, i, i + 1))
+            return true;
+    }
+    
+    return false;
+}
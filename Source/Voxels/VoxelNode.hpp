@@ -8,6 +8,18 @@ typedef uint32_t VoxelPointer;
 // Use 64-bit hashes
 typedef uint64_t VoxelNodeHash;
 
+// Entry in the root node table at the start of the buffer.
+// There is one entry per tile.
+struct VoxelRootEntry
+{
+    // The tile's root node
+    VoxelPointer root;
+    
+    // The height of the tile's tree.
+    // Tiles can have different resolutions.
+    uint32_t treeHeight;
+};
+
 // Subsection of the voxel structure
 struct VoxelTile
 {
@@ -32,8 +44,11 @@ enum VoxelShadowing : int
 // May contain children.
 struct VoxelInnerNode
 {
-    // 16 bits padding
-    uint16_t paddingBits;
+    // Quantized fraction of the node's voxels that are shadowed.
+    // 0 = fully unshadowed, 32767 = fully shadowed.
+    // Used for prefiltered sampling of distant regions.
+    // The top bit is set if the shadowing changes along z.
+    uint16_t shadowedFraction;
     
     // 2 bits per child
     uint16_t childMask;
@@ -51,6 +66,27 @@ struct VoxelInnerNode
 // Non-expanded child hashes are filled with the parent's childmask.
 VoxelNodeHash computeInnerNodeHash(VoxelNodeHash* childHashes);
 
+// The quantized shadowed fraction of a fully shadowed region.
+const uint16_t VoxelFullyShadowed = 32767;
+
+// Set in the shadowed fraction of nodes whose shadowing changes along z.
+// Their fraction mixes depths in front of and behind a receiver,
+// so it can't be used to shade a surface inside the node.
+const uint16_t VoxelVariesInZ = 32768;
+
+// Computes the quantized shadowed fraction of a leaf from its leaf mask.
+uint16_t computeLeafShadowedFraction(uint64_t leafMask);
+
+// Computes the quantized shadowed fraction of an inner node from
+// the fractions of its 8 children. Non-expanded children are filled
+// with 0 (unshadowed) or VoxelFullyShadowed (shadowed).
+uint16_t computeInnerShadowedFraction(const uint16_t* childFractions);
+
+// Returns true if the shadowing of an inner node changes along z.
+// The children of leaf parents are stacked along z. Other nodes
+// pair their children along z with the lowest bit of the child index.
+bool computeInnerVariesInZ(uint16_t childMask, const VoxelNodeHash* childHashes, const uint16_t* childFractions, bool leafChildren);
+
 // Leaf node.
 // Contains an 8x8 voxel plane.
 struct VoxelLeafNode
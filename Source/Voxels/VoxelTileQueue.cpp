@@ -0,0 +1,131 @@
+#include "VoxelTileQueue.hpp"
+
+#include <assert.h>
+#include <algorithm>
+
+VoxelTileQueue::VoxelTileQueue()
+    : heap_(),
+    positions_()
+{
+}
+
+void VoxelTileQueue::reset(int tileCount)
+{
+    heap_.clear();
+    positions_.assign(tileCount, -1);
+}
+
+void VoxelTileQueue::push(int tile, const VoxelTilePriority &priority)
+{
+    assert(contains(tile) == false);
+    
+    // Add to the bottom of the heap and move it up
+    Entry entry;
+    entry.tile = tile;
+    entry.priority = priority;
+    heap_.push_back(entry);
+    positions_[tile] = heap_.size() - 1;
+    siftUp(heap_.size() - 1);
+}
+
+void VoxelTileQueue::update(int tile, const VoxelTilePriority &priority)
+{
+    assert(contains(tile));
+    
+    // The entry moves up if its priority increased, otherwise down
+    int position = positions_[tile];
+    heap_[position].priority = priority;
+    if(siftUp(position) == position)
+    {
+        siftDown(position);
+    }
+}
+
+void VoxelTileQueue::remove(int tile)
+{
+    assert(contains(tile));
+    
+    // Replace the entry with the last one, then reorder that
+    int position = positions_[tile];
+    int last = heap_.size() - 1;
+    swapEntries(position, last);
+    heap_.pop_back();
+    positions_[tile] = -1;
+    
+    if(position < last && siftUp(position) == position)
+    {
+        siftDown(position);
+    }
+}
+
+int VoxelTileQueue::pop()
+{
+    assert(empty() == false);
+    
+    int tile = heap_[0].tile;
+    remove(tile);
+    return tile;
+}
+
+void VoxelTileQueue::clear()
+{
+    for(auto entry = heap_.begin(); entry != heap_.end(); ++entry)
+    {
+        positions_[entry->tile] = -1;
+    }
+    
+    heap_.clear();
+}
+
+int VoxelTileQueue::siftUp(int position)
+{
+    while(position > 0)
+    {
+        int parent = (position - 1) / 2;
+        if((heap_[position].priority < heap_[parent].priority) == false)
+        {
+            break;
+        }
+        
+        swapEntries(position, parent);
+        position = parent;
+    }
+    
+    return position;
+}
+
+int VoxelTileQueue::siftDown(int position)
+{
+    int count = heap_.size();
+    while(true)
+    {
+        // Find the child with the highest priority
+        int child = position * 2 + 1;
+        if(child >= count)
+        {
+            break;
+        }
+        
+        if(child + 1 < count && heap_[child + 1].priority < heap_[child].priority)
+        {
+            child ++;
+        }
+        
+        if((heap_[child].priority < heap_[position].priority) == false)
+        {
+            break;
+        }
+        
+        swapEntries(position, child);
+        position = child;
+    }
+    
+    return position;
+}
+
+void VoxelTileQueue::swapEntries(int a, int b)
+{
+    std::swap(heap_[a], heap_[b]);
+    positions_[heap_[a].tile] = a;
+    positions_[heap_[b].tile] = b;
+}
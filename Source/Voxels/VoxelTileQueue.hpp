@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+
+using namespace std;
+
+// The order in which a queued tile is built.
+// Tiles with a lower rank are built first, then the closest tiles.
+struct VoxelTilePriority
+{
+    int rank;
+    float distance;
+    
+    bool operator < (const VoxelTilePriority &other) const
+    {
+        return rank < other.rank || (rank == other.rank && distance < other.distance);
+    }
+};
+
+// The tiles waiting to be built, ordered by priority.
+// A binary heap that also stores each tile's position in the heap,
+// so tiles can be removed or reprioritized in O(log n).
+class VoxelTileQueue
+{
+public:
+    VoxelTileQueue();
+    
+    // Sets the number of tiles that can be queued.
+    // Removes every queued tile.
+    void reset(int tileCount);
+    
+    bool empty() const { return heap_.empty(); }
+    int size() const { return heap_.size(); }
+    
+    // Checks if a tile is queued
+    bool contains(int tile) const { return positions_[tile] >= 0; }
+    
+    // Adds a tile that is not already queued
+    void push(int tile, const VoxelTilePriority &priority);
+    
+    // Changes the priority of a queued tile
+    void update(int tile, const VoxelTilePriority &priority);
+    
+    // Removes a queued tile
+    void remove(int tile);
+    
+    // The tile with the highest priority
+    int top() const { return heap_[0].tile; }
+    
+    // Removes and returns the tile with the highest priority
+    int pop();
+    
+    // Removes every queued tile
+    void clear();
+    
+    // The queued tiles, in no particular order
+    int tileAt(int index) const { return heap_[index].tile; }
+    
+private:
+    struct Entry
+    {
+        int tile;
+        VoxelTilePriority priority;
+    };
+    
+    // The heap, highest priority first
+    vector<Entry> heap_;
+    
+    // The position of each tile in the heap, or -1 if not queued
+    vector<int> positions_;
+    
+    // Moves an entry up or down until the heap is ordered.
+    // Returns the entry's new position.
+    int siftUp(int position);
+    int siftDown(int position);
+    
+    // Swaps two entries and updates their positions
+    void swapEntries(int a, int b);
+};
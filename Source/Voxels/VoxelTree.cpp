@@ -2,45 +2,142 @@
 
 #include <assert.h>
 #include <math.h>
+#include <algorithm>
 
 #include <QElapsedTimer>
 
+#include "VoxelBufferPool.hpp"
+#include "VoxelBuildTrace.hpp"
+
+// Defined here as it is passed to std::min by reference
+const int VoxelTree::MaxCascadesPerKeyframe;
+
 VoxelTree::VoxelTree(UniformManager* uniformManager, const Scene* scene, int resolution)
     : uniformManager_(uniformManager),
     scene_(scene),
-    sceneBoundsLightSpace_(computeSceneBoundsLightSpace()),
     buildTimer_(),
     pcfKernelSize_(9),
+    requestedTiles_(0),
     startedTiles_(0),
     mergedTiles_(0),
     uploadedTiles_(0),
-    treeResolution_(resolution),
+    deterministicBuild_(false),
+    buildFingerprint_(0),
+    buildChecksum_(0),
+    stageQueueDepth_(DefaultStageQueueDepth),
+    buildMemoryBudget_((size_t)DefaultBuildMemoryBudgetMB * 1024 * 1024),
+    peakBuildMemory_(0),
+    reservedBuildMemory_(0),
+    buildFrameBudget_(DefaultBuildFrameBudget),
+    buildFrameTime_(0.0),
+    peakBuildFrameTime_(0.0),
+    totalBuildTime_(0.0),
+    uploadFirst_(false),
+    readbacks_(),
+    nextReadback_(0),
+    readbackSequence_(0),
+    refits_(),
+    lights_(),
+    keyframes_(),
+    cascades_(),
+    totalTiles_(0),
+    keyframeRebuilds_(0),
+    keyframeRebuildTiles_(0),
+    objectTrees_(),
+    firstObjectKeyframe_(0),
+    objectShadows_(),
+    tileResolutions_(),
     shadowMap_(scene, uniformManager, 1, 4),
     voxelWriter_(),
+    voxelWriterMutex_(),
+    committedSizeWords_(0),
+    depthRecordingFile_(),
+    recordedTiles_(0),
+    firstBuildComplete_(false),
+    collectedSizeWords_(0),
+    compactedWriter_(NULL),
+    compactedTiles_(0),
+    compactedRoots_(),
+    compactions_(0),
+    unmergedTiles_(0),
+    uploadedSizeWords_(0),
+    bufferCapacityWords_(0),
+    uploadedCompactions_(0),
+    pendingBuffer_(0),
+    pendingSizeWords_(0),
+    pendingCapacityWords_(0),
+    pendingCompactions_(0),
+    uniformBufferDirty_(false),
     activeTiles_(),
-    activeTilesMutex_()
+    activeTilesMutex_(),
+    mipQueue_(),
+    treeQueue_(),
+    mergeQueue_(),
+    latestBuilders_(),
+    queuedTiles_(),
+    currentCascades_(),
+    priorityCameraToWorld_(),
+    priorityCameraPositions_(),
+    priorityFrustumPlanes_(),
+    prioritySweepTile_(0),
+    prioritySweepRemaining_(0),
+    staticInstances_(),
+    mipThreads_(),
+    treeThreads_(),
+    mergingThread_(),
+    pipelineStarted_(false)
 {
     buildTimer_.start();
     
-    // Make each tile as small as possible.
-    tileResolution_ = std::min(resolution, 4096);
-    while(totalTiles() > MaxTileCount)
+    // No build steps have been timed yet
+    for(int i = 0; i < (int)VoxelBuildStep::Count; ++i)
     {
-        // Double the resolution until under the tile count limit.
-        tileResolution_ *= 2;
+        buildStepTimes_[i] = 0.0;
     }
     
-    // Each tile must be at least 8x8 so that leaf masks can be used
-    // and no more than 16K (maximum texture resolution)
-    assert(tileResolution_ >= 8);
-    assert(tileResolution_ <= 16384);
+    // Readbacks, merges and uploads happen one tile at a time.
+    // No stage holds any tiles yet.
+    for(int i = 0; i < (int)VoxelBuildStage::Count; ++i)
+    {
+        stageConcurrency_[i] = 1;
+        stageMemoryBytes_[i] = 0;
+    }
     
-    // Set the correct shadow map resolution
-    shadowMap_.setCascades(1, tileResolution_);
+    stageConcurrency_[(int)VoxelBuildStage::Render] = DefaultRenderConcurrency;
+    stageConcurrency_[(int)VoxelBuildStage::Mips] = DefaultMipConcurrency;
+    stageConcurrency_[(int)VoxelBuildStage::Tree] = DefaultConcurrentBuilds;
+    
+    // Divide the scene into keyframes, cascades and tiles
+    createKeyframes();
+    createObjectKeyframes();
+    createCascades(resolution);
+    
+    tileResolutions_.resize(totalTiles(), 0);
+    for(unsigned int k = 0; k < keyframes_.size(); ++k)
+    {
+        computeTileResolutions(k);
+    }
+    
+    // Allocate the tile shadow map once, at the largest tile resolution
+    int maxTileResolution = 0;
+    for(auto cascade = cascades_.begin(); cascade != cascades_.end(); ++cascade)
+    {
+        maxTileResolution = std::max(maxTileResolution, cascade->tileResolution);
+    }
+    shadowMap_.setCascades(1, maxTileResolution);
     
     // Create the root pointers in the buffer
     voxelWriter_.reserveRootNodePointerSpace(totalTiles());
     
+    // Record the height of each tile's tree
+    for(int tile = 0; tile < totalTiles(); ++tile)
+    {
+        VoxelPointer root = voxelWriter_.rootEntry(tile).root;
+        voxelWriter_.setRootNodePointer(tile, root, log2(tileResolutions_[tile]));
+    }
+    
+    committedSizeWords_.store(voxelWriter_.dataSizeWords(), std::memory_order_release);
+    
     // Create the buffer to hold the tree
     glGenBuffers(1, &buffer_);
     glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
@@ -49,16 +146,89 @@ VoxelTree::VoxelTree(UniformManager* uniformManager, const Scene* scene, int res
     glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, buffer_);
     
     // Set the initial buffer values
-    updateBuffers();
+    updateTreeBuffer();
     
-    // Start the tile merging thread
-    mergingThread_ = thread(&VoxelTree::mergeTiles, this);
+    // Record the static geometry being built
+    staticInstances_ = findStaticInstances();
+    latestBuilders_.resize(totalTiles(), NULL);
     
-    // Add every tile to the list of tiles to build
-    for(int tile = 0; tile < totalTiles(); ++tile)
+    // Create the build queue
+    notStartedTiles_.reset(totalTiles());
+    queuedTiles_.resize(totalTiles());
+    
+    // Add every tile to the list of tiles to build.
+    // Spare keyframes are only built once their light rotates.
+    vector<int> tiles;
+    for(unsigned int k = 0; k < keyframes_.size(); ++k)
+    {
+        if(isSpareKeyframe(k) == false)
+        {
+            for(int tile = keyframeFirstTile(k); tile < keyframeEndTile(k); ++tile)
+            {
+                tiles.push_back(tile);
+            }
+        }
+    }
+    
+    queueTileBuilds(tiles);
+}
+
+VoxelTree::~VoxelTree()
+{
+    // Stop the tiles being started and the running builds
+    for(auto readback = readbacks_.begin(); readback != readbacks_.end(); ++readback)
+    {
+        cancelTileStart(*readback);
+        glDeleteBuffers(2, readback->readBuffers);
+    }
+    
+    activeTilesMutex_.lock();
+    for(auto builder = activeTiles_.begin(); builder != activeTiles_.end(); ++builder)
+    {
+        (*builder)->cancel();
+    }
+    
+    notStartedTiles_.clear();
+    activeTilesMutex_.unlock();
+    
+    // Closing the queues stops the worker and merging threads
+    mipQueue_.close();
+    treeQueue_.close();
+    mergeQueue_.close();
+    for(auto worker = mipThreads_.begin(); worker != mipThreads_.end(); ++worker)
+    {
+        worker->join();
+    }
+    
+    for(auto worker = treeThreads_.begin(); worker != treeThreads_.end(); ++worker)
+    {
+        worker->join();
+    }
+    
+    if(mergingThread_.joinable())
+    {
+        mergingThread_.join();
+    }
+    
+    // Drop any unfinished compaction
+    delete compactedWriter_;
+    
+    // The builders that were not merged are still active
+    for(auto builder = activeTiles_.begin(); builder != activeTiles_.end(); ++builder)
     {
-        notStartedTiles_.push_back(tile);
+        delete *builder;
     }
+    
+    glDeleteTextures(1, &bufferTexture_);
+    glDeleteBuffers(1, &buffer_);
+    glDeleteBuffers(1, &pendingBuffer_);
+}
+
+int VoxelTree::resolution() const
+{
+    // The main light's last cascade covers the entire scene
+    const VoxelKeyframe &keyframe = keyframes_[0];
+    return cascades_[keyframe.firstCascade + keyframe.cascadeCount - 1].treeResolution;
 }
 
 size_t VoxelTree::sizeBytes() const
@@ -73,8 +243,25 @@ size_t VoxelTree::sizeMB() const
 
 size_t VoxelTree::originalSizeBytes() const
 {
-    // Using 3 bytes -> 24 bits per pixel
-    return (size_t)treeResolution_ * (size_t)treeResolution_ * 3;
+    size_t size = 0;
+    
+    // Using 3 bytes -> 24 bits per pixel for each cascade
+    for(auto cascade = cascades_.begin(); cascade != cascades_.end(); ++cascade)
+    {
+        // Only the displayed keyframe of rotatable lights is counted,
+        // and staging keyframes are not. Object trees replace shadow
+        // map rendering of dynamic objects.
+        const VoxelLight &light = lights_[keyframes_[cascade->keyframe].light];
+        if(isObjectKeyframe(cascade->keyframe) || (light.rotatable && cascade->keyframe != light.displayedKeyframe)
+           || cascade->keyframe == light.stagingKeyframe)
+        {
+            continue;
+        }
+        
+        size += (size_t)cascade->treeResolution * (size_t)cascade->treeResolution * 3;
+    }
+    
+    return size;
 }
 
 size_t VoxelTree::originalSizeMB() const
@@ -93,268 +280,2520 @@ void VoxelTree::setPCFFilterSize(int kernelSize)
     updateUniformBuffer();
 }
 
-void VoxelTree::updateBuild()
+void VoxelTree::setStageConcurrency(VoxelBuildStage stage, int concurrency)
 {
-    // Start another tile build if the limit is not currently met
-    int activeTiles = startedTiles_ - mergedTiles_;
-    if(activeTiles < ConcurrentBuilds && startedTiles_ < totalTiles())
+    assert(pipelineStarted_ == false);
+    
+    // Readbacks, merges and uploads happen one tile at a time
+    if(stage == VoxelBuildStage::Render || stage == VoxelBuildStage::Mips || stage == VoxelBuildStage::Tree)
     {
-        startTileBuild();
+        stageConcurrency_[(int)stage] = std::max(concurrency, 1);
     }
-    
-    // Reupload the tree to the gpu if more tiles have finished
-    if(uploadedTiles_ < mergedTiles_)
+}
+
+void VoxelTree::setStageQueueDepth(int depth)
+{
+    assert(pipelineStarted_ == false);
+    stageQueueDepth_ = std::max(depth, 1);
+}
+
+int VoxelTree::tilesInFlightLimit() const
+{
+    // Each stage holds as many tiles as it works on at once,
+    // plus those waiting in the mip, tree and merge queues.
+    // Finished tiles are only uploaded once merged.
+    int limit = stageQueueDepth_ * 3;
+    for(int i = 0; i < (int)VoxelBuildStage::Count; ++i)
     {
-        updateBuffers();
-        
-        // Output build stats if now finished
-        if(uploadedTiles_ == totalTiles())
+        if(i != (int)VoxelBuildStage::Upload)
         {
-            auto time = buildTimer_.elapsed();
-            printf("Tree construction finished in %lld ms \n", time);
+            limit += stageConcurrency_[i];
         }
     }
+    
+    return limit;
 }
 
-void VoxelTree::startTileBuild()
+size_t VoxelTree::buildMemoryBytes() const
 {
-    int tileIndex = getNextTileToStart();
-    startedTiles_ ++;
-    
-    // Compute the light space bounds of the tile
-    Bounds bounds = tileBoundsLightSpace(tileIndex);
+    size_t bytes = VoxelBufferPool::idleBytes();
+    for(int i = 0; i < (int)VoxelBuildStage::Count; ++i)
+    {
+        bytes += stageMemoryBytes_[i];
+    }
     
-    // Get the entry and exit depths for the tile by rendering
-    // a dual shadow map.
-    float* entryDepths;
-    float* exitDepths;
-    computeDualShadowMaps(bounds, &entryDepths, &exitDepths);
+    return bytes;
+}
+
+size_t VoxelTree::tileMemoryBytes(VoxelBuildStage stage, int resolution) const
+{
+    // The entry and exit depths. Their mips add another third.
+    size_t texels = (size_t)resolution * resolution;
+    size_t depthBytes = texels * sizeof(float) * 2;
+    size_t mipBytes = depthBytes / 3;
     
-    // Create the builder.
-    VoxelBuilder* builder = new VoxelBuilder(tileIndex, tileResolution_, entryDepths, exitDepths);
+    // The builder's node buffer, and its leaf cache with an entry per 8x8 texels
+    size_t writerBytes = (size_t)VoxelWriter::BufferSizeMB * 1024 * 1024;
+    size_t leafCacheBytes = (texels / 64) * sizeof(VoxelLeafCache);
     
-    // Add to the active tiles list
-    activeTilesMutex_.lock();
-    activeTiles_.push_back(builder);
-    activeTilesMutex_.unlock();
+    switch(stage)
+    {
+        case VoxelBuildStage::Readback:
+            return depthBytes;
+        case VoxelBuildStage::Mips:
+        case VoxelBuildStage::Tree:
+            return depthBytes + mipBytes + writerBytes + leafCacheBytes;
+        case VoxelBuildStage::Merge:
+            return writerBytes;
+        default:
+            // Rendered depths are on the GPU and merged nodes are in the tree
+            return 0;
+    }
 }
 
-int VoxelTree::getNextTileToStart()
+bool VoxelTree::hasBuildMemoryFor(int tile) const
 {
-    // Check there are tiles waiting to be started
-    assert(notStartedTiles_.empty() == false);
+    // Tiles larger than the budget are started once nothing else is running
+    if(buildMemoryBudget_ == 0 || reservedBuildMemory_ == 0)
+    {
+        return true;
+    }
     
-    // Get the world to light space transformation matrix (without translation)
-    Matrix4x4 worldToLight = scene_->mainLight()->worldToLocal();
-    worldToLight.set(0, 3, 0.0);
-    worldToLight.set(1, 3, 0.0);
-    worldToLight.set(2, 3, 0.0);
+    size_t tileBytes = tileMemoryBytes(VoxelBuildStage::Mips, tileResolutions_[tile]);
+    return reservedBuildMemory_ + tileBytes <= buildMemoryBudget_;
+}
+
+void VoxelTree::moveTileMemory(int resolution, VoxelBuildStage from, VoxelBuildStage to)
+{
+    stageMemoryBytes_[(int)from] -= tileMemoryBytes(from, resolution);
+    stageMemoryBytes_[(int)to] += tileMemoryBytes(to, resolution);
+}
+
+void VoxelTree::finishTileMemory(int resolution, VoxelBuildStage stage)
+{
+    stageMemoryBytes_[(int)stage] -= tileMemoryBytes(stage, resolution);
+    reservedBuildMemory_ -= tileMemoryBytes(VoxelBuildStage::Mips, resolution);
+}
+
+void VoxelTree::startPipeline()
+{
+    // Create the buffers each starting tile's depths are read back into
+    readbacks_.resize(stageConcurrency(VoxelBuildStage::Render));
+    for(auto readback = readbacks_.begin(); readback != readbacks_.end(); ++readback)
+    {
+        glGenBuffers(2, readback->readBuffers);
+    }
     
-    // Get the camera position in light space
-    Vector4 cameraPosWorld = Vector4(scene_->mainCamera()->position(), 1.0);
-    Vector3 cameraPosLight = (worldToLight * cameraPosWorld).vec3();
+    mipQueue_.setCapacity(stageQueueDepth_);
+    treeQueue_.setCapacity(stageQueueDepth_);
+    mergeQueue_.setCapacity(stageQueueDepth_);
     
-    // Keep track of the best tile
-    float closestDistance = 1000000000000.0;
-    int highestTileIndex = 0;
+    // Start the worker threads of each stage
+    for(int i = 0; i < stageConcurrency(VoxelBuildStage::Mips); ++i)
+    {
+        mipThreads_.push_back(thread(&VoxelTree::buildTileMips, this));
+    }
     
-    // Check each tile
-    for(unsigned int i = 0; i < notStartedTiles_.size(); ++i)
+    for(int i = 0; i < stageConcurrency(VoxelBuildStage::Tree); ++i)
     {
-        // Get the tile centre in light space
-        Bounds tileBounds = tileBoundsLightSpace(notStartedTiles_[i]);
-        Vector3 tileCentre = tileBounds.centre();
-        
-        // Get the camera to tile centre sqr distance
-        float distance = (cameraPosLight - tileCentre).sqrMagnitude();
-        
-        // Check if this tile is the new closest one
-        if(distance < closestDistance)
-        {
-            closestDistance = distance;
-            highestTileIndex = i;
-        }
+        treeThreads_.push_back(thread(&VoxelTree::buildTileTrees, this));
     }
     
-    // Remove the tile from the queue + return it
-    int tileIndex = notStartedTiles_[highestTileIndex];
-    std::swap(notStartedTiles_[highestTileIndex], notStartedTiles_.back());
-    notStartedTiles_.pop_back();
-    return tileIndex;
+    mergingThread_ = thread(&VoxelTree::mergeTiles, this);
+    pipelineStarted_ = true;
 }
 
-void VoxelTree::mergeTiles()
+void VoxelTree::updateBuild()
 {
-    // Keep looking for tiles to merge until finished
-    while(mergedTiles_ < totalTiles())
+    // Follow the light through its keyframes
+    updateKeyframeBlend();
+    
+    if(pipelineStarted_ == false)
     {
-        // Look for a finished builder
-        activeTilesMutex_.lock();
-        VoxelBuilder* builder = findFinishedBuilder();
-        activeTilesMutex_.unlock();
-        
-        if(builder == NULL)
+        startPipeline();
+    }
+    
+    // Time the main thread's part of the build
+    QElapsedTimer frameTimer;
+    frameTimer.start();
+    int previousUploadedTiles = uploadedTiles_;
+    
+    // Keep the queued tiles in priority order as the camera moves
+    if(notStartedTiles_.empty() == false)
+    {
+        updateTilePriorities();
+    }
+    
+    // Start tiles and upload merged tiles until the budget is used.
+    // Tile starts and uploads take turns so neither is held up.
+    int stepsRun = 0;
+    while(true)
+    {
+        VoxelBuildStep step = uploadFirst_ ? nextUploadStep() : nextTileStartStep();
+        if(step == VoxelBuildStep::None)
         {
-            continue;
+            step = uploadFirst_ ? nextTileStartStep() : nextUploadStep();
+        }
+    
+        if(step == VoxelBuildStep::None)
+        {
+            break;
         }
         
-        // Gather the subtree information
-        int tile = builder->tileIndex();
-        uint32_t* subtree = (uint32_t*)builder->tree();
-        VoxelPointer subtreeRoot = builder->rootAddress();
-
-        // Write the tree to the combined tree and store the root node location
-        VoxelPointer ptr = voxelWriter_.writeTree(subtree, subtreeRoot, tileResolution_);
-        voxelWriter_.setRootNodePointer(tile, ptr);
+        // Leave the step for a later frame if it is expected
+        // to exceed the budget, unless nothing has run yet
+        float elapsed = frameTimer.nsecsElapsed() / 1000000.0;
+        float expected = buildStepTimes_[(int)step];
+        if(stepsRun > 0 && buildFrameBudget_ > 0.0 && elapsed + expected > buildFrameBudget_)
+        {
+            break;
+        }
         
-        // The builder is no longer needed
-        delete builder;
+        runBuildStep(step);
+        stepsRun ++;
+        uploadFirst_ = !uploadFirst_;
         
-        // Update the merged tiles count
-        mergedTiles_ ++;
+        // Expect the step to take about as long as it recently did
+        float stepTime = frameTimer.nsecsElapsed() / 1000000.0 - elapsed;
+        buildStepTimes_[(int)step] = (expected == 0.0) ? stepTime : expected * 0.75 + stepTime * 0.25;
     }
-}
-
-VoxelBuilder* VoxelTree::findFinishedBuilder()
-{
-    // Look for a builder that has finished
-    for(unsigned int i = 0; i < activeTiles_.size(); ++i)
+    
+    // Update the uniform buffer once for all of the frame's uploads
+    if(uniformBufferDirty_)
     {
-        // Get the builder
-        VoxelBuilder* builder = activeTiles_[i];
+        updateUniformBuffer();
+        uniformBufferDirty_ = false;
+    }
+    
+    // Record the time spent this frame and the memory in use
+    float frameTime = frameTimer.nsecsElapsed() / 1000000.0;
+    buildFrameTime_ = buildFrameTime_ * 0.9 + frameTime * 0.1;
+    peakBuildFrameTime_ = std::max(peakBuildFrameTime_, frameTime);
+    totalBuildTime_ += frameTime;
+    peakBuildMemory_ = std::max(peakBuildMemory_, buildMemoryBytes());
         
-        // Check the state is Done
-        if(builder->buildState() == VoxelBuilderState::Done)
-        {
-            // Remove the builder from the active list
-            std::swap(activeTiles_[i], activeTiles_.back());
-            activeTiles_.pop_back();
+    // Output build stats if now finished
+    if(uploadedTiles_ != previousUploadedTiles && uploadedTiles_ == requestedTiles_)
+    {
+        auto time = buildTimer_.elapsed();
+        printf("Tree construction finished in %lld ms \n", time);
+        printf("Main thread build time %.0f ms, at most %.1f ms per frame (%.1f ms budget) \n",
+               totalBuildTime_, peakBuildFrameTime_, buildFrameBudget_);
+        printf("Build memory at most %zu MB (%d MB budget) \n",
+               peakBuildMemory_ / (1024 * 1024), buildMemoryBudgetMB());
+        printf("Reused %d of %d build buffers \n",
+               VoxelBufferPool::reusedBuffers(), VoxelBufferPool::acquiredBuffers());
+        
+        // Later builds replace tiles, leaving nodes to be collected
+        firstBuildComplete_ = true;
+        
+        // Free the buffers kept for later tiles
+        VoxelBufferPool::trim();
             
-            return builder;
+        // Deterministic builds can be compared with earlier builds
+        if(deterministicBuild_)
+        {
+            printf("Tree fingerprint %016llx, buffer checksum %016llx \n",
+                   (unsigned long long)fingerprint(), (unsigned long long)checksum());
         }
     }
-    
-    // No builders are finished
-    return NULL;
-}
-
-void VoxelTree::updateBuffers()
-{
-    updateUniformBuffer();
-    updateTreeBuffer();
 }
 
-void VoxelTree::updateUniformBuffer()
+VoxelBuildStep VoxelTree::nextTileStartStep()
 {
-    // Cover the scene witht the shadowmap and get the world to shadow matrix
-    shadowMap_.setLightSpaceBounds(sceneBoundsLightSpace_);
-    Matrix4x4 worldToShadow = shadowMap_.worldToShadowMatrix(0);
+    // Finish a render that is part way through before any other,
+    // as every tile renders into the same shadow map
+    for(unsigned int i = 0; i < readbacks_.size(); ++i)
+    {
+        if(readbacks_[i].renderedInstances > 0)
+        {
+            nextReadback_ = i;
+            return readbacks_[i].step;
+        }
+    }
     
-    // Scale the world to shadow matrix by the total voxel resolution
-    Vector3 scale;
-    scale.x = treeResolution_;
-    scale.y = treeResolution_;
-    scale.z = tileResolution_; // The trees are only tiled in x and y
-    worldToShadow = Matrix4x4::scale(scale) * worldToShadow;
-    
-    // Update the uniform buffer
-    VoxelsUniformBuffer buffer;
-    buffer.worldToVoxels = worldToShadow;
-    buffer.voxelTreeHeight = log2(tileResolution_);
-    buffer.tileSubdivisions = tileSubdivisions();
-    buffer.pcfSampleCount = pcfKernelSize_ * pcfKernelSize_;
-    buffer.pcfLookups = ((pcfKernelSize_ + 7) / 8) * ((pcfKernelSize_ + 7) / 8);
+    // Find the earliest started tile and a free slot
+    int oldest = -1;
+    int free = -1;
+    for(unsigned int i = 0; i < readbacks_.size(); ++i)
+    {
+        const VoxelTileReadback &readback = readbacks_[i];
+        if(readback.step == VoxelBuildStep::None)
+        {
+            free = i;
+        }
+        else if(oldest < 0 || readback.sequence < readbacks_[oldest].sequence)
+        {
+            oldest = i;
+        }
+    }
     
-    // Precompute PCF offsets and bitmasks
-    for(int i = 0; i < 64; ++i)
+    // Tiles are read back in the order they were started. The depths
+    // are copied once the GPU has read them back, and the builder is
+    // created once the mip stage has room for it.
+    if(oldest >= 0)
     {
-        // Get the x and y coords
-        int x = i / 8;
-        int y = i % 8;
-        
-        // Find the leaves used in the lookup
-        int lookupIndex = 0;
-        
-        // Consider a range of possible offsets
-        // Always offset by a full leaf tile (8 places).
-        for(int xOffset = -32; xOffset <= 32; xOffset+= 8)
+        const VoxelTileReadback &readback = readbacks_[oldest];
+        bool ready = true;
+        if(readback.step == VoxelBuildStep::ReadEntryDepths)
         {
-            for(int yOffset = -32; yOffset <= 32; yOffset+= 8)
-            {
-                // Get the bitmask at this offset
-                uint64_t bitmask = pcfBitmask(x - xOffset, y - yOffset);
-                
-                if(bitmask != 0)
-                {
-                    // Bitmask is non-zero. Include it in the filter kernel.
-                    auto offsetData = &buffer.pcfOffsets[i*9 + lookupIndex];
-                    offsetData->xOffset = xOffset;
-                    offsetData->yOffset = yOffset;
-                    offsetData->bitmaskHigh = bitmask >> 32;
-                    offsetData->bitmaskLow = (uint32_t)bitmask;
-                    
-                    lookupIndex ++;
-                }
-            }
+            ready = (glClientWaitSync(readback.fence, 0, 0) != GL_TIMEOUT_EXPIRED);
+        }
+        else if(readback.step == VoxelBuildStep::ReadExitDepths)
+        {
+            ready = (mipQueue_.full() == false);
         }
         
-        // There should be the same number of lookups for each leaf index.
-        assert(lookupIndex == (int)buffer.pcfLookups);
+        if(ready && readback.step != VoxelBuildStep::RenderExitDepths)
+        {
+            nextReadback_ = oldest;
+            return readback.step;
+        }
     }
     
-    uniformManager_->updateVoxelBuffer(&buffer, sizeof(VoxelsUniformBuffer));
-}
-
-uint64_t VoxelTree::pcfBitmask(int kernelX, int kernelY) const
-{
-    uint64_t bitmask = 0;
-    for(int i = 0; i < 64; ++i)
+    // Render the exit depths of tiles that only have their entry depths
+    for(unsigned int i = 0; i < readbacks_.size(); ++i)
     {
-        // Get the x and y coords
-        int coordX = i / 8;
-        int coordY = i % 8;
-        
-        // Compute whether the coord is in the filter kernel
-        if(coordX >= kernelX - pcfKernelSize_/2 && coordX <= kernelX + pcfKernelSize_/2
-           && coordY >= kernelY - pcfKernelSize_/2 && coordY <= kernelY + pcfKernelSize_/2)
+        if(readbacks_[i].step == VoxelBuildStep::RenderExitDepths)
         {
-            bitmask |= ((uint64_t)1) << i;
+            nextReadback_ = i;
+            return VoxelBuildStep::RenderExitDepths;
         }
     }
     
-    return bitmask;
+    // Refit keyframes before starting more tiles. Their tiles are
+    // queued once they are refitted.
+    if(refits_.empty() == false)
+    {
+        return VoxelBuildStep::RefitKeyframe;
+    }
+    
+    // Start another tile if a slot is free, and neither the
+    // in-flight limit nor the memory budget is met
+    int activeTiles = startedTiles_ - mergedTiles_;
+    if(free >= 0 && activeTiles < tilesInFlightLimit() && startedTiles_ < requestedTiles_
+       && hasBuildMemoryFor(notStartedTiles_.top()))
+    {
+        nextReadback_ = free;
+        return VoxelBuildStep::RenderEntryDepths;
+    }
+        
+    return VoxelBuildStep::None;
 }
 
-void VoxelTree::updateTreeBuffer()
+VoxelBuildStep VoxelTree::nextUploadStep() const
 {
-    // Update the uploaded tiles count
-    uploadedTiles_ = mergedTiles_;
+    // Reupload the tree to the gpu if more tiles have finished
+    if(uploadedTiles_ == mergedTiles_)
+    {
+        return VoxelBuildStep::None;
+    }
     
-    // Get the current tree data
-    const void* treeData = voxelWriter_.data();
-    size_t treeSizeBytes = voxelWriter_.dataSizeBytes();
+    // Compacting moves the uploaded nodes
+    size_t sizeWords = committedSizeWords_.load(std::memory_order_acquire);
+    if(compactions_ != uploadedCompactions_ || sizeWords > bufferCapacityWords_)
+    {
+        return VoxelBuildStep::UploadTree;
+    }
     
-    // Create the buffer to hold the tree
-    glBufferData(GL_TEXTURE_BUFFER, treeSizeBytes, treeData, GL_STATIC_DRAW);
+    // Upload any large amount of new nodes in parts before the root
+    // entries that point at them. The size can be out of date until
+    // the writer is locked, so is checked again by the step.
+    if(sizeWords > uploadedSizeWords_ && (sizeWords - uploadedSizeWords_) * 4 > UploadStepBytes)
+    {
+        return VoxelBuildStep::UploadNodes;
+    }
+    
+    return VoxelBuildStep::UploadRootEntries;
 }
 
-Bounds VoxelTree::computeSceneBoundsLightSpace() const
+void VoxelTree::runBuildStep(VoxelBuildStep step)
 {
-    // Get the world to light space transformation matrix (without translation)
-    Matrix4x4 worldToLight = scene_->mainLight()->worldToLocal();
-    worldToLight.set(0, 3, 0.0);
-    worldToLight.set(1, 3, 0.0);
-    worldToLight.set(2, 3, 0.0);
+    switch(step)
+    {
+        case VoxelBuildStep::RefitKeyframe:
+            refitKeyframeStep();
+            break;
+        case VoxelBuildStep::RenderEntryDepths:
+            renderTileEntryDepths(readbacks_[nextReadback_]);
+            break;
+        case VoxelBuildStep::RenderExitDepths:
+            renderTileExitDepths(readbacks_[nextReadback_]);
+            break;
+        case VoxelBuildStep::ReadEntryDepths:
+            readTileEntryDepths(readbacks_[nextReadback_]);
+            break;
+        case VoxelBuildStep::ReadExitDepths:
+            createTileBuilder(readbacks_[nextReadback_]);
+            break;
+        case VoxelBuildStep::UploadNodes:
+            uploadNewNodes();
+            break;
+        case VoxelBuildStep::UploadRootEntries:
+            uploadRootEntries();
+            break;
+        case VoxelBuildStep::UploadTree:
+            uploadTreePart();
+            break;
+        default:
+            assert(false);
+            break;
+    }
+}
+
+int VoxelTree::updateStaticGeometry()
+{
+    // Instances are only added when the scene is loaded, so each one is
+    // identified by its index. Most frames change nothing, so the change
+    // counts are checked before anything is recorded.
+    const vector<MeshInstance> &sceneInstances = scene_->meshInstances();
+    assert(sceneInstances.size() == staticInstances_.size());
     
-    // Create a Bounds containing the origin only.
-    Bounds bounds = Bounds(Vector3::zero(), Vector3::zero());
+    bool changed = false;
+    for(unsigned int i = 0; i < sceneInstances.size() && changed == false; ++i)
+    {
+        changed = staticInstances_[i].matches(sceneInstances[i]) == false;
+    }
     
-    // Expand the scene bounds to cover each mesh
-    const vector<MeshInstance> &instances = scene_->meshInstances();
-    for(auto instance = instances.begin(); instance != instances.end(); ++instance)
+    // Outgrown keyframes may still be waiting for their light's staging keyframe
+    if(changed == false)
     {
-        // Skip objects that are not static
-        if(instance->isStatic() == false)
+        return startKeyframeReplacements();
+    }
+    
+    // Keyframes whose scene bounds no longer cover the static geometry
+    vector<bool> changedTiles(totalTiles(), false);
+    vector<bool> outgrownKeyframes(keyframes_.size(), false);
+    for(unsigned int i = 0; i < sceneInstances.size(); ++i)
+    {
+        if(staticInstances_[i].matches(sceneInstances[i]))
+        {
+            continue;
+        }
+        
+        VoxelStaticInstance previous = staticInstances_[i];
+        staticInstances_[i] = recordStaticInstance(sceneInstances[i]);
+        const VoxelStaticInstance &instance = staticInstances_[i];
+        
+        // Rebuild the tiles covering both the old and new location.
+        // Spare keyframes are rebuilt in full when they are next used,
+        // as are keyframes being refitted. Object trees only contain
+        // their own instance.
+        for(unsigned int k = 0; k < keyframes_.size(); ++k)
+        {
+            if(isSpareKeyframe(k) || isObjectKeyframe(k) || isRefittingKeyframe(k))
+            {
+                continue;
+            }
+            
+            if(previous.isStatic)
+            {
+                findOverlappingTiles(k, previous.boundsLightSpace[k], changedTiles);
+            }
+            
+            if(instance.isStatic)
+            {
+                findOverlappingTiles(k, instance.boundsLightSpace[k], changedTiles);
+                
+                // Local light keyframes cover their range rather than the scene
+                if(keyframes_[k].perspective == false && keyframes_[k].sceneBoundsLightSpace.contains(instance.boundsLightSpace[k]) == false)
+                {
+                    outgrownKeyframes[k] = true;
+                }
+            }
+        }
+    }
+    
+    // Refits measure the geometry again, as it may have
+    // moved after they measured it
+    restartKeyframeRefits();
+    
+    // Refit the keyframes the static geometry has moved out of.
+    // All of their tiles move, so they are rebuilt in full.
+    int refitTiles = 0;
+    for(unsigned int l = 0; l < lights_.size(); ++l)
+    {
+        const VoxelLight &light = lights_[l];
+        if(light.rotatable)
+        {
+            // Rebuild into the hidden keyframe for the light's current rotation.
+            // The displayed keyframe is shown until the rebuild is finished.
+            if(outgrownKeyframes[light.displayedKeyframe] || (light.rebuildKeyframe >= 0 && outgrownKeyframes[light.rebuildKeyframe]))
+            {
+                rebuildKeyframe(l, scene_->lights()[light.sceneLight].rotation());
+                refitTiles += keyframeEndTile(light.rebuildKeyframe) - keyframeFirstTile(light.rebuildKeyframe);
+            }
+        }
+        else if(light.stagingKeyframe >= 0)
+        {
+            // Keyframed lights refit one keyframe at a time into their staging
+            // keyframe. The outgrown keyframe is displayed until it is replaced.
+            if(light.replacedKeyframe >= 0 && outgrownKeyframes[light.stagingKeyframe])
+            {
+                refitKeyframe(light.stagingKeyframe, keyframes_[light.replacedKeyframe].lightRotation);
+                refitTiles += keyframeEndTile(light.stagingKeyframe) - keyframeFirstTile(light.stagingKeyframe);
+            }
+            
+            for(auto k = light.rotationKeyframes.begin(); k != light.rotationKeyframes.end(); ++k)
+            {
+                if(outgrownKeyframes[*k] && *k != light.replacedKeyframe
+                   && std::find(light.outgrownKeyframes.begin(), light.outgrownKeyframes.end(), *k) == light.outgrownKeyframes.end())
+                {
+                    lights_[l].outgrownKeyframes.push_back(*k);
+                }
+            }
+        }
+        else
+        {
+            // Other keyframes are refitted in place
+            for(int k = light.firstKeyframe; k < light.firstKeyframe + light.keyframeCount; ++k)
+            {
+                if(outgrownKeyframes[k])
+                {
+                    refitKeyframe(k, keyframes_[k].lightRotation);
+                    refitTiles += keyframeEndTile(k) - keyframeFirstTile(k);
+                }
+            }
+        }
+    }
+    
+    refitTiles += startKeyframeReplacements();
+    
+    // Queue the changed tiles that are not already waiting to be started
+    vector<int> tiles;
+    for(int tile = 0; tile < totalTiles(); ++tile)
+    {
+        if(changedTiles[tile] && notStartedTiles_.contains(tile) == false)
+        {
+            tiles.push_back(tile);
+        }
+    }
+    
+    if(tiles.empty() == false)
+    {
+        printf("Static geometry changed. Rebuilding %d tiles \n", (int)tiles.size());
+        queueTileBuilds(tiles);
+    }
+    
+    return tiles.size() + refitTiles;
+}
+
+int VoxelTree::updateLightRotations()
+{
+    int rebuilds = 0;
+    for(unsigned int i = 0; i < lights_.size(); ++i)
+    {
+        VoxelLight &light = lights_[i];
+        if(light.rotatable == false)
+        {
+            continue;
+        }
+        
+        Quaternion rotation = scene_->lights()[light.sceneLight].rotation();
+        float displayedAngle = Quaternion::angle(rotation, keyframes_[light.displayedKeyframe].lightRotation);
+        
+        // Stop any rebuild if the light is back at the displayed rotation
+        if(displayedAngle < RebuildAngle)
+        {
+            if(light.rebuildKeyframe >= 0)
+            {
+                cancelKeyframeBuilds(light.rebuildKeyframe);
+                light.rebuildKeyframe = -1;
+            }
+            
+            continue;
+        }
+        
+        // Let a running rebuild finish while it is still closer to the light
+        // than the displayed keyframe, so slow movement is not restarted.
+        if(light.rebuildKeyframe >= 0)
+        {
+            float rebuildAngle = Quaternion::angle(rotation, keyframes_[light.rebuildKeyframe].lightRotation);
+            if(rebuildAngle < RebuildAngle || (rebuildAngle < displayedAngle && rebuildAngle < MaxRebuildLag))
+            {
+                continue;
+            }
+        }
+        
+        rebuildKeyframe(i, rotation);
+        rebuilds ++;
+    }
+    
+    return rebuilds;
+}
+
+void VoxelTree::updateObjectTrees()
+{
+    // Object trees are built for the main light
+    const vector<MeshInstance> &instances = scene_->meshInstances();
+    Quaternion lightRotation = scene_->lights()[lights_[0].sceneLight].rotation();
+    objectShadows_.assign(instances.size(), false);
+    
+    bool changed = false;
+    for(unsigned int i = 0; i < objectTrees_.size(); ++i)
+    {
+        VoxelObjectTree &tree = objectTrees_[i];
+        const MeshInstance &instance = instances[tree.meshInstance];
+        Quaternion rotation = instance.rotation();
+        Vector3 scale = instance.scale();
+        
+        // Translation is followed by moving the tree. Other changes need a rebuild.
+        bool lightRotated = Quaternion::angle(lightRotation, keyframes_[tree.keyframe].lightRotation) >= RebuildAngle;
+        bool transformChanged = Quaternion::angle(rotation, tree.bakeRotation) >= ObjectRotationTolerance
+            || (scale - tree.bakeScale).sqrMagnitude() > 0.0;
+        
+        // Continuously rotating instances are left to the shadow map
+        // rather than rebuilt every frame.
+        bool atRest = memcmp(&rotation, &tree.previousRotation, sizeof(Quaternion)) == 0
+            && memcmp(&scale, &tree.previousScale, sizeof(Vector3)) == 0;
+        tree.previousRotation = rotation;
+        tree.previousScale = scale;
+        
+        if(tree.built && (lightRotated || (transformChanged && atRest)))
+        {
+            rebuildObjectTree(i, lightRotation);
+        }
+        
+        tree.valid = tree.built && !lightRotated && !transformChanged;
+        objectShadows_[tree.meshInstance] = tree.valid;
+        
+        // Only upload the buffer when a tree is enabled, disabled or moved
+        changed = updateObjectCascade(i) || changed;
+    }
+    
+    if(changed)
+    {
+        uniformManager_->updateVoxelBuffer(&uniformBuffer_, sizeof(VoxelsUniformBuffer));
+    }
+}
+
+bool VoxelTree::updateObjectCascade(int index)
+{
+    const VoxelObjectTree &tree = objectTrees_[index];
+    int cascade = keyframes_[tree.keyframe].firstCascade;
+    VoxelsUniformBuffer::Cascade &bufferCascade = uniformBuffer_.cascades[cascade];
+    VoxelsUniformBuffer::Cascade previous = bufferCascade;
+    
+    // Disabled trees are skipped by the voxel sampling shader
+    bufferCascade.maxDistance = tree.valid ? 1000000000.0 : -1.0;
+    
+    // Transform receivers into the instance's space at build time
+    if(tree.valid)
+    {
+        const MeshInstance &instance = scene_->meshInstances()[tree.meshInstance];
+        bufferCascade.worldToVoxels = cascadeWorldToVoxels(cascade) * tree.bakeLocalToWorld * instance.worldToLocal();
+    }
+    
+    return memcmp(&previous, &bufferCascade, sizeof(previous)) != 0;
+}
+
+bool VoxelTree::hasVoxelShadows(int meshInstance) const
+{
+    return meshInstance < (int)objectShadows_.size() && objectShadows_[meshInstance];
+}
+
+void VoxelTree::recordTileDepths(const char* fileName)
+{
+    // Tiles are appended to the file as they are started
+    FILE* file = fopen(fileName, "wb");
+    if(file == NULL)
+    {
+        printf("Failed to record tile depths to %s \n", fileName);
+        return;
+    }
+    
+    fclose(file);
+    depthRecordingFile_ = fileName;
+    recordedTiles_ = 0;
+}
+
+VoxelTreeSampler* VoxelTree::createSampler()
+{
+    // Use the nearer of the keyframes the main light is between
+    const VoxelsUniformBuffer::Light &light = uniformBuffer_.lights[0];
+    int keyframe = (light.keyframeBlend > 0.5) ? light.nextKeyframe : light.currentKeyframe;
+    
+    const VoxelsUniformBuffer::Cascade* firstCascade = uniformBuffer_.cascades + keyframes_[keyframe].firstCascade;
+    vector<VoxelsUniformBuffer::Cascade> cascades(firstCascade, firstCascade + keyframes_[keyframe].cascadeCount);
+    
+    // The tree cannot be compacted while it is copied
+    voxelWriterMutex_.lock();
+    VoxelTreeSampler* sampler = new VoxelTreeSampler((const uint32_t*)voxelWriter_.data(), committedSizeWords_.load(std::memory_order_acquire), cascades, voxelWriter_.emptyNode());
+    voxelWriterMutex_.unlock();
+    
+    return sampler;
+}
+
+VoxelTreeStats* VoxelTree::computeStats()
+{
+    // The tree cannot be compacted while it is walked
+    voxelWriterMutex_.lock();
+    VoxelTreeStats* stats = new VoxelTreeStats((const uint32_t*)voxelWriter_.data(), committedSizeWords_.load(std::memory_order_acquire), totalTiles(), voxelWriter_.emptyNode(), originalSizeBytes());
+    voxelWriterMutex_.unlock();
+    
+    stats->setKeyframeRebuilds(keyframeRebuilds_, keyframeRebuildTiles_);
+    
+    // Tiles with few shadow casters are built at a reduced resolution
+    int reducedTiles = 0;
+    for(int tile = 0; tile < totalTiles(); ++tile)
+    {
+        if(tileResolutions_[tile] < tileCascade(tile).tileResolution)
+        {
+            reducedTiles ++;
+        }
+    }
+    
+    stats->setReducedResolutionTiles(reducedTiles);
+    
+    return stats;
+}
+
+void VoxelTree::rebuildObjectTree(int index, const Quaternion &lightRotation)
+{
+    // The instance transform is recorded once the tile is started
+    VoxelObjectTree &tree = objectTrees_[index];
+    cancelKeyframeBuilds(tree.keyframe);
+    keyframes_[tree.keyframe].lightRotation = lightRotation;
+    
+    vector<int> tiles;
+    for(int tile = keyframeFirstTile(tree.keyframe); tile < keyframeEndTile(tree.keyframe); ++tile)
+    {
+        tiles.push_back(tile);
+    }
+    
+    queueTileBuilds(tiles);
+}
+
+void VoxelTree::prepareObjectTree(int index)
+{
+    VoxelObjectTree &tree = objectTrees_[index];
+    const MeshInstance &instance = scene_->meshInstances()[tree.meshInstance];
+    tree.bakeLocalToWorld = instance.localToWorld();
+    tree.bakeRotation = instance.rotation();
+    tree.bakeScale = instance.scale();
+    
+    // Fit the tree's single cascade around the instance
+    VoxelKeyframe &keyframe = keyframes_[tree.keyframe];
+    keyframe.sceneBoundsLightSpace = objectBoundsLightSpace(index);
+    cascades_[keyframe.firstCascade].boundsLightSpace = keyframe.sceneBoundsLightSpace;
+}
+
+void VoxelTree::rebuildKeyframe(int lightIndex, const Quaternion &rotation)
+{
+    // Build into the keyframe that is not displayed
+    VoxelLight &light = lights_[lightIndex];
+    int k = (light.displayedKeyframe == light.firstKeyframe) ? light.firstKeyframe + 1 : light.firstKeyframe;
+    
+    light.rebuildKeyframe = k;
+    refitKeyframe(k, rotation);
+    
+    keyframeRebuilds_ ++;
+    keyframeRebuildTiles_ += keyframeEndTile(k) - keyframeFirstTile(k);
+}
+
+void VoxelTree::refitKeyframe(int k, const Quaternion &rotation)
+{
+    // Stop building the keyframe's previous rotation and bounds
+    cancelKeyframeBuilds(k);
+    
+    // Measure the static geometry in the new light space over the
+    // next build steps. The keyframe is not built until then.
+    keyframes_[k].lightRotation = rotation;
+    refits_.push_back(VoxelKeyframeRefit(k));
+}
+
+void VoxelTree::refitKeyframeStep()
+{
+    VoxelKeyframeRefit &refit = refits_.front();
+    VoxelTraceScope scope("Refit Keyframe", refit.keyframe);
+    
+    // Measure the next few static instances
+    const vector<MeshInstance> &instances = scene_->meshInstances();
+    int measuredVertices = 0;
+    while(refit.nextInstance < (int)instances.size() && measuredVertices < RefitStepVertices)
+    {
+        const MeshInstance &instance = instances[refit.nextInstance];
+        if(instance.isStatic())
+        {
+            if(refit.measuringCasters)
+            {
+                addCasterAreas(refit.keyframe, instance, refit.casterLayers);
+            }
+            else
+            {
+                // Record the instance's bounds for the new rotation
+                // and expand the scene bounds to cover them
+                Bounds bounds = instanceBoundsLightSpace(instance, refit.keyframe);
+                staticInstances_[refit.nextInstance].boundsLightSpace[refit.keyframe] = bounds;
+                refit.sceneBounds.expandToCover(bounds.min());
+                refit.sceneBounds.expandToCover(bounds.max());
+            }
+            
+            measuredVertices += instance.mesh()->verticesCount();
+        }
+        
+        refit.nextInstance ++;
+    }
+    
+    if(refit.nextInstance < (int)instances.size())
+    {
+        return;
+    }
+    
+    // Move the cascades to the measured scene, then
+    // measure the caster density over their tiles
+    int k = refit.keyframe;
+    if(refit.measuringCasters == false)
+    {
+        keyframes_[k].sceneBoundsLightSpace = refit.sceneBounds;
+        updateCascadeBounds(k);
+        refit.measuringCasters = true;
+        refit.nextInstance = 0;
+        refit.casterLayers.assign(totalTiles(), 0.0);
+        return;
+    }
+    
+    finishTileResolutions(k, refit.casterLayers);
+    refits_.erase(refits_.begin());
+    
+    // The new cascade matrices are not used until the keyframe is displayed
+    uniformBufferDirty_ = true;
+    
+    vector<int> tiles;
+    for(int tile = keyframeFirstTile(k); tile < keyframeEndTile(k); ++tile)
+    {
+        tiles.push_back(tile);
+    }
+    
+    queueTileBuilds(tiles);
+}
+
+bool VoxelTree::isRefittingKeyframe(int keyframe) const
+{
+    for(auto refit = refits_.begin(); refit != refits_.end(); ++refit)
+    {
+        if(refit->keyframe == keyframe)
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+void VoxelTree::restartKeyframeRefits()
+{
+    for(auto refit = refits_.begin(); refit != refits_.end(); ++refit)
+    {
+        *refit = VoxelKeyframeRefit(refit->keyframe);
+    }
+}
+
+void VoxelTree::cancelKeyframeBuilds(int keyframe)
+{
+    int firstTile = keyframeFirstTile(keyframe);
+    int endTile = keyframeEndTile(keyframe);
+    
+    // Stop starting the keyframe's tiles
+    for(auto readback = readbacks_.begin(); readback != readbacks_.end(); ++readback)
+    {
+        if(readback->tile >= firstTile && readback->tile < endTile)
+        {
+            cancelTileStart(*readback);
+        }
+    }
+    
+    // Drop the keyframe's refit if its tiles are not queued yet
+    for(auto refit = refits_.begin(); refit != refits_.end(); ++refit)
+    {
+        if(refit->keyframe == keyframe)
+        {
+            refits_.erase(refit);
+            break;
+        }
+    }
+    
+    // Remove the keyframe's tiles from the queue
+    for(int tile = firstTile; tile < endTile; ++tile)
+    {
+        if(notStartedTiles_.contains(tile))
+        {
+            notStartedTiles_.remove(tile);
+            requestedTiles_ --;
+        }
+    }
+    
+    // Cancel the running builders. They are discarded once finished,
+    // including any that are already being merged.
+    activeTilesMutex_.lock();
+    for(auto builder = activeTiles_.begin(); builder != activeTiles_.end(); ++builder)
+    {
+        if((*builder)->tileIndex() >= firstTile && (*builder)->tileIndex() < endTile)
+        {
+            (*builder)->cancel();
+        }
+    }
+    
+    // The tiles are empty until rebuilt
+    voxelWriterMutex_.lock();
+    for(int tile = firstTile; tile < endTile; ++tile)
+    {
+        latestBuilders_[tile] = NULL;
+        voxelWriter_.resetRootNodePointer(tile);
+    }
+    
+    voxelWriterMutex_.unlock();
+    activeTilesMutex_.unlock();
+    
+    // Object trees are not sampled until rebuilt
+    if(isObjectKeyframe(keyframe))
+    {
+        objectTrees_[keyframe - firstObjectKeyframe_].built = false;
+    }
+}
+
+int VoxelTree::startKeyframeReplacements()
+{
+    int refitTiles = 0;
+    for(auto light = lights_.begin(); light != lights_.end(); ++light)
+    {
+        if(light->replacedKeyframe >= 0 || light->outgrownKeyframes.empty())
+        {
+            continue;
+        }
+        
+        // Build the keyframe's refit in the staging keyframe,
+        // which drops the tiles of the keyframe it last replaced
+        light->replacedKeyframe = light->outgrownKeyframes.front();
+        light->outgrownKeyframes.erase(light->outgrownKeyframes.begin());
+        refitKeyframe(light->stagingKeyframe, keyframes_[light->replacedKeyframe].lightRotation);
+        refitTiles += keyframeEndTile(light->stagingKeyframe) - keyframeFirstTile(light->stagingKeyframe);
+    }
+    
+    return refitTiles;
+}
+
+bool VoxelTree::swapRebuiltKeyframes()
+{
+    bool swapped = false;
+    for(unsigned int i = 0; i < lights_.size(); ++i)
+    {
+        // Wait for every tile of the cascade covering the entire scene
+        VoxelLight &light = lights_[i];
+        if(light.rebuildKeyframe >= 0)
+        {
+            const VoxelKeyframe &keyframe = keyframes_[light.rebuildKeyframe];
+            const VoxelCascade &sceneCascade = cascades_[keyframe.firstCascade + keyframe.cascadeCount - 1];
+            if(areTilesBuilt(sceneCascade.firstTile, sceneCascade.firstTile + sceneCascade.tileCount()))
+            {
+                light.displayedKeyframe = light.rebuildKeyframe;
+                light.rebuildKeyframe = -1;
+                swapped = true;
+            }
+        }
+        
+        // Staging keyframes replace a displayed keyframe once every tile
+        // is built, as the finer cascades have no keyframe to fall back to
+        int staging = light.stagingKeyframe;
+        if(light.replacedKeyframe >= 0 && isRefittingKeyframe(staging) == false
+           && areTilesBuilt(keyframeFirstTile(staging), keyframeEndTile(staging)))
+        {
+            for(auto k = light.rotationKeyframes.begin(); k != light.rotationKeyframes.end(); ++k)
+            {
+                if(*k == light.replacedKeyframe)
+                {
+                    *k = staging;
+                }
+            }
+            
+            light.stagingKeyframe = light.replacedKeyframe;
+            light.replacedKeyframe = -1;
+            swapped = true;
+        }
+    }
+    
+    return swapped;
+}
+
+bool VoxelTree::areTilesBuilt(int firstTile, int endTile) const
+{
+    for(int tile = firstTile; tile < endTile; ++tile)
+    {
+        if(voxelWriter_.rootEntry(tile).root == voxelWriter_.emptyNode())
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool VoxelTree::isSpareKeyframe(int keyframe) const
+{
+    if(isObjectKeyframe(keyframe))
+    {
+        return false;
+    }
+    
+    const VoxelLight &light = lights_[keyframes_[keyframe].light];
+    if(keyframe == light.stagingKeyframe)
+    {
+        return light.replacedKeyframe < 0;
+    }
+    
+    return light.rotatable && keyframe != light.displayedKeyframe && keyframe != light.rebuildKeyframe;
+}
+
+int VoxelTree::keyframeFirstTile(int keyframe) const
+{
+    return cascades_[keyframes_[keyframe].firstCascade].firstTile;
+}
+
+int VoxelTree::keyframeEndTile(int keyframe) const
+{
+    const VoxelCascade &lastCascade = cascades_[keyframes_[keyframe].firstCascade + keyframes_[keyframe].cascadeCount - 1];
+    return lastCascade.firstTile + lastCascade.tileCount();
+}
+
+void VoxelTree::queueTileBuilds(const vector<int> &tiles)
+{
+    // Restart the build timers if the tree was finished
+    if(uploadedTiles_ == requestedTiles_)
+    {
+        buildTimer_.restart();
+        peakBuildFrameTime_ = 0.0;
+        totalBuildTime_ = 0.0;
+        peakBuildMemory_ = 0;
+    }
+    
+    // Keyframes may have moved since the camera was last recorded.
+    // This also brings the existing queue up to date.
+    priorityCameraPositions_.clear();
+    updateTilePriorities();
+    
+    // Keep the bounds of each tile to prioritize it later
+    for(auto tile = tiles.begin(); tile != tiles.end(); ++tile)
+    {
+        const VoxelCascade &cascade = tileCascade(*tile);
+        Bounds bounds = tileBoundsLightSpace(*tile);
+        queuedTiles_[*tile].cascade = &cascade - &cascades_[0];
+        queuedTiles_[*tile].boundsMin = bounds.min();
+        queuedTiles_[*tile].boundsMax = bounds.max();
+        notStartedTiles_.push(*tile, tilePriority(*tile));
+    }
+    
+    requestedTiles_ += (int)tiles.size();
+}
+
+void VoxelTree::startTileBuild(VoxelTileReadback &readback)
+{
+    VoxelTraceScope chooseScope("Choose Tile");
+    int tileIndex = getNextTileToStart();
+    startedTiles_ ++;
+    chooseScope.end();
+    
+    VoxelTraceScope scope("Start Tile", tileIndex);
+    
+    // Object trees are built around the instance's current transform
+    int keyframeIndex = tileCascade(tileIndex).keyframe;
+    if(isObjectKeyframe(keyframeIndex))
+    {
+        prepareObjectTree(keyframeIndex - firstObjectKeyframe_);
+    }
+    
+    // Record the tile and its resolution
+    readback.tile = tileIndex;
+    readback.resolution = tileResolutions_[tileIndex];
+    readback.sequence = readbackSequence_ ++;
+    
+    // Reserve the memory the tile needs at its largest
+    reservedBuildMemory_ += tileMemoryBytes(VoxelBuildStage::Mips, readback.resolution);
+    readback.step = VoxelBuildStep::RenderEntryDepths;
+    
+    // Buffers kept for reuse count against the budget too.
+    // Free any that no longer fit beside the reserved memory.
+    if(buildMemoryBudget_ > 0)
+    {
+        size_t reserved = reservedBuildMemory_;
+        VoxelBufferPool::trim(buildMemoryBudget_ - std::min(reserved, buildMemoryBudget_));
+    }
+}
+
+void VoxelTree::renderTileEntryDepths(VoxelTileReadback &readback)
+{
+    // Free slots start the next queued tile
+    if(readback.step == VoxelBuildStep::None)
+    {
+        startTileBuild(readback);
+    }
+    
+    // The exit depths are rendered once the entry depths are
+    if(renderTileDepths(readback, false))
+    {
+        readback.step = VoxelBuildStep::RenderExitDepths;
+    }
+}
+
+void VoxelTree::renderTileExitDepths(VoxelTileReadback &readback)
+{
+    if(renderTileDepths(readback, true) == false)
+    {
+        return;
+    }
+    
+    // The depths are copied once both reads have finished
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    readback.step = VoxelBuildStep::ReadEntryDepths;
+}
+
+void VoxelTree::readTileEntryDepths(VoxelTileReadback &readback)
+{
+    readback.entryDepths = readTileDepths(readback, false);
+    readback.step = VoxelBuildStep::ReadExitDepths;
+    moveTileMemory(readback.resolution, VoxelBuildStage::Render, VoxelBuildStage::Readback);
+}
+
+void VoxelTree::createTileBuilder(VoxelTileReadback &readback)
+{
+    int tile = readback.tile;
+    int resolution = readback.resolution;
+    float* entryDepths = readback.entryDepths;
+    float* exitDepths = readTileDepths(readback, true);
+    glDeleteSync(readback.fence);
+    readback.fence = NULL;
+    readback.entryDepths = NULL;
+    readback.tile = -1;
+    readback.step = VoxelBuildStep::None;
+    
+    VoxelTraceScope scope("Start Builder", tile);
+    
+    // Keep the depths for benchmarking the builder
+    if(depthRecordingFile_.empty() == false && recordedTiles_ < MaxRecordedTiles && resolution <= MaxRecordedResolution)
+    {
+        if(::recordTileDepths(depthRecordingFile_.c_str(), tile, resolution, entryDepths, exitDepths))
+        {
+            recordedTiles_ ++;
+        }
+    }
+    
+    // Create the builder.
+    VoxelBuilder* builder = new VoxelBuilder(tile, resolution, entryDepths, exitDepths);
+    
+    // Add to the active tiles list
+    activeTilesMutex_.lock();
+    activeTiles_.push_back(builder);
+    latestBuilders_[tile] = builder;
+    activeTilesMutex_.unlock();
+    
+    // Hand it to the mip stage, which was checked to have room
+    moveTileMemory(resolution, VoxelBuildStage::Readback, VoxelBuildStage::Mips);
+    mipQueue_.push(builder);
+}
+
+void VoxelTree::cancelTileStart(VoxelTileReadback &readback)
+{
+    if(readback.step == VoxelBuildStep::None)
+    {
+        return;
+    }
+    
+    if(readback.fence != NULL)
+    {
+        glDeleteSync(readback.fence);
+        readback.fence = NULL;
+    }
+    
+    // The tile no longer counts towards the build or its memory
+    if(readback.entryDepths != NULL)
+    {
+        VoxelBufferPool::releaseFloats(readback.entryDepths, (size_t)readback.resolution * readback.resolution);
+        readback.entryDepths = NULL;
+        finishTileMemory(readback.resolution, VoxelBuildStage::Readback);
+    }
+    else
+    {
+        finishTileMemory(readback.resolution, VoxelBuildStage::Render);
+    }
+    
+    readback.tile = -1;
+    readback.step = VoxelBuildStep::None;
+    readback.renderedInstances = 0;
+    startedTiles_ --;
+    requestedTiles_ --;
+}
+
+int VoxelTree::getNextTileToStart()
+{
+    // Check there are tiles waiting to be started
+    assert(notStartedTiles_.empty() == false);
+    
+    // The queue is kept in priority order
+    return notStartedTiles_.pop();
+}
+    
+void VoxelTree::updateTilePriorities()
+{
+    // Reprioritize every queued tile if the displayed keyframes changed.
+    // This is rare, and decides which keyframe is built first.
+    vector<bool> currentCascades = findCurrentCascades();
+    bool cameraMoved = updatePriorityCamera();
+    if(currentCascades != currentCascades_)
+    {
+        currentCascades_ = currentCascades;
+        
+        // Updates reorder the queue, so copy the tiles first
+        vector<int> tiles;
+        for(int i = 0; i < notStartedTiles_.size(); ++i)
+        {
+            tiles.push_back(notStartedTiles_.tileAt(i));
+        }
+        
+        for(auto tile = tiles.begin(); tile != tiles.end(); ++tile)
+        {
+            notStartedTiles_.update(*tile, tilePriority(*tile));
+        }
+        
+        // The queue order is now up to date
+        prioritySweepRemaining_ = 0;
+        return;
+    }
+    
+    // Start a new sweep whenever the camera moves. Sweeps spread the
+    // work over several frames, so moving the camera has a small fixed
+    // cost per frame. Deterministic builds ignore the camera.
+    if(cameraMoved && deterministicBuild_ == false)
+    {
+        prioritySweepRemaining_ = totalTiles();
+    }
+    
+    int count = std::min(prioritySweepRemaining_, TilePriorityUpdatesPerFrame);
+    for(int i = 0; i < count; ++i)
+    {
+        int tile = prioritySweepTile_;
+        if(notStartedTiles_.contains(tile))
+        {
+            notStartedTiles_.update(tile, tilePriority(tile));
+        }
+        
+        prioritySweepTile_ = (tile + 1) % totalTiles();
+    }
+    
+    prioritySweepRemaining_ -= count;
+}
+
+vector<bool> VoxelTree::findCurrentCascades() const
+{
+    // Tiles in the keyframes currently being displayed are built first
+    vector<bool> currentKeyframes(keyframes_.size(), false);
+    vector<bool> currentCascades(cascades_.size(), false);
+    for(unsigned int i = 0; i < lights_.size(); ++i)
+    {
+        currentKeyframes[uniformBuffer_.lights[i].currentKeyframe] = true;
+        currentKeyframes[uniformBuffer_.lights[i].nextKeyframe] = true;
+        
+        // Rebuilt keyframes are displayed once their last cascade is built
+        if(lights_[i].rebuildKeyframe >= 0)
+        {
+            const VoxelKeyframe &keyframe = keyframes_[lights_[i].rebuildKeyframe];
+            currentCascades[keyframe.firstCascade + keyframe.cascadeCount - 1] = true;
+        }
+        
+        // Staging keyframes are displayed once all of their cascades are built
+        if(lights_[i].replacedKeyframe >= 0)
+        {
+            currentKeyframes[lights_[i].stagingKeyframe] = true;
+        }
+        
+        // All views of a local light are displayed at once
+        if(lights_[i].type != LightType::Directional)
+        {
+            for(int k = 0; k < lights_[i].keyframeCount; ++k)
+            {
+                currentKeyframes[lights_[i].firstKeyframe + k] = true;
+            }
+        }
+    }
+    
+    // Object trees are used as soon as they are built
+    for(unsigned int k = firstObjectKeyframe_; k < keyframes_.size(); ++k)
+    {
+        currentKeyframes[k] = true;
+    }
+    
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        if(currentKeyframes[cascades_[i].keyframe])
+        {
+            currentCascades[i] = true;
+        }
+    }
+    
+    return currentCascades;
+}
+
+bool VoxelTree::updatePriorityCamera()
+{
+    // Check if the camera has moved since it was recorded
+    const Camera* camera = scene_->mainCamera();
+    Matrix4x4 cameraToWorld = camera->localToWorld();
+    if(priorityCameraPositions_.size() == keyframes_.size()
+       && memcmp(priorityCameraToWorld_.elements, cameraToWorld.elements, sizeof(cameraToWorld.elements)) == 0)
+    {
+        return false;
+    }
+    
+    priorityCameraToWorld_ = cameraToWorld;
+    priorityCameraPositions_.clear();
+    priorityFrustumPlanes_.clear();
+    
+    // Get the corners of the view frustum in world space.
+    // Near corners are first, then the far corners.
+    Vector4 frustumCorners[8];
+    bool perspective = (camera->type() == CameraType::Perspective);
+    if(perspective)
+    {
+        camera->getFrustumCorners(camera->nearPlane(), frustumCorners);
+        camera->getFrustumCorners(camera->farPlane(), frustumCorners + 4);
+        for(int i = 0; i < 8; ++i)
+        {
+            frustumCorners[i] = cameraToWorld * frustumCorners[i];
+        }
+    }
+    
+    // The corners making up each face of the frustum
+    const static int faces[6][3] = { {0, 1, 2}, {4, 5, 6}, {0, 1, 4}, {2, 3, 6}, {0, 2, 4}, {1, 3, 5} };
+    
+    Vector4 cameraPosWorld = Vector4(camera->position(), 1.0);
+    for(auto keyframe = keyframes_.begin(); keyframe != keyframes_.end(); ++keyframe)
+    {
+        Matrix4x4 worldToLight = worldToLightMatrix(keyframe->lightRotation, keyframe->lightPosition);
+        priorityCameraPositions_.push_back((worldToLight * cameraPosWorld).vec3());
+        
+        if(perspective == false)
+        {
+            continue;
+        }
+        
+        // Transform the frustum into light space
+        Vector3 corners[8];
+        Vector3 centre = Vector3::zero();
+        for(int i = 0; i < 8; ++i)
+        {
+            corners[i] = (worldToLight * frustumCorners[i]).vec3();
+            centre = centre + corners[i] / 8.0;
+        }
+        
+        // Create a plane for each face, facing into the frustum
+        for(int i = 0; i < 6; ++i)
+        {
+            Vector3 a = corners[faces[i][0]];
+            Vector3 normal = Vector3::cross(corners[faces[i][1]] - a, corners[faces[i][2]] - a).normalized();
+            if(Vector3::dot(normal, centre - a) < 0.0)
+            {
+                normal = normal * -1.0;
+            }
+            
+            priorityFrustumPlanes_.push_back(Vector4(normal, -Vector3::dot(normal, a)));
+        }
+    }
+    
+    return true;
+}
+
+VoxelTilePriority VoxelTree::tilePriority(int tile) const
+{
+    const VoxelQueuedTile &queued = queuedTiles_[tile];
+    bool isCurrent = currentCascades_[queued.cascade];
+    VoxelTilePriority priority;
+    
+    // Deterministic builds use the tile index instead of the camera
+    if(deterministicBuild_)
+    {
+        priority.rank = isCurrent ? 0 : 1;
+        priority.distance = tile;
+        return priority;
+    }
+    
+    // Visible tiles in the displayed keyframes are built first
+    priority.rank = (isCurrent ? 0 : 2) + (isTileVisible(tile) ? 0 : 1);
+    
+    // Then those closest to the camera
+    int keyframe = cascades_[queued.cascade].keyframe;
+    Vector3 tileCentre = (queued.boundsMin + queued.boundsMax) * 0.5;
+    priority.distance = (priorityCameraPositions_[keyframe] - tileCentre).sqrMagnitude();
+    return priority;
+}
+
+bool VoxelTree::isTileVisible(int tile) const
+{
+    // Every tile is visible to cameras without a frustum
+    if(priorityFrustumPlanes_.empty())
+    {
+        return true;
+    }
+    
+    const VoxelQueuedTile &queued = queuedTiles_[tile];
+    int keyframe = cascades_[queued.cascade].keyframe;
+    const Vector4* planes = &priorityFrustumPlanes_[keyframe * 6];
+    
+    // The tile is outside if the corner furthest
+    // into the frustum is behind any of the planes
+    for(int i = 0; i < 6; ++i)
+    {
+        Vector3 normal = planes[i].vec3();
+        Vector3 corner(
+            (normal.x >= 0.0) ? queued.boundsMax.x : queued.boundsMin.x,
+            (normal.y >= 0.0) ? queued.boundsMax.y : queued.boundsMin.y,
+            (normal.z >= 0.0) ? queued.boundsMax.z : queued.boundsMin.z);
+        
+        if(Vector3::dot(normal, corner) + planes[i].w < 0.0)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void VoxelTree::buildTileMips()
+{
+    VoxelBuildTrace::nameThread("Mip Builder");
+    
+    while(true)
+    {
+        // Wait for a tile. The queue is closed when the tree is destroyed.
+        VoxelBuilder* builder = mipQueue_.pop();
+        if(builder == NULL)
+        {
+            return;
+        }
+        
+        // Build its mips, then wait for room in the tree stage
+        builder->buildDepthMap();
+        moveTileMemory(builder->resolution(), VoxelBuildStage::Mips, VoxelBuildStage::Tree);
+        treeQueue_.push(builder);
+    }
+}
+
+void VoxelTree::buildTileTrees()
+{
+    VoxelBuildTrace::nameThread("Tile Builder");
+    
+    while(true)
+    {
+        // Wait for a tile. The queue is closed when the tree is destroyed.
+        VoxelBuilder* builder = treeQueue_.pop();
+        if(builder == NULL)
+        {
+            return;
+        }
+        
+        // Build its tree, then wait for room in the merge stage
+        builder->buildTree();
+        moveTileMemory(builder->resolution(), VoxelBuildStage::Tree, VoxelBuildStage::Merge);
+        mergeQueue_.push(builder);
+    }
+}
+
+void VoxelTree::mergeTiles()
+{
+    VoxelBuildTrace::nameThread("Tile Merging");
+    
+    // Finished builders wait here until they can be merged
+    vector<VoxelBuilder*> finished;
+    
+    while(true)
+    {
+        // Carry on compacting the tree while there is nothing to merge
+        while(compactedWriter_ != NULL && mergeQueue_.size() == 0 && mergeQueue_.closed() == false)
+        {
+            compactTreeStep();
+        }
+        
+        // Wait for a finished tile. The queue is closed when the tree is destroyed.
+        VoxelBuilder* builder = mergeQueue_.pop();
+        if(builder == NULL)
+        {
+            return;
+        }
+        
+        finished.push_back(builder);
+        
+        // Merge every builder that is ready
+        while(true)
+        {
+            activeTilesMutex_.lock();
+            builder = findFinishedBuilder(finished);
+            bool outdated = (builder != NULL && latestBuilders_[builder->tileIndex()] != builder);
+            activeTilesMutex_.unlock();
+        
+            if(builder == NULL)
+            {
+                break;
+            }
+        
+            mergeTile(builder, outdated);
+        }
+    }
+}
+
+void VoxelTree::mergeTile(VoxelBuilder* builder, bool outdated)
+{
+    // Discard the builder if the tile was rebuilt or cancelled while it was running
+    if(outdated || builder->isCancelled())
+    {
+        finishTileMemory(builder->resolution(), VoxelBuildStage::Merge);
+        delete builder;
+        countMergedTile();
+        return;
+    }
+        
+    // Gather the subtree information
+    int tile = builder->tileIndex();
+    uint32_t* subtree = (uint32_t*)builder->tree();
+    VoxelPointer subtreeRoot = builder->rootAddress();
+    
+    // Discard the tile if it may not fit in the tree. Merging never
+    // writes more nodes than the builder's tree holds. The tile keeps
+    // its previous tree, or the empty node if it was never built.
+    if(builder->treeSizeWords() > voxelWriter_.freeSizeWords())
+    {
+        if(unmergedTiles_ == 0)
+        {
+            printf("Voxel tree is larger than its %u MB buffer. Tiles that do not fit are not merged. \n",
+                   VoxelWriter::BufferSizeMB);
+        }
+        
+        unmergedTiles_ ++;
+        finishTileMemory(builder->resolution(), VoxelBuildStage::Merge);
+        delete builder;
+        countMergedTile();
+        return;
+    }
+        
+    // Write the tree to the combined tree
+    VoxelTraceScope mergeScope("Merge Tile", tile);
+    VoxelPointer ptr = voxelWriter_.writeTree(subtree, subtreeRoot, builder->resolution());
+    mergeScope.end();
+        
+    // Store the root node location, unless the tile was cancelled
+    // or requeued while the tree was being written. Its nodes can be
+    // read by other threads once the new size is published.
+    activeTilesMutex_.lock();
+    voxelWriterMutex_.lock();
+    committedSizeWords_.store(voxelWriter_.dataSizeWords(), std::memory_order_release);
+    if(latestBuilders_[tile] == builder && builder->isCancelled() == false)
+    {
+        voxelWriter_.setRootNodePointer(tile, ptr, log2(builder->resolution()));
+    }
+        
+    voxelWriterMutex_.unlock();
+    activeTilesMutex_.unlock();
+        
+    // The builder is no longer needed
+    finishTileMemory(builder->resolution(), VoxelBuildStage::Merge);
+    delete builder;
+        
+    // Update the merged tiles count
+    countMergedTile();
+        
+    // Remove nodes that are no longer used by any tile
+    collectGarbage();
+}
+
+void VoxelTree::countMergedTile()
+{
+    // The merge thread is the only writer, so it can read the tree
+    // without holding the lock and without stalling the main thread
+    if(deterministicBuild_ && firstBuildComplete_ == false && mergedTiles_ + 1 == requestedTiles_)
+    {
+        VoxelTraceScope hashScope("Hash Tree");
+        buildFingerprint_ = voxelWriter_.fingerprint();
+        buildChecksum_ = voxelWriter_.checksum();
+    }
+    
+    mergedTiles_ ++;
+}
+
+void VoxelTree::collectGarbage()
+{
+    // The first build does not replace any nodes.
+    // The size of the tree after it is the baseline for collections.
+    if(firstBuildComplete_ == false)
+    {
+        return;
+    }
+    
+    if(collectedSizeWords_ == 0)
+    {
+        collectedSizeWords_ = voxelWriter_.dataSizeWords();
+        return;
+    }
+    
+    // Start a compaction once the rebuilt tiles have grown the tree enough
+    if(compactedWriter_ == NULL)
+    {
+        if(voxelWriter_.dataSizeWords() < collectedSizeWords_ * GarbageCollectionGrowth)
+        {
+            return;
+        }
+        
+        compactedWriter_ = new VoxelWriter();
+        compactedWriter_->reserveRootNodePointerSpace(totalTiles());
+        compactedRoots_.assign(totalTiles(), voxelWriter_.emptyNode());
+        compactedTiles_ = 0;
+    }
+    
+    compactTreeStep();
+}
+
+void VoxelTree::compactTreeStep()
+{
+    VoxelTraceScope scope("Compact Tree");
+    
+    // Read the next tiles' root entries.
+    // The main thread can reset them, so they are read under the lock.
+    int endTile = std::min(compactedTiles_ + CompactionStepTiles, totalTiles());
+    vector<VoxelRootEntry> entries;
+    voxelWriterMutex_.lock();
+    for(int tile = compactedTiles_; tile < endTile; ++tile)
+    {
+        entries.push_back(voxelWriter_.rootEntry(tile));
+    }
+    
+    voxelWriterMutex_.unlock();
+    
+    // Copy their trees. Nodes are only written by this thread,
+    // so they can be read without the lock.
+    for(int tile = compactedTiles_; tile < endTile; ++tile)
+    {
+        const VoxelRootEntry &entry = entries[tile - compactedTiles_];
+        copyCompactedTile(tile, entry.root, entry.treeHeight);
+    }
+    
+    compactedTiles_ = endTile;
+    if(compactedTiles_ == totalTiles())
+    {
+        finishCompaction();
+    }
+}
+
+void VoxelTree::copyCompactedTile(int tile, VoxelPointer root, int treeHeight)
+{
+    compactedRoots_[tile] = root;
+    
+    // Tiles that are not built point at the compacted tree's own empty node
+    if(root == voxelWriter_.emptyNode())
+    {
+        compactedWriter_->resetRootNodePointer(tile);
+        return;
+    }
+    
+    // Writing the tree again removes its unreachable nodes
+    // and merges it with the tiles copied before it
+    VoxelPointer compactedRoot = compactedWriter_->writeTree((const uint32_t*)voxelWriter_.data(), root, 1 << treeHeight);
+    compactedWriter_->setRootNodePointer(tile, compactedRoot, treeHeight);
+}
+
+void VoxelTree::finishCompaction()
+{
+    // Copy the tiles merged since they were copied
+    voxelWriterMutex_.lock();
+    vector<VoxelRootEntry> entries((const VoxelRootEntry*)voxelWriter_.data(), (const VoxelRootEntry*)voxelWriter_.data() + totalTiles());
+    voxelWriterMutex_.unlock();
+    
+    for(int tile = 0; tile < totalTiles(); ++tile)
+    {
+        if(entries[tile].root != compactedRoots_[tile])
+        {
+            copyCompactedTile(tile, entries[tile].root, entries[tile].treeHeight);
+        }
+    }
+    
+    // Swap in the compacted tree. Only the main thread can have changed
+    // the root entries since they were read, by resetting tiles.
+    voxelWriterMutex_.lock();
+    for(int tile = 0; tile < totalTiles(); ++tile)
+    {
+        if(voxelWriter_.rootEntry(tile).root != compactedRoots_[tile])
+        {
+            compactedWriter_->resetRootNodePointer(tile);
+        }
+    }
+    
+    size_t reclaimedWords = voxelWriter_.dataSizeWords() - compactedWriter_->dataSizeWords();
+    voxelWriter_.swap(*compactedWriter_);
+    collectedSizeWords_ = voxelWriter_.dataSizeWords();
+    committedSizeWords_.store(voxelWriter_.dataSizeWords(), std::memory_order_release);
+    compactions_ ++;
+    voxelWriterMutex_.unlock();
+    
+    // The old tree is no longer needed
+    delete compactedWriter_;
+    compactedWriter_ = NULL;
+    
+    printf("Removed %zu KB of unused voxel nodes \n", reclaimedWords * 4 / 1024);
+}
+
+VoxelBuilder* VoxelTree::findFinishedBuilder(vector<VoxelBuilder*> &finished)
+{
+    // Deterministic builds merge the builders in the order they were started.
+    // Later builders wait in the finished list in the meantime.
+    VoxelBuilder* builder = NULL;
+    if(deterministicBuild_)
+    {
+        if(activeTiles_.empty() == false && std::find(finished.begin(), finished.end(), activeTiles_[0]) != finished.end())
+        {
+            builder = activeTiles_[0];
+        }
+    }
+    else if(finished.empty() == false)
+    {
+        builder = finished[0];
+    }
+        
+    // No builders are ready
+    if(builder == NULL)
+    {
+        return NULL;
+    }
+    
+    // Remove the builder from the finished and active lists
+    finished.erase(std::find(finished.begin(), finished.end(), builder));
+    activeTiles_.erase(std::find(activeTiles_.begin(), activeTiles_.end(), builder));
+    return builder;
+}
+
+void VoxelTree::updateUniformBuffer()
+{
+    VoxelsUniformBuffer &buffer = uniformBuffer_;
+    
+    // Store the keyframe range of each light
+    buffer.lightCount = lights_.size();
+    for(unsigned int i = 0; i < lights_.size(); ++i)
+    {
+        buffer.lights[i].firstKeyframe = lights_[i].firstKeyframe;
+        buffer.lights[i].keyframeCount = lights_[i].keyframeCount;
+        buffer.lights[i].currentKeyframe = lights_[i].firstKeyframe;
+        buffer.lights[i].nextKeyframe = lights_[i].firstKeyframe;
+        buffer.lights[i].keyframeBlend = -1.0;
+        
+        // Local lights select a view by position instead
+        const Light &sceneLight = scene_->lights()[lights_[i].sceneLight];
+        buffer.lights[i].type = (uint32_t)lights_[i].type;
+        buffer.lights[i].position = Vector4(sceneLight.position(), sceneLight.range());
+    }
+    
+    // Store the cascade range of each light's keyframes
+    for(int i = 0; i < firstObjectKeyframe_; ++i)
+    {
+        buffer.keyframes[i].firstCascade = keyframes_[i].firstCascade;
+        buffer.keyframes[i].cascadeCount = keyframes_[i].cascadeCount;
+    }
+    
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        const VoxelCascade &cascade = cascades_[i];
+        buffer.cascades[i].worldToVoxels = cascadeWorldToVoxels(i);
+        buffer.cascades[i].treeHeight = log2(cascade.tileResolution);
+        buffer.cascades[i].tileSubdivisions = cascade.tileSubdivisions;
+        buffer.cascades[i].firstTile = cascade.firstTile;
+        buffer.cascades[i].maxDistance = cascade.maxDistance;
+    }
+    
+    // Keep the object trees' cascades as updateObjectTrees last set them
+    for(unsigned int i = 0; i < objectTrees_.size(); ++i)
+    {
+        updateObjectCascade(i);
+    }
+    
+    // Tiles pointing at the empty node are not built yet
+    buffer.emptyRoot = voxelWriter_.emptyNode();
+    
+    // The object trees' cascades follow those of the lights
+    buffer.objectCascadeCount = objectTrees_.size();
+    buffer.firstObjectCascade = objectTrees_.empty() ? 0 : keyframes_[firstObjectKeyframe_].firstCascade;
+    
+    // Update the PCF settings
+    buffer.pcfSampleCount = pcfKernelSize_ * pcfKernelSize_;
+    buffer.pcfLookups = ((pcfKernelSize_ + 7) / 8) * ((pcfKernelSize_ + 7) / 8);
+    
+    // Precompute PCF offsets and bitmasks
+    for(int i = 0; i < 64; ++i)
+    {
+        // Get the x and y coords
+        int x = i / 8;
+        int y = i % 8;
+        
+        // Find the leaves used in the lookup
+        int lookupIndex = 0;
+        
+        // Consider a range of possible offsets
+        // Always offset by a full leaf tile (8 places).
+        for(int xOffset = -32; xOffset <= 32; xOffset+= 8)
+        {
+            for(int yOffset = -32; yOffset <= 32; yOffset+= 8)
+            {
+                // Get the bitmask at this offset
+                uint64_t bitmask = pcfBitmask(x - xOffset, y - yOffset);
+                
+                if(bitmask != 0)
+                {
+                    // Bitmask is non-zero. Include it in the filter kernel.
+                    auto offsetData = &buffer.pcfOffsets[i*9 + lookupIndex];
+                    offsetData->xOffset = xOffset;
+                    offsetData->yOffset = yOffset;
+                    offsetData->bitmaskHigh = bitmask >> 32;
+                    offsetData->bitmaskLow = (uint32_t)bitmask;
+                    
+                    lookupIndex ++;
+                }
+            }
+        }
+        
+        // There should be the same number of lookups for each leaf index.
+        assert(lookupIndex == (int)buffer.pcfLookups);
+    }
+    
+    // Set the keyframe blend and upload the buffer
+    updateKeyframeBlend();
+}
+
+Matrix4x4 VoxelTree::cascadeWorldToVoxels(int index)
+{
+    const VoxelCascade &cascade = cascades_[index];
+    const VoxelKeyframe &keyframe = keyframes_[cascade.keyframe];
+    
+    // Cover the cascade with the shadowmap and get the world to shadow matrix
+    Matrix4x4 worldToShadow;
+    if(keyframe.perspective)
+    {
+        shadowMap_.setPerspective(keyframe.lightPosition, keyframe.lightRotation, keyframe.fieldOfView, keyframe.range * LocalLightNearPlane, keyframe.range);
+        worldToShadow = shadowMap_.worldToShadowMatrix(0);
+        
+        // The voxel depths are linear, so replace the depth row with the
+        // light space depth over the range. Only x and y are divided by w.
+        Matrix4x4 worldToLight = worldToLightMatrix(keyframe.lightRotation, keyframe.lightPosition);
+        for(int c = 0; c < 4; ++c)
+        {
+            worldToShadow.set(2, c, worldToLight.get(2, c) / keyframe.range);
+        }
+    }
+    else
+    {
+        shadowMap_.setLightSpaceBounds(cascade.boundsLightSpace, keyframe.lightRotation);
+        worldToShadow = shadowMap_.worldToShadowMatrix(0);
+    }
+    
+    // Scale the world to shadow matrix by the total voxel resolution
+    Vector3 scale;
+    scale.x = cascade.treeResolution;
+    scale.y = cascade.treeResolution;
+    scale.z = cascade.tileResolution; // The trees are only tiled in x and y
+    return Matrix4x4::scale(scale) * worldToShadow;
+}
+
+void VoxelTree::updateKeyframeBlend()
+{
+    VoxelsUniformBuffer &buffer = uniformBuffer_;
+    bool changed = false;
+    
+    for(unsigned int i = 0; i < lights_.size(); ++i)
+    {
+        const VoxelLight &light = lights_[i];
+        
+        // The keyframes match the light's keyframes if it has any.
+        // Rotatable lights use their displayed keyframe.
+        int current = light.displayedKeyframe;
+        int next = current;
+        float blend = 0.0;
+        if(light.rotationKeyframes.empty() == false)
+        {
+            scene_->lights()[light.sceneLight].currentKeyframes(&current, &next, &blend);
+            int last = light.rotationKeyframes.size() - 1;
+            current = light.rotationKeyframes[std::min(current, last)];
+            next = light.rotationKeyframes[std::min(next, last)];
+        }
+        
+        // Only upload the buffer when a blend changes
+        VoxelsUniformBuffer::Light &bufferLight = buffer.lights[i];
+        if((int)bufferLight.currentKeyframe != current || (int)bufferLight.nextKeyframe != next || bufferLight.keyframeBlend != blend)
+        {
+            bufferLight.currentKeyframe = current;
+            bufferLight.nextKeyframe = next;
+            bufferLight.keyframeBlend = blend;
+            changed = true;
+        }
+    }
+    
+    if(changed)
+    {
+        uniformManager_->updateVoxelBuffer(&buffer, sizeof(VoxelsUniformBuffer));
+    }
+}
+
+uint64_t VoxelTree::pcfBitmask(int kernelX, int kernelY) const
+{
+    uint64_t bitmask = 0;
+    for(int i = 0; i < 64; ++i)
+    {
+        // Get the x and y coords
+        int coordX = i / 8;
+        int coordY = i % 8;
+        
+        // Compute whether the coord is in the filter kernel
+        if(coordX >= kernelX - pcfKernelSize_/2 && coordX <= kernelX + pcfKernelSize_/2
+           && coordY >= kernelY - pcfKernelSize_/2 && coordY <= kernelY + pcfKernelSize_/2)
+        {
+            bitmask |= ((uint64_t)1) << i;
+        }
+    }
+    
+    return bitmask;
+}
+
+void VoxelTree::updateTreeBuffer()
+{
+    VoxelTraceScope scope("Upload Tree");
+    
+    // Tiles merged before the writer is locked are in the uploaded data
+    int mergedTiles = mergedTiles_;
+    
+    // Get the current tree data.
+    // The tree cannot be swapped for a compacted copy during the upload.
+    voxelWriterMutex_.lock();
+    const void* treeData = voxelWriter_.data();
+    size_t treeSizeWords = committedSizeWords_.load(std::memory_order_acquire);
+    
+    // Create the buffer to hold the tree, with room to grow
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
+    if(treeSizeWords > bufferCapacityWords_)
+    {
+        bufferCapacityWords_ = treeSizeWords * TreeBufferGrowth;
+        glBufferData(GL_TEXTURE_BUFFER, bufferCapacityWords_ * 4, NULL, GL_DYNAMIC_DRAW);
+    }
+    
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, treeSizeWords * 4, treeData);
+    uploadedSizeWords_ = treeSizeWords;
+    uploadedCompactions_ = compactions_;
+    
+    finishTreeUpload(mergedTiles);
+    voxelWriterMutex_.unlock();
+    
+    updateUniformBuffer();
+}
+
+void VoxelTree::uploadTreePart()
+{
+    VoxelTraceScope scope("Upload Tree Part");
+    
+    // Tiles merged before the writer is locked are in the uploaded data
+    int mergedTiles = mergedTiles_;
+    
+    voxelWriterMutex_.lock();
+    const uint32_t* treeData = (const uint32_t*)voxelWriter_.data();
+    size_t treeSizeWords = committedSizeWords_.load(std::memory_order_acquire);
+    
+    // Start the upload again if the tree was compacted again or
+    // outgrew the pending buffer, with room for the tree to grow
+    if(pendingBuffer_ == 0)
+    {
+        glGenBuffers(1, &pendingBuffer_);
+        pendingCapacityWords_ = 0;
+    }
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, pendingBuffer_);
+    if(pendingCompactions_ != compactions_ || treeSizeWords > pendingCapacityWords_)
+    {
+        pendingCapacityWords_ = treeSizeWords * TreeBufferGrowth;
+        glBufferData(GL_TEXTURE_BUFFER, pendingCapacityWords_ * 4, NULL, GL_DYNAMIC_DRAW);
+        pendingSizeWords_ = 0;
+        pendingCompactions_ = compactions_;
+    }
+    
+    // Nodes are only added to the end of the tree until it is compacted
+    size_t remainingWords = treeSizeWords - pendingSizeWords_;
+    if(remainingWords * 4 > UploadStepBytes)
+    {
+        glBufferSubData(GL_TEXTURE_BUFFER, pendingSizeWords_ * 4, UploadStepBytes, treeData + pendingSizeWords_);
+        pendingSizeWords_ += UploadStepBytes / 4;
+        voxelWriterMutex_.unlock();
+        return;
+    }
+    
+    // Upload the last nodes and the root entries pointing at them
+    glBufferSubData(GL_TEXTURE_BUFFER, pendingSizeWords_ * 4, remainingWords * 4, treeData + pendingSizeWords_);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, totalTiles() * sizeof(VoxelRootEntry), treeData);
+    
+    // Render from the new buffer
+    glDeleteBuffers(1, &buffer_);
+    buffer_ = pendingBuffer_;
+    pendingBuffer_ = 0;
+    glBindTexture(GL_TEXTURE_BUFFER, bufferTexture_);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, buffer_);
+    uploadedSizeWords_ = treeSizeWords;
+    bufferCapacityWords_ = pendingCapacityWords_;
+    uploadedCompactions_ = compactions_;
+    
+    finishTreeUpload(mergedTiles);
+    voxelWriterMutex_.unlock();
+    
+    uniformBufferDirty_ = true;
+}
+
+void VoxelTree::uploadNewNodes()
+{
+    VoxelTraceScope scope("Upload Nodes");
+    
+    // Nodes are only ever added to the end of the tree until it is
+    // compacted, which is checked while the writer is locked. A compacted
+    // tree is uploaded in full by the next step instead.
+    voxelWriterMutex_.lock();
+    size_t treeSizeWords = committedSizeWords_.load(std::memory_order_acquire);
+    if(compactions_ == uploadedCompactions_ && treeSizeWords <= bufferCapacityWords_)
+    {
+        size_t words = std::min(treeSizeWords - uploadedSizeWords_, (size_t)UploadStepBytes / 4);
+        const uint32_t* nodes = (const uint32_t*)voxelWriter_.data() + uploadedSizeWords_;
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
+        glBufferSubData(GL_TEXTURE_BUFFER, uploadedSizeWords_ * 4, words * 4, nodes);
+        uploadedSizeWords_ += words;
+    }
+    
+    voxelWriterMutex_.unlock();
+}
+
+void VoxelTree::uploadRootEntries()
+{
+    VoxelTraceScope scope("Upload Root Entries");
+    
+    // Tiles merged before the writer is locked are in the uploaded data
+    int mergedTiles = mergedTiles_;
+    
+    // Leave the upload to other steps if the tree was compacted, or too
+    // many nodes were added, since the step was chosen
+    voxelWriterMutex_.lock();
+    size_t treeSizeWords = committedSizeWords_.load(std::memory_order_acquire);
+    if(compactions_ != uploadedCompactions_ || treeSizeWords > bufferCapacityWords_
+       || (treeSizeWords - uploadedSizeWords_) * 4 > UploadStepBytes)
+    {
+        voxelWriterMutex_.unlock();
+        return;
+    }
+    
+    // Upload the nodes added since the step was chosen, so
+    // every root entry points at nodes that are uploaded
+    const uint32_t* treeData = (const uint32_t*)voxelWriter_.data();
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
+    glBufferSubData(GL_TEXTURE_BUFFER, uploadedSizeWords_ * 4, (treeSizeWords - uploadedSizeWords_) * 4, treeData + uploadedSizeWords_);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, totalTiles() * sizeof(VoxelRootEntry), treeData);
+    uploadedSizeWords_ = treeSizeWords;
+    
+    finishTreeUpload(mergedTiles);
+    voxelWriterMutex_.unlock();
+    
+    uniformBufferDirty_ = true;
+}
+
+void VoxelTree::finishTreeUpload(int mergedTiles)
+{
+    // Update the uploaded tiles count
+    uploadedTiles_ = mergedTiles;
+    
+    // Swap in rebuilt keyframes whose tiles are in the uploaded data
+    swapRebuiltKeyframes();
+    
+    // Object trees are sampled once their tile is in the uploaded data
+    for(auto tree = objectTrees_.begin(); tree != objectTrees_.end(); ++tree)
+    {
+        tree->built = voxelWriter_.rootEntry(keyframeFirstTile(tree->keyframe)).root != voxelWriter_.emptyNode();
+    }
+}
+
+void VoxelTree::createKeyframes()
+{
+    const vector<Light> &sceneLights = scene_->lights();
+    for(unsigned int i = 0; i < sceneLights.size(); ++i)
+    {
+        // There is one shadow mask channel per light
+        if((int)lights_.size() == VoxelsUniformBuffer::MaxLights)
+        {
+            printf("Too many shadow casting lights. Ignoring the remaining lights. \n");
+            break;
+        }
+        
+        // Each light needs at least one keyframe.
+        // Point lights need one for each cube face.
+        const Light &sceneLight = sceneLights[i];
+        int minKeyframes = (sceneLight.type() == LightType::Point) ? 6 : 1;
+        if((int)keyframes_.size() + minKeyframes > VoxelsUniformBuffer::MaxKeyframes)
+        {
+            printf("Too many light keyframes. Ignoring the remaining lights. \n");
+            break;
+        }
+        
+        VoxelLight light;
+        light.sceneLight = i;
+        light.type = sceneLight.type();
+        light.firstKeyframe = keyframes_.size();
+        light.rotatable = false;
+        light.displayedKeyframe = light.firstKeyframe;
+        light.rebuildKeyframe = -1;
+        light.stagingKeyframe = -1;
+        light.replacedKeyframe = -1;
+        
+        const vector<LightKeyframe> &lightKeyframes = sceneLight.keyframes();
+        if(sceneLight.type() == LightType::Spot)
+        {
+            // Look along the light, widened to cover the PCF margin
+            addLocalKeyframe(sceneLight, sceneLight.rotation(), sceneLight.spotAngle());
+        }
+        else if(sceneLight.type() == LightType::Point)
+        {
+            // Look along +x, -x, +y, -y, +z, -z.
+            // Must match the face order in the voxel sampling shader.
+            addLocalKeyframe(sceneLight, Quaternion::euler(0.0, 90.0, 0.0), 90.0);
+            addLocalKeyframe(sceneLight, Quaternion::euler(0.0, -90.0, 0.0), 90.0);
+            addLocalKeyframe(sceneLight, Quaternion::euler(-90.0, 0.0, 0.0), 90.0);
+            addLocalKeyframe(sceneLight, Quaternion::euler(90.0, 0.0, 0.0), 90.0);
+            addLocalKeyframe(sceneLight, Quaternion::euler(0.0, 0.0, 0.0), 90.0);
+            addLocalKeyframe(sceneLight, Quaternion::euler(0.0, 180.0, 0.0), 90.0);
+        }
+        else if(lightKeyframes.size() > 1)
+        {
+            // Use the light's keyframes if it moves
+            for(auto keyframe = lightKeyframes.begin(); keyframe != lightKeyframes.end(); ++keyframe)
+            {
+                if((int)keyframes_.size() == VoxelsUniformBuffer::MaxKeyframes)
+                {
+                    printf("Too many light keyframes. Ignoring the remaining keyframes. \n");
+                    break;
+                }
+                
+                Bounds sceneBounds = computeSceneBoundsLightSpace(keyframe->rotation);
+                keyframes_.push_back(VoxelKeyframe(lights_.size(), keyframe->rotation, sceneBounds));
+                light.rotationKeyframes.push_back(keyframes_.size() - 1);
+            }
+            
+            // Add a staging keyframe to refit the others into. Without one,
+            // outgrown keyframes are refitted in place and not displayed
+            // until they are rebuilt.
+            if((int)keyframes_.size() < VoxelsUniformBuffer::MaxKeyframes)
+            {
+                const VoxelKeyframe &last = keyframes_.back();
+                keyframes_.push_back(VoxelKeyframe(lights_.size(), last.lightRotation, last.sceneBoundsLightSpace));
+                light.stagingKeyframe = keyframes_.size() - 1;
+            }
+        }
+        else
+        {
+            Quaternion rotation = sceneLight.rotation();
+            Bounds sceneBounds = computeSceneBoundsLightSpace(rotation);
+            keyframes_.push_back(VoxelKeyframe(lights_.size(), rotation, sceneBounds));
+            
+            // Add a spare keyframe to rebuild into if the light is rotated
+            if((int)keyframes_.size() < VoxelsUniformBuffer::MaxKeyframes)
+            {
+                keyframes_.push_back(VoxelKeyframe(lights_.size(), rotation, sceneBounds));
+                light.rotatable = true;
+            }
+        }
+        
+        light.keyframeCount = keyframes_.size() - light.firstKeyframe;
+        lights_.push_back(light);
+    }
+}
+
+void VoxelTree::addLocalKeyframe(const Light &light, const Quaternion &rotation, float fieldOfView)
+{
+    // Widen the view so the lit region is at least the PCF margin
+    // inside the view's edges.
+    float halfFov = (fieldOfView / 2.0) * (M_PI / 180.0);
+    float resolution = light.voxelResolution();
+    float widenedTan = tan(halfFov) * resolution / (resolution - 2.0 * LocalLightPCFMargin);
+    float widenedFov = 2.0 * atan(widenedTan) * (180.0 / M_PI);
+    
+    // The light space bounds cover the view up to the light's range
+    float halfSize = light.range() * widenedTan;
+    Bounds bounds(Vector3(-halfSize, -halfSize, 0.0), Vector3(halfSize, halfSize, light.range()));
+    
+    VoxelKeyframe keyframe(lights_.size(), rotation, bounds);
+    keyframe.perspective = true;
+    keyframe.lightPosition = light.position();
+    keyframe.fieldOfView = widenedFov;
+    keyframe.range = light.range();
+    keyframes_.push_back(keyframe);
+}
+
+void VoxelTree::createObjectKeyframes()
+{
+    firstObjectKeyframe_ = keyframes_.size();
+    if(lights_.empty())
+    {
+        return;
+    }
+    
+    // Object trees are built for the main light
+    Quaternion lightRotation = scene_->lights()[lights_[0].sceneLight].rotation();
+    const vector<MeshInstance> &instances = scene_->meshInstances();
+    for(unsigned int i = 0; i < instances.size(); ++i)
+    {
+        if(instances[i].isStatic())
+        {
+            continue;
+        }
+        
+        if((int)objectTrees_.size() == MaxObjectTrees)
+        {
+            printf("Too many dynamic objects. The remaining objects are only shadowed by the shadow map. \n");
+            break;
+        }
+        
+        VoxelObjectTree tree;
+        tree.meshInstance = i;
+        tree.keyframe = keyframes_.size();
+        tree.bakeLocalToWorld = instances[i].localToWorld();
+        tree.bakeRotation = instances[i].rotation();
+        tree.bakeScale = instances[i].scale();
+        tree.previousRotation = tree.bakeRotation;
+        tree.previousScale = tree.bakeScale;
+        tree.built = false;
+        tree.valid = false;
+        objectTrees_.push_back(tree);
+        
+        // Cover the instance at its current transform
+        keyframes_.push_back(VoxelKeyframe(0, lightRotation, Bounds(Vector3::zero(), Vector3::zero())));
+        keyframes_.back().sceneBoundsLightSpace = objectBoundsLightSpace(objectTrees_.size() - 1);
+    }
+}
+
+void VoxelTree::createCascades(int resolution)
+{
+    // Local light views and object trees have a single cascade.
+    // The rest are shared equally by the directional keyframes.
+    int singleCascadeKeyframes = 0;
+    for(unsigned int k = 0; k < keyframes_.size(); ++k)
+    {
+        singleCascadeKeyframes += (keyframes_[k].perspective || isObjectKeyframe(k)) ? 1 : 0;
+    }
+    
+    int directionalKeyframes = std::max((int)keyframes_.size() - singleCascadeKeyframes, 1);
+    int availableCascades = VoxelsUniformBuffer::MaxCascades - singleCascadeKeyframes;
+    const int cascadesPerKeyframe = std::min(MaxCascadesPerKeyframe, availableCascades / directionalKeyframes);
+    
+    for(unsigned int k = 0; k < keyframes_.size(); ++k)
+    {
+        VoxelKeyframe &keyframe = keyframes_[k];
+        keyframe.firstCascade = cascades_.size();
+        
+        // Local light views are a single tile at the light's resolution
+        if(keyframe.perspective)
+        {
+            int lightResolution = scene_->lights()[lights_[keyframe.light].sceneLight].voxelResolution();
+            addCascade(k, keyframe.sceneBoundsLightSpace, lightResolution, 1000000000.0);
+            keyframe.cascadeCount = 1;
+            continue;
+        }
+        
+        // Object trees are a single tile around their instance.
+        // They are enabled each frame by updateObjectTrees.
+        if(isObjectKeyframe(k))
+        {
+            addCascade(k, keyframe.sceneBoundsLightSpace, ObjectTreeResolution, -1.0);
+            keyframe.cascadeCount = 1;
+            continue;
+        }
+        
+        // Add the high resolution regions specified by the scene
+        Bounds sceneBounds = keyframe.sceneBoundsLightSpace;
+        const vector<VoxelCascadeRegion> &regions = scene_->voxelCascades();
+        for(auto region = regions.begin(); region != regions.end(); ++region)
+        {
+            // The last cascade is reserved for the entire scene
+            if((int)cascades_.size() - keyframe.firstCascade == cascadesPerKeyframe - 1)
+            {
+                if(k == 0)
+                {
+                    printf("Too many voxel cascades. Ignoring the remaining regions. \n");
+                }
+                
+                break;
+            }
+            
+            addCascade(k, regionBoundsLightSpace(keyframe, *region), region->resolution, region->maxDistance);
+        }
+        
+        // The final cascade covers the entire scene at any distance
+        addCascade(k, sceneBounds, resolution, 1000000000.0);
+        keyframe.cascadeCount = cascades_.size() - keyframe.firstCascade;
+    }
+}
+
+Bounds VoxelTree::regionBoundsLightSpace(const VoxelKeyframe &keyframe, const VoxelCascadeRegion &region) const
+{
+    // Get the world to light space transformation matrix (without translation)
+    Matrix4x4 worldToLight = worldToLightMatrix(keyframe.lightRotation);
+    Bounds sceneBounds = keyframe.sceneBoundsLightSpace;
+    
+    // Centre the region on its light space position.
+    // The depth range always covers the entire scene.
+    Vector3 centre = (worldToLight * Vector4(region.centre, 1.0)).vec3();
+    Vector3 boundsMin(centre.x - region.size / 2.0, centre.y - region.size / 2.0, sceneBounds.min().z);
+    Vector3 boundsMax(centre.x + region.size / 2.0, centre.y + region.size / 2.0, sceneBounds.max().z);
+    
+    return Bounds(boundsMin, boundsMax);
+}
+
+void VoxelTree::updateCascadeBounds(int keyframe)
+{
+    // The cascades match the regions they were created from,
+    // followed by the cascade covering the entire scene.
+    const VoxelKeyframe &lightKeyframe = keyframes_[keyframe];
+    const vector<VoxelCascadeRegion> &regions = scene_->voxelCascades();
+    for(int i = 0; i < lightKeyframe.cascadeCount - 1; ++i)
+    {
+        cascades_[lightKeyframe.firstCascade + i].boundsLightSpace = regionBoundsLightSpace(lightKeyframe, regions[i]);
+    }
+    
+    cascades_[lightKeyframe.firstCascade + lightKeyframe.cascadeCount - 1].boundsLightSpace = lightKeyframe.sceneBoundsLightSpace;
+}
+
+void VoxelTree::addCascade(int keyframe, const Bounds &bounds, int resolution, float maxDistance)
+{
+    VoxelCascade cascade(bounds);
+    cascade.keyframe = keyframe;
+    cascade.treeResolution = resolution;
+    cascade.firstTile = totalTiles_;
+    cascade.maxDistance = maxDistance;
+    
+    // Make each tile as small as possible.
+    cascade.tileResolution = std::min(resolution, 4096);
+    cascade.tileSubdivisions = resolution / cascade.tileResolution;
+    while(cascade.tileCount() > MaxTileCount)
+    {
+        // Double the resolution until under the tile count limit.
+        cascade.tileResolution *= 2;
+        cascade.tileSubdivisions = resolution / cascade.tileResolution;
+    }
+    
+    // Each tile must be at least 8x8 so that leaf masks can be used
+    // and no more than 16K (maximum texture resolution)
+    assert(cascade.tileResolution >= 8);
+    assert(cascade.tileResolution <= 16384);
+    
+    // Add the cascade's tiles to the total
+    totalTiles_ += cascade.tileCount();
+    cascades_.push_back(cascade);
+}
+
+const VoxelCascade& VoxelTree::tileCascade(int index) const
+{
+    // Find the cascade whose tile range contains the index
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        if(index < cascades_[i].firstTile + cascades_[i].tileCount())
+        {
+            return cascades_[i];
+        }
+    }
+    
+    // The index must be valid
+    assert(false);
+    return cascades_.back();
+}
+
+void VoxelTree::computeTileResolutions(int keyframe)
+{
+    // Object trees are a single tile covering only their instance
+    if(isObjectKeyframe(keyframe))
+    {
+        int tile = keyframeFirstTile(keyframe);
+        tileResolutions_[tile] = tileCascade(tile).tileResolution;
+        return;
+    }
+    
+    // Sum the projected area of the static triangles over each tile.
+    // Measured in tiles, this is the depth complexity of the tile's
+    // shadow casters. Used as a measure of shadow caster density.
+    vector<float> casterLayers(totalTiles(), 0.0);
+    
+    const vector<MeshInstance> &instances = scene_->meshInstances();
+    for(auto instance = instances.begin(); instance != instances.end(); ++instance)
+    {
+        // Only static objects are rendered into the tree
+        if(instance->isStatic())
+        {
+            addCasterAreas(keyframe, *instance, casterLayers);
+        }
+    }
+    
+    finishTileResolutions(keyframe, casterLayers);
+}
+
+void VoxelTree::addCasterAreas(int keyframe, const MeshInstance &instance, vector<float> &casterLayers) const
+{
+    // The keyframe's cascades
+    auto firstCascade = cascades_.begin() + keyframes_[keyframe].firstCascade;
+    auto lastCascade = firstCascade + keyframes_[keyframe].cascadeCount;
+    
+    // Get the model to light transformation
+    const VoxelKeyframe &lightKeyframe = keyframes_[keyframe];
+    Matrix4x4 worldToLight = worldToLightMatrix(lightKeyframe.lightRotation, lightKeyframe.lightPosition);
+    Matrix4x4 modelToLight = worldToLight * instance.localToWorld();
+    
+    // Convert each vertex to light space
+    Mesh* mesh = instance.mesh();
+    vector<Vector3> lightVertices(mesh->verticesCount());
+    for(int v = 0; v < mesh->verticesCount(); ++v)
+    {
+        lightVertices[v] = (modelToLight * Vector4(mesh->vertices()[v], 1.0)).vec3();
+    }
+    
+    for(auto cascade = firstCascade; cascade != lastCascade; ++cascade)
+    {
+        for(int e = 0; e + 2 < mesh->elementsCount(); e += 3)
+        {
+            addCasterArea(*cascade, lightVertices[mesh->elements()[e]], lightVertices[mesh->elements()[e + 1]], lightVertices[mesh->elements()[e + 2]], casterLayers);
+        }
+    }
+}
+
+void VoxelTree::finishTileResolutions(int keyframe, const vector<float> &casterLayers)
+{
+    // Compute the resolution of each tile relative to the densest tile in its cascade
+    auto firstCascade = cascades_.begin() + keyframes_[keyframe].firstCascade;
+    auto lastCascade = firstCascade + keyframes_[keyframe].cascadeCount;
+    for(auto cascade = firstCascade; cascade != lastCascade; ++cascade)
+    {
+        auto first = casterLayers.begin() + cascade->firstTile;
+        float maxLayers = *std::max_element(first, first + cascade->tileCount());
+        
+        for(int i = 0; i < cascade->tileCount(); ++i)
+        {
+            int tile = cascade->firstTile + i;
+            float density = (maxLayers > 0.0) ? casterLayers[tile] / maxLayers : 0.0;
+            tileResolutions_[tile] = computeTileResolution(tile, density);
+        }
+    }
+}
+
+void VoxelTree::addCasterArea(const VoxelCascade &cascade, const Vector3 &a, const Vector3 &b, const Vector3 &c, vector<float> &casterLayers) const
+{
+    // Convert the triangle to tile units within the cascade
+    Vector3 origin = cascade.boundsLightSpace.min();
+    Vector3 size = cascade.boundsLightSpace.size();
+    float scaleX = cascade.tileSubdivisions / size.x;
+    float scaleY = cascade.tileSubdivisions / size.y;
+    
+    float ax = (a.x - origin.x) * scaleX;
+    float ay = (a.y - origin.y) * scaleY;
+    float bx = (b.x - origin.x) * scaleX;
+    float by = (b.y - origin.y) * scaleY;
+    float cx = (c.x - origin.x) * scaleX;
+    float cy = (c.y - origin.y) * scaleY;
+    
+    // The area of the triangle projected along the light direction.
+    // Triangles seen edge on cast no shadow.
+    float area = fabs((bx - ax) * (cy - ay) - (cx - ax) * (by - ay)) * 0.5;
+    if(area <= 0.0)
+    {
+        return;
+    }
+    
+    // Spread the area over the tiles under the triangle's bounds
+    // in proportion to how much of the bounds each tile covers.
+    float minX = std::min(ax, std::min(bx, cx));
+    float maxX = std::max(ax, std::max(bx, cx));
+    float minY = std::min(ay, std::min(by, cy));
+    float maxY = std::max(ay, std::max(by, cy));
+    float boundsArea = (maxX - minX) * (maxY - minY);
+    
+    int firstX = std::max((int)floor(minX), 0);
+    int lastX = std::min((int)floor(maxX), cascade.tileSubdivisions - 1);
+    int firstY = std::max((int)floor(minY), 0);
+    int lastY = std::min((int)floor(maxY), cascade.tileSubdivisions - 1);
+    
+    for(int x = firstX; x <= lastX; ++x)
+    {
+        float overlapX = std::min(maxX, x + 1.0f) - std::max(minX, (float)x);
+        for(int y = firstY; y <= lastY; ++y)
+        {
+            float overlapY = std::min(maxY, y + 1.0f) - std::max(minY, (float)y);
+            casterLayers[cascade.firstTile + x * cascade.tileSubdivisions + y] += area * overlapX * overlapY / boundsArea;
+        }
+    }
+}
+
+int VoxelTree::computeTileResolution(int index, float casterDensity) const
+{
+    const VoxelCascade &cascade = tileCascade(index);
+    
+    // Use the importance map instead of caster density if the scene has one
+    float importance = casterDensity;
+    if(scene_->hasVoxelImportanceMap())
+    {
+        // Get the light to world transformation matrix
+        const VoxelKeyframe &keyframe = keyframes_[cascade.keyframe];
+        Matrix4x4 lightToWorld = lightToWorldMatrix(keyframe.lightRotation, keyframe.lightPosition);
+        
+        // The tile is a column through the scene along the light direction.
+        // Use the most important point along the column.
+        Bounds bounds = tileBoundsLightSpace(index);
+        importance = 0.0;
+        for(int i = 0; i < 8; ++i)
+        {
+            Vector3 lightPos = bounds.centre();
+            lightPos.z = bounds.min().z + bounds.size().z * (i + 0.5) / 8.0;
+            
+            Vector3 worldPos = (lightToWorld * Vector4(lightPos, 1.0)).vec3();
+            importance = std::max(importance, scene_->voxelImportance(worldPos));
+        }
+    }
+    
+    // Halve the resolution each time the importance halves
+    int reduction = 0;
+    while(reduction < MaxResolutionReduction && importance < 1.0 / (2 << reduction))
+    {
+        reduction ++;
+    }
+    
+    // Tiles must stay big enough for a few levels of inner nodes
+    int resolution = cascade.tileResolution >> reduction;
+    return std::max(resolution, std::min(cascade.tileResolution, 64));
+}
+
+Matrix4x4 VoxelTree::worldToLightMatrix(const Quaternion &lightRotation, const Vector3 &lightPosition)
+{
+    // Directional lights are at the origin, so have no translation
+    Object light;
+    light.setPosition(lightPosition);
+    light.setRotation(lightRotation);
+    return light.worldToLocal();
+}
+
+Matrix4x4 VoxelTree::lightToWorldMatrix(const Quaternion &lightRotation, const Vector3 &lightPosition)
+{
+    // Directional lights are at the origin, so have no translation
+    Object light;
+    light.setPosition(lightPosition);
+    light.setRotation(lightRotation);
+    return light.localToWorld();
+}
+
+Bounds VoxelTree::computeSceneBoundsLightSpace(const Quaternion &lightRotation) const
+{
+    // Get the world to light space transformation matrix (without translation)
+    Matrix4x4 worldToLight = worldToLightMatrix(lightRotation);
+    
+    // Create a Bounds containing the origin only.
+    Bounds bounds = Bounds(Vector3::zero(), Vector3::zero());
+    
+    // Expand the scene bounds to cover each mesh
+    const vector<MeshInstance> &instances = scene_->meshInstances();
+    for(auto instance = instances.begin(); instance != instances.end(); ++instance)
+    {
+        // Skip objects that are not static
+        if(instance->isStatic() == false)
         {
             continue;
         }
@@ -378,47 +2817,254 @@ Bounds VoxelTree::computeSceneBoundsLightSpace() const
     return bounds;
 }
 
+Bounds VoxelTree::instanceBoundsLightSpace(const MeshInstance &instance, int keyframe) const
+{
+    // Get the model to light transformation
+    const VoxelKeyframe &lightKeyframe = keyframes_[keyframe];
+    Matrix4x4 worldToLight = worldToLightMatrix(lightKeyframe.lightRotation, lightKeyframe.lightPosition);
+    Matrix4x4 modelToLight = worldToLight * instance.localToWorld();
+    
+    // Start with the first vertex and expand to cover the rest
+    Mesh* mesh = instance.mesh();
+    Vector3 first = (modelToLight * Vector4(mesh->vertices()[0], 1.0)).vec3();
+    Bounds bounds = Bounds(first, first);
+    
+    for(int v = 1; v < mesh->verticesCount(); ++v)
+    {
+        Vector3 lightPos = (modelToLight * Vector4(mesh->vertices()[v], 1.0)).vec3();
+        bounds.expandToCover(lightPos);
+    }
+    
+    return bounds;
+}
+
+Bounds VoxelTree::objectBoundsLightSpace(int index) const
+{
+    const VoxelObjectTree &tree = objectTrees_[index];
+    Bounds bounds = instanceBoundsLightSpace(scene_->meshInstances()[tree.meshInstance], tree.keyframe);
+    
+    // Keep the instance the PCF margin inside the tree's edges.
+    // Thin instances are given some size so the view is not degenerate.
+    float padding = (float)ObjectTreeResolution / (ObjectTreeResolution - 2.0 * LocalLightPCFMargin);
+    Vector3 size = bounds.size();
+    float halfWidth = std::max(size.x, 0.01f) * padding / 2.0;
+    float halfHeight = std::max(size.y, 0.01f) * padding / 2.0;
+    float halfDepth = std::max(size.z, 0.01f) * 1.02 / 2.0;
+    
+    Vector3 centre = bounds.centre();
+    Vector3 halfSize(halfWidth, halfHeight, halfDepth);
+    return Bounds(centre - halfSize, centre + halfSize);
+}
+
+vector<VoxelStaticInstance> VoxelTree::findStaticInstances() const
+{
+    vector<VoxelStaticInstance> records;
+    
+    const vector<MeshInstance> &instances = scene_->meshInstances();
+    for(auto instance = instances.begin(); instance != instances.end(); ++instance)
+    {
+        records.push_back(recordStaticInstance(*instance));
+    }
+    
+    return records;
+}
+
+VoxelStaticInstance VoxelTree::recordStaticInstance(const MeshInstance &instance) const
+{
+    // Dynamic instances are not in the tree, so they have no bounds
+    vector<Bounds> bounds;
+    if(instance.isStatic())
+    {
+        for(unsigned int k = 0; k < keyframes_.size(); ++k)
+        {
+            bounds.push_back(instanceBoundsLightSpace(instance, k));
+        }
+    }
+    
+    return VoxelStaticInstance(instance, bounds);
+}
+
+void VoxelTree::findOverlappingTiles(int keyframe, const Bounds &bounds, vector<bool> &tiles) const
+{
+    auto firstCascade = cascades_.begin() + keyframes_[keyframe].firstCascade;
+    auto lastCascade = firstCascade + keyframes_[keyframe].cascadeCount;
+    for(auto cascade = firstCascade; cascade != lastCascade; ++cascade)
+    {
+        // Skip cascades the bounds are entirely in front of or behind.
+        // Directional cascades cover the entire scene depth.
+        if(bounds.max().z < cascade->boundsLightSpace.min().z || bounds.min().z > cascade->boundsLightSpace.max().z)
+        {
+            continue;
+        }
+        
+        // Find the range of tiles covered by the bounds in x and y
+        Vector3 tileSize = cascade->boundsLightSpace.size() / cascade->tileSubdivisions;
+        Vector3 minOffset = bounds.min() - cascade->boundsLightSpace.min();
+        Vector3 maxOffset = bounds.max() - cascade->boundsLightSpace.min();
+        int minX = std::max((int)floor(minOffset.x / tileSize.x), 0);
+        int minY = std::max((int)floor(minOffset.y / tileSize.y), 0);
+        int maxX = std::min((int)floor(maxOffset.x / tileSize.x), cascade->tileSubdivisions - 1);
+        int maxY = std::min((int)floor(maxOffset.y / tileSize.y), cascade->tileSubdivisions - 1);
+        
+        // Mark each tile in the range. The range is empty
+        // if the bounds are outside the cascade.
+        for(int x = minX; x <= maxX; ++x)
+        {
+            for(int y = minY; y <= maxY; ++y)
+            {
+                tiles[cascade->firstTile + x * cascade->tileSubdivisions + y] = true;
+            }
+        }
+    }
+}
+
 Bounds VoxelTree::tileBoundsLightSpace(int index) const
 {
-    // Get the bounds of the entire scene in light space
-    Bounds sceneBounds = sceneBoundsLightSpace_;
+    // Get the bounds of the tile's cascade in light space
+    const VoxelCascade &cascade = tileCascade(index);
+    Bounds cascadeBounds = cascade.boundsLightSpace;
     
     // Compute the light space size of each tile
-    float tileSizeX = sceneBounds.size().x / tileSubdivisions();
-    float tileSizeY = sceneBounds.size().y / tileSubdivisions();
+    float tileSizeX = cascadeBounds.size().x / cascade.tileSubdivisions;
+    float tileSizeY = cascadeBounds.size().y / cascade.tileSubdivisions;
     
-    // Get the x and y position of the tile
-    int x = index / tileSubdivisions();
-    int y = index % tileSubdivisions();
+    // Get the x and y position of the tile within the cascade
+    int localIndex = index - cascade.firstTile;
+    int x = localIndex / cascade.tileSubdivisions;
+    int y = localIndex % cascade.tileSubdivisions;
     
     // Determine the light space bounds of the tile
-    float posX = sceneBounds.min().x + (tileSizeX * x);
-    float posY = sceneBounds.min().y + (tileSizeY * y);
-    Vector3 boundsMin(posX, posY, sceneBounds.min().z);
-    Vector3 boundsMax(posX + tileSizeX, posY + tileSizeY, sceneBounds.max().z);
-
+    float posX = cascadeBounds.min().x + (tileSizeX * x);
+    float posY = cascadeBounds.min().y + (tileSizeY * y);
+    Vector3 boundsMin(posX, posY, cascadeBounds.min().z);
+    Vector3 boundsMax(posX + tileSizeX, posY + tileSizeY, cascadeBounds.max().z);
+    
     return Bounds(boundsMin, boundsMax);
 }
 
-void VoxelTree::computeDualShadowMaps(const Bounds &bounds, float** entryDepths, float** exitDepths)
+void VoxelTree::setTileShadowMap(const Bounds &bounds, const VoxelKeyframe &keyframe, int resolution)
 {
-    // Set the shadow map to cover the correct area
-    shadowMap_.setLightSpaceBounds(bounds);
+    // Tiles can use different resolutions.
+    // Smaller tiles render into the corner of the shadow map.
+    shadowMap_.setViewportResolution(resolution);
     
-    // Render the shadow map with static but not dynamic objects
-    // Do not use depth biasing.
-    shadowMap_.renderCascades(true, false, false);
+    // Set the shadow map to cover the correct area.
+    // Local light views are a single tile covering the whole view.
+    if(keyframe.perspective)
+    {
+        shadowMap_.setPerspective(keyframe.lightPosition, keyframe.lightRotation, keyframe.fieldOfView, keyframe.range * LocalLightNearPlane, keyframe.range);
+    }
+    else
+    {
+        shadowMap_.setLightSpaceBounds(bounds, keyframe.lightRotation);
+    }
+}
+
+bool VoxelTree::renderTileDepths(VoxelTileReadback &readback, bool exitDepths)
+{
+    VoxelTraceScope scope(exitDepths ? "Render Exit Depths" : "Render Entry Depths", readback.tile);
     
-    // Store the depths as the shadow entry depths
-    *entryDepths = new float[tileResolution_ * tileResolution_];
-    glReadPixels(0, 0, tileResolution_, tileResolution_, GL_DEPTH_COMPONENT, GL_FLOAT, *entryDepths);
+    // Cover the tile with each part of the render. The shadow map's
+    // camera is also used to compute the cascade matrices, eg when
+    // object trees move, so it can have changed since the last part.
+    int keyframeIndex = tileCascade(readback.tile).keyframe;
+    bool firstPart = (readback.renderedInstances == 0);
+    setTileShadowMap(tileBoundsLightSpace(readback.tile), keyframes_[keyframeIndex], readback.resolution);
     
-    // Render the shadow map back faces
-    glCullFace(GL_FRONT);
-    shadowMap_.renderCascades(true, false, false); // Static objects only
+    // Object trees contain only their own instance. Otherwise
+    // render the next few instances with static but not dynamic
+    // objects, over the instances rendered by earlier steps.
+    const vector<MeshInstance> &sceneInstances = scene_->meshInstances();
+    vector<MeshInstance> instances;
+    bool drawDynamic = false;
+    bool lastPart = true;
+    if(isObjectKeyframe(keyframeIndex))
+    {
+        int meshInstance = objectTrees_[keyframeIndex - firstObjectKeyframe_].meshInstance;
+        instances.push_back(sceneInstances[meshInstance]);
+        drawDynamic = true;
+    }
+    else
+    {
+        int endInstance = std::min(readback.renderedInstances + RenderStepInstances, (int)sceneInstances.size());
+        instances.assign(sceneInstances.begin() + readback.renderedInstances, sceneInstances.begin() + endInstance);
+        readback.renderedInstances = endInstance;
+        lastPart = (endInstance == (int)sceneInstances.size());
+    }
+    
+    // Exit depths are rendered from the back faces.
+    // Do not use depth biasing.
+    if(exitDepths)
+    {
+        glCullFace(GL_FRONT);
+    }
+    
+    shadowMap_.renderCascadesPart(instances, true, drawDynamic, false, firstPart);
     glCullFace(GL_BACK);
     
-    // Store the depths as the shadow exit depths
-    *exitDepths = new float[tileResolution_ * tileResolution_];
-    glReadPixels(0, 0, tileResolution_, tileResolution_, GL_DEPTH_COMPONENT, GL_FLOAT, *exitDepths);
+    if(lastPart == false)
+    {
+        return false;
+    }
+    
+    readback.renderedInstances = 0;
+    
+    // Start reading back the depths. The GPU copies them
+    // into the pixel buffer once the render has finished.
+    size_t sizeBytes = (size_t)readback.resolution * readback.resolution * sizeof(float);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.readBuffers[exitDepths ? 1 : 0]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, sizeBytes, NULL, GL_STREAM_READ);
+    glReadPixels(0, 0, readback.resolution, readback.resolution, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return true;
+}
+
+float* VoxelTree::readTileDepths(const VoxelTileReadback &readback, bool exitDepths)
+{
+    VoxelTraceScope scope(exitDepths ? "Read Exit Depths" : "Read Entry Depths", readback.tile);
+    
+    // Copy the depths out of the pixel buffer
+    int texels = readback.resolution * readback.resolution;
+    float* depths = VoxelBufferPool::acquireFloats(texels);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.readBuffers[exitDepths ? 1 : 0]);
+    const void* readDepths = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, texels * sizeof(float), GL_MAP_READ_BIT);
+    if(readDepths != NULL)
+    {
+        memcpy(depths, readDepths, texels * sizeof(float));
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    else
+    {
+        // Treat the tile as empty if the depths cannot be read
+        printf("Failed to read back the depths of tile %d \n", readback.tile);
+        std::fill(depths, depths + texels, 1.0f);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    
+    // The voxel depths of local lights are linear
+    const VoxelKeyframe &keyframe = keyframes_[tileCascade(readback.tile).keyframe];
+    if(keyframe.perspective)
+    {
+        VoxelTraceScope linearizeScope("Linearize Depths");
+        linearizeDepths(keyframe, readback.resolution, depths);
+    }
+    
+    return depths;
+}
+
+void VoxelTree::linearizeDepths(const VoxelKeyframe &keyframe, int resolution, float* depths) const
+{
+    float n = keyframe.range * LocalLightNearPlane;
+    float f = keyframe.range;
+    
+    for(int i = 0; i < resolution * resolution; ++i)
+    {
+        // Recover the light space depth from the [0-1] depth buffer value.
+        // Cleared depths stay at the far plane.
+        float ndc = depths[i] * 2.0 - 1.0;
+        float lightDepth = (2.0 * f * n) / ((f + n) - ndc * (f - n));
+        
+        // Store as a fraction of the range
+        depths[i] = std::min(lightDepth / f, 1.0f);
+    }
 }
@@ -3,10 +3,13 @@
 #define GL_GLEXT_PROTOTYPES 1 // Enables OpenGL 3 Features
 #include <QGLWidget> // Links OpenGL Headers
 
+#include <atomic>
 #include <queue>
+#include <string>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <string.h>
 
 #include <QElapsedTimer>
 
@@ -19,31 +22,482 @@ using namespace std;
 #include "ShadowMap.hpp"
 #include "UniformManager.hpp"
 #include "VoxelBuilder.hpp"
+#include "VoxelBuildQueue.hpp"
+#include "VoxelTileQueue.hpp"
+#include "VoxelTreeSampler.hpp"
+#include "VoxelTreeStats.hpp"
+
+// A light that the tree is built for.
+// Lights share the tree's node buffer and build scheduler.
+struct VoxelLight
+{
+    // The index of the light in the scene
+    int sceneLight;
+    
+    // Directional lights have a keyframe per rotation.
+    // Spot lights have one perspective keyframe and point lights
+    // have one for each cube face.
+    LightType type;
+    
+    // The light's keyframes
+    int firstKeyframe;
+    int keyframeCount;
+    
+    // Directional lights without keyframes can be rotated at runtime.
+    // They have 2 keyframes. One is displayed while the other is rebuilt
+    // for the new rotation, then they swap. -1 when not rebuilding.
+    bool rotatable;
+    int displayedKeyframe;
+    int rebuildKeyframe;
+    
+    // Lights with keyframed rotations have an extra staging keyframe.
+    // A keyframe that static geometry has moved out of is refitted into
+    // it while still displayed, and the two swap once it is fully built.
+    // The keyframe displayed for each rotation, the staging keyframe,
+    // the keyframe it is replacing and the keyframes waiting for it.
+    // Empty or -1 for other lights.
+    vector<int> rotationKeyframes;
+    int stagingKeyframe;
+    int replacedKeyframe;
+    vector<int> outgrownKeyframes;
+};
+
+// A light rotation that the tree is built for, eg a time of day,
+// or one perspective view of a local light.
+// Keyframes share the tree's node buffer, so regions that look
+// the same from several light directions are only stored once.
+struct VoxelKeyframe
+{
+    VoxelKeyframe(int light, const Quaternion &rotation, const Bounds &sceneBounds)
+        : light(light),
+        lightRotation(rotation),
+        perspective(false),
+        lightPosition(Vector3::zero()),
+        fieldOfView(0.0),
+        range(0.0),
+        sceneBoundsLightSpace(sceneBounds)
+    {
+    }
+    
+    // The light the keyframe belongs to
+    int light;
+    
+    Quaternion lightRotation;
+    
+    // Local lights use a perspective view from the light position.
+    // The voxel depths are linear distances up to the light's range.
+    bool perspective;
+    Vector3 lightPosition;
+    float fieldOfView;
+    float range;
+    
+    // The bounds of the static objects in the keyframe's light space
+    Bounds sceneBoundsLightSpace;
+    
+    // The keyframe's cascades
+    int firstCascade;
+    int cascadeCount;
+};
+
+// A region of the tree covered by a grid of equally sized tiles.
+// Cascades share the tree's node buffer, with their root node
+// pointers stored one after another at the start of the buffer.
+struct VoxelCascade
+{
+    VoxelCascade(const Bounds &bounds)
+        : boundsLightSpace(bounds)
+    {
+    }
+    
+    // The keyframe the cascade belongs to
+    int keyframe;
+    
+    // The light space region covered by the cascade
+    Bounds boundsLightSpace;
+    
+    // Resolution of the entire cascade and the largest individual tile.
+    // Tiles with few shadow casters use a lower resolution.
+    int treeResolution;
+    int tileResolution;
+    
+    // The number of subdivisions in each axis (x, y)
+    int tileSubdivisions;
+    
+    // The index of the cascade's first tile
+    int firstTile;
+    
+    // The camera distance up to which the cascade is used
+    float maxDistance;
+    
+    // The number of tiles in the cascade
+    int tileCount() const { return tileSubdivisions * tileSubdivisions; }
+};
+
+// A rigid dynamic mesh instance with its own tree, built for the main
+// light in the light space of the instance's transform at build time.
+// The tree is moved with the instance while it only translates.
+struct VoxelObjectTree
+{
+    // The mesh instance and the keyframe holding its single tile
+    int meshInstance;
+    int keyframe;
+    
+    // The instance's transform when the tree was built
+    Matrix4x4 bakeLocalToWorld;
+    Quaternion bakeRotation;
+    Vector3 bakeScale;
+    
+    // The instance's rotation and scale in the previous frame.
+    // Used to tell when a rotated instance has come to rest.
+    Quaternion previousRotation;
+    Vector3 previousScale;
+    
+    // True once the tile is uploaded, and while the tree matches
+    // the instance and light closely enough to be sampled.
+    bool built;
+    bool valid;
+};
+
+// The state of a mesh instance when its tiles were last queued for building.
+// Used to find the tiles affected by changes to static geometry.
+struct VoxelStaticInstance
+{
+    VoxelStaticInstance(const MeshInstance &instance, const vector<Bounds> &bounds)
+        : isStatic(instance.isStatic()),
+        changeCount(instance.changeCount()),
+        boundsLightSpace(bounds)
+    {
+    }
+    
+    // Checks if the instance is unchanged since it was recorded.
+    // Instances never become static again, so moving a dynamic
+    // instance does not affect the tree.
+    bool matches(const MeshInstance &instance) const
+    {
+        return changeCount == instance.changeCount() || (isStatic == false && instance.isStatic() == false);
+    }
+    
+    bool isStatic;
+    unsigned int changeCount;
+    
+    // The region covered by the instance in each keyframe's light space.
+    // Empty for dynamic instances.
+    vector<Bounds> boundsLightSpace;
+};
+
+// A tile waiting to be built. Its light space bounds are kept
+// so the build queue can be reprioritized as the camera moves.
+struct VoxelQueuedTile
+{
+    VoxelQueuedTile()
+        : cascade(0),
+        boundsMin(Vector3::zero()),
+        boundsMax(Vector3::zero())
+    {
+    }
+    
+    int cascade;
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+};
+
+// The parts of the build that run on the main thread.
+// Each frame runs steps until the frame's build time budget is used.
+enum class VoxelBuildStep
+{
+    None,
+    
+    // Fitting a keyframe to a new light rotation or to moved static
+    // geometry, a few static instances at a time, before its tiles
+    // are queued.
+    RefitKeyframe,
+    
+    // Starting a tile. Its dual shadow map is rendered a few instances
+    // at a time and read back into pixel buffers, then copied once the
+    // GPU has finished, before the tile's builder is started.
+    RenderEntryDepths,
+    RenderExitDepths,
+    ReadEntryDepths,
+    ReadExitDepths,
+    
+    // Uploading merged tiles. New nodes are uploaded in parts, then
+    // the root entries pointing at them. After the tree is compacted or
+    // outgrows the GPU buffer, it is uploaded in parts to a new buffer.
+    UploadNodes,
+    UploadRootEntries,
+    UploadTree,
+    
+    Count
+};
+
+// The stages of a tile's build, connected by bounded queues.
+// The depths are rendered and read back and the tree is uploaded on
+// the main thread. The mips and tree are built by pools of worker
+// threads, and the merging thread writes finished tiles into the tree.
+enum class VoxelBuildStage
+{
+    Render,
+    Readback,
+    Mips,
+    Tree,
+    Merge,
+    Upload,
+    
+    Count
+};
+
+// A tile whose depths are being rendered and read back on the main
+// thread. The depths are read back into pixel buffers, which are
+// ready to be copied once the fence is signalled.
+struct VoxelTileReadback
+{
+    VoxelTileReadback()
+        : step(VoxelBuildStep::None),
+        tile(-1),
+        resolution(0),
+        sequence(0),
+        renderedInstances(0),
+        entryDepths(NULL),
+        fence(NULL)
+    {
+        readBuffers[0] = 0;
+        readBuffers[1] = 0;
+    }
+    
+    // The next step, or None if the slot is free
+    VoxelBuildStep step;
+    
+    int tile;
+    int resolution;
+    
+    // The order the tiles were started in.
+    // Tiles are read back in the same order.
+    int sequence;
+    
+    // The scene instances rendered so far into the depths being
+    // rendered. Zero unless a render is part way through, in which
+    // case no other tile is rendered until it is finished.
+    int renderedInstances;
+    
+    float* entryDepths;
+    GLuint readBuffers[2];
+    GLsync fence;
+};
+
+// A keyframe being fitted to the static geometry on the main thread.
+// The static instances are measured over several build steps, first
+// for the scene bounds and then for the density of shadow casters.
+struct VoxelKeyframeRefit
+{
+    VoxelKeyframeRefit(int keyframe)
+        : keyframe(keyframe),
+        measuringCasters(false),
+        nextInstance(0),
+        sceneBounds(Vector3::zero(), Vector3::zero()),
+        casterLayers()
+    {
+    }
+    
+    int keyframe;
+    
+    // Set once the scene bounds are measured and the cascades moved
+    // to them. The next scene instance to measure in either pass.
+    bool measuringCasters;
+    int nextInstance;
+    
+    // The bounds of the static instances measured so far, including
+    // the origin, and the caster layers of each tile
+    Bounds sceneBounds;
+    vector<float> casterLayers;
+};
 
 class VoxelTree
 {
-    // The maximum tile count. Each tile is up to 16K.
+    // The maximum tile count per cascade. Each tile is up to 16K.
     const static int MaxTileCount = 64*64;
     
-    // The maximum number of tiles that are built simultaneously.
-    const static int ConcurrentBuilds = 6;
+    // The maximum number of cascades for each keyframe,
+    // including the cascade covering the entire scene.
+    const static int MaxCascadesPerKeyframe = 4;
+    
+    // The number of voxels kept between the edge of a local light's
+    // view and the region it lights, so PCF lookups stay in the view.
+    // Object trees keep the same margin around their instance.
+    // Must match PCF_MAX_OFFSET in the voxel sampling shader.
+    const static int LocalLightPCFMargin = 32;
+    
+    // The near plane of a local light's views, as a fraction of its range
+    constexpr static float LocalLightNearPlane = 0.01;
+    
+    // The default number of tiles rendered and read back at once,
+    // and of threads building tiles' mips and trees.
+    const static int DefaultRenderConcurrency = 2;
+    const static int DefaultMipConcurrency = 2;
+    const static int DefaultConcurrentBuilds = 6;
     
+    // The default number of tiles waiting between two stages
+    const static int DefaultStageQueueDepth = 2;
+    
+    // The default memory (MB) that tiles being built can use.
+    // A 4K tile needs about 300 MB, most of it its builder's node buffer.
+    const static int DefaultBuildMemoryBudgetMB = 4096;
+    
+    // The default time (ms) spent each frame on the main thread's part of
+    // the build, rendering tile depths and uploading the tree. Zero means
+    // there is no limit.
+    constexpr static float DefaultBuildFrameBudget = 4.0;
+    
+    // The most node data uploaded by a single build step
+    const static int UploadStepBytes = 4 * 1024 * 1024;
+    
+    // The most scene instances rendered into a tile's depths by a
+    // single build step
+    const static int RenderStepInstances = 256;
+    
+    // The most static mesh vertices measured by a single keyframe refit step
+    const static int RefitStepVertices = 64 * 1024;
+    
+    // The GPU tree buffer is allocated with room for the tree to
+    // grow by this factor, so new nodes can be added to it in place.
+    constexpr static float TreeBufferGrowth = 1.5;
+    
+    // The maximum number of times a tile's resolution can be halved
+    // in areas with few shadow casters.
+    const static int MaxResolutionReduction = 4;
+    
+    // The change in rotation (degrees) before a rotatable light's tree
+    // is rebuilt, and the furthest a running rebuild can fall behind
+    // the light before it is cancelled and restarted.
+    constexpr static float RebuildAngle = 1.0;
+    constexpr static float MaxRebuildLag = 10.0;
+    
+    // The maximum number of dynamic mesh instances with their own tree,
+    // and the resolution of each object tree.
+    const static int MaxObjectTrees = 8;
+    const static int ObjectTreeResolution = 512;
+    
+    // The change in an instance's rotation (degrees) before its tree
+    // no longer matches and its shadow falls back to the shadow map.
+    constexpr static float ObjectRotationTolerance = 0.5;
+    
+    // Unused nodes are collected once rebuilt tiles have grown the
+    // tree by this factor since the last collection. The compacted copy
+    // only holds live nodes, so it is never larger than the tree it
+    // replaces. Tiles that would grow the tree past its buffer are not merged.
+    constexpr static float GarbageCollectionGrowth = 1.25;
+    
+    // The number of tiles copied into the compacted tree at a time.
+    // Merges are handled between the steps.
+    const static int CompactionStepTiles = 4;
+    
+    // The number of tiles whose build priority is checked each frame
+    // after the camera moves. Queued tiles are swept in index order.
+    const static int TilePriorityUpdatesPerFrame = 1024;
+
+    // The number of tiles whose depths are recorded for benchmarking,
+    // and the largest recorded tile resolution. A 4K tile is 128 MB.
+    const static int MaxRecordedTiles = 4;
+    const static int MaxRecordedResolution = 4096;
+
 public:
     VoxelTree(UniformManager* uniformManager, const Scene* scene, int resolution);
-
+    ~VoxelTree();
+    
     // The size of the PCF filter kernel.
     // Either 9 or 17.
     int pcfFilterSize() const { return pcfKernelSize_; }
     
-    // The total resolution of the tree
-    int resolution() const { return treeResolution_; }
+    // The resolution of the main light's cascade covering the entire scene
+    int resolution() const;
     
-    // The number of subdivisions in each axis (x, y)
-    int tileSubdivisions() const { return treeResolution_ / tileResolution_; }
+    // The lights and light rotations the tree is built for
+    const vector<VoxelLight>& lights() const { return lights_; }
+    const vector<VoxelKeyframe>& keyframes() const { return keyframes_; }
+    
+    // The trees of rigid dynamic mesh instances.
+    // Their keyframes follow those of the lights.
+    const vector<VoxelObjectTree>& objectTrees() const { return objectTrees_; }
+    
+    // True if a dynamic mesh instance is currently shadowed by its own
+    // tree, so it can be left out of the shadow map.
+    bool hasVoxelShadows(int meshInstance) const;
+    
+    // The cascades making up the tree.
+    // Grouped by keyframe, highest resolution first.
+    const vector<VoxelCascade>& cascades() const { return cascades_; }
+    
+    // The number of tiles in different states.
+    // Tiles waiting to be rebuilt are not complete.
+    int totalTiles() const { return totalTiles_; }
+    int completedTiles() const { return std::max(totalTiles_ - (requestedTiles_ - uploadedTiles_), 0); }
+    int requestedTiles() const { return requestedTiles_; }
+    
+    // The number of tiles each build stage works on at once.
+    // Tiles are read back, merged and uploaded one at a time.
+    // Must be set before the build is first updated.
+    int stageConcurrency(VoxelBuildStage stage) const { return stageConcurrency_[(int)stage]; }
+    void setStageConcurrency(VoxelBuildStage stage, int concurrency);
     
-    // The number of tiles in different states
-    int totalTiles() const { return tileSubdivisions() * tileSubdivisions(); }
-    int completedTiles() const { return uploadedTiles_; }
+    // The number of tiles that can wait between two stages. A stage
+    // stops when the next one falls behind, so at most
+    // tilesInFlightLimit() tiles hold depths or trees in memory.
+    // Must be set before the build is first updated.
+    int stageQueueDepth() const { return stageQueueDepth_; }
+    void setStageQueueDepth(int depth);
+    int tilesInFlightLimit() const;
+    
+    // The number of threads building tile trees
+    int concurrentBuilds() const { return stageConcurrency(VoxelBuildStage::Tree); }
+    void setConcurrentBuilds(int builds) { setStageConcurrency(VoxelBuildStage::Tree, builds); }
+    
+    // The memory (MB) that the tiles being built can use, including the
+    // unused buffers kept by the buffer pool. Tiles wait to be started
+    // until the memory they need at their largest is free, but one tile
+    // is always started so the build progresses. Zero means there is no
+    // limit.
+    int buildMemoryBudgetMB() const { return buildMemoryBudget_ / (1024 * 1024); }
+    void setBuildMemoryBudgetMB(int megabytes) { buildMemoryBudget_ = (size_t)std::max(megabytes, 0) * 1024 * 1024; }
+    
+    // The estimated memory used by the tiles in each build stage, including
+    // those waiting for the stage, and the total with the buffer pool's
+    // unused buffers and the most since the build started.
+    size_t stageMemoryBytes(VoxelBuildStage stage) const { return stageMemoryBytes_[(int)stage]; }
+    size_t buildMemoryBytes() const;
+    size_t peakBuildMemoryBytes() const { return peakBuildMemory_; }
+    
+    // The time (ms) each frame that updateBuild spends on the main thread.
+    // Steps that are expected to exceed the budget are left for the next
+    // frame, but one step always runs so the build progresses.
+    // Zero means there is no limit.
+    float buildFrameBudget() const { return buildFrameBudget_; }
+    void setBuildFrameBudget(float milliseconds) { buildFrameBudget_ = std::max(milliseconds, 0.0f); }
+    
+    // The time (ms) updateBuild spent on the main thread, averaged over
+    // recent frames, and the most in one frame and in total since the
+    // build started.
+    float buildFrameTime() const { return buildFrameTime_; }
+    float peakBuildFrameTime() const { return peakBuildFrameTime_; }
+    float totalBuildTime() const { return totalBuildTime_; }
+    
+    // In a deterministic build, tiles are started in index order, after
+    // those being displayed, and merged in the order they were started,
+    // so the buffer is identical whatever the number of builders or
+    // the camera position. Tiles are still built concurrently.
+    // Must be set before the first update.
+    bool deterministicBuild() const { return deterministicBuild_; }
+    void setDeterministicBuild(bool deterministic) { deterministicBuild_ = deterministic; }
+    
+    // A hash of every tile's tree, independent of the buffer layout,
+    // and a hash of the buffer bytes. See VoxelWriter::fingerprint.
+    // Recorded by the merge thread once the first build is merged,
+    // for deterministic builds only.
+    uint64_t fingerprint() const { return buildFingerprint_; }
+    uint64_t checksum() const { return buildChecksum_; }
+    
+    // Records the dual shadow maps of the next few tiles that are
+    // started to a file, replacing its contents. The recorded tiles
+    // are used by the builder microbenchmarks.
+    void recordTileDepths(const char* fileName);
     
     // The size of the tree
     size_t sizeBytes() const;
@@ -64,13 +518,43 @@ public:
     // Carrys out the tree construction process using time slicing.
     // Most of the work is carried out via background threads, but
     // some work (eg openGL rendering) occurs on the main thread
-    // inside this function.
+    // inside this function, within the build frame budget.
     void updateBuild();
     
+    // Compares the scene's static mesh instances with those the tree was
+    // built from. Every tile overlapping a moved static instance, or one
+    // made dynamic, is rebuilt and its root pointer replaced once merged.
+    // Keyframes the geometry has moved out of are refitted and rebuilt.
+    // Returns the number of tiles queued for rebuilding.
+    int updateStaticGeometry();
+    
+    // Compares the rotation of each rotatable light with its displayed
+    // keyframe. The other keyframe is rebuilt in the background for the
+    // new rotation, cancelling any outdated rebuild, and is displayed once
+    // its cascade covering the entire scene is built. Tiles in the finer
+    // cascades fall back to that cascade until they are built.
+    // Returns the number of rebuilds started.
+    int updateLightRotations();
+    
+    // Moves the tree of each rigid dynamic instance with the instance.
+    // Trees are disabled while their instance is rotated or scaled from
+    // the transform they were built with, or the main light has rotated,
+    // so the instance falls back to the shadow map. They are rebuilt once
+    // the light has rotated or the instance comes to rest.
+    void updateObjectTrees();
+    
+    // Creates a CPU sampler for the main light at its current keyframe.
+    // The sampler copies the tree, so it is unaffected by later rebuilds
+    // and can be shared by other threads. The caller owns the sampler.
+    VoxelTreeSampler* createSampler();
+    
+    // Walks the whole tree, including every light and keyframe, and
+    // reports how its nodes are shared. The caller owns the stats.
+    VoxelTreeStats* computeStats();
+    
 private:
     UniformManager* uniformManager_;
     const Scene* scene_;
-    Bounds sceneBoundsLightSpace_;
     
     // A timer used for construction time measurements
     QElapsedTimer buildTimer_;
@@ -78,14 +562,75 @@ private:
     // The size of the PCF filter kernel
     int pcfKernelSize_;
     
-    // The building status
-    int startedTiles_;
-    int mergedTiles_;
-    int uploadedTiles_;
+    // The building status.
+    // Requested tiles includes tiles queued for rebuilding.
+    // Tiles are merged on the merge thread and counted on the main thread.
+    std::atomic<int> requestedTiles_;
+    std::atomic<int> startedTiles_;
+    std::atomic<int> mergedTiles_;
+    std::atomic<int> uploadedTiles_;
+    bool deterministicBuild_;
+    
+    // The hashes of the first deterministic build
+    std::atomic<uint64_t> buildFingerprint_;
+    std::atomic<uint64_t> buildChecksum_;
+    
+    // The concurrency of each stage and the depth of the queues between them
+    int stageConcurrency_[(int)VoxelBuildStage::Count];
+    int stageQueueDepth_;
+    
+    // The build memory budget, the memory reserved by the started tiles
+    // for their largest stage and the memory used by each stage (bytes)
+    size_t buildMemoryBudget_;
+    size_t peakBuildMemory_;
+    std::atomic<size_t> reservedBuildMemory_;
+    std::atomic<size_t> stageMemoryBytes_[(int)VoxelBuildStage::Count];
+    
+    // The main thread's build time budget and measurements, and the
+    // recent time (ms) taken by each type of build step
+    float buildFrameBudget_;
+    float buildFrameTime_;
+    float peakBuildFrameTime_;
+    float totalBuildTime_;
+    float buildStepTimes_[(int)VoxelBuildStep::Count];
+    
+    // Tile starts and uploads take turns to run first
+    bool uploadFirst_;
+    
+    // The tiles being rendered and read back, and the one whose
+    // step is run next. The next started tile's sequence number.
+    vector<VoxelTileReadback> readbacks_;
+    int nextReadback_;
+    int readbackSequence_;
+    
+    // The keyframes waiting to be refitted, in the order they were
+    // requested. Only the first is measured by the refit steps.
+    vector<VoxelKeyframeRefit> refits_;
+    
+    // The lights, keyframes, cascades and the total tile count
+    vector<VoxelLight> lights_;
+    vector<VoxelKeyframe> keyframes_;
+    vector<VoxelCascade> cascades_;
+    int totalTiles_;
+    
+    // The number of times a rotated light's keyframe was rebuilt
+    // and the tiles queued for those rebuilds, for the stats report
+    int keyframeRebuilds_;
+    int keyframeRebuildTiles_;
+    
+    // The trees of rigid dynamic instances and their first keyframe
+    vector<VoxelObjectTree> objectTrees_;
+    int firstObjectKeyframe_;
+    
+    // Whether each mesh instance is shadowed by its own tree this frame
+    vector<bool> objectShadows_;
     
-    // Resolution of the entire tree and an individual tile
-    int treeResolution_;
-    int tileResolution_;
+    // The resolution of each tile
+    vector<int> tileResolutions_;
+    
+    // The uniform buffer contents.
+    // Kept so the keyframe blend can be updated each frame.
+    VoxelsUniformBuffer uniformBuffer_;
     
     // The voxel buffer and containing buffer texture.
     GLuint buffer_;
@@ -95,43 +640,356 @@ private:
     ShadowMap shadowMap_;
     
     // The VoxelWriter containing the entire tree.
+    // The mutex prevents uploads while the tree's root entries are
+    // changed or it is swapped for a compacted copy.
     VoxelWriter voxelWriter_;
+    mutex voxelWriterMutex_;
+    
+    // The size of the nodes of every merged tile. The merge thread writes
+    // the next tile's nodes past it without the lock, so other threads
+    // only read the tree up to this size. Published with release ordering
+    // once the tile's nodes are written.
+    std::atomic<size_t> committedSizeWords_;
+    
+    // The file the next started tiles' depths are recorded to,
+    // and the number recorded so far
+    string depthRecordingFile_;
+    int recordedTiles_;
+    
+    // Set by the main thread once every tile of the first build is uploaded
+    std::atomic<bool> firstBuildComplete_;
+    
+    // The size of the tree after it was last compacted.
+    // Zero until the first build is finished.
+    size_t collectedSizeWords_;
+    
+    // The compacted copy of the tree being built, the number of tiles
+    // copied into it so far and the root each tile was copied from.
+    // NULL when the tree is not being compacted.
+    VoxelWriter* compactedWriter_;
+    int compactedTiles_;
+    vector<VoxelPointer> compactedRoots_;
     
-    // The tiles that are not started yet and those being built
-    vector<int> notStartedTiles_;
+    // The number of times the tree has been compacted. Compacting
+    // moves nodes, so the whole tree must be uploaded again.
+    std::atomic<int> compactions_;
+    
+    // The number of tiles discarded as they did not fit in
+    // the tree's node buffer. Only used by the merging thread.
+    int unmergedTiles_;
+    
+    // The size of the node data uploaded to the GPU, the size of the
+    // GPU buffer and the number of compactions of the uploaded tree
+    size_t uploadedSizeWords_;
+    size_t bufferCapacityWords_;
+    int uploadedCompactions_;
+    
+    // The buffer the whole tree is uploaded to in parts, after it is
+    // compacted or outgrows the GPU buffer. The tree buffer is rendered
+    // until it is replaced. The size uploaded so far, the buffer's size
+    // and the number of compactions of the tree being uploaded.
+    // Zero when no upload is in progress.
+    GLuint pendingBuffer_;
+    size_t pendingSizeWords_;
+    size_t pendingCapacityWords_;
+    int pendingCompactions_;
+    
+    // Set by uploads that change the uniform buffer, which is then
+    // updated once after the frame's build steps
+    bool uniformBufferDirty_;
+    
+    // The tiles that are not started yet and those being built.
+    // Every builder stays in the active tiles until it is merged.
+    VoxelTileQueue notStartedTiles_;
     vector<VoxelBuilder*> activeTiles_;
     mutex activeTilesMutex_;
     
-    // The thread that merges finished tiles into voxelWriter_
+    // The builders waiting for each worker stage
+    VoxelBuildQueue mipQueue_;
+    VoxelBuildQueue treeQueue_;
+    VoxelBuildQueue mergeQueue_;
+    
+    // The most recently started builder for each tile.
+    // Older builders of rebuilt tiles are discarded when finished.
+    vector<VoxelBuilder*> latestBuilders_;
+    
+    // The bounds of each queued tile, and whether each cascade is
+    // displayed, so its tiles are built first
+    vector<VoxelQueuedTile> queuedTiles_;
+    vector<bool> currentCascades_;
+    
+    // The camera used to prioritize the queued tiles, its position in
+    // each keyframe's light space and the planes of its view frustum
+    // in each keyframe's light space (6 per keyframe). There are no
+    // planes if the camera is not perspective.
+    Matrix4x4 priorityCameraToWorld_;
+    vector<Vector3> priorityCameraPositions_;
+    vector<Vector4> priorityFrustumPlanes_;
+    
+    // The next tile checked by the priority sweep, and the
+    // number left to check since the camera last moved
+    int prioritySweepTile_;
+    int prioritySweepRemaining_;
+    
+    // The mesh instances the tree was built from
+    vector<VoxelStaticInstance> staticInstances_;
+    
+    // The threads building the tiles' mips and trees, and the
+    // thread that merges finished tiles into voxelWriter_.
+    // Started by the first build update.
+    vector<thread> mipThreads_;
+    vector<thread> treeThreads_;
     thread mergingThread_;
+    bool pipelineStarted_;
+    
+    // Creates the readback slots and starts the worker threads
+    void startPipeline();
     
-    // Starts the processing of the next queued tile.
-    // Renders the tile's depth maps and starts a builder thread.
-    void startTileBuild();
+    // Estimates the memory (bytes) a tile uses in a build stage.
+    // Tiles use the most while their mips and tree are built.
+    size_t tileMemoryBytes(VoxelBuildStage stage, int resolution) const;
+    
+    // Checks if the build memory budget has room to start a tile
+    bool hasBuildMemoryFor(int tile) const;
+    
+    // Records a tile's memory moving between stages. Finishing releases
+    // the tile's reservation once it is merged or cancelled.
+    void moveTileMemory(int resolution, VoxelBuildStage from, VoxelBuildStage to);
+    void finishTileMemory(int resolution, VoxelBuildStage stage);
+    
+    // Finds the next tile start or upload step, or None if there
+    // is nothing to do or it must wait for the GPU or the mip stage.
+    // Tile start steps are run on readbacks_[nextReadback_].
+    VoxelBuildStep nextTileStartStep();
+    VoxelBuildStep nextUploadStep() const;
+    void runBuildStep(VoxelBuildStep step);
+    
+    // Starts the processing of the next queued tile over several steps.
+    // Renders the tile's entry and exit depths, copies them once they
+    // are read back and queues its builder for the mip stage.
+    void startTileBuild(VoxelTileReadback &readback);
+    void renderTileEntryDepths(VoxelTileReadback &readback);
+    void renderTileExitDepths(VoxelTileReadback &readback);
+    void readTileEntryDepths(VoxelTileReadback &readback);
+    void createTileBuilder(VoxelTileReadback &readback);
     int getNextTileToStart();
     
+    // Stops starting a tile, eg if its keyframe is cancelled
+    void cancelTileStart(VoxelTileReadback &readback);
+    
+    // Keeps the build queue in priority order. Every queued tile is
+    // reprioritized when the displayed keyframes change. When the camera
+    // moves, the queued tiles are reprioritized a few at a time.
+    void updateTilePriorities();
+    
+    // Finds the cascades whose tiles are built first. These are the
+    // displayed keyframes' cascades, and the cascade covering the entire
+    // scene in keyframes being rebuilt.
+    vector<bool> findCurrentCascades() const;
+    
+    // Records the camera position and view frustum in each keyframe's
+    // light space. Returns false if the camera has not moved.
+    bool updatePriorityCamera();
+    
+    // Computes the build priority of a queued tile
+    VoxelTilePriority tilePriority(int tile) const;
+    
+    // Checks if a queued tile is inside the camera's view frustum
+    bool isTileVisible(int tile) const;
+    
+    // Run on the worker threads.
+    // Build the mips and then the trees of queued tiles.
+    void buildTileMips();
+    void buildTileTrees();
+    
     // Runs on the merging thread.
-    // Merges finished builders into the
+    // Merges finished builders into the tree.
     void mergeTiles();
+    void mergeTile(VoxelBuilder* builder, bool outdated);
+    
+    // Counts a merged tile. Records the hashes of a deterministic
+    // build before its last tile is counted, so they are ready
+    // by the time the main thread sees the build finish.
+    void countMergedTile();
+    
+    // Looks for a finished builder that is ready to be merged.
+    // Removes it from the finished and active tiles vectors.
+    VoxelBuilder* findFinishedBuilder(vector<VoxelBuilder*> &finished);
+    
+    // Runs on the merging thread.
+    // Removes nodes left behind by rebuilt tiles if enough have built up.
+    // The live trees are copied into a compacted writer a few tiles at a
+    // time, without holding the writer lock, which is then swapped in.
+    void collectGarbage();
+    void compactTreeStep();
+    void copyCompactedTile(int tile, VoxelPointer root, int treeHeight);
+    void finishCompaction();
+    
+    // Moves a rotatable light's hidden keyframe to a new rotation
+    // and queues its tiles for building.
+    void rebuildKeyframe(int light, const Quaternion &rotation);
+    
+    // Moves a keyframe to a rotation and starts fitting its cascades to
+    // the current static geometry. Its tiles are queued for building by
+    // the refit build steps once the geometry is measured.
+    void refitKeyframe(int keyframe, const Quaternion &rotation);
+    
+    // Measures the next few static instances for the first refit, then
+    // moves the keyframe's cascades or queues its tiles.
+    void refitKeyframeStep();
+    
+    // Checks if a keyframe is waiting to be refitted or being refitted
+    bool isRefittingKeyframe(int keyframe) const;
+    
+    // Measures the refitted keyframes again from the first instance,
+    // eg after static geometry they already measured has moved
+    void restartKeyframeRefits();
+    
+    // Removes a keyframe's queued tiles and refit, cancels its running
+    // builders and resets its root pointers to the empty node.
+    void cancelKeyframeBuilds(int keyframe);
+    
+    // Refits the next outgrown keyframe of each light with a staging
+    // keyframe into it, once it is not replacing another keyframe.
+    // Returns the number of tiles queued by the refits.
+    int startKeyframeReplacements();
+    
+    // Displays rebuilt keyframes once their cascade covering the entire
+    // scene is built, and staging keyframes in place of the keyframe
+    // they replace once all of their tiles are built. Called with
+    // voxelWriterMutex_ locked. Returns true if any keyframe was swapped.
+    bool swapRebuiltKeyframes();
+    
+    // Checks if every tile in a range has been merged since it was reset.
+    // Called with voxelWriterMutex_ locked.
+    bool areTilesBuilt(int firstTile, int endTile) const;
+    
+    // Checks if a keyframe is neither displayed nor being rebuilt
+    bool isSpareKeyframe(int keyframe) const;
+    
+    // Checks if a keyframe holds an object tree
+    bool isObjectKeyframe(int keyframe) const { return keyframe >= firstObjectKeyframe_; }
+    
+    // Queues an object tree for rebuilding at the light's new rotation
+    void rebuildObjectTree(int index, const Quaternion &lightRotation);
+    
+    // Fits an object tree to its instance's current transform.
+    // Called when the tree's tile is started.
+    void prepareObjectTree(int index);
     
-    // Looks for a builder that has finished and is ready
-    // to be merged. Removes it from the active tiles vector.
-    VoxelBuilder* findFinishedBuilder();
+    // The range of tiles in a keyframe's cascades
+    int keyframeFirstTile(int keyframe) const;
+    int keyframeEndTile(int keyframe) const;
     
-    // Updates the uniform buffer and tree texture buffer
-    void updateBuffers();
+    // Updates the uniform buffer.
     void updateUniformBuffer();
+    
+    // Uploads the whole tree to the tree texture buffer.
+    // Only used when the tree is created, while it is small.
     void updateTreeBuffer();
     
+    // Uploads part of the whole tree to the pending buffer, which
+    // replaces the tree buffer once every node is uploaded
+    void uploadTreePart();
+    
+    // Uploads part of the nodes added since the last upload
+    void uploadNewNodes();
+    
+    // Uploads the remaining new nodes and the root entries,
+    // so the uploaded tree includes every merged tile.
+    void uploadRootEntries();
+    
+    // Displays the keyframes and object trees that are now uploaded.
+    // Called with voxelWriterMutex_ locked.
+    void finishTreeUpload(int mergedTiles);
+    
+    // Computes the world to voxel matrix of a cascade
+    Matrix4x4 cascadeWorldToVoxels(int cascade);
+    
+    // Enables or disables an object tree's cascade and moves it with
+    // its instance. Returns true if the uniform buffer data changed.
+    bool updateObjectCascade(int index);
+    
+    // Updates the keyframe blend to match each light's current rotation
+    void updateKeyframeBlend();
+    
     // Computes the bitmask to use on a leaf for the with
     // the specified PCF kernel centre coordinates
     uint64_t pcfBitmask(int kernelX, int kernelY) const;
     
-    // Computes bounds of the scene in light space.
+    // Creates a keyframe for each of each light's keyframed rotations,
+    // or a single keyframe if the light does not move.
+    // Local lights get a perspective keyframe for each view.
+    void createKeyframes();
+    void addLocalKeyframe(const Light &light, const Quaternion &rotation, float fieldOfView);
+    
+    // Creates a keyframe for each rigid dynamic instance's tree
+    void createObjectKeyframes();
+    
+    // Creates the cascades covering the scene for each keyframe.
+    // The entire scene is covered at the specified resolution.
+    void createCascades(int resolution);
+    void addCascade(int keyframe, const Bounds &bounds, int resolution, float maxDistance);
+    
+    // Computes the light space bounds of a scene cascade region in a keyframe
+    Bounds regionBoundsLightSpace(const VoxelKeyframe &keyframe, const VoxelCascadeRegion &region) const;
+    
+    // Moves a keyframe's cascades to match its rotation and scene bounds
+    void updateCascadeBounds(int keyframe);
+    
+    // Finds the cascade containing the specified tile
+    const VoxelCascade& tileCascade(int index) const;
+    
+    // Chooses the resolution of each tile from the density of shadow
+    // casters in the tile, or the scene's importance map if it has one.
+    // The caster layers can be summed over several steps, one instance
+    // at a time, before the resolutions are chosen from them.
+    void computeTileResolutions(int keyframe);
+    void addCasterAreas(int keyframe, const MeshInstance &instance, vector<float> &casterLayers) const;
+    void finishTileResolutions(int keyframe, const vector<float> &casterLayers);
+    int computeTileResolution(int index, float casterDensity) const;
+    
+    // Adds the projected area of a light space triangle to the
+    // caster layers of the cascade's tiles it covers.
+    void addCasterArea(const VoxelCascade &cascade, const Vector3 &a, const Vector3 &b, const Vector3 &c, vector<float> &casterLayers) const;
+    
+    // Computes bounds of the scene in a keyframe's light space.
     // The bounds includes *static* objects only.
-    Bounds computeSceneBoundsLightSpace() const;
+    Bounds computeSceneBoundsLightSpace(const Quaternion &lightRotation) const;
     Bounds tileBoundsLightSpace(int index) const;
+    Bounds instanceBoundsLightSpace(const MeshInstance &instance, int keyframe) const;
+    
+    // Computes the bounds of an object tree's instance in its keyframe's
+    // light space, padded so PCF lookups around the instance stay in the tree.
+    Bounds objectBoundsLightSpace(int index) const;
+    
+    // Records the current state of the scene's mesh instances
+    vector<VoxelStaticInstance> findStaticInstances() const;
+    VoxelStaticInstance recordStaticInstance(const MeshInstance &instance) const;
+    
+    // Marks the tiles in a keyframe's cascades that overlap the light space bounds
+    void findOverlappingTiles(int keyframe, const Bounds &bounds, vector<bool> &tiles) const;
+    
+    // Adds tiles to the build queue.
+    // Restarts the merging thread if it has finished.
+    void queueTileBuilds(const vector<int> &tiles);
+    
+    // Gets the world to light space matrix, and its inverse.
+    // Directional lights have no translation.
+    static Matrix4x4 worldToLightMatrix(const Quaternion &lightRotation, const Vector3 &lightPosition = Vector3::zero());
+    static Matrix4x4 lightToWorldMatrix(const Quaternion &lightRotation, const Vector3 &lightPosition = Vector3::zero());
+    
+    // Covers a tile with the shadow map used for dual shadow maps
+    void setTileShadowMap(const Bounds &bounds, const VoxelKeyframe &keyframe, int resolution);
+    
+    // Renders the next instances into the entry or exit depths of a
+    // starting tile. Once every instance is rendered, starts reading the
+    // depths back into a pixel buffer, without waiting for the GPU, and
+    // returns true.
+    bool renderTileDepths(VoxelTileReadback &readback, bool exitDepths);
     
-    // Renders dual shadow maps for the scene.
-    void computeDualShadowMaps(const Bounds &bounds, float** entryDepths, float** exitDepths);
+    // Copies a starting tile's depths from their pixel buffer.
+    // Perspective depths are converted to linear depths.
+    float* readTileDepths(const VoxelTileReadback &readback, bool exitDepths);
+    void linearizeDepths(const VoxelKeyframe &keyframe, int resolution, float* depths) const;
 };
@@ -0,0 +1,1351 @@
+#include "VoxelTreeSampler.hpp"
+
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+
+#include <QFile>
+
+VoxelSamplerRegion VoxelSamplerRegion::toTile(float offsetX, float offsetY, float scale) const
+{
+    VoxelSamplerRegion region = *this;
+    for(int i = 0; i < 4; ++i)
+    {
+        region.corners[i] = (corners[i] - Vector2(offsetX, offsetY)) * (1.0 / scale);
+    }
+    
+    // The surface slope is unchanged as x, y and depth are all scaled
+    region.depthOffset = (depthX * offsetX + depthY * offsetY + depthOffset) / scale;
+    region.minDepth = minDepth / scale;
+    region.maxDepth = maxDepth / scale;
+    return region;
+}
+
+VoxelTreeSampler::VoxelTreeSampler(const uint32_t* data, size_t sizeWords, const vector<VoxelsUniformBuffer::Cascade> &cascades, VoxelPointer emptyRoot)
+    : data_(NULL),
+    sizeWords_(sizeWords),
+    dataCopy_(data, data + sizeWords),
+    mappedFile_(NULL),
+    cascades_(cascades),
+    emptyRoot_(emptyRoot)
+{
+    data_ = &dataCopy_[0];
+}
+
+VoxelTreeSampler::VoxelTreeSampler(const vector<VoxelsUniformBuffer::Cascade> &cascades, VoxelPointer emptyRoot)
+    : data_(NULL),
+    sizeWords_(0),
+    dataCopy_(),
+    mappedFile_(NULL),
+    cascades_(cascades),
+    emptyRoot_(emptyRoot)
+{
+    
+}
+
+VoxelTreeSampler::~VoxelTreeSampler()
+{
+    // Closing the file unmaps it
+    delete mappedFile_;
+}
+
+bool VoxelTreeSampler::save(const char* fileName) const
+{
+    QFile file(fileName);
+    if(file.open(QIODevice::WriteOnly | QIODevice::Truncate) == false)
+    {
+        printf("Failed to create tree file %s \n", fileName);
+        return false;
+    }
+    
+    VoxelTreeFileHeader header;
+    memcpy(header.magic, "VXTS", 4);
+    header.version = TreeFileVersion;
+    header.cascadeCount = cascades_.size();
+    header.emptyRoot = emptyRoot_;
+    header.sizeWords = sizeWords_;
+    
+    qint64 cascadesSize = cascades_.size() * sizeof(VoxelsUniformBuffer::Cascade);
+    qint64 dataSize = sizeWords_ * 4;
+    if(file.write((const char*)&header, sizeof(header)) != sizeof(header)
+       || file.write((const char*)&cascades_[0], cascadesSize) != cascadesSize
+       || file.write((const char*)data_, dataSize) != dataSize)
+    {
+        printf("Failed to write tree file %s \n", fileName);
+        return false;
+    }
+    
+    return true;
+}
+
+VoxelTreeSampler* VoxelTreeSampler::load(const char* fileName)
+{
+    QFile* file = new QFile(fileName);
+    if(file->open(QIODevice::ReadOnly) == false)
+    {
+        printf("Failed to read tree file %s \n", fileName);
+        delete file;
+        return NULL;
+    }
+    
+    // Check the header before mapping the rest of the file
+    VoxelTreeFileHeader header;
+    if(file->read((char*)&header, sizeof(header)) != sizeof(header)
+       || memcmp(header.magic, "VXTS", 4) != 0
+       || header.version != TreeFileVersion
+       || header.cascadeCount == 0)
+    {
+        printf("Invalid tree file %s \n", fileName);
+        delete file;
+        return NULL;
+    }
+    
+    qint64 cascadesSize = header.cascadeCount * sizeof(VoxelsUniformBuffer::Cascade);
+    qint64 fileSize = sizeof(header) + cascadesSize + header.sizeWords * 4;
+    uchar* mapping = (file->size() == fileSize) ? file->map(0, fileSize) : NULL;
+    if(mapping == NULL)
+    {
+        printf("Failed to map tree file %s \n", fileName);
+        delete file;
+        return NULL;
+    }
+    
+    const VoxelsUniformBuffer::Cascade* cascades = (const VoxelsUniformBuffer::Cascade*)(mapping + sizeof(header));
+    VoxelTreeSampler* sampler = new VoxelTreeSampler(vector<VoxelsUniformBuffer::Cascade>(cascades, cascades + header.cascadeCount), header.emptyRoot);
+    sampler->data_ = (const uint32_t*)(mapping + sizeof(header) + cascadesSize);
+    sampler->sizeWords_ = header.sizeWords;
+    sampler->mappedFile_ = file;
+    return sampler;
+}
+
+Bounds VoxelTreeSampler::bounds() const
+{
+    // Cascades are orthographic, so invert the affine part of the matrix
+    const VoxelsUniformBuffer::Cascade &c = cascades_.back();
+    const Matrix4x4 &m = c.worldToVoxels;
+    float a = m.get(0, 0), b = m.get(0, 1), d = m.get(0, 2);
+    float e = m.get(1, 0), f = m.get(1, 1), g = m.get(1, 2);
+    float h = m.get(2, 0), i = m.get(2, 1), j = m.get(2, 2);
+    float determinant = a * (f * j - g * i) - b * (e * j - g * h) + d * (e * i - f * h);
+    
+    Matrix4x4 inverse = Matrix4x4::identity();
+    inverse.setRow(0, (f * j - g * i) / determinant, (d * i - b * j) / determinant, (b * g - d * f) / determinant, 0.0);
+    inverse.setRow(1, (g * h - e * j) / determinant, (a * j - d * h) / determinant, (d * e - a * g) / determinant, 0.0);
+    inverse.setRow(2, (e * i - f * h) / determinant, (b * h - a * i) / determinant, (a * f - b * e) / determinant, 0.0);
+    inverse = inverse * Matrix4x4::translation(Vector3(-m.get(0, 3), -m.get(1, 3), -m.get(2, 3)));
+    
+    // Cover the corners of the cascade's voxels
+    float resolution = (float)(c.tileSubdivisions << c.treeHeight);
+    float depth = (float)(1u << c.treeHeight);
+    Vector4 corners[8];
+    for(int k = 0; k < 8; ++k)
+    {
+        Vector3 corner((k & 4) ? resolution : 0.0, (k & 2) ? resolution : 0.0, (k & 1) ? depth : 0.0);
+        corners[k] = inverse * Vector4(corner, 1.0);
+    }
+    
+    return Bounds::cover(corners, 8);
+}
+
+float VoxelTreeSampler::sample(const Vector3 &position) const
+{
+    VoxelSamplerLookup lookup;
+    if(findVoxel(position, &lookup) == false)
+    {
+        return 1.0;
+    }
+    
+    VoxelPointer path[MaxTreeHeight];
+    path[0] = lookup.root;
+    
+    int lastDepth;
+    return traverse(lookup, 0, path, &lastDepth);
+}
+
+void VoxelTreeSampler::sampleBatch(const vector<Vector3> &positions, vector<float> &results) const
+{
+    // Positions outside the tree are lit
+    results.assign(positions.size(), 1.0);
+    
+    // Find the voxel of each query
+    vector<VoxelSamplerQuery> queries;
+    queries.reserve(positions.size());
+    for(unsigned int i = 0; i < positions.size(); ++i)
+    {
+        VoxelSamplerQuery query;
+        query.index = i;
+        if(findVoxel(positions[i], &query.lookup))
+        {
+            query.mortonCode = mortonCode(query.lookup.coord);
+            queries.push_back(query);
+        }
+    }
+    
+    // Queries in the same tile that are close in Morton order
+    // follow the same path through the upper levels of the tree.
+    std::sort(queries.begin(), queries.end());
+    
+    VoxelPointer path[MaxTreeHeight];
+    const VoxelSamplerQuery* previous = NULL;
+    int previousDepth = 0;
+    
+    for(auto query = queries.begin(); query != queries.end(); ++query)
+    {
+        const VoxelSamplerLookup &lookup = query->lookup;
+        
+        // Resume from the deepest node shared with the previous query
+        int startDepth = 0;
+        if(previous != NULL && previous->lookup.root == lookup.root && previous->lookup.treeHeight == lookup.treeHeight)
+        {
+            while(startDepth < previousDepth
+                  && childIndex(lookup.treeHeight, startDepth, lookup.coord) == childIndex(lookup.treeHeight, startDepth, previous->lookup.coord))
+            {
+                startDepth ++;
+            }
+        }
+        else
+        {
+            path[0] = lookup.root;
+        }
+        
+        results[query->index] = traverse(lookup, startDepth, path, &previousDepth);
+        previous = &(*query);
+    }
+}
+
+float VoxelTreeSampler::shadowedFraction(const Bounds &bounds) const
+{
+    // Use the highest resolution cascade covering the whole region
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        VoxelSamplerRegion region;
+        if(boxRegion(i, bounds, &region) == false)
+        {
+            return 0.0;
+        }
+        
+        if(i + 1 == cascades_.size() || isRegionBuilt(i, region))
+        {
+            return measureRegion(i, region);
+        }
+    }
+    
+    return 0.0;
+}
+
+float VoxelTreeSampler::shadowedFraction(const Vector3 &corner, const Vector3 &edgeA, const Vector3 &edgeB) const
+{
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        // Surfaces seen edge on from the light have no area in the
+        // tree, so use the shadowing at their centre.
+        VoxelSamplerRegion region;
+        if(parallelogramRegion(i, corner, edgeA, edgeB, &region) == false)
+        {
+            return 1.0 - sample(corner + (edgeA + edgeB) * 0.5);
+        }
+        
+        if(i + 1 == cascades_.size() || isRegionBuilt(i, region))
+        {
+            return measureRegion(i, region);
+        }
+    }
+    
+    return 0.0;
+}
+
+void VoxelTreeSampler::shadowIntervals(const Vector3 &start, const Vector3 &end, vector<VoxelShadowInterval> &intervals) const
+{
+    intervals.clear();
+    
+    // Find the segment's ray through each cascade. Each node is
+    // left by a step of a millionth of a voxel past its edge.
+    vector<VoxelSamplerRay> rays(cascades_.size());
+    double step = 1.0;
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        Vector4 a = cascades_[i].worldToVoxels * Vector4(start, 1.0);
+        Vector4 b = cascades_[i].worldToVoxels * Vector4(end, 1.0);
+        double voxelStart[3] = { a.x / a.w, a.y / a.w, a.z };
+        double voxelEnd[3] = { b.x / b.w, b.y / b.w, b.z };
+        
+        double lengthSquared = 0.0;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            rays[i].origin[axis] = voxelStart[axis];
+            rays[i].direction[axis] = voxelEnd[axis] - voxelStart[axis];
+            lengthSquared += rays[i].direction[axis] * rays[i].direction[axis];
+        }
+        
+        if(lengthSquared > 0.0)
+        {
+            step = std::min(step, 1e-6 / sqrt(lengthSquared));
+        }
+    }
+    
+    VoxelPointer path[MaxTreeHeight];
+    VoxelSamplerLookup previous;
+    int previousDepth = 0;
+    bool hasPrevious = false;
+    
+    double t = 0.0;
+    while(t < 1.0)
+    {
+        // Find the node just past the end of the last one
+        double probe = std::min(t + step, 1.0);
+        VoxelSamplerLookup lookup;
+        VoxelSamplerRay tileRay;
+        double exit;
+        bool shadowed = false;
+        if(findSegmentVoxel(rays, probe, &lookup, &tileRay, &exit))
+        {
+            // Resume from the deepest node shared with the last one
+            int startDepth = 0;
+            if(hasPrevious && previous.root == lookup.root && previous.treeHeight == lookup.treeHeight)
+            {
+                while(startDepth < previousDepth
+                      && childIndex(lookup.treeHeight, startDepth, lookup.coord) == childIndex(lookup.treeHeight, startDepth, previous.coord))
+                {
+                    startDepth ++;
+                }
+            }
+            else
+            {
+                path[0] = lookup.root;
+            }
+            
+            int lastDepth;
+            shadowed = (traverse(lookup, startDepth, path, &lastDepth) == 0.0);
+            previous = lookup;
+            previousDepth = lastDepth;
+            hasPrevious = true;
+            
+            // Find the box of the uniform child or voxel that was reached.
+            // The last inner node's children are 8x8x1 leaves.
+            int leafDepth = lookup.treeHeight - 2;
+            uint32_t sizeXY = 1, sizeZ = 1;
+            if(lastDepth == leafDepth - 1)
+            {
+                sizeXY = 8;
+            }
+            else if(lastDepth < leafDepth)
+            {
+                sizeXY = sizeZ = 1u << (lookup.treeHeight - lastDepth - 1);
+            }
+            
+            double boxMin[3], boxMax[3];
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                uint32_t size = (axis < 2) ? sizeXY : sizeZ;
+                boxMin[axis] = (double)(lookup.coord[axis] & ~(size - 1));
+                boxMax[axis] = boxMin[axis] + size;
+            }
+            
+            // Positions behind the tile use its furthest voxels
+            if(boxMax[2] >= (double)(1u << lookup.treeHeight))
+            {
+                boxMax[2] = DBL_MAX;
+            }
+            
+            exit = std::min(exit, exitBox(tileRay, boxMin, boxMax, probe));
+        }
+        
+        // Join intervals with the same shadowing
+        exit = std::min(std::max(exit, probe), 1.0);
+        if(intervals.empty() == false && intervals.back().shadowed == shadowed)
+        {
+            intervals.back().end = exit;
+        }
+        else
+        {
+            VoxelShadowInterval interval = { (float)t, (float)exit, shadowed };
+            intervals.push_back(interval);
+        }
+        
+        t = exit;
+    }
+}
+
+bool VoxelTreeSampler::heightSurface(int cascade, float height, VoxelRasterSurface* surface) const
+{
+    // Find a point on the plane and its axes in voxel space
+    const Matrix4x4 &worldToVoxels = cascades_[cascade].worldToVoxels;
+    Vector3 origin = (worldToVoxels * Vector4(Vector3(0.0, height, 0.0), 1.0)).vec3();
+    Vector3 u = (worldToVoxels * Vector4(Vector3(1.0, 0.0, 0.0), 0.0)).vec3();
+    Vector3 v = (worldToVoxels * Vector4(Vector3(0.0, 0.0, 1.0), 0.0)).vec3();
+    
+    float area = u.x * v.y - u.y * v.x;
+    if(fabs(area) < 1e-6)
+    {
+        return false;
+    }
+    
+    // Fit the surface depth the same way as a parallelogram region
+    surface->depthX = (u.z * v.y - v.z * u.y) / area;
+    surface->depthY = (v.z * u.x - u.z * v.x) / area;
+    surface->depthOffset = origin.z - surface->depthX * origin.x - surface->depthY * origin.y;
+    surface->depths = NULL;
+    return true;
+}
+
+void VoxelTreeSampler::decodeRaster(int cascade, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                                    const VoxelRasterSurface &surface, uint8_t* image, size_t rowStride, int threadCount) const
+{
+    const VoxelsUniformBuffer::Cascade &c = cascades_[cascade];
+    assert(x + width <= (c.tileSubdivisions << c.treeHeight));
+    assert(y + height <= (c.tileSubdivisions << c.treeHeight));
+    
+    if(width == 0 || height == 0)
+    {
+        return;
+    }
+    
+    VoxelRasterJob job;
+    job.cascade = cascade;
+    job.tileResolution = 1u << c.treeHeight;
+    job.x = x;
+    job.y = y;
+    job.width = width;
+    job.height = height;
+    job.surface = surface;
+    job.image = image;
+    job.rowStride = rowStride;
+    job.firstTileX = x >> c.treeHeight;
+    job.firstTileY = y >> c.treeHeight;
+    job.tilesX = ((x + width - 1) >> c.treeHeight) - job.firstTileX + 1;
+    job.tilesY = ((y + height - 1) >> c.treeHeight) - job.firstTileY + 1;
+    job.nextTile = 0;
+    
+    // The calling thread decodes tiles as well
+    vector<thread> threads;
+    for(int i = 1; i < threadCount; ++i)
+    {
+        threads.push_back(thread(&VoxelTreeSampler::decodeTiles, this, &job));
+    }
+    
+    decodeTiles(&job);
+    
+    for(auto t = threads.begin(); t != threads.end(); ++t)
+    {
+        t->join();
+    }
+}
+
+bool VoxelTreeSampler::decodeRasterToFile(const char* fileName, int cascade, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                                          const VoxelRasterSurface &surface, int threadCount) const
+{
+    char header[64];
+    int headerSize = sprintf(header, "P5\n%u %u\n255\n", width, height);
+    qint64 fileSize = headerSize + (qint64)width * height;
+    
+    // Size the file before mapping it
+    QFile file(fileName);
+    if(file.open(QIODevice::ReadWrite | QIODevice::Truncate) == false || file.resize(fileSize) == false)
+    {
+        printf("Failed to create raster file %s \n", fileName);
+        return false;
+    }
+    
+    uchar* data = file.map(0, fileSize);
+    if(data == NULL)
+    {
+        printf("Failed to map raster file %s \n", fileName);
+        return false;
+    }
+    
+    memcpy(data, header, headerSize);
+    decodeRaster(cascade, x, y, width, height, surface, data + headerSize, width, threadCount);
+    
+    file.unmap(data);
+    return true;
+}
+
+void VoxelTreeSampler::decodeTiles(VoxelRasterJob* job) const
+{
+    uint32_t tileCount = job->tilesX * job->tilesY;
+    for(uint32_t tile = job->nextTile++; tile < tileCount; tile = job->nextTile++)
+    {
+        decodeTile(*job, job->firstTileX + tile / job->tilesY, job->firstTileY + tile % job->tilesY);
+    }
+}
+
+void VoxelTreeSampler::decodeTile(const VoxelRasterJob &job, uint32_t tileX, uint32_t tileY) const
+{
+    // Pixels are lit unless a shadowed voxel is found.
+    // Only the tile's part of each row is written, so that
+    // threads never write to the same pixels.
+    uint32_t minX = std::max(tileX * job.tileResolution, job.x);
+    uint32_t minY = std::max(tileY * job.tileResolution, job.y);
+    uint32_t maxX = std::min((tileX + 1) * job.tileResolution, job.x + job.width);
+    uint32_t maxY = std::min((tileY + 1) * job.tileResolution, job.y + job.height);
+    for(uint32_t y = minY; y < maxY; ++y)
+    {
+        memset(job.image + (y - job.y) * job.rowStride + (minX - job.x), 255, maxX - minX);
+    }
+    
+    VoxelPointer root;
+    uint32_t treeHeight;
+    readRootEntry(cascades_[job.cascade], tileX, tileY, &root, &treeHeight);
+    if(root == emptyRoot_)
+    {
+        return;
+    }
+    
+    // Tiles with few shadow casters have shorter trees than the cascade
+    uint32_t origin[3] = { tileX << treeHeight, tileY << treeHeight, 0 };
+    uint32_t scale = job.tileResolution >> treeHeight;
+    decodeInner(job, root, treeHeight, 0, origin, 1u << treeHeight, scale);
+}
+
+void VoxelTreeSampler::decodeInner(const VoxelRasterJob &job, VoxelPointer node, uint32_t treeHeight, int depth, const uint32_t* origin, uint32_t size, uint32_t scale) const
+{
+    uint32_t childMask = data_[node] >> 16;
+    for(uint32_t i = 0; i < 8; ++i)
+    {
+        // The last inner node is a vertical stack of leaves.
+        // Other nodes are split in half along each axis.
+        uint32_t childOrigin[3];
+        uint32_t childSizeXY = size / 2;
+        uint32_t childSizeZ = size / 2;
+        if(depth == (int)treeHeight - 3)
+        {
+            childOrigin[0] = origin[0];
+            childOrigin[1] = origin[1];
+            childOrigin[2] = origin[2] + i;
+            childSizeXY = size;
+            childSizeZ = 1;
+        }
+        else
+        {
+            childOrigin[0] = origin[0] + ((i >> 2) & 1) * childSizeXY;
+            childOrigin[1] = origin[1] + ((i >> 1) & 1) * childSizeXY;
+            childOrigin[2] = origin[2] + (i & 1) * childSizeZ;
+        }
+        
+        // Lit children are already filled
+        uint32_t childState = (childMask >> (i * 2)) & 3;
+        if(childState == VS_Unshadowed)
+        {
+            continue;
+        }
+        
+        // Skip children that the receiver does not pass through
+        uint32_t min[3] = { childOrigin[0] * scale, childOrigin[1] * scale, childOrigin[2] * scale };
+        uint32_t max[3] = { min[0] + childSizeXY * scale, min[1] + childSizeXY * scale, min[2] + childSizeZ * scale };
+        bool inside;
+        if(clipRasterBox(job, min, max, &inside) == false)
+        {
+            continue;
+        }
+        
+        if(childState == VS_Shadowed)
+        {
+            decodeUniform(job, 0, min, max, inside);
+            continue;
+        }
+        
+        VoxelPointer child = data_[node + childPointerOffset(childMask, i)];
+        if(depth == (int)treeHeight - 3)
+        {
+            decodeLeaf(job, child, min, max, inside, scale);
+        }
+        else
+        {
+            decodeInner(job, child, treeHeight, depth + 1, childOrigin, childSizeXY, scale);
+        }
+    }
+}
+
+void VoxelTreeSampler::decodeUniform(const VoxelRasterJob &job, uint8_t value, const uint32_t* min, const uint32_t* max, bool inside) const
+{
+    for(uint32_t y = min[1]; y < max[1]; ++y)
+    {
+        uint8_t* row = job.image + (y - job.y) * job.rowStride;
+        
+        // Fill whole rows of the box when every receiver voxel is inside it
+        if(inside)
+        {
+            memset(row + (min[0] - job.x), value, max[0] - min[0]);
+            continue;
+        }
+        
+        for(uint32_t x = min[0]; x < max[0]; ++x)
+        {
+            int depth = rasterDepth(job, x, y);
+            if(depth >= (int)min[2] && depth < (int)max[2])
+            {
+                row[x - job.x] = value;
+            }
+        }
+    }
+}
+
+void VoxelTreeSampler::decodeLeaf(const VoxelRasterJob &job, VoxelPointer leaf, const uint32_t* min, const uint32_t* max, bool inside, uint32_t scale) const
+{
+    // Set bits are unshadowed. The first word holds the lower 32 bits.
+    uint64_t bits = (uint64_t)data_[leaf] | ((uint64_t)data_[leaf + 1] << 32);
+    
+    for(uint32_t y = min[1]; y < max[1]; ++y)
+    {
+        uint8_t* row = job.image + (y - job.y) * job.rowStride;
+        uint32_t voxelY = (y / scale) & 7;
+        for(uint32_t x = min[0]; x < max[0]; ++x)
+        {
+            if(inside == false)
+            {
+                int depth = rasterDepth(job, x, y);
+                if(depth < (int)min[2] || depth >= (int)max[2])
+                {
+                    continue;
+                }
+            }
+            
+            uint32_t voxelX = (x / scale) & 7;
+            row[x - job.x] = ((bits >> ((voxelX << 3) | voxelY)) & 1) ? 255 : 0;
+        }
+    }
+}
+
+bool VoxelTreeSampler::clipRasterBox(const VoxelRasterJob &job, uint32_t* min, uint32_t* max, bool* inside)
+{
+    min[0] = std::max(min[0], job.x);
+    min[1] = std::max(min[1], job.y);
+    max[0] = std::min(max[0], job.x + job.width);
+    max[1] = std::min(max[1], job.y + job.height);
+    if(min[0] >= max[0] || min[1] >= max[1])
+    {
+        return false;
+    }
+    
+    // A plane is deepest and shallowest at the corner columns.
+    // Other surfaces are checked column by column.
+    int minDepth = INT_MAX;
+    int maxDepth = -1;
+    if(job.surface.depths == NULL)
+    {
+        for(int i = 0; i < 4; ++i)
+        {
+            int depth = rasterDepth(job, (i & 1) ? max[0] - 1 : min[0], (i & 2) ? max[1] - 1 : min[1]);
+            minDepth = std::min(minDepth, depth);
+            maxDepth = std::max(maxDepth, depth);
+        }
+    }
+    else
+    {
+        for(uint32_t y = min[1]; y < max[1]; ++y)
+        {
+            for(uint32_t x = min[0]; x < max[0]; ++x)
+            {
+                int depth = rasterDepth(job, x, y);
+                minDepth = std::min(minDepth, depth);
+                maxDepth = std::max(maxDepth, depth);
+            }
+        }
+    }
+    
+    *inside = (minDepth >= (int)min[2] && maxDepth < (int)max[2]);
+    return maxDepth >= (int)min[2] && minDepth < (int)max[2];
+}
+
+int VoxelTreeSampler::rasterDepth(const VoxelRasterJob &job, uint32_t x, uint32_t y)
+{
+    float depth;
+    if(job.surface.depths != NULL)
+    {
+        depth = job.surface.depths[(size_t)(y - job.y) * job.width + (x - job.x)];
+    }
+    else
+    {
+        depth = job.surface.depthX * (x + 0.5f) + job.surface.depthY * (y + 0.5f) + job.surface.depthOffset;
+    }
+    
+    // Receivers behind the tree use its furthest voxels, as in findVoxel
+    if(depth < 0.0)
+    {
+        return -1;
+    }
+    
+    return (int)std::min(depth, (float)(job.tileResolution - 1));
+}
+
+bool VoxelTreeSampler::boxRegion(int cascade, const Bounds &bounds, VoxelSamplerRegion* region) const
+{
+    // Cover the box corners in voxel space
+    const Matrix4x4 &worldToVoxels = cascades_[cascade].worldToVoxels;
+    Vector3 first = (worldToVoxels * Vector4(bounds.min(), 1.0)).vec3();
+    Bounds voxelBounds(first, first);
+    for(int i = 1; i < 8; ++i)
+    {
+        Vector3 corner((i & 4) ? bounds.max().x : bounds.min().x,
+                       (i & 2) ? bounds.max().y : bounds.min().y,
+                       (i & 1) ? bounds.max().z : bounds.min().z);
+        voxelBounds.expandToCover((worldToVoxels * Vector4(corner, 1.0)).vec3());
+    }
+    
+    // Depths in front of or behind the tree are not counted
+    float maxTileDepth = (float)((1u << cascades_[cascade].treeHeight) - 1);
+    region->corners[0] = Vector2(voxelBounds.min().x, voxelBounds.min().y);
+    region->corners[1] = Vector2(voxelBounds.max().x, voxelBounds.min().y);
+    region->corners[2] = Vector2(voxelBounds.max().x, voxelBounds.max().y);
+    region->corners[3] = Vector2(voxelBounds.min().x, voxelBounds.max().y);
+    region->depthX = 0.0;
+    region->depthY = 0.0;
+    region->depthOffset = 0.0;
+    region->minDepth = std::max(voxelBounds.min().z, 0.0f);
+    region->maxDepth = std::min(voxelBounds.max().z, maxTileDepth);
+    
+    return region->minDepth <= region->maxDepth;
+}
+
+bool VoxelTreeSampler::parallelogramRegion(int cascade, const Vector3 &corner, const Vector3 &edgeA, const Vector3 &edgeB, VoxelSamplerRegion* region) const
+{
+    const Matrix4x4 &worldToVoxels = cascades_[cascade].worldToVoxels;
+    Vector3 origin = (worldToVoxels * Vector4(corner, 1.0)).vec3();
+    Vector3 u = (worldToVoxels * Vector4(corner + edgeA, 1.0)).vec3() - origin;
+    Vector3 v = (worldToVoxels * Vector4(corner + edgeB, 1.0)).vec3() - origin;
+    
+    // The footprint area in voxels. Reverse the corners if clockwise.
+    float area = u.x * v.y - u.y * v.x;
+    if(fabs(area) < 1.0)
+    {
+        return false;
+    }
+    
+    if(area < 0.0)
+    {
+        std::swap(u, v);
+        area = -area;
+    }
+    
+    region->corners[0] = Vector2(origin.x, origin.y);
+    region->corners[1] = Vector2(origin.x + u.x, origin.y + u.y);
+    region->corners[2] = Vector2(origin.x + u.x + v.x, origin.y + u.y + v.y);
+    region->corners[3] = Vector2(origin.x + v.x, origin.y + v.y);
+    
+    // Fit the surface depth to the corners
+    region->depthX = (u.z * v.y - v.z * u.y) / area;
+    region->depthY = (v.z * u.x - u.z * v.x) / area;
+    region->depthOffset = origin.z - region->depthX * origin.x - region->depthY * origin.y;
+    region->minDepth = 0.0;
+    region->maxDepth = 0.0;
+    
+    return true;
+}
+
+bool VoxelTreeSampler::isRegionBuilt(int cascade, const VoxelSamplerRegion &region) const
+{
+    const VoxelsUniformBuffer::Cascade &c = cascades_[cascade];
+    float resolution = (float)(c.tileSubdivisions << c.treeHeight);
+    
+    float minX = resolution, minY = resolution, maxX = 0.0, maxY = 0.0;
+    for(int i = 0; i < 4; ++i)
+    {
+        minX = std::min(minX, region.corners[i].x);
+        minY = std::min(minY, region.corners[i].y);
+        maxX = std::max(maxX, region.corners[i].x);
+        maxY = std::max(maxY, region.corners[i].y);
+    }
+    
+    if(minX < 0.0 || minY < 0.0 || maxX >= resolution || maxY >= resolution)
+    {
+        return false;
+    }
+    
+    // Check every tile the footprint overlaps
+    for(uint32_t x = (uint32_t)minX >> c.treeHeight; x <= (uint32_t)maxX >> c.treeHeight; ++x)
+    {
+        for(uint32_t y = (uint32_t)minY >> c.treeHeight; y <= (uint32_t)maxY >> c.treeHeight; ++y)
+        {
+            if(data_[(x * c.tileSubdivisions + y + c.firstTile) * 2] == emptyRoot_)
+            {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+float VoxelTreeSampler::measureRegion(int cascade, const VoxelSamplerRegion &region) const
+{
+    const VoxelsUniformBuffer::Cascade &c = cascades_[cascade];
+    int tileResolution = 1 << c.treeHeight;
+    
+    // Find the tiles overlapped by the footprint
+    float minX = region.corners[0].x, minY = region.corners[0].y;
+    float maxX = minX, maxY = minY;
+    for(int i = 1; i < 4; ++i)
+    {
+        minX = std::min(minX, region.corners[i].x);
+        minY = std::min(minY, region.corners[i].y);
+        maxX = std::max(maxX, region.corners[i].x);
+        maxY = std::max(maxY, region.corners[i].y);
+    }
+    
+    int lastTile = c.tileSubdivisions - 1;
+    int firstTileX = std::max((int)floor(minX / tileResolution), 0);
+    int firstTileY = std::max((int)floor(minY / tileResolution), 0);
+    int lastTileX = std::min((int)floor(maxX / tileResolution), lastTile);
+    int lastTileY = std::min((int)floor(maxY / tileResolution), lastTile);
+    
+    VoxelAreaCount total = { 0.0, 0.0 };
+    for(int x = firstTileX; x <= lastTileX; ++x)
+    {
+        for(int y = firstTileY; y <= lastTileY; ++y)
+        {
+            VoxelPointer root;
+            uint32_t treeHeight;
+            readRootEntry(c, x, y, &root, &treeHeight);
+            
+            // Move the region into the tile's coords
+            float scale = (float)(1u << (c.treeHeight - treeHeight));
+            VoxelSamplerRegion tileRegion = region.toTile(x * tileResolution, y * tileResolution, scale);
+            
+            VoxelAreaCount count = { 0.0, 0.0 };
+            uint32_t origin[3] = { 0, 0, 0 };
+            countInner(tileRegion, root, treeHeight, 0, origin, 1u << treeHeight, &count);
+            
+            // Sloped regions are one voxel thick at any resolution,
+            // so their voxels only grow in x and y.
+            double weight = region.isSloped() ? scale * scale : scale * scale * scale;
+            total.voxels += count.voxels * weight;
+            total.shadowedVoxels += count.shadowedVoxels * weight;
+        }
+    }
+    
+    return (total.voxels > 0.0) ? total.shadowedVoxels / total.voxels : 0.0;
+}
+
+void VoxelTreeSampler::countInner(const VoxelSamplerRegion &region, VoxelPointer node, uint32_t treeHeight, int depth, const uint32_t* origin, uint32_t size, VoxelAreaCount* count) const
+{
+    uint32_t childMask = data_[node] >> 16;
+    for(uint32_t i = 0; i < 8; ++i)
+    {
+        // The last inner node is a vertical stack of leaves.
+        // Other nodes are split in half along each axis.
+        uint32_t childOrigin[3];
+        uint32_t childSizeXY = size / 2;
+        uint32_t childSizeZ = size / 2;
+        if(depth == (int)treeHeight - 3)
+        {
+            childOrigin[0] = origin[0];
+            childOrigin[1] = origin[1];
+            childOrigin[2] = origin[2] + i;
+            childSizeXY = size;
+            childSizeZ = 1;
+        }
+        else
+        {
+            childOrigin[0] = origin[0] + ((i >> 2) & 1) * childSizeXY;
+            childOrigin[1] = origin[1] + ((i >> 1) & 1) * childSizeXY;
+            childOrigin[2] = origin[2] + (i & 1) * childSizeZ;
+        }
+        
+        // Uniform children are counted without visiting them
+        uint32_t childState = (childMask >> (i * 2)) & 3;
+        if(childState < VS_Mixed)
+        {
+            countUniform(region, childState == VS_Shadowed, childOrigin, childSizeXY, childSizeZ, count);
+            continue;
+        }
+        
+        // Skip mixed children outside the region before fetching them
+        double voxels;
+        if(overlapBox(region, childOrigin, childSizeXY, childSizeZ, &voxels) == VRO_Outside)
+        {
+            continue;
+        }
+        
+        VoxelPointer child = data_[node + childPointerOffset(childMask, i)];
+        if(depth == (int)treeHeight - 3)
+        {
+            countLeaf(region, child, childOrigin, count);
+        }
+        else
+        {
+            countInner(region, child, treeHeight, depth + 1, childOrigin, childSizeXY, count);
+        }
+    }
+}
+
+void VoxelTreeSampler::countUniform(const VoxelSamplerRegion &region, bool shadowed, const uint32_t* origin, uint32_t sizeXY, uint32_t sizeZ, VoxelAreaCount* count) const
+{
+    double voxels;
+    VoxelRegionOverlap overlap = overlapBox(region, origin, sizeXY, sizeZ, &voxels);
+    if(overlap == VRO_Outside)
+    {
+        return;
+    }
+    
+    // Sloped surfaces cross the depth range of most large boxes they
+    // pass through. Rather than splitting those down to single voxels,
+    // estimate the columns whose voxel is in the box from their area.
+    if(overlap == VRO_Partial && region.isSloped() && sizeXY > 1 && overlapFootprint(region, origin, sizeXY) == VRO_Inside)
+    {
+        overlap = VRO_Inside;
+        voxels = areaAboveDepth(region, origin, sizeXY, origin[2] + sizeZ) - areaAboveDepth(region, origin, sizeXY, origin[2]);
+    }
+    
+    if(overlap == VRO_Inside)
+    {
+        count->voxels += voxels;
+        count->shadowedVoxels += shadowed ? voxels : 0.0;
+        return;
+    }
+    
+    // Split boxes on the edge of the region until they are inside or outside.
+    // Single voxels are always one or the other.
+    uint32_t halfXY = std::max(sizeXY / 2, 1u);
+    uint32_t halfZ = std::max(sizeZ / 2, 1u);
+    for(uint32_t x = 0; x < sizeXY; x += halfXY)
+    {
+        for(uint32_t y = 0; y < sizeXY; y += halfXY)
+        {
+            for(uint32_t z = 0; z < sizeZ; z += halfZ)
+            {
+                uint32_t childOrigin[3] = { origin[0] + x, origin[1] + y, origin[2] + z };
+                countUniform(region, shadowed, childOrigin, halfXY, halfZ, count);
+            }
+        }
+    }
+}
+
+void VoxelTreeSampler::countLeaf(const VoxelSamplerRegion &region, VoxelPointer leaf, const uint32_t* origin, VoxelAreaCount* count) const
+{
+    // Find the voxels of the leaf inside the region
+    double voxels;
+    uint64_t regionMask = ~(uint64_t)0;
+    if(overlapBox(region, origin, 8, 1, &voxels) == VRO_Partial)
+    {
+        regionMask = 0;
+        for(uint32_t x = 0; x < 8; ++x)
+        {
+            for(uint32_t y = 0; y < 8; ++y)
+            {
+                uint32_t voxel[3] = { origin[0] + x, origin[1] + y, origin[2] };
+                if(overlapBox(region, voxel, 1, 1, &voxels) == VRO_Inside)
+                {
+                    regionMask |= (uint64_t)1 << ((x << 3) | y);
+                }
+            }
+        }
+    }
+    
+    // Set bits are unshadowed. The first word holds the lower 32 bits.
+    uint64_t bits = (uint64_t)data_[leaf] | ((uint64_t)data_[leaf + 1] << 32);
+    count->voxels += __builtin_popcountll(regionMask);
+    count->shadowedVoxels += __builtin_popcountll(regionMask & ~bits);
+}
+
+VoxelRegionOverlap VoxelTreeSampler::overlapFootprint(const VoxelSamplerRegion &region, const uint32_t* origin, uint32_t sizeXY)
+{
+    // The centres of the box's corner columns
+    Vector2 columns[4];
+    float minX = origin[0] + 0.5;
+    float minY = origin[1] + 0.5;
+    float maxX = origin[0] + sizeXY - 0.5;
+    float maxY = origin[1] + sizeXY - 0.5;
+    columns[0] = Vector2(minX, minY);
+    columns[1] = Vector2(maxX, minY);
+    columns[2] = Vector2(maxX, maxY);
+    columns[3] = Vector2(minX, maxY);
+    
+    // Separate the box from the footprint along the box axes
+    float footprintMinX = region.corners[0].x, footprintMinY = region.corners[0].y;
+    float footprintMaxX = footprintMinX, footprintMaxY = footprintMinY;
+    for(int i = 1; i < 4; ++i)
+    {
+        footprintMinX = std::min(footprintMinX, region.corners[i].x);
+        footprintMinY = std::min(footprintMinY, region.corners[i].y);
+        footprintMaxX = std::max(footprintMaxX, region.corners[i].x);
+        footprintMaxY = std::max(footprintMaxY, region.corners[i].y);
+    }
+    
+    if(maxX < footprintMinX || minX > footprintMaxX || maxY < footprintMinY || minY > footprintMaxY)
+    {
+        return VRO_Outside;
+    }
+    
+    // Then along each footprint edge
+    bool insideFootprint = true;
+    for(int e = 0; e < 4; ++e)
+    {
+        Vector2 edge = region.corners[(e + 1) % 4] - region.corners[e];
+        int outsideCount = 0;
+        for(int c = 0; c < 4; ++c)
+        {
+            Vector2 offset = columns[c] - region.corners[e];
+            if(edge.x * offset.y - edge.y * offset.x < 0.0)
+            {
+                outsideCount ++;
+            }
+        }
+        
+        if(outsideCount == 4)
+        {
+            return VRO_Outside;
+        }
+        
+        insideFootprint = insideFootprint && (outsideCount == 0);
+    }
+    
+    return insideFootprint ? VRO_Inside : VRO_Partial;
+}
+
+double VoxelTreeSampler::areaAboveDepth(const VoxelSamplerRegion &region, const uint32_t* origin, uint32_t sizeXY, float depth)
+{
+    // Clip the square to the side of the surface shallower than the depth
+    Vector2 square[4];
+    square[0] = Vector2(origin[0], origin[1]);
+    square[1] = Vector2(origin[0] + sizeXY, origin[1]);
+    square[2] = Vector2(origin[0] + sizeXY, origin[1] + sizeXY);
+    square[3] = Vector2(origin[0], origin[1] + sizeXY);
+    
+    Vector2 clipped[5];
+    int clippedCount = 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        const Vector2 &a = square[i];
+        const Vector2 &b = square[(i + 1) % 4];
+        float distanceA = depth - (region.depthX * a.x + region.depthY * a.y + region.depthOffset);
+        float distanceB = depth - (region.depthX * b.x + region.depthY * b.y + region.depthOffset);
+        
+        if(distanceA >= 0.0)
+        {
+            clipped[clippedCount++] = a;
+        }
+        
+        // Add the crossing point if the edge crosses the surface
+        if((distanceA >= 0.0) != (distanceB >= 0.0))
+        {
+            float t = distanceA / (distanceA - distanceB);
+            clipped[clippedCount++] = a + (b - a) * t;
+        }
+    }
+    
+    // Shoelace formula
+    double area = 0.0;
+    for(int i = 0; i < clippedCount; ++i)
+    {
+        const Vector2 &a = clipped[i];
+        const Vector2 &b = clipped[(i + 1) % clippedCount];
+        area += (double)a.x * b.y - (double)b.x * a.y;
+    }
+    
+    return area / 2.0;
+}
+
+VoxelRegionOverlap VoxelTreeSampler::overlapBox(const VoxelSamplerRegion &region, const uint32_t* origin, uint32_t sizeXY, uint32_t sizeZ, double* voxels)
+{
+    VoxelRegionOverlap footprint = overlapFootprint(region, origin, sizeXY);
+    if(footprint == VRO_Outside)
+    {
+        return VRO_Outside;
+    }
+    
+    // The centres of the box's corner columns
+    Vector2 columns[4];
+    float minX = origin[0] + 0.5;
+    float minY = origin[1] + 0.5;
+    float maxX = origin[0] + sizeXY - 0.5;
+    float maxY = origin[1] + sizeXY - 0.5;
+    columns[0] = Vector2(minX, minY);
+    columns[1] = Vector2(maxX, minY);
+    columns[2] = Vector2(maxX, maxY);
+    columns[3] = Vector2(minX, maxY);
+    
+    // Find the voxels of the region in each column from the surface depth
+    float surfaceMin = 1000000000.0;
+    float surfaceMax = -1000000000.0;
+    for(int c = 0; c < 4; ++c)
+    {
+        float surface = region.depthX * columns[c].x + region.depthY * columns[c].y + region.depthOffset;
+        surfaceMin = std::min(surfaceMin, surface);
+        surfaceMax = std::max(surfaceMax, surface);
+    }
+    
+    int firstDepth = (int)floor(surfaceMin + region.minDepth);
+    int lastDepth = (int)floor(surfaceMax + region.maxDepth);
+    int boxFirstDepth = origin[2];
+    int boxLastDepth = origin[2] + sizeZ - 1;
+    if(lastDepth < boxFirstDepth || firstDepth > boxLastDepth)
+    {
+        return VRO_Outside;
+    }
+    
+    // Flat regions cover the same depths in every column.
+    // Sloped ones are inside if every column's voxel is in the box.
+    int columnVoxels = std::min(lastDepth, boxLastDepth) - std::max(firstDepth, boxFirstDepth) + 1;
+    if(region.isSloped())
+    {
+        columnVoxels = 1;
+        if(firstDepth < boxFirstDepth || lastDepth > boxLastDepth)
+        {
+            return VRO_Partial;
+        }
+    }
+    
+    if(footprint == VRO_Partial)
+    {
+        return VRO_Partial;
+    }
+    
+    *voxels = (double)sizeXY * (double)sizeXY * (double)columnVoxels;
+    return VRO_Inside;
+}
+
+bool VoxelTreeSampler::findVoxel(const Vector3 &position, VoxelSamplerLookup* lookup) const
+{
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        const VoxelsUniformBuffer::Cascade &cascade = cascades_[i];
+        Vector4 voxelPosition = cascade.worldToVoxels * Vector4(position, 1.0);
+        
+        // Skip cascades that do not cover the position.
+        // Only x and y are divided by w, as in the shader.
+        float x = voxelPosition.x / voxelPosition.w;
+        float y = voxelPosition.y / voxelPosition.w;
+        float resolution = (float)(cascade.tileSubdivisions << cascade.treeHeight);
+        if(x < 0.0 || y < 0.0 || x >= resolution || y >= resolution)
+        {
+            continue;
+        }
+        
+        // Positions in front of the cascade are in front of every caster.
+        // Positions behind it use the furthest voxel.
+        if(voxelPosition.z < 0.0)
+        {
+            return false;
+        }
+        
+        float tileResolution = (float)(1u << cascade.treeHeight);
+        uint32_t coord[3] = { (uint32_t)x, (uint32_t)y, (uint32_t)std::min(voxelPosition.z, tileResolution - 1.0f) };
+        
+        // Read the root table entry of the tile containing the coord
+        uint32_t tileX = coord[0] >> cascade.treeHeight;
+        uint32_t tileY = coord[1] >> cascade.treeHeight;
+        VoxelPointer root;
+        uint32_t treeHeight;
+        readRootEntry(cascade, tileX, tileY, &root, &treeHeight);
+        
+        // Finer cascades fall back to the next one until their tile is built
+        if(root == emptyRoot_ && i + 1 < cascades_.size())
+        {
+            continue;
+        }
+        
+        // Tiles with few shadow casters have shorter trees than the cascade
+        uint32_t shift = cascade.treeHeight - treeHeight;
+        lookup->root = root;
+        lookup->treeHeight = treeHeight;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            lookup->coord[axis] = coord[axis] >> shift;
+        }
+        
+        return true;
+    }
+    
+    return false;
+}
+
+bool VoxelTreeSampler::findSegmentVoxel(const vector<VoxelSamplerRay> &rays, double t, VoxelSamplerLookup* lookup, VoxelSamplerRay* tileRay, double* exit) const
+{
+    // Matches findVoxel, but also finds where the cascade used changes
+    *exit = DBL_MAX;
+    for(unsigned int i = 0; i < cascades_.size(); ++i)
+    {
+        const VoxelsUniformBuffer::Cascade &cascade = cascades_[i];
+        const VoxelSamplerRay &ray = rays[i];
+        double position[3];
+        ray.at(t, position);
+        
+        // Stop where the segment enters a cascade that comes first
+        double resolution = (double)(cascade.tileSubdivisions << cascade.treeHeight);
+        double areaMin[3] = { 0.0, 0.0, -DBL_MAX };
+        double areaMax[3] = { resolution, resolution, DBL_MAX };
+        if(position[0] < 0.0 || position[1] < 0.0 || position[0] >= resolution || position[1] >= resolution)
+        {
+            *exit = std::min(*exit, enterBox(ray, areaMin, areaMax, t));
+            continue;
+        }
+        
+        // Positions in front of the cascade are lit until
+        // they leave it or pass its near plane.
+        if(position[2] < 0.0)
+        {
+            areaMax[2] = 0.0;
+            *exit = std::min(*exit, exitBox(ray, areaMin, areaMax, t));
+            return false;
+        }
+        
+        uint32_t tileResolution = 1u << cascade.treeHeight;
+        uint32_t coord[3] = { (uint32_t)position[0], (uint32_t)position[1], (uint32_t)std::min(position[2], tileResolution - 1.0) };
+        
+        uint32_t tileX = coord[0] >> cascade.treeHeight;
+        uint32_t tileY = coord[1] >> cascade.treeHeight;
+        VoxelPointer root;
+        uint32_t treeHeight;
+        readRootEntry(cascade, tileX, tileY, &root, &treeHeight);
+        
+        // Finer cascades fall back to the next one until their tile is built
+        if(root == emptyRoot_ && i + 1 < cascades_.size())
+        {
+            double tileMin[3] = { (double)(tileX * tileResolution), (double)(tileY * tileResolution), -DBL_MAX };
+            double tileMax[3] = { tileMin[0] + tileResolution, tileMin[1] + tileResolution, DBL_MAX };
+            *exit = std::min(*exit, exitBox(ray, tileMin, tileMax, t));
+            continue;
+        }
+        
+        // Tiles with few shadow casters have shorter trees than the cascade
+        uint32_t shift = cascade.treeHeight - treeHeight;
+        double scale = (double)(1u << shift);
+        lookup->root = root;
+        lookup->treeHeight = treeHeight;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            lookup->coord[axis] = coord[axis] >> shift;
+            tileRay->origin[axis] = ray.origin[axis] / scale;
+            tileRay->direction[axis] = ray.direction[axis] / scale;
+        }
+        
+        return true;
+    }
+    
+    return false;
+}
+
+void VoxelTreeSampler::readRootEntry(const VoxelsUniformBuffer::Cascade &cascade, uint32_t tileX, uint32_t tileY, VoxelPointer* root, uint32_t* treeHeight) const
+{
+    uint32_t entry = (tileX * cascade.tileSubdivisions + tileY + cascade.firstTile) * 2;
+    *root = data_[entry];
+    *treeHeight = data_[entry + 1];
+    
+    // Unbuilt tiles point at the empty node with a height of 0.
+    // It is uniform, so is valid at the cascade's full height.
+    if(*root == emptyRoot_)
+    {
+        *treeHeight = cascade.treeHeight;
+    }
+}
+
+float VoxelTreeSampler::traverse(const VoxelSamplerLookup &lookup, int startDepth, VoxelPointer* path, int* lastDepth) const
+{
+    assert(lookup.treeHeight >= 3 && (int)lookup.treeHeight <= MaxTreeHeight);
+    
+    // Traverse inner nodes. The leaf is stored at depth treeHeight - 2.
+    int leafDepth = lookup.treeHeight - 2;
+    for(int depth = startDepth; depth < leafDepth; ++depth)
+    {
+        // Fetch the node's child mask
+        uint32_t index = childIndex(lookup.treeHeight, depth, lookup.coord);
+        uint32_t childMask = data_[path[depth]] >> 16;
+        uint32_t childState = (childMask >> (index * 2)) & 3;
+        
+        // Uniform children are either fully shadowed or fully lit
+        if(childState < VS_Mixed)
+        {
+            *lastDepth = depth;
+            return (float)childState;
+        }
+        
+        // Follow the pointer to the mixed child
+        path[depth + 1] = data_[path[depth] + childPointerOffset(childMask, index)];
+    }
+    
+    // Read the voxel from the leaf's 8x8 mask.
+    // The first word holds the lower 32 bits.
+    *lastDepth = leafDepth;
+    uint32_t leafIndex = ((lookup.coord[0] & 7) << 3) | (lookup.coord[1] & 7);
+    uint32_t word = data_[path[leafDepth] + (leafIndex > 31 ? 1 : 0)];
+    return (float)((word >> (leafIndex & 31)) & 1);
+}
+
+double VoxelTreeSampler::exitBox(const VoxelSamplerRay &ray, const double* min, const double* max, double t)
+{
+    double exit = DBL_MAX;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(ray.direction[axis] > 0.0)
+        {
+            exit = std::min(exit, (max[axis] - ray.origin[axis]) / ray.direction[axis]);
+        }
+        else if(ray.direction[axis] < 0.0)
+        {
+            exit = std::min(exit, (min[axis] - ray.origin[axis]) / ray.direction[axis]);
+        }
+    }
+    
+    return std::max(exit, t);
+}
+
+double VoxelTreeSampler::enterBox(const VoxelSamplerRay &ray, const double* min, const double* max, double t)
+{
+    // Clip the ray to the slab of each axis
+    double enter = t;
+    double exit = DBL_MAX;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(ray.direction[axis] == 0.0)
+        {
+            if(ray.origin[axis] < min[axis] || ray.origin[axis] >= max[axis])
+            {
+                return DBL_MAX;
+            }
+            
+            continue;
+        }
+        
+        double a = (min[axis] - ray.origin[axis]) / ray.direction[axis];
+        double b = (max[axis] - ray.origin[axis]) / ray.direction[axis];
+        enter = std::max(enter, std::min(a, b));
+        exit = std::min(exit, std::max(a, b));
+    }
+    
+    return (enter < exit) ? enter : DBL_MAX;
+}
+
+uint32_t VoxelTreeSampler::childIndex(uint32_t treeHeight, int depth, const uint32_t* coord)
+{
+    // The last inner node before the leaf nodes is a vertical stack.
+    // Recover directly from the last z coord bits.
+    if(depth == (int)treeHeight - 3)
+    {
+        return coord[2] & 7;
+    }
+    
+    // Use the bit for this depth of each axis
+    uint32_t shift = treeHeight - 1 - depth;
+    uint32_t x = (coord[0] >> shift) & 1;
+    uint32_t y = (coord[1] >> shift) & 1;
+    uint32_t z = (coord[2] >> shift) & 1;
+    return (x << 2) | (y << 1) | z;
+}
+
+int VoxelTreeSampler::childPointerOffset(uint32_t childMask, uint32_t childIndex)
+{
+    // Count the mixed flags up to and including the child.
+    // The mixed flag is the second bit of each child's 2 bits.
+    uint32_t mixedFlagBits = 43690u >> (14 - childIndex * 2); // binary 10 10 10 10 10 10 10 10
+    return __builtin_popcount(childMask & mixedFlagBits);
+}
+
+uint64_t VoxelTreeSampler::mortonCode(const uint32_t* coord)
+{
+    // Coords are at most 14 bits, so 42 bits are used
+    uint64_t code = 0;
+    for(int bit = MaxTreeHeight - 1; bit >= 0; --bit)
+    {
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            code = (code << 1) | ((coord[axis] >> bit) & 1);
+        }
+    }
+    
+    return code;
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+#include "Vector2.hpp"
+#include "Vector3.hpp"
+#include "Bounds.hpp"
+#include "VoxelNode.hpp"
+#include "UniformManager.hpp"
+
+class QFile;
+
+// The tile and voxel found for a world space position.
+// coord is scaled to the tile's resolution.
+struct VoxelSamplerLookup
+{
+    VoxelPointer root;
+    uint32_t treeHeight;
+    uint32_t coord[3];
+};
+
+// A point query waiting to be traversed in a batch
+struct VoxelSamplerQuery
+{
+    // The index of the query's position and result
+    int index;
+    
+    VoxelSamplerLookup lookup;
+    
+    // The interleaved coord bits. Queries with nearby codes
+    // share the upper levels of their paths through the tree.
+    uint64_t mortonCode;
+    
+    // Sorts by tile, then in Morton order
+    bool operator < (const VoxelSamplerQuery &other) const
+    {
+        if(lookup.root != other.lookup.root)
+        {
+            return lookup.root < other.lookup.root;
+        }
+        
+        return mortonCode < other.mortonCode;
+    }
+};
+
+// A region of a tile measured by an area query, in voxel coords.
+// The region covers the columns whose centre is inside a convex
+// footprint, between two depths relative to a surface across them.
+struct VoxelSamplerRegion
+{
+    // The footprint corners, counter clockwise
+    Vector2 corners[4];
+    
+    // The surface depth is depthX * x + depthY * y + depthOffset.
+    // Sloped surfaces are a single voxel thick.
+    float depthX;
+    float depthY;
+    float depthOffset;
+    
+    // The depths covered relative to the surface
+    float minDepth;
+    float maxDepth;
+    
+    // True if the surface is not flat in voxel space
+    bool isSloped() const { return depthX != 0.0 || depthY != 0.0; }
+    
+    // Moves the region into the coords of a tile at the given
+    // offset, whose voxels are scale times the size.
+    VoxelSamplerRegion toTile(float offsetX, float offsetY, float scale) const;
+};
+
+// How a box of voxels overlaps a region
+enum VoxelRegionOverlap
+{
+    VRO_Outside,
+    VRO_Partial,
+    VRO_Inside,
+};
+
+// The voxels found by an area query
+struct VoxelAreaCount
+{
+    double voxels;
+    double shadowedVoxels;
+};
+
+// A straight line through a cascade or tile, in voxel coords.
+// Doubles are used so that a step of a tiny fraction of a voxel
+// is still exact in cascades thousands of voxels across.
+struct VoxelSamplerRay
+{
+    double origin[3];
+    double direction[3];
+    
+    // Gets the position at a fraction of the way along the ray
+    void at(double t, double* position) const
+    {
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            position[axis] = origin[axis] + direction[axis] * t;
+        }
+    }
+};
+
+// A part of a segment that is either fully shadowed or fully lit.
+// start and end are fractions of the way along the segment.
+struct VoxelShadowInterval
+{
+    float start;
+    float end;
+    bool shadowed;
+};
+
+// The receiver surface decoded into a raster, in a cascade's voxel coords.
+// The surface depth at a column centre is depthX * x + depthY * y + depthOffset,
+// unless depths is set, eg to a terrain, with a depth for every pixel.
+struct VoxelRasterSurface
+{
+    float depthX;
+    float depthY;
+    float depthOffset;
+    const float* depths;
+};
+
+// A raster being decoded by one or more threads
+struct VoxelRasterJob
+{
+    int cascade;
+    uint32_t tileResolution;
+    
+    // The columns covered by the raster, in the cascade's voxel coords
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    
+    VoxelRasterSurface surface;
+    
+    uint8_t* image;
+    size_t rowStride;
+    
+    // The tiles overlapped by the raster.
+    // Each thread takes the next tile until none are left.
+    uint32_t firstTileX;
+    uint32_t firstTileY;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    std::atomic<uint32_t> nextTile;
+};
+
+// The start of a saved tree file.
+// The cascades follow the header, then the tree data.
+struct VoxelTreeFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t cascadeCount;
+    VoxelPointer emptyRoot;
+    uint64_t sizeWords;
+};
+
+// Answers shadow queries on the CPU, eg for gameplay and AI.
+// Traverses the tree the same way as the voxel sampling shader.
+// The sampler holds its own copy of the tree and never changes,
+// so it can be used by any number of threads at once.
+class VoxelTreeSampler
+{
+    // The tallest tile tree. Tiles are at most 16K.
+    const static int MaxTreeHeight = 14;
+    
+    // Changed whenever the tree file layout changes
+    const static uint32_t TreeFileVersion = 1;
+    
+public:
+    // Copies the tree data. The cascades are those of a single
+    // keyframe, highest resolution first.
+    VoxelTreeSampler(const uint32_t* data, size_t sizeWords, const vector<VoxelsUniformBuffer::Cascade> &cascades, VoxelPointer emptyRoot);
+    ~VoxelTreeSampler();
+    
+    // Saves the tree and cascades to a file
+    bool save(const char* fileName) const;
+    
+    // Creates a sampler from a saved tree file. The file is mapped into
+    // memory rather than copied, so processes loading the same file share
+    // its pages. Returns NULL if the file cannot be read.
+    static VoxelTreeSampler* load(const char* fileName);
+    
+    // The size of the tree
+    size_t sizeBytes() const { return sizeWords_ * 4; }
+    
+    // Gets the world space bounds covered by the last cascade
+    Bounds bounds() const;
+    
+    // Gets the shadowing at a world space position.
+    // 0 when shadowed and 1 when lit. Positions outside the tree are lit.
+    float sample(const Vector3 &position) const;
+    
+    // Gets the shadowing at many world space positions.
+    // The queries are sorted so that nearby positions are traversed
+    // one after another, reusing the nodes fetched for the last query.
+    void sampleBatch(const vector<Vector3> &positions, vector<float> &results) const;
+    
+    // Gets the fraction of the voxels in the light space box covering
+    // a world space AABB that are shadowed.
+    float shadowedFraction(const Bounds &bounds) const;
+    
+    // Gets the fraction of a world space parallelogram, eg a rectangle
+    // on the ground, that is shadowed. One voxel is used per column.
+    float shadowedFraction(const Vector3 &corner, const Vector3 &edgeA, const Vector3 &edgeB) const;
+    
+    // Finds the shadowed and lit parts of a world space segment, eg a path
+    // along a road. The intervals are in order and cover the whole segment.
+    // Uniform nodes are stepped over in one go rather than voxel by voxel.
+    void shadowIntervals(const Vector3 &start, const Vector3 &end, vector<VoxelShadowInterval> &intervals) const;
+    
+    // Creates the receiver surface of a horizontal world space plane.
+    // Returns false if the light is parallel to the plane.
+    bool heightSurface(int cascade, float height, VoxelRasterSurface* surface) const;
+    
+    // Writes the shadowing of a rectangle of a cascade's columns to an image with a
+    // byte per column. Pixels are 0 when shadowed and 255 when lit, and rows are
+    // rowStride bytes apart. The tiles are decoded in parallel by threadCount threads,
+    // filling uniform nodes as blocks and expanding leaves bit by bit.
+    void decodeRaster(int cascade, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                      const VoxelRasterSurface &surface, uint8_t* image, size_t rowStride, int threadCount) const;
+    
+    // Decodes a raster straight into a binary PGM file mapped into memory,
+    // so that images larger than the available memory can be exported.
+    bool decodeRasterToFile(const char* fileName, int cascade, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                            const VoxelRasterSurface &surface, int threadCount) const;
+                            
+private:
+    // The tree data, either copied or in a mapped file
+    const uint32_t* data_;
+    size_t sizeWords_;
+    vector<uint32_t> dataCopy_;
+    QFile* mappedFile_;
+    
+    vector<VoxelsUniformBuffer::Cascade> cascades_;
+    VoxelPointer emptyRoot_;
+    
+    // Used by load, which points the sampler at the mapped file
+    VoxelTreeSampler(const vector<VoxelsUniformBuffer::Cascade> &cascades, VoxelPointer emptyRoot);
+    
+    // Finds the tile and voxel containing a position.
+    // Uses the highest resolution cascade whose tile is built.
+    // Returns false if the position is outside the tree.
+    bool findVoxel(const Vector3 &position, VoxelSamplerLookup* lookup) const;
+    
+    // Reads the root node and tree height of a cascade's tile.
+    // Unbuilt tiles get the cascade's height, as the height of 0 stored
+    // with the empty root would fail the checks in traverse().
+    void readRootEntry(const VoxelsUniformBuffer::Cascade &cascade, uint32_t tileX, uint32_t tileY, VoxelPointer* root, uint32_t* treeHeight) const;
+    
+    // Traverses a tile's tree towards a voxel, starting at the node stored
+    // in path[startDepth]. The nodes visited are added to path and the
+    // depth of the last one is output. Returns the voxel's shadowing.
+    float traverse(const VoxelSamplerLookup &lookup, int startDepth, VoxelPointer* path, int* lastDepth) const;
+    
+    // Finds the tile and voxel at a fraction of the way along a segment,
+    // given the segment's ray through each cascade. The ray through the
+    // tile is output in the tile's voxel coords. Returns false if the
+    // position is outside the tree.
+    // exit is set to where the segment enters a cascade that would be used
+    // instead or leaves the area outside the tree.
+    bool findSegmentVoxel(const vector<VoxelSamplerRay> &rays, double t, VoxelSamplerLookup* lookup, VoxelSamplerRay* tileRay, double* exit) const;
+    
+    // Decodes tiles from a raster job until every tile is taken
+    void decodeTiles(VoxelRasterJob* job) const;
+    void decodeTile(const VoxelRasterJob &job, uint32_t tileX, uint32_t tileY) const;
+    
+    // Decodes the children of a node that overlap a raster. scale is the
+    // number of raster columns across each of the tile's voxels.
+    void decodeInner(const VoxelRasterJob &job, VoxelPointer node, uint32_t treeHeight, int depth, const uint32_t* origin, uint32_t size, uint32_t scale) const;
+    
+    // Writes a value to the pixels of a clipped box where the receiver is inside it
+    void decodeUniform(const VoxelRasterJob &job, uint8_t value, const uint32_t* min, const uint32_t* max, bool inside) const;
+    
+    // Expands the bits of a leaf where the receiver is inside it
+    void decodeLeaf(const VoxelRasterJob &job, VoxelPointer leaf, const uint32_t* min, const uint32_t* max, bool inside, uint32_t scale) const;
+    
+    // Clips a box of voxels to a raster's columns. Returns false if none of
+    // their receiver voxels are in the box, and outputs if all of them are.
+    // The box bounds are in the cascade's voxel coords, with max exclusive.
+    static bool clipRasterBox(const VoxelRasterJob &job, uint32_t* min, uint32_t* max, bool* inside);
+    
+    // Gets the depth of the receiver voxel in a column.
+    // Returns -1 if the receiver is in front of the tree.
+    static int rasterDepth(const VoxelRasterJob &job, uint32_t x, uint32_t y);
+    
+    // Creates the region covered by a query in a cascade's voxel coords.
+    // Returns false if the region is empty.
+    bool boxRegion(int cascade, const Bounds &bounds, VoxelSamplerRegion* region) const;
+    bool parallelogramRegion(int cascade, const Vector3 &corner, const Vector3 &edgeA, const Vector3 &edgeB, VoxelSamplerRegion* region) const;
+    
+    // Checks if a region is inside a cascade and its tiles are built
+    bool isRegionBuilt(int cascade, const VoxelSamplerRegion &region) const;
+    
+    // Gets the shadowed fraction of a region in each tile it overlaps.
+    // Lower resolution tiles are weighted by their voxel size.
+    float measureRegion(int cascade, const VoxelSamplerRegion &region) const;
+    
+    // Counts the region's voxels in a node and its children. Uniform
+    // children are counted from the child mask without being visited,
+    // and leaves are counted by masking their bits.
+    void countInner(const VoxelSamplerRegion &region, VoxelPointer node, uint32_t treeHeight, int depth, const uint32_t* origin, uint32_t size, VoxelAreaCount* count) const;
+    void countUniform(const VoxelSamplerRegion &region, bool shadowed, const uint32_t* origin, uint32_t sizeXY, uint32_t sizeZ, VoxelAreaCount* count) const;
+    void countLeaf(const VoxelSamplerRegion &region, VoxelPointer leaf, const uint32_t* origin, VoxelAreaCount* count) const;
+    
+    // Finds how a box of voxels overlaps a region. Outputs the number
+    // of the region's voxels in the box if it is inside.
+    static VoxelRegionOverlap overlapBox(const VoxelSamplerRegion &region, const uint32_t* origin, uint32_t sizeXY, uint32_t sizeZ, double* voxels);
+    static VoxelRegionOverlap overlapFootprint(const VoxelSamplerRegion &region, const uint32_t* origin, uint32_t sizeXY);
+    
+    // Computes the area of a square of columns where a sloped region's
+    // surface is shallower than the given depth.
+    static double areaAboveDepth(const VoxelSamplerRegion &region, const uint32_t* origin, uint32_t sizeXY, float depth);
+    
+    // Computes where a ray that is inside a box at t leaves it
+    static double exitBox(const VoxelSamplerRay &ray, const double* min, const double* max, double t);
+    
+    // Computes where a ray first enters a box after t.
+    // Returns DBL_MAX if it never does.
+    static double enterBox(const VoxelSamplerRay &ray, const double* min, const double* max, double t);
+    
+    // Computes the child index at a given depth for the specified coord.
+    // Must be consistent with the builder and the voxel sampling shader.
+    static uint32_t childIndex(uint32_t treeHeight, int depth, const uint32_t* coord);
+    
+    // Computes the word offset from a child mask to the pointer to the
+    // child with the specified index.
+    static int childPointerOffset(uint32_t childMask, uint32_t childIndex);
+    
+    // Interleaves the bits of a coord, most significant first
+    static uint64_t mortonCode(const uint32_t* coord);
+};
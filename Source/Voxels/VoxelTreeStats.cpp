@@ -0,0 +1,300 @@
+#include "VoxelTreeStats.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+VoxelTreeStats::VoxelTreeStats(const uint32_t* data, size_t sizeWords, int tileCount, VoxelPointer emptyNode, size_t originalSizeBytes)
+    : treeBytes_(sizeWords * 4),
+    originalSizeBytes_(originalSizeBytes),
+    keyframeRebuilds_(0),
+    keyframeRebuildTiles_(0),
+    reducedResolutionTiles_(0),
+    tiles_(tileCount),
+    leafMaskReferences_()
+{
+    memset(levels_, 0, sizeof(levels_));
+    memset(expandedChildCounts_, 0, sizeof(expandedChildCounts_));
+    
+    // Walk each tile in order, so that a node shared by several
+    // tiles is counted as a hit for every tile after the first.
+    // The root entry height includes the leaf level.
+    vector<bool> visited(sizeWords, false);
+    const VoxelRootEntry* entries = (const VoxelRootEntry*)data;
+    for(int i = 0; i < tileCount; ++i)
+    {
+        VoxelTileStats &tile = tiles_[i];
+        tile.treeHeight = entries[i].treeHeight;
+        tile.built = (entries[i].root != emptyNode);
+        tile.references = 0;
+        tile.sharedReferences = 0;
+        
+        if(tile.built)
+        {
+            visitNode(data, entries[i].root, tile.treeHeight - 1, &tile, visited);
+        }
+    }
+}
+
+size_t VoxelTreeStats::reachableBytes() const
+{
+    size_t bytes = rootTableBytes();
+    for(int level = 1; level < LevelCount; ++level)
+    {
+        bytes += levels_[level].bytes;
+    }
+    
+    return bytes;
+}
+
+double VoxelTreeStats::compressionRatio() const
+{
+    return (treeBytes_ > 0) ? (double)originalSizeBytes_ / treeBytes_ : 0.0;
+}
+
+uint64_t VoxelTreeStats::uniqueNodes() const
+{
+    uint64_t nodes = 0;
+    for(int level = 1; level < LevelCount; ++level)
+    {
+        nodes += levels_[level].uniqueNodes;
+    }
+    
+    return nodes;
+}
+
+uint64_t VoxelTreeStats::references() const
+{
+    uint64_t references = 0;
+    for(int level = 1; level < LevelCount; ++level)
+    {
+        references += levels_[level].references;
+    }
+    
+    return references;
+}
+
+double VoxelTreeStats::dedupHitRate() const
+{
+    uint64_t total = references();
+    return (total > 0) ? 1.0 - (double)uniqueNodes() / total : 0.0;
+}
+
+int VoxelTreeStats::builtTiles() const
+{
+    int built = 0;
+    for(auto tile = tiles_.begin(); tile != tiles_.end(); ++tile)
+    {
+        built += tile->built ? 1 : 0;
+    }
+    
+    return built;
+}
+
+void VoxelTreeStats::setKeyframeRebuilds(int rebuilds, int tiles)
+{
+    keyframeRebuilds_ = rebuilds;
+    keyframeRebuildTiles_ = tiles;
+}
+
+string VoxelTreeStats::toJSON() const
+{
+    ostringstream json;
+    json << "{\n";
+    json << "  \"treeBytes\": " << treeBytes_ << ",\n";
+    json << "  \"reachableBytes\": " << reachableBytes() << ",\n";
+    json << "  \"rootTableBytes\": " << rootTableBytes() << ",\n";
+    json << "  \"originalBytes\": " << originalSizeBytes_ << ",\n";
+    json << "  \"compressionRatio\": " << compressionRatio() << ",\n";
+    json << "  \"tiles\": " << tiles_.size() << ",\n";
+    json << "  \"builtTiles\": " << builtTiles() << ",\n";
+    json << "  \"uniqueNodes\": " << uniqueNodes() << ",\n";
+    json << "  \"references\": " << references() << ",\n";
+    json << "  \"dedupHitRate\": " << dedupHitRate() << ",\n";
+    json << "  \"keyframeRebuilds\": " << keyframeRebuilds_ << ",\n";
+    json << "  \"keyframeRebuildTiles\": " << keyframeRebuildTiles_ << ",\n";
+    json << "  \"reducedResolutionTiles\": " << reducedResolutionTiles_ << ",\n";
+    
+    // Levels that contain nodes, from the leaves up
+    json << "  \"levels\": [";
+    bool first = true;
+    for(int level = 1; level < LevelCount; ++level)
+    {
+        const VoxelLevelStats &stats = levels_[level];
+        if(stats.references == 0)
+        {
+            continue;
+        }
+        
+        double hitRate = 1.0 - (double)stats.uniqueNodes / stats.references;
+        json << (first ? "\n" : ",\n");
+        json << "    { \"level\": " << level
+             << ", \"kind\": \"" << ((level == 1) ? "leaf" : "inner")
+             << "\", \"uniqueNodes\": " << stats.uniqueNodes
+             << ", \"references\": " << stats.references
+             << ", \"dedupHitRate\": " << hitRate
+             << ", \"bytes\": " << stats.bytes << " }";
+        first = false;
+    }
+    json << "\n  ],\n";
+    
+    // Unique inner nodes by their number of expanded children
+    json << "  \"expandedChildren\": [";
+    for(int i = 0; i < 9; ++i)
+    {
+        json << ((i > 0) ? ", " : "") << expandedChildCounts_[i];
+    }
+    json << "],\n";
+    
+    json << "  \"leafMasks\": {\n";
+    json << "    \"distinct\": " << leafMaskReferences_.size() << ",\n";
+    
+    // Masks with 1, 2-3, 4-7 ... references
+    vector<uint64_t> histogram = leafMaskReferenceHistogram();
+    json << "    \"referenceHistogram\": [";
+    for(unsigned int i = 0; i < histogram.size(); ++i)
+    {
+        json << ((i > 0) ? "," : "") << "\n      { \"minReferences\": " << (1ull << i)
+             << ", \"maxReferences\": " << ((2ull << i) - 1)
+             << ", \"masks\": " << histogram[i] << " }";
+    }
+    json << "\n    ],\n";
+    
+    // The most referenced masks as hex, set bits are unshadowed
+    vector<pair<uint64_t, uint64_t> > popular = popularLeafMasks();
+    json << "    \"mostReferenced\": [";
+    for(unsigned int i = 0; i < popular.size(); ++i)
+    {
+        char mask[19];
+        sprintf(mask, "0x%016llx", (unsigned long long)popular[i].first);
+        json << ((i > 0) ? "," : "") << "\n      { \"mask\": \"" << mask
+             << "\", \"references\": " << popular[i].second << " }";
+    }
+    json << "\n    ]\n";
+    json << "  },\n";
+    
+    json << "  \"tileStats\": [";
+    for(unsigned int i = 0; i < tiles_.size(); ++i)
+    {
+        const VoxelTileStats &tile = tiles_[i];
+        double hitRate = (tile.references > 0) ? (double)tile.sharedReferences / tile.references : 0.0;
+        json << ((i > 0) ? "," : "") << "\n    { \"tile\": " << i
+             << ", \"built\": " << (tile.built ? "true" : "false")
+             << ", \"treeHeight\": " << tile.treeHeight
+             << ", \"references\": " << tile.references
+             << ", \"sharedReferences\": " << tile.sharedReferences
+             << ", \"dedupHitRate\": " << hitRate << " }";
+    }
+    json << "\n  ]\n";
+    json << "}\n";
+    
+    return json.str();
+}
+
+bool VoxelTreeStats::writeJSON(const string &fileName) const
+{
+    ofstream file(fileName);
+    if(!file)
+    {
+        printf("Failed to write tree stats %s \n", fileName.c_str());
+        return false;
+    }
+    
+    file << toJSON();
+    return true;
+}
+
+void VoxelTreeStats::visitNode(const uint32_t* data, VoxelPointer node, int height, VoxelTileStats* tile, vector<bool> &visited)
+{
+    assert(height >= 1 && height < LevelCount);
+    
+    // Every pointer to the node is a reference
+    VoxelLevelStats &level = levels_[height];
+    level.references ++;
+    tile->references ++;
+    
+    if(height == 1)
+    {
+        // The first word holds the lower 32 bits
+        uint64_t mask = (uint64_t)data[node] | ((uint64_t)data[node + 1] << 32);
+        leafMaskReferences_[mask] ++;
+    }
+    
+    // Nodes reached before were merged with a duplicate when written
+    if(visited[node])
+    {
+        tile->sharedReferences ++;
+        return;
+    }
+    
+    visited[node] = true;
+    level.uniqueNodes ++;
+    
+    if(height == 1)
+    {
+        level.bytes += sizeof(VoxelLeafNode);
+        return;
+    }
+    
+    // Visit each expanded child
+    const VoxelInnerNode* inner = (const VoxelInnerNode*)(data + node);
+    int expandedChildren = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        if(inner->isChildExpanded(i))
+        {
+            visitNode(data, inner->childPositions[expandedChildren], height - 1, tile, visited);
+            expandedChildren ++;
+        }
+    }
+    
+    level.bytes += (1 + expandedChildren) * 4;
+    expandedChildCounts_[expandedChildren] ++;
+}
+
+vector<pair<uint64_t, uint64_t> > VoxelTreeStats::popularLeafMasks() const
+{
+    // Sort by references, most first
+    vector<pair<uint64_t, uint64_t> > masks;
+    for(auto mask = leafMaskReferences_.begin(); mask != leafMaskReferences_.end(); ++mask)
+    {
+        masks.push_back(pair<uint64_t, uint64_t>(mask->second, mask->first));
+    }
+    
+    size_t count = min(masks.size(), (size_t)PopularLeafMaskCount);
+    partial_sort(masks.begin(), masks.begin() + count, masks.end(), greater<pair<uint64_t, uint64_t> >());
+    
+    vector<pair<uint64_t, uint64_t> > popular;
+    for(size_t i = 0; i < count; ++i)
+    {
+        popular.push_back(pair<uint64_t, uint64_t>(masks[i].second, masks[i].first));
+    }
+    
+    return popular;
+}
+
+vector<uint64_t> VoxelTreeStats::leafMaskReferenceHistogram() const
+{
+    vector<uint64_t> histogram;
+    for(auto mask = leafMaskReferences_.begin(); mask != leafMaskReferences_.end(); ++mask)
+    {
+        // Find the power of two bucket
+        unsigned int bucket = 0;
+        while((2ull << bucket) <= mask->second)
+        {
+            bucket ++;
+        }
+        
+        if(histogram.size() <= bucket)
+        {
+            histogram.resize(bucket + 1, 0);
+        }
+        
+        histogram[bucket] ++;
+    }
+    
+    return histogram;
+}
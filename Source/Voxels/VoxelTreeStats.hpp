@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+#include "VoxelNode.hpp"
+
+// The nodes at one level of the tree.
+// Levels count up from the leaves, which are level 1.
+struct VoxelLevelStats
+{
+    // Nodes stored once in the buffer
+    uint64_t uniqueNodes;
+    
+    // Pointers to the level's nodes, including from root entries.
+    // References beyond the first are duplicates that were merged.
+    uint64_t references;
+    
+    // The size of the unique nodes
+    uint64_t bytes;
+};
+
+// The references made by one tile's tree
+struct VoxelTileStats
+{
+    uint32_t treeHeight;
+    bool built;
+    
+    uint64_t references;
+    
+    // References to nodes already reached from this
+    // tile or an earlier one, ie deduplication hits
+    uint64_t sharedReferences;
+};
+
+// A report of where the bytes of the tree go, made by walking
+// the final DAG from every root entry.
+class VoxelTreeStats
+{
+public:
+    // Levels 1 to 14, so that index 0 is unused
+    const static int LevelCount = 15;
+    
+    // The number of leaf masks listed by popularity
+    const static int PopularLeafMaskCount = 16;
+    
+    VoxelTreeStats(const uint32_t* data, size_t sizeWords, int tileCount, VoxelPointer emptyNode, size_t originalSizeBytes);
+    
+    // Buffer sizes
+    size_t treeBytes() const { return treeBytes_; }
+    size_t reachableBytes() const;
+    size_t rootTableBytes() const { return tiles_.size() * sizeof(VoxelRootEntry); }
+    size_t originalSizeBytes() const { return originalSizeBytes_; }
+    
+    // The original size over the tree size
+    double compressionRatio() const;
+    
+    // Totals over every level
+    uint64_t uniqueNodes() const;
+    uint64_t references() const;
+    
+    // The fraction of references to a node that was already written
+    double dedupHitRate() const;
+    
+    int builtTiles() const;
+    size_t distinctLeafMasks() const { return leafMaskReferences_.size(); }
+    
+    const VoxelLevelStats& level(int level) const { return levels_[level]; }
+    const VoxelTileStats& tile(int tile) const { return tiles_[tile]; }
+    
+    // Rebuilds of rotated lights' keyframes since the tree was created
+    // and the tiles they queued. Recorded by the tree, not the walk.
+    int keyframeRebuilds() const { return keyframeRebuilds_; }
+    int keyframeRebuildTiles() const { return keyframeRebuildTiles_; }
+    void setKeyframeRebuilds(int rebuilds, int tiles);
+    
+    // Tiles whose resolution was reduced because they have few shadow
+    // casters, or low importance. Recorded by the tree, not the walk.
+    int reducedResolutionTiles() const { return reducedResolutionTiles_; }
+    void setReducedResolutionTiles(int tiles) { reducedResolutionTiles_ = tiles; }
+    
+    // Writes the report as JSON
+    string toJSON() const;
+    bool writeJSON(const string &fileName) const;
+    
+private:
+    size_t treeBytes_;
+    size_t originalSizeBytes_;
+    
+    int keyframeRebuilds_;
+    int keyframeRebuildTiles_;
+    int reducedResolutionTiles_;
+    
+    VoxelLevelStats levels_[LevelCount];
+    vector<VoxelTileStats> tiles_;
+    
+    // Unique inner nodes by their number of expanded children
+    uint64_t expandedChildCounts_[9];
+    
+    // References to each leaf mask
+    unordered_map<uint64_t, uint64_t> leafMaskReferences_;
+    
+    // Counts a reference to a node and, on the first
+    // visit, the node and the references it makes.
+    void visitNode(const uint32_t* data, VoxelPointer node, int height, VoxelTileStats* tile, vector<bool> &visited);
+    
+    // Gets the most referenced leaf masks, most popular first
+    vector<pair<uint64_t, uint64_t> > popularLeafMasks() const;
+    
+    // Gets the number of leaf masks with 1, 2-3, 4-7 ... references
+    vector<uint64_t> leafMaskReferenceHistogram() const;
+};
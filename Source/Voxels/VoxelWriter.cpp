@@ -2,25 +2,31 @@
 
 #include <assert.h>
 #include <memory.h>
+#include <stdlib.h>
 #include <cmath>
+#include <algorithm>
+
+#include "VoxelBufferPool.hpp"
 
 VoxelWriter::VoxelWriter()
-    : innerNodeLocations_(),
+    : rootEntryCount_(0),
+    emptyNode_(0),
+    innerNodeLocations_(),
     leafLocations_()
 {
     // Define the max buffer size
-    const uint32_t bufferSizeMB = 128;
-    const uint32_t bufferSizeB = bufferSizeMB * 1024 * 1024;
+    const uint32_t bufferSizeB = BufferSizeMB * 1024 * 1024;
     maxSizeWords_ = bufferSizeB / 4;
     
-    // Allocate the buffer
-    data_ = new uint32_t[maxSizeWords_];
+    // Allocate the buffer, reusing one from an earlier tile.
+    // Most trees use a small part of it, so it is not faulted in up front.
+    data_ = (uint32_t*)VoxelBufferPool::acquire(bufferSizeB, false);
     sizeWords_ = 0;
 }
 
 VoxelWriter::~VoxelWriter()
 {
-    delete[] data_;
+    VoxelBufferPool::release(data_, (size_t)maxSizeWords_ * 4);
 }
 
 void VoxelWriter::reserveRootNodePointerSpace(int pointerCount)
@@ -29,26 +35,37 @@ void VoxelWriter::reserveRootNodePointerSpace(int pointerCount)
     assert(sizeWords_ == 0);
     assert(pointerCount < (int)maxSizeWords_);
     
-    // Each pointer occupies 1 word.
-    sizeWords_ = pointerCount;
+    // Each entry occupies 2 words.
+    const int entryWords = sizeof(VoxelRootEntry) / 4;
+    sizeWords_ = pointerCount * entryWords;
+    rootEntryCount_ = pointerCount;
     
     // Create a dummy 100% unshadowed node for the root nodes
     // to point at until the tiles are properly created
     VoxelInnerNode node;
+    node.shadowedFraction = 0;
     node.childMask = 21845; // = 0101010101010101 = 8 Unshadowed children
-    VoxelPointer nodePtr = writeNode(node, 0, 0);
+    emptyNode_ = writeNode(node, 0, 0);
     
-    // Set each of the new pointers to the new address
+    // Set each of the new pointers to the new address.
+    // The dummy node is uniform so is valid at any height.
     for(int i = 0; i < pointerCount; ++i)
     {
-        setRootNodePointer(i, nodePtr);
+        resetRootNodePointer(i);
     }
 }
 
-void VoxelWriter::setRootNodePointer(int index, VoxelPointer value)
+void VoxelWriter::resetRootNodePointer(int index)
+{
+    setRootNodePointer(index, emptyNode_, 0);
+}
+
+void VoxelWriter::setRootNodePointer(int index, VoxelPointer value, int treeHeight)
 {
-    // The pointers are stored in the words at the start of the buffer.
-    data_[index] = value;
+    // The entries are stored in the words at the start of the buffer.
+    VoxelRootEntry* entries = (VoxelRootEntry*)data_;
+    entries[index].root = value;
+    entries[index].treeHeight = treeHeight;
 }
 
 VoxelPointer VoxelWriter::writeNode(const VoxelInnerNode &node, int expandedChildCount, VoxelNodeHash hash)
@@ -158,11 +175,113 @@ VoxelPointer VoxelWriter::writeSubtree(const uint32_t* tree, uint32_t nodeLocati
     return writeNode(innerNode, visitedChildren, *hash);
 }
 
+void VoxelWriter::swap(VoxelWriter &other)
+{
+    std::swap(data_, other.data_);
+    std::swap(sizeWords_, other.sizeWords_);
+    std::swap(maxSizeWords_, other.maxSizeWords_);
+    std::swap(rootEntryCount_, other.rootEntryCount_);
+    std::swap(emptyNode_, other.emptyNode_);
+    innerNodeLocations_.swap(other.innerNodeLocations_);
+    leafLocations_.swap(other.leafLocations_);
+}
+
+// Combines a value into a fingerprint.
+// Uses the splitmix64 finalizer, so fingerprints are the same on every platform.
+static uint64_t mixFingerprint(uint64_t fingerprint, uint64_t value)
+{
+    uint64_t x = fingerprint ^ (value + 0x9E3779B97F4A7C15ull + (fingerprint << 6) + (fingerprint >> 2));
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t VoxelWriter::fingerprint() const
+{
+    std::unordered_map<VoxelPointer, uint64_t> fingerprints;
+    
+    // Combine the tiles in order. Tiles that are not built
+    // point at the empty node, which has no fixed height.
+    uint64_t fingerprint = mixFingerprint(0, rootEntryCount_);
+    for(int i = 0; i < rootEntryCount_; ++i)
+    {
+        const VoxelRootEntry &entry = rootEntry(i);
+        if(entry.root == emptyNode_)
+        {
+            fingerprint = mixFingerprint(fingerprint, 0);
+        }
+        else
+        {
+            fingerprint = mixFingerprint(fingerprint, entry.treeHeight);
+            fingerprint = mixFingerprint(fingerprint, fingerprintSubtree(entry.root, entry.treeHeight - 1, fingerprints));
+        }
+    }
+    
+    return fingerprint;
+}
+
+uint64_t VoxelWriter::checksum() const
+{
+    // 64 bit FNV-1a over the words
+    uint64_t checksum = 0xCBF29CE484222325ull;
+    for(uint32_t i = 0; i < sizeWords_; ++i)
+    {
+        checksum = (checksum ^ data_[i]) * 0x100000001B3ull;
+    }
+    
+    return checksum;
+}
+
+uint64_t VoxelWriter::fingerprintSubtree(VoxelPointer nodeLocation, int height, std::unordered_map<VoxelPointer, uint64_t> &fingerprints) const
+{
+    auto visited = fingerprints.find(nodeLocation);
+    if(visited != fingerprints.end())
+    {
+        return visited->second;
+    }
+    
+    uint64_t fingerprint;
+    if(height == 1)
+    {
+        // Leaves are identified by their mask
+        const VoxelLeafNode* leaf = (const VoxelLeafNode*)(data_ + nodeLocation);
+        fingerprint = mixFingerprint(1, leaf->leafMask);
+    }
+    else
+    {
+        // Inner nodes by their child states, prefiltered fraction,
+        // height and the fingerprints of their expanded children
+        const VoxelInnerNode* node = (const VoxelInnerNode*)(data_ + nodeLocation);
+        fingerprint = mixFingerprint(2, ((uint64_t)height << 32) | ((uint64_t)node->childMask << 16) | node->shadowedFraction);
+        
+        int expandedChildren = 0;
+        for(int i = 0; i < 8; ++i)
+        {
+            if(node->isChildExpanded(i))
+            {
+                uint64_t child = fingerprintSubtree(node->childPositions[expandedChildren], height - 1, fingerprints);
+                fingerprint = mixFingerprint(fingerprint, child);
+                expandedChildren ++;
+            }
+        }
+    }
+    
+    fingerprints[nodeLocation] = fingerprint;
+    return fingerprint;
+}
+
 VoxelPointer VoxelWriter::writeWords(const void* words, int wordCount)
 {
     // Check the word count is valid and not too big
     assert(wordCount > 0);
-    assert(sizeWords_ + wordCount <= maxSizeWords_);
+    if(sizeWords_ + wordCount > maxSizeWords_)
+    {
+        printf("Voxel node buffer is full (%u MB) \n", BufferSizeMB);
+        abort();
+    }
     
     // Remember the start position
     uint32_t startPos = sizeWords_;
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <unordered_map>
+#include <vector>
 
 #include "VoxelNode.hpp"
 
@@ -11,6 +12,12 @@
 class VoxelWriter
 {
 public:
+    // The size of the node buffer, which is allocated up front.
+    // It is never grown, as other threads read the nodes through
+    // data() while they are being written. Writing past the end
+    // is a fatal error, so callers check that the words fit first.
+    const static uint32_t BufferSizeMB = 128;
+    
     VoxelWriter();
     ~VoxelWriter();
     
@@ -21,12 +28,25 @@ public:
     size_t dataSizeBytes() const { return sizeWords_ * 4; }
     size_t dataSizeWords() const { return sizeWords_; }
     
+    // The number of words that can still be written
+    size_t freeSizeWords() const { return maxSizeWords_ - sizeWords_; }
+    
     // Reserves space for the specified number of root node
-    // pointers at the start of the buffer.
+    // entries at the start of the buffer.
     void reserveRootNodePointerSpace(int pointerCount);
     
-    // Sets a root node pointer to the specified index.
-    void setRootNodePointer(int index, VoxelPointer value);
+    // Sets the root node pointer and tree height of the specified entry.
+    void setRootNodePointer(int index, VoxelPointer value, int treeHeight);
+    
+    // The uniformly unshadowed node that root entries point at until
+    // their tile is built. It is never removed by garbage collection.
+    VoxelPointer emptyNode() const { return emptyNode_; }
+    
+    // Points the specified entry back at the empty node
+    void resetRootNodePointer(int index);
+    
+    // Gets the specified root node entry.
+    const VoxelRootEntry& rootEntry(int index) const { return ((const VoxelRootEntry*)data_)[index]; }
     
     // Writes an inner node to the buffer.
     // Returns its position pointer.
@@ -40,11 +60,30 @@ public:
     // Returns a pointer to the root node.
     VoxelPointer writeTree(const uint32_t* tree, VoxelPointer root, int resolution);
     
+    // Exchanges the buffers and node caches of two writers.
+    // Used to replace the tree with a compacted copy.
+    void swap(VoxelWriter &other);
+    
+    // A hash of the contents of every tile's tree that does not depend
+    // on where nodes are in the buffer, so trees built in any order or
+    // compacted differently have the same fingerprint.
+    uint64_t fingerprint() const;
+    
+    // A hash of the bytes of the buffer.
+    // Only equal for trees with identical layouts.
+    uint64_t checksum() const;
+    
 private:
     uint32_t* data_;
     uint32_t sizeWords_;
     uint32_t maxSizeWords_;
     
+    // The number of root node entries at the start of the buffer
+    int rootEntryCount_;
+    
+    // The node used by tiles that are not built
+    VoxelPointer emptyNode_;
+    
     // Cache of leaf and inner node locations, stored based on hash
     std::unordered_map<VoxelNodeHash, VoxelPointer> innerNodeLocations_;
     std::unordered_map<VoxelNodeHash, VoxelPointer> leafLocations_;
@@ -55,6 +94,10 @@ private:
     // Also outputs the hash of the subtree.
     VoxelPointer writeSubtree(const uint32_t* tree, uint32_t nodeLocation, int height, uint64_t* hash);
     
+    // Computes the fingerprint of a subtree. Fingerprints of visited
+    // nodes are kept so that shared nodes are only visited once.
+    uint64_t fingerprintSubtree(VoxelPointer nodeLocation, int height, std::unordered_map<VoxelPointer, uint64_t> &fingerprints) const;
+    
     // Writes data to the buffer.
     // Returns the word index of the first written word.
     VoxelPointer writeWords(const void* words, int wordCount);
@@ -1,9 +1,20 @@
 #include <QApplication>
 
+#include <cstdio>
+#include <cstdlib>
 #include <string>
+#include <thread>
+#include <pthread.h>
+#include <signal.h>
 
+#include "BuildBenchmark.hpp"
 #include "MainWindow.hpp"
 #include "MainWindowController.hpp"
+#include "VoxelBufferPool.hpp"
+#include "VoxelBuildTrace.hpp"
+#include "VoxelMicrobenchmark.hpp"
+#include "ShadowQueryBenchmark.hpp"
+#include "ShadowQueryServer.hpp"
 
 bool flagSet(std::string flag, int argc, char* argv[])
 {
@@ -21,6 +32,71 @@ bool flagSet(std::string flag, int argc, char* argv[])
     return false;
 }
 
+// Gets the argument index places after the flag
+const char* flagValue(std::string flag, int argc, char* argv[], int index = 0)
+{
+    for(int i = 0; i + index + 1 < argc; ++i)
+    {
+        // Return the argument following the flag
+        std::string actualValue(argv[i]);
+        if(actualValue == flag)
+        {
+            return argv[i + index + 1];
+        }
+    }
+    
+    // No flag set, or too few arguments after it
+    return NULL;
+}
+
+// Stops the server once the process is interrupted or terminated.
+// The signals are waited for on this thread rather than handled,
+// as stopping the server is not safe in a signal handler.
+void waitForStopSignal(ShadowQueryServer* server, sigset_t stopSignals)
+{
+    int signal;
+    sigwait(&stopSignals, &signal);
+    server->stop();
+}
+
+int runShadowServer(const char* treeFileName, const char* socketPath)
+{
+    // Block the stop signals before any threads are started, so that
+    // every thread inherits the mask and only the waiting thread gets them
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    
+    VoxelTreeSampler* sampler = VoxelTreeSampler::load(treeFileName);
+    if(sampler == NULL)
+    {
+        return 1;
+    }
+    
+    ShadowQueryServer* server = new ShadowQueryServer(sampler);
+    if(server->listen(socketPath) == false)
+    {
+        delete server;
+        delete sampler;
+        return 1;
+    }
+    
+    printf("Serving shadow queries for %s on %s \n", treeFileName, socketPath);
+    std::thread signalThread(waitForStopSignal, server, stopSignals);
+    server->run();
+    
+    // Wake the waiting thread if the server stopped by itself.
+    // The server is deleted afterwards, which removes its socket.
+    pthread_kill(signalThread.native_handle(), SIGTERM);
+    signalThread.join();
+    
+    delete server;
+    delete sampler;
+    return 0;
+}
+
 int getTreeResolution(int argc, char* argv[])
 {
     // Look for a resolution flag
@@ -40,6 +116,49 @@ int getTreeResolution(int argc, char* argv[])
 
 int main(int argc, char* argv[])
 {
+    // Back the tree build's buffers with huge pages, if specified
+    if(flagSet("-hugepages", argc, argv))
+    {
+        VoxelBufferPool::setHugePages(true);
+    }
+    
+    // Serve queries for a saved tree without opening a window
+    const char* serverTree = flagValue("-shadowserver", argc, argv, 0);
+    const char* serverSocket = flagValue("-shadowserver", argc, argv, 1);
+    if(serverTree != NULL && serverSocket != NULL)
+    {
+        return runShadowServer(serverTree, serverSocket);
+    }
+    
+    const char* benchmarkTree = flagValue("-shadowbenchmark", argc, argv);
+    if(benchmarkTree != NULL)
+    {
+        return runShadowQueryBenchmark(benchmarkTree);
+    }
+    
+    // Measure tree construction without opening a window
+    const char* buildBenchmarkResults = flagValue("-buildbenchmark", argc, argv);
+    if(buildBenchmarkResults != NULL)
+    {
+        const char* repeats = flagValue("-repeats", argc, argv);
+        QGuiApplication app(argc, argv);
+        return runBuildBenchmark(buildBenchmarkResults, (repeats != NULL) ? atoi(repeats) : 3, flagSet("-deterministic", argc, argv));
+    }
+    
+    // Measure the builder's inner kernels, on recorded tiles if given
+    if(flagSet("-microbenchmark", argc, argv))
+    {
+        return runVoxelMicrobenchmarks(flagValue("-microbenchmark", argc, argv));
+    }
+    
+    // Trace the tile build pipeline, if specified
+    const char* buildTrace = flagValue("-buildtrace", argc, argv);
+    if(buildTrace != NULL)
+    {
+        VoxelBuildTrace::start();
+        VoxelBuildTrace::nameThread("Main");
+    }
+    
     QApplication app(argc, argv);
     
     // Specify OpenGL 4.0 Core Profile
@@ -52,10 +171,10 @@ int main(int argc, char* argv[])
     bool fullScreen = flagSet("-fullscreen", argc, argv);
     MainWindow* window = new MainWindow(fullScreen, format, getTreeResolution(argc, argv));
     MainWindowController* controller = new MainWindowController(window);
-
+    
     // Pass all events to the controller
     app.installEventFilter(controller);
-
+    
     // Show the window
     window->resize(1350, 850);
     window->setWindowTitle("Shadow Rendering");
@@ -72,11 +191,61 @@ int main(int argc, char* argv[])
         window->show();
     }
     
+    // Build the tree in a fixed order, if specified
+    if(flagSet("-deterministic", argc, argv))
+    {
+        window->rendererWidget()->setDeterministicBuild(true);
+    }
+    
+    // Limit the time spent building the tree each frame, if specified
+    const char* buildBudget = flagValue("-buildbudget", argc, argv);
+    if(buildBudget != NULL)
+    {
+        window->rendererWidget()->setBuildFrameBudget(atof(buildBudget));
+    }
+    
+    // Limit the memory used by the tiles being built, if specified
+    const char* buildMemory = flagValue("-buildmemory", argc, argv);
+    if(buildMemory != NULL)
+    {
+        window->rendererWidget()->setBuildMemoryBudget(atoi(buildMemory));
+    }
+    
+    // Record the depths of the first tiles for the microbenchmarks
+    const char* recordedDepths = flagValue("-recorddepths", argc, argv);
+    if(recordedDepths != NULL)
+    {
+        window->rendererWidget()->recordTileDepths(recordedDepths);
+    }
+    
     // Precompute the voxel tree, if specified
-    if(flagSet("-precompute", argc, argv))
+    const char* savedTree = flagValue("-savetree", argc, argv);
+    const char* treeStatsFile = flagValue("-treestats", argc, argv);
+    if(flagSet("-precompute", argc, argv) || savedTree != NULL || treeStatsFile != NULL || buildTrace != NULL || recordedDepths != NULL)
     {
         window->rendererWidget()->precomputeTree();
     }
     
+    // Write the trace of the finished build
+    if(buildTrace != NULL)
+    {
+        VoxelBuildTrace::stop();
+        VoxelBuildTrace::write(buildTrace);
+    }
+    
+    // Save the finished tree for the shadow query server
+    if(savedTree != NULL)
+    {
+        window->rendererWidget()->saveTree(savedTree);
+    }
+    
+    // Write a report on the finished tree's nodes
+    if(treeStatsFile != NULL)
+    {
+        VoxelTreeStats* stats = window->rendererWidget()->computeTreeStats();
+        stats->writeJSON(treeStatsFile);
+        delete stats;
+    }
+    
     return app.exec();
 }
@@ -9,7 +9,9 @@ qmake -project \
     "INCLUDEPATH += . Source/Math" \
     "INCLUDEPATH += . Source/Assets" \
     "INCLUDEPATH += . Source/Voxels" \
-    "INCLUDEPATH += . Source/Scene"
+    "INCLUDEPATH += . Source/Scene" \
+    "INCLUDEPATH += . Source/Server" \
+    "LIBS += -lrt"
 
 qmake
 make